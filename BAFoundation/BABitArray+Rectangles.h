@@ -34,6 +34,50 @@ NS_INLINE CGRect BARectSquare(CGRect rect) {
 	return rect;
 }
 
+/**
+ * Answers empty rectangle queries for a 2-dimensional bit array without rescanning it.
+ *
+ * For every bit, the index keeps the number of clear bits in its column, up to and including it; for every
+ * row, it keeps the largest empty rect and square whose last row that is. The bit array tells the index
+ * which rows are written. At the next query, those rows are recomputed, along with the rows after them
+ * as far as their column counts change, which usually stops at the next obstacle.
+ *
+ * An index belongs to its bit array (see -rectangleIndex), and uses 4 bytes per bit. Queries must not
+ * overlap with writes to the bit array.
+ */
+
+// Return YES to stop
+typedef BOOL (^BARegion2Handler)(BARegion2 region);
+
+/**
+ * Covers the set bits of a 2-dimensional bit array with few rects, e.g. for collision boxes or quads.
+ *
+ * Greedy meshing: each rect starts at the first set bit not yet covered, in row order, and is made as wide,
+ * then as tall, as it can be. Rows are scanned and compared a word at a time. Rects do not overlap, and are
+ * reported as they are found. Returns the number of rects reported.
+ */
+extern NSUInteger BABitArrayEnumerateSetRegions2(id<BABitArray2D> bitArray, BARegion2Handler block);
+
+
+@interface BARectangleIndex : NSObject {
+    BABitArray *_bitArray; // not retained; the bit array owns the index
+    NSUInteger _width;
+    NSUInteger _height;
+    UInt32 *_heights;
+    CGRect *_bestRects;
+    CGRect *_bestSquares;
+    void *_bars;
+}
+
+- (CGRect)largestEmptyRect;
+- (CGRect)largestEmptySquare;
+
+// The first empty rect of the given size, in row order; CGRectNull if there is none
+- (CGRect)firstEmptyRectWithSize:(CGSize)size;
+
+@end
+
+
 @interface BABitArray (Rectangles)
 
 // caller must free returned pointer
@@ -42,7 +86,16 @@ NS_INLINE CGRect BARectSquare(CGRect rect) {
 
 - (void)iterateEmptyRectsWithBlock:(BOOL (^)(CGRect))block;
 
+// These use the rectangle index, making it if need be
 - (CGRect)largestEmptyRect;
 - (CGRect)largestEmptySquare;
+- (CGRect)firstEmptyRectWithSize:(CGSize)size;
+
+// See BABitArrayEnumerateSetRegions2()
+- (NSUInteger)enumerateSetRegions2:(BARegion2Handler)block;
+
+// Made on first use, and kept up to date until discarded
+- (BARectangleIndex *)rectangleIndex;
+- (void)discardRectangleIndex;
 
 @end
@@ -8,6 +8,257 @@
 
 #import "BABitArray+Rectangles.h"
 
+#import "BABitArrayPrivate.h"
+
+
+typedef struct {
+	NSUInteger start;
+	UInt32 height;
+} BAHistogramBar;
+
+// Recomputes the column counts of row <y> from the row before; returns YES if any changed
+static BOOL UpdateHeights(const unsigned char *bits, NSUInteger width, NSUInteger y, UInt32 *heights) {
+	
+	UInt32 *row = heights + y * width;
+	const UInt32 *previous = y ? row - width : NULL;
+	BOOL changed = NO;
+	
+	for (NSUInteger x=0; x<width; x+=64) {
+		
+		NSUInteger n = MIN(64, width - x);
+		uint64_t word = BABitsLoad(bits, y * width + x, n);
+		
+		for (NSUInteger i=0; i<n; ++i, word<<=1) {
+			UInt32 height = (word >> 63) ? 0 : (previous ? previous[x + i] : 0) + 1;
+			changed |= row[x + i] != height;
+			row[x + i] = height;
+		}
+	}
+	
+	return changed;
+}
+
+// Every maximal rect whose last row is <y> is popped from the stack of bars once
+static void FindBestInRow(const UInt32 *heights, NSUInteger width, NSUInteger y, BAHistogramBar *bars, CGRect *bestRect, CGRect *bestSquare) {
+	
+	const UInt32 *row = heights + y * width;
+	NSUInteger top = 0;
+	CGRect rect = CGRectZero;
+	CGRect square = CGRectZero;
+	
+	for (NSUInteger x=0; x<=width; ++x) {
+		
+		UInt32 height = x < width ? row[x] : 0;
+		NSUInteger start = x;
+		
+		while(top && bars[top-1].height >= height) {
+			
+			BAHistogramBar bar = bars[--top];
+			NSUInteger barWidth = x - bar.start;
+			
+			if(bar.height) {
+				CGFloat minY = (CGFloat)(y + 1 - bar.height);
+				NSUInteger side = MIN(barWidth, bar.height);
+				rect = BABestRect(rect, CGRectMake(bar.start, minY, barWidth, bar.height));
+				if(side > square.size.width)
+					square = CGRectMake(bar.start, minY, side, side);
+			}
+			start = bar.start;
+		}
+		
+		bars[top++] = (BAHistogramBar){ start, height };
+	}
+	
+	*bestRect = rect;
+	*bestSquare = square;
+}
+
+// The first x where a rect of <w> by <h> ends in row <y>, or NSNotFound
+static NSUInteger FindFitInRow(const UInt32 *heights, NSUInteger width, NSUInteger y, NSUInteger w, NSUInteger h) {
+	
+	const UInt32 *row = heights + y * width;
+	NSUInteger run = 0;
+	
+	for (NSUInteger x=0; x<width; ++x) {
+		run = row[x] >= h ? run + 1 : 0;
+		if(run == w)
+			return x + 1 - w;
+	}
+	
+	return NSNotFound;
+}
+
+// Clears <length> bits starting at <index>, a word at a time
+static void ClearBits(unsigned char *bits, NSUInteger index, NSUInteger length) {
+	for (NSUInteger i=0; i<length; ) {
+		NSUInteger n = MIN(length - i, 64 - ((index + i) & 63));
+		BABitsStore(bits, index + i, n, 0);
+		i += n;
+	}
+}
+
+// <bits> holds the bits not yet covered, and is cleared as they are
+static NSUInteger EnumerateSetRegions2(unsigned char *bits, NSUInteger width, NSUInteger height, BARegion2Handler block) {
+	
+	NSUInteger reported = 0;
+	
+	for (NSUInteger y=0; y<height; ++y) {
+		
+		NSUInteger row = y * width;
+		NSUInteger x = 0;
+		
+		while(x < width) {
+			
+			NSUInteger offset = BABitsFindFirst(bits, row + x, width - x, YES);
+			
+			if(offset == NSNotFound)
+				break;
+			
+			x += offset;
+			
+			NSUInteger runLength = BABitsFindFirst(bits, row + x, width - x, NO);
+			NSUInteger rows = 1;
+			
+			if(runLength == NSNotFound)
+				runLength = width - x;
+			
+			// the rows below must have the whole run set, and not covered yet
+			while(y + rows < height && BABitsFindFirst(bits, row + rows * width + x, runLength, NO) == NSNotFound)
+				++rows;
+			
+			for (NSUInteger i=0; i<rows; ++i)
+				ClearBits(bits, row + i * width + x, runLength);
+			
+			++reported;
+			if(block && block(BARegion2Make(x, y, runLength, rows)))
+				return reported;
+			
+			x += runLength;
+		}
+	}
+	
+	return reported;
+}
+
+NSUInteger BABitArrayEnumerateSetRegions2(id<BABitArray2D> bitArray, BARegion2Handler block) {
+	
+	if([bitArray isKindOfClass:[BABitArray class]])
+		return [(BABitArray *)bitArray enumerateSetRegions2:block];
+	
+	BASize2 size2 = [bitArray size].size2;
+	BABitArray *copy = [[BABitArray alloc] initWithBitArray:bitArray region:BARegion2Make(0, 0, size2.width, size2.height)];
+	NSUInteger reported = [copy enumerateSetRegions2:block];
+	
+	[copy release];
+	
+	return reported;
+}
+
+
+@implementation BARectangleIndex
+
+- (id)initWithBitArray:(BABitArray *)bitArray {
+	self = [super init];
+	if(self) {
+		BASize3 size3 = [bitArray size].size3;
+		NSAssert([bitArray size] && size3.depth == 1, @"rectangle index requires a 2-dimensional size");
+		_bitArray = bitArray;
+		_width = size3.width;
+		_height = size3.height;
+		_heights = calloc(_width * _height, sizeof(UInt32));
+		_bestRects = calloc(_height, sizeof(CGRect));
+		_bestSquares = calloc(_height, sizeof(CGRect));
+		_bars = malloc((_width + 1) * sizeof(BAHistogramBar));
+		
+		unsigned char *bits = [bitArray buffer];
+		
+		for (NSUInteger y=0; y<_height; ++y) {
+			UpdateHeights(bits, _width, y, _heights);
+			FindBestInRow(_heights, _width, y, _bars, _bestRects + y, _bestSquares + y);
+		}
+	}
+	return self;
+}
+
+- (void)dealloc {
+	free(_heights);
+	free(_bestRects);
+	free(_bestSquares);
+	free(_bars);
+	[super dealloc];
+}
+
+// Rows whose column counts are unchanged do not affect the rows after them
+- (void)update {
+	
+	BABitArray *changedRows = [_bitArray takeChangedRows];
+	
+	if(!changedRows || [changedRows count] == 0)
+		return;
+	
+	unsigned char *bits = [_bitArray buffer];
+	unsigned char *changed = [changedRows buffer];
+	NSUInteger y = BABitsFindFirst(changed, 0, _height, YES);
+	
+	while(y < _height) {
+		if(UpdateHeights(bits, _width, y, _heights)) {
+			FindBestInRow(_heights, _width, y, _bars, _bestRects + y, _bestSquares + y);
+			++y;
+		}
+		else {
+			NSUInteger next = BABitsFindFirst(changed, y + 1, _height - y - 1, YES);
+			y = next == NSNotFound ? _height : y + 1 + next;
+		}
+	}
+}
+
+- (CGRect)largestEmptyRect {
+	
+	[self update];
+	
+	CGRect best = CGRectZero;
+	
+	for (NSUInteger y=0; y<_height; ++y)
+		best = BABestRect(best, _bestRects[y]);
+	
+	return best;
+}
+
+- (CGRect)largestEmptySquare {
+	
+	[self update];
+	
+	CGRect best = CGRectZero;
+	
+	for (NSUInteger y=0; y<_height; ++y)
+		if(_bestSquares[y].size.width > best.size.width)
+			best = _bestSquares[y];
+	
+	return best;
+}
+
+- (CGRect)firstEmptyRectWithSize:(CGSize)size {
+	
+	NSUInteger w = (NSUInteger)size.width;
+	NSUInteger h = (NSUInteger)size.height;
+	
+	if(w == 0 || h == 0 || w > _width || h > _height)
+		return CGRectNull;
+	
+	[self update];
+	
+	for (NSUInteger y=h-1; y<_height; ++y) {
+		NSUInteger x = FindFitInRow(_heights, _width, y, w, h);
+		if(x != NSNotFound)
+			return CGRectMake(x, y + 1 - h, w, h);
+	}
+	
+	return CGRectNull;
+}
+
+@end
+
+
 @implementation BABitArray (Rectangles)
 
 - (UInt16 *)histogram2dInverse:(BOOL)inverse {
@@ -113,47 +364,55 @@ end:
 - (CGRect)largestEmptyRect {
 	
 	// Quick return for full or empty area
-	if(count == length)
+	NSUInteger setBits = [self count];
+	
+	if(setBits == length)
 		return CGRectZero;
-	else if(count == 0)
+	else if(setBits == 0)
 		return CGRectMake(0, 0, size2.width, size2.height);
 	
-	__block CGRect best = CGRectZero;
-	
-	best.origin = CGPointMake(-1, -1);
-	best.size = CGSizeZero;
-	
-	[self iterateEmptyRectsWithBlock:^(CGRect curr) {
-		if(BARectArea(curr) > BARectArea(best)) {
-			best = curr;
-		}
-		return NO;
-	}];
-	
-	if(CGRectIsEmpty(best))
-		best = CGRectZero;
-	
-	return best;
+	return [[self rectangleIndex] largestEmptyRect];
 }
 
 - (CGRect)largestEmptySquare {
+	return [[self rectangleIndex] largestEmptySquare];
+}
+
+- (CGRect)firstEmptyRectWithSize:(CGSize)rectSize {
+	return [[self rectangleIndex] firstEmptyRectWithSize:rectSize];
+}
+
+- (NSUInteger)enumerateSetRegions2:(BARegion2Handler)block {
 	
-	__block CGRect best = CGRectZero;
+	NSAssert(size && size3.depth == 1, @"set regions require a 2-dimensional size");
 	
-	best.origin = CGPointMake(-1, -1);
-	best.size = CGSizeZero;
+	if(0 == [self count])
+		return 0;
 	
-	[self iterateEmptyRectsWithBlock:^(CGRect curr) {
-		CGRect square = BARectSquare(curr);
-		if(square.size.width > best.size.width)
-			best = square;
-		return NO;
-	}];
+	// a private copy of the bits, in whole words
+	unsigned char *bits = calloc((length + 63) / 64, sizeof(uint64_t));
+	memcpy(bits, [self buffer], (length + 7) / 8);
 	
-	if(CGRectIsEmpty(best))
-		best = CGRectZero;
+	NSUInteger reported = EnumerateSetRegions2(bits, size2.width, size2.height, block);
 	
-	return best;
+	free(bits);
+	
+	return reported;
+}
+
+- (BARectangleIndex *)rectangleIndex {
+	if(!rectangleIndex) {
+		// rows written from here on are seen by the index
+		changedRows = [[BABitArray alloc] initWithLength:size2.height];
+		changedRows.concurrent = self.isConcurrent;
+		rectangleIndex = [[BARectangleIndex alloc] initWithBitArray:self];
+	}
+	return rectangleIndex;
+}
+
+- (void)discardRectangleIndex {
+	[rectangleIndex release], rectangleIndex = nil;
+	[changedRows release], changedRows = nil;
 }
 
 @end
@@ -12,7 +12,16 @@
 
 #define SEQUENTIAL_BIT_ORDER 1
 
+@class BARectangleIndex, BASlabAllocator;
+
 typedef void (^BABitArrayEnumerator) (NSUInteger bit);
+typedef void (^BABitArrayRunEnumerator) (NSRange run);
+
+typedef NS_ENUM(NSUInteger, BABitArrayStorage) {
+    BABitArrayStorageHeap,    // calloc
+    BABitArrayStorageMapped,  // anonymous mmap; pages are zero-filled on first touch
+    BABitArrayStorageSlab,    // a block from a BASlabAllocator
+};
 
 /**
  * A bit array is an array of indexable bit values.
@@ -78,6 +87,9 @@ typedef void (^BABitArrayEnumerator) (NSUInteger bit);
 - (id<BABitArray2D>)subArrayWithRegion:(BARegion2)region;
 
 @optional
+// Runs of set bits in row y, as ranges of x, in order
+- (void)enumerateRunsInRow:(NSUInteger)y block:(BABitArrayRunEnumerator)block;
+
 - (NSArray *)rowStringsForRegion2:(BARegion2)region;
 - (NSString *)stringForRegion2:(BARegion2)region;
 - (NSString *)stringForRegion2;
@@ -93,25 +105,53 @@ typedef void (^BABitArrayEnumerator) (NSUInteger bit);
  * of conveniences for reading and writing ranges of bits, and initializing new bit arrays.
  *
  * The dimensions are stored in a sample array.
+ *
+ * Buffers at or above +mappedStorageThreshold bytes are mapped rather than allocated, so a very large,
+ * mostly empty array only costs the pages which have been written.
+ *
+ * Copies share storage. A mapped buffer is duplicated by the system a page at a time, as either side
+ * writes to it; a heap buffer is duplicated on the first write. A buffer from a slab is never shared; its
+ * copies are given heap buffers.
+ *
+ * In concurrent mode, -bit:, -count and the single bit, range and region set and clear methods may be
+ * called from any number of threads at once. Bits are updated with atomic operations on whole words,
+ * and changes to the count are kept in per-thread counters which are added up when the count is read.
+ * Any other method must not overlap with writers. Only the writes themselves are synchronised: wait
+ * for writers to finish (e.g. with dispatch_group_wait()) before relying on what they wrote.
  */
 
 @interface BABitArray : NSObject<NSCopying, NSCoding, BABitArray> {
     
     BASampleArray *size;
 	BASize2 size2;
+	BASize3 size3;
     
 	unsigned char *buffer;
 	NSUInteger bufferLength; // in bytes, rounded up
 	NSUInteger length;       // in bits as initialized
 	NSUInteger count;        // number of set bits
     
+    BABitArrayStorage storage;
+    BASlabAllocator *slab;   // where a slab buffer came from, or nil
+    NSUInteger *shareCount;  // owners of a heap buffer shared with copies, or NULL
+    struct BABitArrayCountStripe *countStripes; // per-thread count changes in concurrent mode, or NULL
+    BABitArray *dirtyTiles;  // tiles changed since last taken, or nil
+    NSUInteger trackingTileSize;
+    BABitArray *changedRows; // rows changed since the rectangle index last updated, or nil
+    BARectangleIndex *rectangleIndex;
     BOOL enableArchiveCompression;
 }
 
 @property (nonatomic) BOOL enableArchiveCompression;
+@property (readonly) BABitArrayStorage storage;
+@property (nonatomic, getter=isConcurrent) BOOL concurrent; // default is NO; do not change while in use
+
+// Bytes of the buffer still shared with copies, and owned outright; for mapped buffers, resident pages only
+@property (readonly) NSUInteger sharedBytes;
+@property (readonly) NSUInteger privateBytes;
 
 @property (readonly) BASampleArray *size;
-@property (readonly) NSData *bufferData;
+@property (readonly) NSData *bufferData; // a snapshot; does not copy the buffer
 
 - (BOOL)isEqualToBitArray:(BABitArray *)other;
 
@@ -132,6 +172,9 @@ typedef void (^BABitArrayEnumerator) (NSUInteger bit);
 - (NSData *)dataForRange:(NSRange)bitRange;
 
 - (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector;
+// The buffer is a block from <slab>, if it fits in one. The size is retained rather than copied, so that
+// many arrays can share one; it must not be changed.
+- (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector slab:(BASlabAllocator *)slab;
 - (id)initWithLength:(NSUInteger)bits;
 - (id)initWithData:(NSData *)data length:(NSUInteger)length;
 // bitRange.location + bitRange.length <= otherArray.length
@@ -144,24 +187,82 @@ typedef void (^BABitArrayEnumerator) (NSUInteger bit);
 + (BABitArray *)bitArray8;
 + (BABitArray *)bitArray64;
 + (BABitArray *)bitArray512;
-+ (BABitArray *)bitArray4096; // 16^3, our zone volume
++ (BABitArray *)bitArray4096; // 16^3, our zone volume; sized for 3D access
+
+// Default is 4MB (32M bits)
++ (NSUInteger)mappedStorageThreshold;
++ (void)setMappedStorageThreshold:(NSUInteger)bytes;
+
+// Request huge pages for mapped buffers, where the system supports them; default is NO
++ (BOOL)usesHugePages;
++ (void)setUsesHugePages:(BOOL)flag;
 
 @end
 
 
 @interface BABitArray (SpatialStorage) <BABitArray2D>
 - (id)initWithSize2:(BASize2)initSize;
+- (id)initWithSize3:(BASize3)initSize;
 - (BABitArray *)bitArrayByFlippingColumns;
 - (BABitArray *)bitArrayByFlippingRows;
 - (BABitArray *)bitArrayByRotating:(NSInteger)quarters; // "quarters" are increments are 90 degrees
 - (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray;
 + (BABitArray *)bitArrayWithSize2:(BASize2)initSize;
++ (BABitArray *)bitArrayWithSize3:(BASize3)initSize;
+@end
+
+
+/**
+ * Box operations for bit arrays with a 3-dimensional size. Rows along the X axis are updated a word
+ * at a time. A 2-dimensional array is treated as a volume with a depth of one.
+ */
+
+@interface BABitArray (VolumeStorage)
+
+- (void)setRegion3:(BARegion3)region;
+- (void)clearRegion3:(BARegion3)region;
+
+// copy bits from the box in bitArray at origin with the size of region
+- (void)writeRegion3:(BARegion3)region fromArray:(BABitArray *)bitArray offset:(BAPoint3)origin;
+- (BABitArray *)subArrayWithRegion3:(BARegion3)region;
+
+// 6-neighbour (4-neighbour in 2D) morphology; cells outside the array are treated as clear
+- (BABitArray *)bitArrayByDilating;
+- (BABitArray *)bitArrayByEroding;
+
+@end
+
+
+/**
+ * Change tracking, for consumers which update incrementally (meshes, path graphs).
+ *
+ * The array is divided into square (or cubic) tiles; every write marks the tiles it touches in a
+ * coarse map, which a consumer takes, clearing it, whenever it updates. A one-dimensional array has
+ * tiles of <tile size> bits. Tracking is not copied. In concurrent mode, taking the map is safe against
+ * writers: every change is in either the map taken, or the next one.
+ */
+
+@interface BABitArray (ChangeTracking)
+
+// 0 (the default) disables tracking; changing it discards the tiles marked so far
+- (NSUInteger)trackingTileSize;
+- (void)setTrackingTileSize:(NSUInteger)tileSize;
+
+// Tiles changed since the last take, as a bit array with one bit per tile and a size of the tile grid; nil if not tracking
+- (BABitArray *)takeDirtyTiles;
+
+// The same, for 2-dimensional arrays, as regions in bit co-ordinates; a span of dirty tiles is merged with
+// identical spans in the rows which follow
+- (void)takeDirtyRegions2:(void (^)(BARegion2 region))block;
+
 @end
 
 
 @interface BASampleArray (BABitArraySupport)
 - (BASize2)size2;
+- (BASize3)size3; // depth is 1 for a 2-dimensional size
 - (void)size3d:(NSUInteger *)size;
 + (BASampleArray *)sampleArrayForSize2:(BASize2)size2;
++ (BASampleArray *)sampleArrayForSize3:(BASize3)size3;
 + (BASampleArray *)sampleArrayForSize3d:(NSUInteger *)size;
 @end
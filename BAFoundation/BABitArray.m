@@ -7,14 +7,20 @@
 
 #import <BAFoundation/BABitArray.h>
 
+#import "BABitArrayPrivate.h"
 #import <BAFoundation/BAFunctions.h>
 #import <BAFoundation/NSData+GZip.h>
+#import <BAFoundation/NSData+WAH.h>
+#import <BAFoundation/BASlabAllocator.h>
+
+#import <sys/mman.h>
+#import <unistd.h>
+#if TARGET_OS_MAC
+#import <mach/mach.h>
+#import <mach/vm_statistics.h>
+#endif
 
 
-// Set/clear a range of bit positions in a single byte
-static void setBits(unsigned char *byte, NSUInteger start, NSUInteger end);
-static void clearBits(unsigned char *byte, NSUInteger start, NSUInteger end);
-
 // These functions refer to a range of bits starting in the byte at the address provided
 // Count the number of set bits
 NSUInteger hammingWeight(unsigned char *bytes, NSRange range);
@@ -25,18 +31,24 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
 // Set or clear bits
 NSInteger setRange(unsigned char *bytes, NSRange range, BOOL set);
 
+// Copy bits between buffers, returning the change in the number of set bits in the destination
+static NSInteger transferBits(const unsigned char *source, NSUInteger sourceIndex, unsigned char *dest, NSUInteger destIndex, NSUInteger length);
 
-@interface BABitArray ()
+// Set or clear bits with atomic word operations; the buffer must be aligned and padded to whole words
+static NSInteger atomicSetRange(unsigned char *bytes, NSRange range, BOOL set);
 
-@property (readwrite) NSUInteger count;
 
+@interface BABitArray (ChangeTrackingPrivate)
+- (void)markDirtyIndex:(NSUInteger)index;
+- (void)markDirtyRange:(NSRange)range;
+- (void)markDirtyBox:(BARegion3)box;
 @end
 
 
 @implementation BABitArray
 
 @synthesize length, count, enableArchiveCompression;
-@synthesize size;
+@synthesize size, storage;
 
 
 NSUInteger bitsInChar = NSNotFound;
@@ -124,21 +136,300 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     return wasSet;
 }
 
+// Returns YES if the bit changed
+static inline BOOL atomicUpdateBit(unsigned char *buffer, NSUInteger index, BOOL set) {
+    
+    uint64_t *word = (uint64_t *)buffer + index/64;
+    uint64_t mask = BABitsMemoryWord(1ULL << (63 - index%64));
+    
+    if(set)
+        return !(__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask);
+    else
+        return (__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+#pragma mark - Concurrent Counting
+
+#define COUNT_STRIPES 16
+
+// Each on its own cache line, so that threads do not contend for them
+struct BABitArrayCountStripe {
+    NSInteger delta;
+    char padding[64 - sizeof(NSInteger)];
+};
+
+static NSUInteger nextCountStripe;
+static __thread NSUInteger threadCountStripe = NSNotFound;
+
+static struct BABitArrayCountStripe *AllocateCountStripes(void) {
+    void *stripes = NULL;
+    if(posix_memalign(&stripes, 64, COUNT_STRIPES * sizeof(struct BABitArrayCountStripe)))
+        return NULL;
+    return memset(stripes, 0, COUNT_STRIPES * sizeof(struct BABitArrayCountStripe));
+}
+
+// Threads are given stripes in turn, the first time they write
+static inline void AddToCountStripe(struct BABitArrayCountStripe *stripes, NSInteger delta) {
+    if(NSNotFound == threadCountStripe)
+        threadCountStripe = __atomic_fetch_add(&nextCountStripe, 1, __ATOMIC_RELAXED) % COUNT_STRIPES;
+    __atomic_add_fetch(&stripes[threadCountStripe].delta, delta, __ATOMIC_RELAXED);
+}
+
+// Move the stripe totals into the count; safe against writers and other readers
+static NSUInteger FoldCountStripes(struct BABitArrayCountStripe *stripes, NSUInteger *count) {
+    NSInteger delta = 0;
+    for (NSUInteger i=0; i<COUNT_STRIPES; ++i)
+        delta += __atomic_exchange_n(&stripes[i].delta, 0, __ATOMIC_ACQ_REL);
+    return __atomic_add_fetch(count, delta, __ATOMIC_ACQ_REL);
+}
+
+#pragma mark - Buffer Allocation
+
+static NSUInteger mappedStorageThreshold = 1 << 22;
+static BOOL usesHugePages = NO;
+
+static NSUInteger PaddedLength(NSUInteger bytes) {
+    return (bytes + sizeof(uint64_t) - 1) & ~(NSUInteger)(sizeof(uint64_t) - 1);
+}
+
+static NSUInteger MappedLength(NSUInteger bytes) {
+    NSUInteger page = (NSUInteger)getpagesize();
+    return (PaddedLength(bytes) + page - 1) / page * page;
+}
+
+// Fresh anonymous pages are zero and cost nothing until touched; with an address, replaces the pages there
+static void *MapZeroPages(void *address, NSUInteger mappedLength) {
+    
+    int flags = MAP_ANON | MAP_PRIVATE | (address ? MAP_FIXED : 0);
+    void *pages = MAP_FAILED;
+    
+#ifdef VM_FLAGS_SUPERPAGE_SIZE_ANY
+    if(usesHugePages)
+        pages = mmap(address, mappedLength, PROT_READ | PROT_WRITE, flags, VM_FLAGS_SUPERPAGE_SIZE_ANY, 0);
+#endif
+    if(MAP_FAILED == pages)
+        pages = mmap(address, mappedLength, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(MAP_FAILED == pages)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if(usesHugePages)
+        madvise(pages, mappedLength, MADV_HUGEPAGE);
+#endif
+    
+    return pages;
+}
+
+// All bit buffers come from here: zero-filled, and padded to whole 64-bit words
+static unsigned char *AllocateBuffer(NSUInteger bytes, BABitArrayStorage *storage) {
+    
+    *storage = BABitArrayStorageHeap;
+    
+    if(0 == bytes)
+        return NULL;
+    
+    if(bytes >= mappedStorageThreshold) {
+        unsigned char *pages = MapZeroPages(NULL, MappedLength(bytes));
+        if(pages) {
+            *storage = BABitArrayStorageMapped;
+            return pages;
+        }
+    }
+    
+    return calloc(PaddedLength(bytes), sizeof(unsigned char));
+}
+
+static void FreeBuffer(unsigned char *buffer, NSUInteger bytes, BABitArrayStorage storage) {
+    if(BABitArrayStorageMapped == storage)
+        munmap(buffer, MappedLength(bytes));
+    else
+        free(buffer);
+}
+
+// The system copies the pages of the new mapping lazily, as either side writes to them
+static unsigned char *CopyMappedBuffer(unsigned char *buffer, NSUInteger bytes) {
+#if TARGET_OS_MAC
+    vm_address_t address = 0;
+    vm_prot_t current, maximum;
+    kern_return_t result = vm_remap(mach_task_self(), &address, MappedLength(bytes), 0, VM_FLAGS_ANYWHERE,
+                                    mach_task_self(), (vm_address_t)buffer, TRUE, &current, &maximum, VM_INHERIT_DEFAULT);
+    return KERN_SUCCESS == result ? (unsigned char *)address : NULL;
+#else
+    return NULL;
+#endif
+}
+
+// Resident pages of a mapped buffer which are still shared copy-on-write, and which are private
+static void MappedResidency(unsigned char *buffer, NSUInteger bytes, NSUInteger *shared, NSUInteger *private) {
+    
+    *shared = *private = 0;
+    
+#if TARGET_OS_MAC
+    vm_address_t start = (vm_address_t)buffer;
+    vm_address_t end = start + MappedLength(bytes);
+    vm_address_t address = start;
+    NSUInteger page = (NSUInteger)getpagesize();
+    
+    while(address < end) {
+        
+        vm_size_t regionSize = 0;
+        vm_region_top_info_data_t info;
+        mach_msg_type_number_t infoCount = VM_REGION_TOP_INFO_COUNT;
+        mach_port_t object = MACH_PORT_NULL;
+        
+        if(KERN_SUCCESS != vm_region_64(mach_task_self(), &address, &regionSize, VM_REGION_TOP_INFO, (vm_region_info_t)&info, &infoCount, &object) || address >= end)
+            break;
+        
+        // Adjacent mappings can be coalesced with ours; count only our share of the region
+        vm_address_t overlap = MIN(end, address + regionSize) - MAX(start, address);
+        double fraction = (double)overlap / (double)regionSize;
+        
+        *shared += (NSUInteger)(info.shared_pages_resident * fraction) * page;
+        *private += (NSUInteger)(info.private_pages_resident * fraction) * page;
+        
+        address += regionSize;
+    }
+#endif
+}
+
+static void ClearBuffer(unsigned char *buffer, NSUInteger bytes, BABitArrayStorage storage) {
+    // Swapping in fresh pages also gives the old ones back to the system
+    if(BABitArrayStorageMapped == storage && MapZeroPages(buffer, MappedLength(bytes)))
+        return;
+    memset(buffer, 0, bytes);
+}
+
+
 // These macros are intended only for use within this file, as they refer to ivars directly
 #if SEQUENTIAL_BIT_ORDER
 #define GET_BIT(_index_) ((buffer[((_index_)/bitsInChar)] & (1 << (maxBitOffset - ((_index_)%bitsInChar)))) != 0)
 #else
 #define GET_BIT(_index_) ((buffer[((_index_)/bitsInChar)] & (1 << ((_index_)%bitsInChar))) != 0)
 #endif
-#define SET_BIT(_index_) do { if(setBit(buffer, _index_)) ++count; }while(0)
-#define CLR_BIT(_index_) do { if(clrBit(buffer, _index_)) --count; }while(0)
+// Every write to our own buffer must be preceded by this
+#define WILL_WRITE() do { if(shareCount) [self unshareBuffer]; }while(0)
+
+// In concurrent mode, count changes go to the stripes; anything which reads the count must reconcile them first
+#define RECONCILE_COUNT() do { if(countStripes) FoldCountStripes(countStripes, &count); }while(0)
+#define ADD_COUNT(_delta_) do { if(countStripes) AddToCountStripe(countStripes, _delta_); else count += (_delta_); }while(0)
+
+// With change tracking, writes mark the tiles they touch
+#define MARK_DIRTY_INDEX(_index_) do { if(dirtyTiles || changedRows) [self markDirtyIndex:_index_]; }while(0)
+#define MARK_DIRTY_RANGE(_range_) do { if(dirtyTiles || changedRows) [self markDirtyRange:_range_]; }while(0)
+#define MARK_DIRTY_BOX(_box_) do { if(dirtyTiles || changedRows) [self markDirtyBox:_box_]; }while(0)
+
+#define SET_BIT(_index_) do { \
+    if(countStripes) { if(atomicUpdateBit(buffer, _index_, YES)) { AddToCountStripe(countStripes, 1); MARK_DIRTY_INDEX(_index_); } } \
+    else { WILL_WRITE(); if(setBit(buffer, _index_)) { ++count; MARK_DIRTY_INDEX(_index_); } } \
+}while(0)
+#define CLR_BIT(_index_) do { \
+    if(countStripes) { if(atomicUpdateBit(buffer, _index_, NO)) { AddToCountStripe(countStripes, -1); MARK_DIRTY_INDEX(_index_); } } \
+    else { WILL_WRITE(); if(clrBit(buffer, _index_)) { --count; MARK_DIRTY_INDEX(_index_); } } \
+}while(0)
+#define SET_RANGE(_range_, _set_) (countStripes ? atomicSetRange(buffer, _range_, _set_) : setRange(buffer, _range_, _set_))
 
 #define SET_OTHER_BIT(_bitArray_, _index_) do { if(setBit((_bitArray_)->buffer, _index_)) ++(_bitArray_)->count; }while(0)
 
 
+#pragma mark - Private
+
+// Take a private copy of a heap buffer shared with copies; the last owner frees the shared one
+- (void)unshareBuffer {
+    
+    if(__atomic_load_n(shareCount, __ATOMIC_ACQUIRE) > 1) {
+        
+        BABitArrayStorage privateStorage;
+        unsigned char *privateBuffer = AllocateBuffer(bufferLength, &privateStorage);
+        
+        memcpy(privateBuffer, buffer, bufferLength);
+        if(0 == __atomic_sub_fetch(shareCount, 1, __ATOMIC_ACQ_REL)) {
+            FreeBuffer(buffer, bufferLength, storage);
+            free(shareCount);
+        }
+        buffer = privateBuffer;
+        storage = privateStorage;
+    }
+    else {
+        free(shareCount);
+    }
+    
+    shareCount = NULL;
+}
+
+
 #pragma mark - Accessors
+- (unsigned char *)buffer {
+    return buffer;
+}
+
 - (NSData *)bufferData {
-    return [NSData dataWithBytes:buffer length:bufferLength];
+    
+    if(!buffer)
+        return [NSData data];
+    
+    // Hand out a snapshot, rather than copying the bytes
+    BABitArray *snapshot = [self copy];
+    
+    return [[[NSData alloc] initWithBytesNoCopy:snapshot->buffer length:bufferLength deallocator:^(void *bytes, NSUInteger bytesLength) {
+        [snapshot release];
+    }] autorelease];
+}
+
+- (NSUInteger)count {
+    if(countStripes)
+        return FoldCountStripes(countStripes, &count);
+    return count;
+}
+
+- (BOOL)isConcurrent {
+    return countStripes != NULL;
+}
+
+- (void)setConcurrent:(BOOL)flag {
+    
+    if(flag == (countStripes != NULL))
+        return;
+    
+    if(flag) {
+        // Atomic updates must not go to a buffer shared with copies
+        WILL_WRITE();
+        countStripes = AllocateCountStripes();
+    }
+    else {
+        RECONCILE_COUNT();
+        free(countStripes);
+        countStripes = NULL;
+    }
+    
+    dirtyTiles.concurrent = flag;
+    changedRows.concurrent = flag;
+}
+
+- (NSUInteger)sharedBytes {
+    
+    if(shareCount)
+        return __atomic_load_n(shareCount, __ATOMIC_ACQUIRE) > 1 ? bufferLength : 0;
+    
+    if(BABitArrayStorageMapped == storage) {
+        NSUInteger shared, private;
+        MappedResidency(buffer, bufferLength, &shared, &private);
+        return shared;
+    }
+    
+    return 0;
+}
+
+- (NSUInteger)privateBytes {
+    
+    if(shareCount)
+        return __atomic_load_n(shareCount, __ATOMIC_ACQUIRE) > 1 ? 0 : bufferLength;
+    
+    if(BABitArrayStorageMapped == storage) {
+        NSUInteger shared, private;
+        MappedResidency(buffer, bufferLength, &shared, &private);
+        return private;
+    }
+    
+    return bufferLength;
 }
 
 
@@ -155,9 +446,38 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 	return [self initWithLength:0];
 }
 
++ (NSUInteger)mappedStorageThreshold {
+    return mappedStorageThreshold;
+}
+
++ (void)setMappedStorageThreshold:(NSUInteger)bytes {
+    mappedStorageThreshold = bytes;
+}
+
++ (BOOL)usesHugePages {
+    return usesHugePages;
+}
+
++ (void)setUsesHugePages:(BOOL)flag {
+    usesHugePages = flag;
+}
+
 - (void)dealloc {
-	if (length > 0)
-		free(buffer);
+    if (shareCount) {
+        if(0 == __atomic_sub_fetch(shareCount, 1, __ATOMIC_ACQ_REL)) {
+            FreeBuffer(buffer, bufferLength, storage);
+            free(shareCount);
+        }
+    }
+    else if (BABitArrayStorageSlab == storage)
+        [slab freeBlock:buffer];
+	else if (buffer)
+		FreeBuffer(buffer, bufferLength, storage);
+    [slab release], slab = nil;
+    free(countStripes);
+    [dirtyTiles release], dirtyTiles = nil;
+    [changedRows release], changedRows = nil;
+    [rectangleIndex release], rectangleIndex = nil;
     [size release], size = nil;
 	[super dealloc];
 }
@@ -166,6 +486,8 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
         
     NSString *state;
     
+    RECONCILE_COUNT();
+    
     if(count == 0)
         state = @"empty";
     else if(count == length)
@@ -199,27 +521,61 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 	
 	BABitArray *copy = [[[self class] alloc] init];
     
+    RECONCILE_COUNT();
+    
+    copy->size = [size copy];
+    copy->size2 = size2;
+    copy->size3 = size3;
     copy->bufferLength = self->bufferLength;
     copy->length = self->length;
     copy->count = self->count;
 	
-	copy->buffer = malloc(bufferLength*sizeof(unsigned char));
-	memcpy(copy->buffer, buffer, bufferLength * sizeof(char));
+    copy->storage = storage;
+    
+    if(BABitArrayStorageMapped == storage && (copy->buffer = CopyMappedBuffer(buffer, bufferLength)))
+        return copy;
+    
+    // Writers may be updating the buffer in place, so it cannot be shared; nor can a slab's block, which
+    // would outlive the array that owns it
+    if(buffer && (countStripes || BABitArrayStorageSlab == storage)) {
+        copy->buffer = AllocateBuffer(bufferLength, &copy->storage);
+        memcpy(copy->buffer, buffer, bufferLength);
+    }
+    // Share the buffer until one side writes to it
+    else if(buffer) {
+        if(!shareCount) {
+            shareCount = malloc(sizeof(NSUInteger));
+            *shareCount = 1;
+        }
+        __atomic_add_fetch(shareCount, 1, __ATOMIC_ACQ_REL);
+        copy->buffer = buffer;
+        copy->shareCount = shareCount;
+    }
 	
 	return copy;
 }
 
 
 #pragma mark - NSCoding
+
+/* Archive versions:
+ *  1 (or none) - raw buffer as "data", or gzipped as "gzippedData"
+ *  2           - compressed buffers are run-length encoded (NSData+WAH) as "wahData"
+ */
+static const NSInteger BABitArrayArchiveVersion = 2;
+
 - (void)encodeWithCoder:(NSCoder *)aCoder {
     
+    RECONCILE_COUNT();
+    
     NSData *data = [NSData dataWithBytesNoCopy:buffer length:bufferLength freeWhenDone:NO];
     NSString *key = @"data";
     if(enableArchiveCompression) {
-        data = [data gzipDeflate];
-        key = @"gzippedData";
+        data = [data wahEncode];
+        key = @"wahData";
     }
     
+    [aCoder encodeInteger:BABitArrayArchiveVersion forKey:@"version"];
     [aCoder encodeObject:data forKey:key];
     [aCoder encodeInteger:(NSInteger)length forKey:@"length"];
     [aCoder encodeBool:enableArchiveCompression forKey:@"compressed"];
@@ -228,12 +584,29 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (id)initWithCoder:(NSCoder *)aDecoder {
-    NSData *data = [aDecoder decodeObjectForKey:@"data"] ?: [[aDecoder decodeObjectForKey:@"gzippedData"] gzipInflate];
-    self = [self initWithData:data length:[aDecoder decodeIntegerForKey:@"length"]];
+    
+    NSInteger version = [aDecoder decodeIntegerForKey:@"version"];
+    NSData *wahData = version >= 2 ? [aDecoder decodeObjectForKey:@"wahData"] : nil;
+    
+    if(wahData) {
+        // decode straight into the new buffer
+        self = [self initWithLength:[aDecoder decodeIntegerForKey:@"length"]];
+        if(self && ![wahData wahDecodeIntoBytes:buffer length:bufferLength]) {
+            [self release];
+            [NSException raise:NSInvalidUnarchiveOperationException format:@"Corrupt run-length encoded bit array"];
+        }
+        [self refreshCount];
+    }
+    else {
+        NSData *data = [aDecoder decodeObjectForKey:@"data"] ?: [[aDecoder decodeObjectForKey:@"gzippedData"] gzipInflate];
+        self = [self initWithData:data length:[aDecoder decodeIntegerForKey:@"length"]];
+    }
+    
     if(self) {
         enableArchiveCompression = [aDecoder decodeBoolForKey:@"compressed"];
         size = [[aDecoder decodeObjectForKey:@"size"] retain];
 		size2 = size.size2;
+		size3 = size.size3;
         
         NSUInteger storedCount = [aDecoder decodeIntegerForKey:@"count"];
         
@@ -249,7 +622,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     self = [super init];
     if(self) {
         bufferLength = [data length];
-        buffer = malloc(bufferLength);
+        buffer = AllocateBuffer(bufferLength, &storage);
         
         if(buffer)
             [data getBytes:buffer length:bufferLength];
@@ -268,7 +641,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     if((size != other->size) && ![size isEqualToSampleArray:other->size])
         return NO;
     
-	return (count == other->count &&
+	return ([self count] == [other count] &&
 			length == other->length &&
 			bufferLength == other->bufferLength &&
 			!memcmp(buffer, other->buffer, bufferLength));
@@ -284,7 +657,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (void)setBit:(NSUInteger)index {
-    if(count == length)
+    if(!countStripes && count == length)
         return;
 	if(index > length)
         [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
@@ -292,24 +665,35 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (void)setRange:(NSRange)bitRange {
-    if(count == length)
+    if(!countStripes && count == length)
         return;
     NSUInteger maxIndex = bitRange.location+bitRange.length-1;
 	if(maxIndex >= length)
 		[NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)maxIndex];
-	count += setRange(buffer, bitRange, YES);
-    NSAssert([self checkCount], @"Count incorrect after setting range");
+    WILL_WRITE();
+    NSInteger delta = SET_RANGE(bitRange, YES);
+	ADD_COUNT(delta);
+    if(delta)
+        MARK_DIRTY_RANGE(bitRange);
+    NSAssert(countStripes || [self checkCount], @"Count incorrect after setting range");
 }
 
 - (void)setAll {
+    RECONCILE_COUNT();
     if(count == length)
         return;
+    WILL_WRITE();
 	memset(buffer, 0xff, bufferLength);
+    // keep the bits past the end clear, so that word-wise counts are right
+    if(length % bitsInChar)
+        BABitsStore(buffer, length, bitsInChar - length % bitsInChar, 0);
 	count = length;
+    [dirtyTiles setAll];
+    [changedRows setAll];
 }
 
 - (void)clearBit:(NSUInteger)index {
-    if(count == 0)
+    if(!countStripes && count == 0)
         return;
 	if(index > length)
 		[NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
@@ -317,20 +701,28 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (void)clearRange:(NSRange)bitRange {
-    if(count == 0)
+    if(!countStripes && count == 0)
         return;
     NSUInteger maxIndex = bitRange.location+bitRange.length-1;
 	if(maxIndex >= length)
 		[NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)maxIndex];
-	count += setRange(buffer, bitRange, NO);
-    NSAssert([self checkCount], @"Count incorrect after setting range");
+    WILL_WRITE();
+    NSInteger delta = SET_RANGE(bitRange, NO);
+	ADD_COUNT(delta);
+    if(delta)
+        MARK_DIRTY_RANGE(bitRange);
+    NSAssert(countStripes || [self checkCount], @"Count incorrect after setting range");
 }
 
 - (void)clearAll {
+    RECONCILE_COUNT();
     if(count == 0)
         return;
-	memset(buffer, 0, bufferLength);
+    WILL_WRITE();
+	ClearBuffer(buffer, bufferLength, storage);
 	count = 0;
+    [dirtyTiles setAll];
+    [changedRows setAll];
 }
 
 - (NSUInteger)first:(unsigned char *)p {
@@ -344,6 +736,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (NSUInteger)firstSetBit {
+    RECONCILE_COUNT();
     if(count == 0)
         return NSNotFound;
     if(count == length)
@@ -353,6 +746,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 
 - (NSUInteger)lastSetBit {
     
+    RECONCILE_COUNT();
     if(count == 0)
         return NSNotFound;
     if(count == length)
@@ -389,8 +783,10 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     NSUInteger maxIndex = range.location+range.length-1;
 	if(maxIndex >= length)
 		[NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)maxIndex];
+    WILL_WRITE();
     NSUInteger diff = copyBits(buffer, bits, range, YES, NO);
-    count+=diff;
+    ADD_COUNT(diff);
+    MARK_DIRTY_RANGE(range);
     return diff;
 }
 
@@ -398,7 +794,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     NSUInteger maxIndex = byteRange.location+byteRange.length-1;
 	if(maxIndex >= bufferLength)
 		[NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)maxIndex];
-    memcpy(bytes, buffer, byteRange.length);
+    memcpy(bytes, buffer + byteRange.location, byteRange.length);
 }
 
 - (void)writeBytes:(unsigned char *)bytes range:(NSRange)byteRange {
@@ -411,53 +807,31 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
     NSInteger newCount = hammingWeight(bytes, bitRange);
     NSInteger oldCount = hammingWeight(buffer+byteRange.location, bitRange);
     
-    memcpy(buffer, bytes, byteRange.length);
+    WILL_WRITE();
+    memcpy(buffer + byteRange.location, bytes, byteRange.length);
     
-    count += newCount-oldCount;
+    ADD_COUNT(newCount-oldCount);
+    MARK_DIRTY_RANGE(NSMakeRange(byteRange.location*bitsInChar, byteRange.length*bitsInChar));
 }
 
 - (NSData *)dataForRange:(NSRange)bitRange {
     
     size_t bytesLength = (bitRange.length+7)/bitsInChar;
     
-    if(bitRange.location%bitsInChar == 0)
+    if(bitRange.location%bitsInChar == 0 && bitRange.length%bitsInChar == 0)
         return [NSData dataWithBytes:buffer + (bitRange.location/bitsInChar) length:bytesLength];
     
-    unsigned char *subBuffer = malloc(sizeof(unsigned char)*bytesLength);
-    
-    union {
-        unsigned char c8[2];
-        uint16_t c16;
-    } pair;
+    // Shift a word at a time; the bits past the end of the range stay clear
+    unsigned char *subBuffer = calloc(PaddedLength(bytesLength), sizeof(unsigned char));
     
-	NSUInteger firstByte = bitRange.location/bitsInChar;
-	NSUInteger lastByte = (bitRange.location+bitRange.length-1)/bitsInChar;
-	NSUInteger firstBit = bitRange.location%bitsInChar;
-    
-    for (NSUInteger i=firstByte; i<lastByte; ++i) {
-#if SEQUENTIAL_BIT_ORDER
-        pair.c8[0] = buffer[i+1];
-        pair.c8[1] = buffer[i];
-        pair.c16 <<= firstBit;
-        subBuffer[i-firstByte] = pair.c8[1];
-#else
-        pair.c8[0] = buffer[i];
-        pair.c8[1] = buffer[i+1];
-        pair.c16 >>= firstBit;
-        subBuffer[i-firstByte] = pair.c8[0];
-#endif
-    }
-    
-	NSUInteger lastBit = bitRange.length%bitsInChar;
-	
-    if(bytesLength*bitsInChar > bitRange.length)
-        clearBits(subBuffer+bytesLength-1, lastBit, bitsInChar-1);
+    transferBits(buffer, bitRange.location, subBuffer, 0, bitRange.length);
     
     return [NSData dataWithBytesNoCopy:subBuffer length:bytesLength freeWhenDone:YES];
 }
 
 - (NSUInteger)firstClearBit {
     
+    RECONCILE_COUNT();
     if(count == 0)
         return 0;
     if(count == length)
@@ -474,6 +848,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 
 - (NSUInteger)lastClearBit {
     
+    RECONCILE_COUNT();
     if(count == 0)
         return length-1;
     if(count == length)
@@ -490,6 +865,7 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 
 - (NSUInteger)indexOfNthClearBit:(NSUInteger)n {
     
+    RECONCILE_COUNT();
     if(count == 0)
         return n;
     else if(n == length-count)
@@ -548,17 +924,18 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 }
 
 - (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector {
-	if(bits > 256*256*256)
+	if(bits > NSUIntegerMax - 64)
 		[NSException raise:NSInvalidArgumentException format:@"Requested unreasonable length for bit array (%lu)", (unsigned long)bits];
 	self = [super init];
 	if(self) {
 		length = bits; // never changes
         size = [vector copy]; // never changes
         size2 = size.size2;
+        size3 = size.size3;
 		bufferLength = bits/bitsInChar + ((bits%bitsInChar) > 0 ? 1 : 0);
-		self.count = 0;
+		count = 0;
 		if(length > 0) {
-			buffer = calloc(bufferLength, sizeof(unsigned char));
+			buffer = AllocateBuffer(bufferLength, &storage);
 			if(NULL == buffer) {
 				[NSException raise:@"" format:@"Could not allocate memory; requested size: %lu", (unsigned long)bufferLength];
 			}
@@ -568,15 +945,37 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 	return self;
 }
 
+- (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector slab:(BASlabAllocator *)aSlab {
+    NSUInteger bytes = bits/bitsInChar + ((bits%bitsInChar) > 0 ? 1 : 0);
+    if(!aSlab || 0 == bytes || PaddedLength(bytes) > aSlab.blockSize)
+        return [self initWithLength:bits size:vector];
+    self = [super init];
+    if(self) {
+        length = bits;
+        size = [vector retain];
+        size2 = size.size2;
+        size3 = size.size3;
+        bufferLength = bytes;
+        buffer = [aSlab allocateBlock];
+        if(NULL == buffer) {
+            [NSException raise:@"" format:@"Could not allocate memory; requested size: %lu", (unsigned long)bufferLength];
+        }
+        storage = BABitArrayStorageSlab;
+        slab = [aSlab retain];
+    }
+    return self;
+}
+
 - (id)initWithLength:(NSUInteger)bits {
     return [self initWithLength:bits size:nil];
 }
 
 - (BOOL)checkCount {
-	return hammingWeight(buffer, NSMakeRange(0, length)) == count;
+	return hammingWeight(buffer, NSMakeRange(0, length)) == [self count];
 }
 
 - (void)refreshCount {
+    RECONCILE_COUNT();
 	count = hammingWeight(buffer, NSMakeRange(0, length));
 }
 
@@ -646,119 +1045,81 @@ static inline BOOL clrBit(unsigned char *buffer, NSUInteger index) {
 	return [[[self alloc] initWithLength:512] autorelease];
 }
 + (BABitArray *)bitArray4096 {
-	return [[[self alloc] initWithLength:4096] autorelease];
+	return [[(BABitArray *)[self alloc] initWithSize3:BASize3Make(16, 16, 16)] autorelease];
 }
 
 @end
 
 
-inline static void setBits(unsigned char *byte, NSUInteger start, NSUInteger end) {
-	for(NSUInteger i=start; i<=end; ++i) {
-#if SEQUENTIAL_BIT_ORDER
-        *byte |= (1 << (maxBitOffset - i));
-#else
-        *byte |= (1 << i);
-#endif
+// Work a word at a time; after the first word, every word is aligned
+NSUInteger hammingWeight(unsigned char *bytes, NSRange bitRange) {
+	
+	NSUInteger index = bitRange.location;
+	NSUInteger end = NSMaxRange(bitRange);
+	NSUInteger total = 0;
+	
+	while(index < end) {
+		NSUInteger n = MIN(end - index, 64 - (index & 63));
+		total += BABitsPopulation(BABitsLoad(bytes, index, n));
+		index += n;
 	}
+	
+	return total;
 }
 
-inline static void clearBits(unsigned char *byte, NSUInteger start, NSUInteger end) {
-	for(NSUInteger i=start; i<=end; ++i) {
-#if SEQUENTIAL_BIT_ORDER
-        *byte &= ~(1 << (maxBitOffset - i));
-#else
-        *byte &= ~(1 << i);
-#endif
+NSInteger setRange(unsigned char *bytes, NSRange range, BOOL set) {
+	
+	NSUInteger index = range.location;
+	NSUInteger end = NSMaxRange(range);
+	uint64_t word = set ? ~0ULL : 0;
+	NSInteger delta = 0;
+	
+	while(index < end) {
+		NSUInteger n = MIN(end - index, 64 - (index & 63));
+		NSInteger oldCount = BABitsPopulation(BABitsLoad(bytes, index, n));
+		BABitsStore(bytes, index, n, word);
+		delta += (set ? (NSInteger)n : 0) - oldCount;
+		index += n;
 	}
+	
+	return delta;
 }
 
-// Algorithm found on the web
-NSUInteger hammingWeight(unsigned char *bytes, NSRange bitRange) {
+static NSInteger atomicSetRange(unsigned char *bytes, NSRange range, BOOL set) {
 	
-	NSUInteger first = bitRange.location/bitsInChar;
-	NSUInteger start = bitRange.location%bitsInChar;
-	NSUInteger last  = (bitRange.location+bitRange.length-1)/bitsInChar;
-	NSUInteger end   = (start+bitRange.length-1)%bitsInChar;
+	NSUInteger index = range.location;
+	NSUInteger end = NSMaxRange(range);
+	NSInteger delta = 0;
 	
-	NSUInteger odd, even;
-	NSUInteger subtotal = 0, total = 0;
-	unsigned char firstMask = 0, lastMask = 0, mask=0xFF;
-	
-    if(first == last) {
-        setBits(&firstMask, start, end);
-    }
-    else {
-        if(0 == start)
-            firstMask = 0xFF;
-        else
-            setBits(&firstMask, start, 7);
-        
-        if(7 == end)
-            lastMask = 0xFF;
-        else
-            setBits(&lastMask, 0, end);
-    }
-		
-	for(NSUInteger i=first; i<=last; ++i) {
-		
-		if(first == i)
-			mask = firstMask;
-		else if(last == i)
-			mask = lastMask;
+	while(index < end) {
+		NSUInteger n = MIN(end - index, 64 - (index & 63));
+		uint64_t *word = (uint64_t *)bytes + index/64;
+		uint64_t mask = BABitsMemoryWord(BABitsHighMask(n) >> (index & 63));
+		if(set)
+			delta += (NSInteger)n - (NSInteger)BABitsPopulation(__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask);
 		else
-			mask = 0xFF;
-		
-		odd  = (bytes[i] & mask)      & 0x55; // 0101 0101 = 0x40 + 0x10 + 0x04 + 0x01
-		even = (bytes[i] & mask) >> 1 & 0x55;
-		subtotal = odd + even;
-		odd  = subtotal      & 0x33; // 0011 0011 - 0x20 + 0x10 + 0x02 + 0x01
-		even = subtotal >> 2 & 0x33;
-		subtotal = odd + even;
-		odd  = subtotal      & 0x0F; // 0000 1111
-		even = subtotal >> 4 & 0x0F;
-		subtotal = odd + even;		
-		total += subtotal;
-        
-        assert(total <= bitRange.length);
-    }
+			delta -= (NSInteger)BABitsPopulation(__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED) & mask);
+		index += n;
+	}
 	
-	return total;
+	return delta;
 }
 
-NSInteger setRange(unsigned char *bytes, NSRange range, BOOL set) {
+static NSInteger transferBits(const unsigned char *source, NSUInteger sourceIndex, unsigned char *dest, NSUInteger destIndex, NSUInteger length) {
 	
-    if(range.length == 0)
-        return 0;
-    
-	NSUInteger first = range.location/bitsInChar;
-	NSUInteger last = (range.location+range.length-1)/bitsInChar;
-	NSUInteger start = range.location%bitsInChar;
-	NSUInteger end = (start+range.length-1)%bitsInChar;
-	unsigned char byteSet = set ? 0xFF : 0;
-	
-	NSInteger oldCount = hammingWeight(bytes, range);
-    
-    // updateBits() is a cover for either setBits() or clearBits(), to reduce the number of if() statements
-    // this might defeat the inlining, but I don't know
-    void(*updateBits)(unsigned char *, NSUInteger, NSUInteger) = set ? setBits : clearBits;
-	
-//	NSLog(@"setRange(0x%08X, %@, %@): first %u; last %u; start %u; end %u; old count %u",
-//		  bytes, NSStringFromRange(range), set?@"YES":@"NO", first, last, start, end, oldCount);
+	NSUInteger end = destIndex + length;
+	NSInteger delta = 0;
 	
-	if (first == last) {
-		updateBits(bytes+first, start, end);
-	}
-	else {
-		updateBits(bytes+first, start, bitsInChar-1);
-		updateBits(bytes+last, 0, end);		
-		if(last - first > 1)
-			memset(bytes+first+1, byteSet, last - first - 1);
+	while(destIndex < end) {
+		NSUInteger n = MIN(end - destIndex, 64 - (destIndex & 63));
+		uint64_t word = BABitsLoad(source, sourceIndex, n);
+		delta += (NSInteger)BABitsPopulation(word) - (NSInteger)BABitsPopulation(BABitsLoad(dest, destIndex, n));
+		BABitsStore(dest, destIndex, n, word);
+		sourceIndex += n;
+		destIndex += n;
 	}
 	
-	if(set)
-		return (NSInteger)range.length - oldCount;
-	else
-		return -oldCount;
+	return delta;
 }
 
 
@@ -858,25 +1219,21 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
 }
 
 
+#define INDEX3(_x_, _y_, _z_) ((_x_) + ((_y_) + (_z_)*size3.height)*size3.width)
+
 - (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
     BIT_ARRAY_SIZE_ASSERT();
-    NSUInteger dims[3];
-    [size size3d:dims];
-    return GET_BIT(x + y*dims[0] + z*dims[1]*dims[0]);
+    return GET_BIT(INDEX3(x, y, z));
 }
 
 - (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
     BIT_ARRAY_SIZE_ASSERT();
-    NSUInteger dims[3];
-    [size size3d:dims];
-    SET_BIT(x + y*dims[0] + z*dims[1]*dims[0]);
+    SET_BIT(INDEX3(x, y, z));
 }
 
 - (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
     BIT_ARRAY_SIZE_ASSERT();
-    NSUInteger dims[3];
-    [size size3d:dims];
-    CLR_BIT(x + y*dims[0] + z*dims[1]*dims[0]);
+    CLR_BIT(INDEX3(x, y, z));
 }
 
 
@@ -890,16 +1247,19 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     NSRange range = NSMakeRange(region.origin.x+size2.width*region.origin.y, region.size.width);
     NSInteger delta = 0;
     
-    NSAssert([self checkCount], @"count incorrect");
+    NSAssert(countStripes || [self checkCount], @"count incorrect");
     
+    WILL_WRITE();
     for (NSInteger i=0; i<region.size.height; ++i) {
-        delta += setRange(buffer, range, set);
+        delta += SET_RANGE(range, set);
         range.location += size2.width;
     }
     
-    count += delta;
+    ADD_COUNT(delta);
+    if(delta)
+        MARK_DIRTY_BOX(BARegion3Make(region.origin.x, region.origin.y, 0, region.size.width, region.size.height, 1));
     
-    NSAssert([self checkCount], @"count incorrect");
+    NSAssert(countStripes || [self checkCount], @"count incorrect");
 }
 
 - (void)setRegion2:(BARegion2)region {
@@ -920,7 +1280,24 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     NSRange sourceRange = NSMakeRange(origin.x + sourceSize.width * origin.y, BARegion2GetWidth(region));
     NSRange destRange = NSMakeRange(region.origin.x + size2.width * region.origin.y, BARegion2GetWidth(region));
     
-    // TODO: Replace with more effective implementation
+    if([(id)bitArray isKindOfClass:[BABitArray class]]) {
+        
+        unsigned char *source = ((BABitArray *)bitArray)->buffer;
+        NSInteger delta = 0;
+        
+        WILL_WRITE();
+        for (NSInteger i=0; i<region.size.height; ++i) {
+            delta += transferBits(source, sourceRange.location, buffer, destRange.location, destRange.length);
+            sourceRange.location += sourceSize.width;
+            destRange.location += size2.width;
+        }
+        
+        ADD_COUNT(delta);
+        MARK_DIRTY_BOX(BARegion3Make(region.origin.x, region.origin.y, 0, region.size.width, region.size.height, 1));
+        
+        return;
+    }
+    
     BOOL *bits = malloc(region.size.width*sizeof(BOOL));
     
     for (NSInteger i=0; i<region.size.height; ++i) {
@@ -956,6 +1333,11 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     return self;
 }
 
+- (void)enumerateRunsInRow:(NSUInteger)y block:(BABitArrayRunEnumerator)block {
+    BIT_ARRAY_SIZE_ASSERT();
+    BABitsEnumerateRuns(buffer, y * size2.width, size2.width, block);
+}
+
 - (NSArray *)rowStringsForRegion2:(BARegion2)region {
     
     NSMutableArray *rows = [NSMutableArray array];
@@ -987,8 +1369,78 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     return [self initWithLength:initSize.width*initSize.height size:[BASampleArray sampleArrayForSize2:initSize]];
 }
 
+- (id)initWithSize3:(BASize3)initSize {
+    return [self initWithLength:initSize.width*initSize.height*initSize.depth size:[BASampleArray sampleArrayForSize3:initSize]];
+}
+
+// Transpose an 8x8 bit matrix packed into a word, first row in the high byte (Hacker's Delight, 7-3)
+static inline uint64_t transpose8x8(uint64_t x) {
+    
+    uint64_t t;
+    
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    
+    return x;
+}
+
+// Transpose a 64x64 bit matrix in place by swapping ever smaller off-diagonal blocks
+static void transpose64x64(uint64_t *rows) {
+    
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    
+    for (NSUInteger j=32; j!=0; j>>=1, m^=(m<<j)) {
+        for (NSUInteger k=0; k<64; k=((k|j)+1) & ~j) {
+            uint64_t t = (rows[k] ^ (rows[k|j] >> j)) & m;
+            rows[k] ^= t;
+            rows[k|j] ^= (t << j);
+        }
+    }
+}
+
+// Load a tile of up to <tile> x <tile> bits starting at (x, y) and transpose it,
+// so that words[c] holds column x+c, with row y in the high bit
+static void transposeTile(const unsigned char *bytes, NSUInteger width, NSUInteger x, NSUInteger y,
+                          NSUInteger columns, NSUInteger rows, NSUInteger tile, uint64_t *words) {
+    
+    for (NSUInteger k=0; k<tile; ++k)
+        words[k] = k < rows ? BABitsLoad(bytes, (y+k)*width + x, columns) : 0;
+    
+    if(tile == 8) {
+        uint64_t packed = 0;
+        for (NSUInteger k=0; k<8; ++k)
+            packed |= (words[k] >> 56) << (56 - 8*k);
+        packed = transpose8x8(packed);
+        for (NSUInteger k=0; k<8; ++k)
+            words[k] = (packed << (8*k)) & 0xFF00000000000000ULL;
+    }
+    else {
+        transpose64x64(words);
+    }
+}
+
+// Copy one row into another, optionally reversing the order of the bits
+static void copyRow(const unsigned char *source, NSUInteger sourceIndex, unsigned char *dest, NSUInteger destIndex, NSUInteger width, BOOL reverse) {
+    
+    for (NSUInteger x=0; x<width; x+=64) {
+        
+        NSUInteger n = MIN(64, width-x);
+        uint64_t word = BABitsLoad(source, sourceIndex + x, n);
+        
+        if(reverse)
+            BABitsStore(dest, destIndex + width - x - n, n, BABitsReverse(word) << (64 - n));
+        else
+            BABitsStore(dest, destIndex + x, n, word);
+    }
+}
+
 - (BABitArray *)bitArrayByFlippingColumns {
     
+    RECONCILE_COUNT();
     if(count == 0 || count == length)
         return [[self copy] autorelease];
     
@@ -997,18 +1449,17 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     NSInteger width = size2.width;
     NSInteger height = size2.height;
     
-    for (NSInteger i=0; i<height; ++i) {
-        for (NSInteger j=0; j<width; ++j) {
-            if(GET_BIT(j + i*width))
-                SET_OTHER_BIT(copy, width-j-1 + i*width);
-        }
-    }
+    for (NSInteger i=0; i<height; ++i)
+        copyRow(buffer, i*width, copy->buffer, i*width, width, YES);
+    
+    copy->count = count;
     
     return copy;
 }
 
 - (BABitArray *)bitArrayByFlippingRowsReverse:(BOOL)reverse {
     
+    RECONCILE_COUNT();
     if(count == 0 || count == length)
         return [[self copy] autorelease];
     
@@ -1016,21 +1467,10 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     NSInteger width = size2.width;
     NSInteger height = size2.height;
     
-    BOOL *bits = malloc(sizeof(BOOL)*width);
+    for (NSInteger i=0; i<height; ++i)
+        copyRow(buffer, i*width, copy->buffer, (height-1-i)*width, width, reverse);
     
-    NSRange source = NSMakeRange(0, width);
-    NSRange dest = NSMakeRange((height-1)*width, width);
-
-    for (NSInteger i=0; i<height; ++i) {
-        copyBits(buffer, bits, source, NO, NO);
-        source.location += width;
-        copyBits(copy->buffer, bits, dest, YES, reverse);
-        dest.location -= width;
-    }
-    
-    [copy refreshCount];
-    
-    free(bits);
+    copy->count = count;
     
     return copy;
 }
@@ -1046,67 +1486,424 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     if(quarters < 0)
         quarters += 4;
     
-    BABitArray *copy = nil;
-    NSInteger width = size2.width;
-    NSInteger height = size2.height;
+    if(quarters == 0)
+        return [[self copy] autorelease];
     
-    switch (quarters) {
+    RECONCILE_COUNT();
+    
+    // (x, y) -> (width-x-1, height-y-1)
+    if(quarters == 2)
+        return [self bitArrayByFlippingRowsReverse:YES];
+    
+    NSUInteger width = size2.width;
+    NSUInteger height = size2.height;
+    
+    // swap height and width in size
+    BABitArray *copy = [BABitArray bitArrayWithLength:length size:[BASampleArray sampleArrayForSize2:BASize2Make(height, width)]];
+    
+    if(count == 0)
+        return copy;
+    if(count == length) {
+        [copy setAll];
+        return copy;
+    }
+    
+    // Columns of the source are rows of the result, so work through the source in square tiles,
+    // transposing each and storing the columns as (partial) rows of the result.
+    // Small arrays, like room templates, fit in a single 8x8 tile.
+    NSUInteger tile = (width <= 8 && height <= 8) ? 8 : 64;
+    uint64_t words[64];
+    
+    for (NSUInteger y=0; y<height; y+=tile) {
+        
+        NSUInteger rows = MIN(tile, height-y);
+        
+        for (NSUInteger x=0; x<width; x+=tile) {
             
-        case 0:
-            copy = [[self copy] autorelease];
-            break;
-
-        case 1:
-            copy = [BABitArray bitArrayWithLength:length size:nil];
-            // Rotate 90 CCW around origin, then translate by x+width
-            // (x,y) -> (-y, x) -> (w+x, y) = (w+(-y), x) = (w-y, x)
-            // x2 = -y, x3 = w-x2 = w - (-y) = w-y
-            // y2 = x,  y3 = y2 = x
-            // index = x3 + w*y3 = (w-y) + w*x
-            // w is actually width-1 for indexed storage
-            for (NSInteger i=0; i<height; ++i) {
-                for (NSInteger j=0; j<width; ++j) {
-                    if(GET_BIT(j + i*width))
-                        SET_OTHER_BIT(copy, (width-1-i) + j*width);
-                }
+            NSUInteger columns = MIN(tile, width-x);
+            
+            transposeTile(buffer, width, x, y, columns, rows, tile, words);
+            
+            for (NSUInteger c=0; c<columns; ++c) {
+                if(quarters == 1)
+                    // Rotate 90 CCW around origin, then translate by x+height
+                    // (x, y) -> (h-1-y, x): column x becomes row x, read from the top down
+                    BABitsStore(copy->buffer, (x+c)*height + height-y-rows, rows, BABitsReverse(words[c]) << (64 - rows));
+                else
+                    // Rotate 90 CW around origin, then translate by y+width
+                    // (x, y) -> (y, w-1-x): column x becomes row w-1-x, read from the bottom up
+                    BABitsStore(copy->buffer, (width-1-x-c)*height + y, rows, words[c]);
             }
+        }
+    }
+    
+    // rotation does not change the number of set bits
+    copy->count = count;
+    
+    return copy;
+}
 
-            break;
++ (BABitArray *)bitArrayWithSize2:(BASize2)initSize {
+    return [[(BABitArray *)[self alloc] initWithSize2:initSize] autorelease];
+}
+
++ (BABitArray *)bitArrayWithSize3:(BASize3)initSize {
+    return [[(BABitArray *)[self alloc] initWithSize3:initSize] autorelease];
+}
+
+@end
+
+
+@implementation BABitArray (VolumeStorage)
+
+#define REGION3_ASSERT(region, size3) NSAssert(region.origin.x >= 0 && region.origin.y >= 0 && region.origin.z >= 0 && \
+    BARegion3ContainsRegion3(BARegion3Make(0, 0, 0, size3.width, size3.height, size3.depth), region), @"region out of bounds")
+
+- (void)updateRegion3:(BARegion3)region set:(BOOL)set {
+    
+    BIT_ARRAY_SIZE_ASSERT();
+    REGION3_ASSERT(region, size3);
+    
+    if(BARegion3IsEmpty(region))
+        return;
+    
+    // Boxes which span whole rows (and whole planes) are contiguous in storage
+    NSUInteger rowLength = region.size.width;
+    NSUInteger rows = region.size.height;
+    NSUInteger planes = region.size.depth;
+    
+    if(rowLength == (NSUInteger)size3.width) {
+        rowLength *= rows;
+        rows = 1;
+        if(region.size.height == size3.height) {
+            rowLength *= planes;
+            planes = 1;
+        }
+    }
+    
+    NSInteger delta = 0;
+    
+    WILL_WRITE();
+    for (NSUInteger z=0; z<planes; ++z)
+        for (NSUInteger y=0; y<rows; ++y)
+            delta += SET_RANGE(NSMakeRange(INDEX3(region.origin.x, region.origin.y + y, region.origin.z + z), rowLength), set);
+    
+    ADD_COUNT(delta);
+    if(delta)
+        MARK_DIRTY_BOX(region);
+    
+    NSAssert(countStripes || [self checkCount], @"count incorrect");
+}
+
+- (void)setRegion3:(BARegion3)region {
+    [self updateRegion3:region set:YES];
+}
+
+- (void)clearRegion3:(BARegion3)region {
+    [self updateRegion3:region set:NO];
+}
+
+- (void)writeRegion3:(BARegion3)region fromArray:(BABitArray *)bitArray offset:(BAPoint3)origin {
+    
+    BIT_ARRAY_SIZE_ASSERT();
+    REGION3_ASSERT(region, size3);
+    
+    BASize3 sourceSize = bitArray->size3;
+    
+    NSAssert(BARegion3ContainsRegion3(BARegion3Make(0, 0, 0, sourceSize.width, sourceSize.height, sourceSize.depth),
+                                      (BARegion3){ origin, region.size }), @"source region out of bounds");
+    
+    NSInteger delta = 0;
+    
+    WILL_WRITE();
+    for (NSInteger z=0; z<region.size.depth; ++z) {
+        for (NSInteger y=0; y<region.size.height; ++y) {
+            NSUInteger sourceIndex = origin.x + ((origin.y + y) + (origin.z + z)*sourceSize.height)*sourceSize.width;
+            NSUInteger destIndex = INDEX3(region.origin.x, region.origin.y + y, region.origin.z + z);
+            delta += transferBits(bitArray->buffer, sourceIndex, buffer, destIndex, region.size.width);
+        }
+    }
+    
+    ADD_COUNT(delta);
+    MARK_DIRTY_BOX(region);
+}
+
+- (BABitArray *)subArrayWithRegion3:(BARegion3)region {
+    
+    BABitArray *result = [BABitArray bitArrayWithSize3:region.size];
+    BAPoint3 origin = region.origin;
+    
+    region.origin = BAPoint3Zero();
+    [result writeRegion3:region fromArray:self offset:origin];
+    
+    return result;
+}
+
+- (BABitArray *)bitArrayByMorphing:(BOOL)dilate {
+    
+    BIT_ARRAY_SIZE_ASSERT();
+    
+    NSUInteger width = size3.width;
+    NSUInteger height = size3.height;
+    NSUInteger depth = size3.depth;
+    NSUInteger plane = width * height;
+    
+    BABitArray *result = [BABitArray bitArrayWithLength:length size:[[size copy] autorelease]];
+    NSUInteger total = 0;
+    
+    for (NSUInteger z=0; z<depth; ++z) {
+        for (NSUInteger y=0; y<height; ++y) {
             
-        case 2: // (x, y) -> (width-x-1, height-y-1)
-            copy = [self bitArrayByFlippingRowsReverse:YES];
-            break;
+            NSUInteger row = INDEX3(0, y, z);
             
-        case 3:
-        default:
-            copy = [BABitArray bitArrayWithLength:length size:nil];
-            // Rotate 90 CW around origin, then translate by y+height
-            // (x,y) -> (y, -x) -> (x, h+y) = (y, h+(-x)) = (y, h-x)
-            // x2 = y, x3 = x2 = y
-            // y2 = -x, y3 = h+y2 = h+(-x) = h-x
-            // index = x3 + w*y3 = y + w*(h-x)
-            // wi is actually width-1 for indexed storage
-            for (NSInteger i=0; i<height; ++i) {
-                for (NSInteger j=0; j<width; ++j) {
-                    if(GET_BIT(j + i*width))
-                        SET_OTHER_BIT(copy, i + (height-1-j)*width);
+            for (NSUInteger x=0; x<width; x+=64) {
+                
+                NSUInteger n = MIN(64, width - x);
+                uint64_t mask = BABitsHighMask(n);
+                // Neighbours outside the array are clear; an axis of extent one has no neighbours
+                uint64_t outside = dilate ? 0 : mask;
+                uint64_t centre = BABitsLoad(buffer, row + x, n);
+                uint64_t neighbours[6];
+                
+                if(width > 1) {
+                    neighbours[0] = x > 0 ? BABitsLoad(buffer, row + x - 1, n) : (centre >> 1) & mask;
+                    neighbours[1] = x + n < width ? BABitsLoad(buffer, row + x + 1, n) : (centre << 1) & mask;
+                }
+                else {
+                    neighbours[0] = neighbours[1] = outside;
+                }
+                
+                if(height > 1) {
+                    neighbours[2] = y > 0 ? BABitsLoad(buffer, row - width + x, n) : 0;
+                    neighbours[3] = y + 1 < height ? BABitsLoad(buffer, row + width + x, n) : 0;
+                }
+                else {
+                    neighbours[2] = neighbours[3] = outside;
+                }
+                
+                if(depth > 1) {
+                    neighbours[4] = z > 0 ? BABitsLoad(buffer, row - plane + x, n) : 0;
+                    neighbours[5] = z + 1 < depth ? BABitsLoad(buffer, row + plane + x, n) : 0;
+                }
+                else {
+                    neighbours[4] = neighbours[5] = outside;
                 }
+                
+                uint64_t word = centre;
+                
+                for (NSUInteger i=0; i<6; ++i)
+                    word = dilate ? word | neighbours[i] : word & neighbours[i];
+                
+                BABitsStore(result->buffer, row + x, n, word);
+                total += BABitsPopulation(word);
             }
+        }
+    }
+    
+    result->count = total;
+    
+    return result;
+}
 
-            break;
+- (BABitArray *)bitArrayByDilating {
+    return [self bitArrayByMorphing:YES];
+}
+
+- (BABitArray *)bitArrayByEroding {
+    return [self bitArrayByMorphing:NO];
+}
+
+@end
+
+
+@implementation BABitArray (ChangeTracking)
+
+// A one-dimensional array is a row
+- (BASize3)trackingSize {
+    return size ? size3 : BASize3Make(length, 1, 1);
+}
+
+- (NSUInteger)trackingTileSize {
+    return trackingTileSize;
+}
+
+- (void)setTrackingTileSize:(NSUInteger)tileSize {
+    
+    [dirtyTiles release], dirtyTiles = nil;
+    trackingTileSize = tileSize;
+    
+    if(tileSize) {
+        BASize3 trackingSize = [self trackingSize];
+        BASize3 grid = BASize3Make((trackingSize.width + tileSize - 1) / tileSize,
+                                   (trackingSize.height + tileSize - 1) / tileSize,
+                                   (trackingSize.depth + tileSize - 1) / tileSize);
+        dirtyTiles = [[BABitArray alloc] initWithSize3:grid];
+        dirtyTiles.concurrent = self.isConcurrent;
+    }
+}
+
+- (void)markDirtyIndex:(NSUInteger)index {
+    
+    BASize3 trackingSize = [self trackingSize];
+    NSUInteger row = index / trackingSize.width;
+    
+    [changedRows setBit:row];
+    
+    if(!dirtyTiles)
+        return;
+    
+    [dirtyTiles setBitAtX:(index % trackingSize.width) / trackingTileSize
+                        y:(row % trackingSize.height) / trackingTileSize
+                        z:(row / trackingSize.height) / trackingTileSize];
+}
+
+- (void)markDirtyBox:(BARegion3)box {
+    
+    // the rectangle index is only kept for 2-dimensional arrays
+    [changedRows setRange:NSMakeRange(box.origin.y, box.size.height)];
+    
+    if(!dirtyTiles)
+        return;
+    
+    NSUInteger minX = box.origin.x / trackingTileSize;
+    NSUInteger minY = box.origin.y / trackingTileSize;
+    NSUInteger minZ = box.origin.z / trackingTileSize;
+    NSUInteger maxX = (box.origin.x + box.size.width - 1) / trackingTileSize;
+    NSUInteger maxY = (box.origin.y + box.size.height - 1) / trackingTileSize;
+    NSUInteger maxZ = (box.origin.z + box.size.depth - 1) / trackingTileSize;
+    
+    [dirtyTiles setRegion3:BARegion3Make(minX, minY, minZ, maxX - minX + 1, maxY - minY + 1, maxZ - minZ + 1)];
+}
+
+// Within a row, only the tiles touched; across rows, whole rows of tiles, one box per plane
+- (void)markDirtyRange:(NSRange)range {
+    
+    BASize3 trackingSize = [self trackingSize];
+    NSUInteger width = trackingSize.width;
+    NSUInteger height = trackingSize.height;
+    NSUInteger end = MIN(NSMaxRange(range), length);
+    
+    if(range.location >= end)
+        return;
+    
+    NSUInteger firstRow = range.location / width;
+    NSUInteger lastRow = (end - 1) / width;
+    
+    if(firstRow == lastRow) {
+        [self markDirtyBox:BARegion3Make(range.location % width, firstRow % height, firstRow / height, end - range.location, 1, 1)];
+        return;
     }
     
-    if(quarters == 1 || quarters == 3) {
-        // swap height and width in size
-        copy->size = [[BASampleArray sampleArrayForSize2:BASize2Make(height, width)] retain];
-        [copy refreshCount];
+    for (NSUInteger row=firstRow; row<=lastRow; ) {
+        NSUInteger z = row / height;
+        NSUInteger planeLastRow = MIN(lastRow, (z + 1) * height - 1);
+        [self markDirtyBox:BARegion3Make(0, row % height, z, width, planeLastRow - row + 1, 1)];
+        row = planeLastRow + 1;
     }
+}
+
+// Swap each word out for zero, so that no concurrent write is lost between reading and clearing
+static BABitArray *TakeBits(BABitArray *bits) {
     
-    return copy;
+    BABitArray *result = [BABitArray bitArrayWithLength:bits->length size:bits->size];
+    uint64_t *source = (uint64_t *)bits->buffer;
+    uint64_t *dest = (uint64_t *)result->buffer;
+    NSInteger taken = 0;
+    
+    for (NSUInteger i=0; i<PaddedLength(bits->bufferLength)/sizeof(uint64_t); ++i) {
+        dest[i] = __atomic_exchange_n(source + i, 0, __ATOMIC_ACQ_REL);
+        taken += BABitsPopulation(dest[i]);
+    }
+    
+    result->count = taken;
+    if(bits->countStripes)
+        AddToCountStripe(bits->countStripes, -taken);
+    else
+        bits->count -= taken;
+    
+    return result;
 }
 
-+ (BABitArray *)bitArrayWithSize2:(BASize2)initSize {
-    return [[(BABitArray *)[self alloc] initWithSize2:initSize] autorelease];
+- (BABitArray *)takeDirtyTiles {
+    return dirtyTiles ? TakeBits(dirtyTiles) : nil;
+}
+
+- (BABitArray *)takeChangedRows {
+    return changedRows ? TakeBits(changedRows) : nil;
+}
+
+- (void)takeDirtyRegions2:(void (^)(BARegion2 region))block {
+    
+    BABitArray *tiles = [self takeDirtyTiles];
+    
+    if(!tiles || tiles->count == 0)
+        return;
+    
+    NSAssert(tiles->size3.depth == 1, @"dirty regions are only available for 2-dimensional arrays");
+    
+    NSUInteger tile = trackingTileSize;
+    NSUInteger width = size2.width;
+    NSUInteger height = size2.height;
+    NSUInteger rows = tiles->size3.height;
+    
+    // Spans of tiles still open, with the row each started in
+    NSUInteger capacity = tiles->size3.width / 2 + 1;
+    NSRange *open = malloc(capacity * sizeof(NSRange));
+    NSUInteger *openRows = malloc(capacity * sizeof(NSUInteger));
+    NSRange *next = malloc(capacity * sizeof(NSRange));
+    NSUInteger *nextRows = malloc(capacity * sizeof(NSUInteger));
+    __block NSUInteger openCount = 0;
+    __block NSUInteger nextCount = 0;
+    
+    void (^close)(NSRange, NSUInteger, NSUInteger) = ^(NSRange span, NSUInteger firstRow, NSUInteger lastRow) {
+        NSUInteger x = span.location * tile;
+        NSUInteger y = firstRow * tile;
+        block(BARegion2Make(x, y, MIN(NSMaxRange(span) * tile, width) - x, MIN((lastRow + 1) * tile, height) - y));
+    };
+    
+    for (NSUInteger row=0; row<=rows; ++row) {
+        
+        __block NSUInteger o = 0;
+        
+        nextCount = 0;
+        
+        // Both rows are in order; an open span continues only if this row has exactly the same span
+        if(row < rows) {
+            [tiles enumerateRunsInRow:row block:^(NSRange span) {
+                while(o < openCount && open[o].location <= span.location) {
+                    if(NSEqualRanges(open[o], span))
+                        break;
+                    close(open[o], openRows[o], row - 1);
+                    ++o;
+                }
+                if(o < openCount && NSEqualRanges(open[o], span)) {
+                    nextRows[nextCount] = openRows[o];
+                    ++o;
+                }
+                else {
+                    nextRows[nextCount] = row;
+                }
+                next[nextCount++] = span;
+            }];
+        }
+        
+        for (; o<openCount; ++o)
+            close(open[o], openRows[o], row - 1);
+        
+        NSRange *swapSpans = open;
+        NSUInteger *swapRows = openRows;
+        
+        open = next;
+        openRows = nextRows;
+        next = swapSpans;
+        nextRows = swapRows;
+        openCount = nextCount;
+    }
+    
+    free(open);
+    free(openRows);
+    free(next);
+    free(nextRows);
 }
 
 @end
@@ -1120,8 +1917,17 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     return result;
 }
 
+- (BASize3)size3 {
+    BASize3 result = { 0, 0, 1 };
+    [self readSamples:(UInt8 *)&result range:NSMakeRange(0, MIN(self.count, 3))];
+    return result;
+}
+
 - (void)size3d:(NSUInteger *)size {
-    [self readSamples:(UInt8 *)&size range:NSMakeRange(0, 3)];
+    BASize3 size3 = self.size3;
+    size[0] = size3.width;
+    size[1] = size3.height;
+    size[2] = size3.depth;
 }
 
 + (BASampleArray *)sampleArrayForSize2:(BASize2)size2 {
@@ -1130,10 +1936,14 @@ NSInteger copyBits(unsigned char *bytes, BOOL *bits, NSRange range, BOOL write,
     return result;
 }
 
-+ (BASampleArray *)sampleArrayForSize3d:(NSUInteger *)size {
++ (BASampleArray *)sampleArrayForSize3:(BASize3)size3 {
     BASampleArray *result = [[[BASampleArray alloc] initWithPower:1 order:3 size:sizeof(NSInteger)/sizeof(UInt8)] autorelease];
-    [result writeSamples:(UInt8 *)&size range:NSMakeRange(0, 3)];
+    [result writeSamples:(UInt8 *)&size3 range:NSMakeRange(0, 3)];
     return result;
 }
 
++ (BASampleArray *)sampleArrayForSize3d:(NSUInteger *)size {
+    return [self sampleArrayForSize3:BASize3Make(size[0], size[1], size[2])];
+}
+
 @end
@@ -0,0 +1,208 @@
+//
+//  BABitArrayPrivate.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-04.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+
+#import <BAFoundation/BABitArray.h>
+
+
+/* Word access to bit buffers.
+ *
+ * A word holds up to 64 consecutive bits of a buffer, in sequence order: the first bit is the most
+ * significant bit of the word. With SEQUENTIAL_BIT_ORDER that is also the storage order, so loading
+ * is just a byte swap. Otherwise each byte is bit-reversed on the way in and out.
+ *
+ * Loads and stores only touch the bytes which contain the requested bits.
+ */
+
+NS_INLINE uint64_t BABitsHighMask(NSUInteger count) {
+    return count >= 64 ? ~0ULL : ~(~0ULL >> count);
+}
+
+NS_INLINE uint64_t BABitsReverse(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return CFSwapInt64(x);
+}
+
+NS_INLINE unsigned char BABitsSequenceByte(unsigned char byte) {
+#if SEQUENTIAL_BIT_ORDER
+    return byte;
+#else
+    return (unsigned char)(BABitsReverse(byte) >> 56);
+#endif
+}
+
+// Returns <count> bits (1-64) starting at bit <index>, in the high bits of the result; low bits are zero
+NS_INLINE uint64_t BABitsLoad(const unsigned char *bytes, NSUInteger index, NSUInteger count) {
+
+    NSUInteger byte = index >> 3;
+    NSUInteger shift = index & 7;
+    NSUInteger byteCount = (shift + count + 7) >> 3;
+    uint64_t word = 0;
+
+    if(byteCount >= 8) {
+        memcpy(&word, bytes + byte, sizeof(word));
+#if SEQUENTIAL_BIT_ORDER
+        word = CFSwapInt64BigToHost(word);
+#else
+        word = BABitsReverse(CFSwapInt64LittleToHost(word));
+#endif
+    }
+    else {
+        for (NSUInteger i=0; i<byteCount; ++i)
+            word |= (uint64_t)BABitsSequenceByte(bytes[byte+i]) << (56 - 8*i);
+    }
+
+    word <<= shift;
+    if(byteCount > 8)
+        word |= (uint64_t)BABitsSequenceByte(bytes[byte+8]) >> (8 - shift);
+
+    return word & BABitsHighMask(count);
+}
+
+// The bytes of a whole, aligned word of the buffer, as a native integer; for in-place (e.g. atomic) updates
+NS_INLINE uint64_t BABitsMemoryWord(uint64_t word) {
+#if SEQUENTIAL_BIT_ORDER
+    return CFSwapInt64HostToBig(word);
+#else
+    return CFSwapInt64HostToLittle(BABitsReverse(word));
+#endif
+}
+
+// Writes the high <count> bits (1-64) of <word> starting at bit <index>; neighbouring bits are preserved
+NS_INLINE void BABitsStore(unsigned char *bytes, NSUInteger index, NSUInteger count, uint64_t word) {
+
+    uint64_t mask = BABitsHighMask(count);
+    NSUInteger byte = index >> 3;
+    NSUInteger shift = index & 7;
+    NSUInteger byteCount = (shift + count + 7) >> 3;
+
+    if(shift == 0 && count == 64) {
+        word = BABitsMemoryWord(word);
+        memcpy(bytes + byte, &word, sizeof(word));
+        return;
+    }
+
+    uint64_t shiftedWord = (word & mask) >> shift;
+    uint64_t shiftedMask = mask >> shift;
+
+    for (NSUInteger i=0; i<byteCount && i<8; ++i) {
+        unsigned char m = BABitsSequenceByte((unsigned char)(shiftedMask >> (56 - 8*i)));
+        unsigned char v = BABitsSequenceByte((unsigned char)(shiftedWord >> (56 - 8*i)));
+        bytes[byte+i] = (bytes[byte+i] & ~m) | (v & m);
+    }
+
+    if(byteCount > 8) {
+        unsigned char m = BABitsSequenceByte((unsigned char)(mask << (8 - shift)));
+        unsigned char v = BABitsSequenceByte((unsigned char)(word << (8 - shift)));
+        bytes[byte+8] = (bytes[byte+8] & ~m) | (v & m);
+    }
+}
+
+NS_INLINE NSUInteger BABitsPopulation(uint64_t word) {
+    return (NSUInteger)__builtin_popcountll(word);
+}
+
+// Offset of the first set (or clear) bit of the <length> bits starting at <index>, or NSNotFound
+NS_INLINE NSUInteger BABitsFindFirst(const unsigned char *bytes, NSUInteger index, NSUInteger length, BOOL set) {
+    
+    for (NSUInteger i=0; i<length; ) {
+        NSUInteger n = MIN(length - i, 64 - ((index + i) & 63));
+        uint64_t word = BABitsLoad(bytes, index + i, n);
+        if(!set)
+            word = ~word & BABitsHighMask(n);
+        if(word)
+            return i + __builtin_clzll(word);
+        i += n;
+    }
+    
+    return NSNotFound;
+}
+
+// Offset of the last set (or clear) bit of the <length> bits starting at <index>, or NSNotFound
+NS_INLINE NSUInteger BABitsFindLast(const unsigned char *bytes, NSUInteger index, NSUInteger length, BOOL set) {
+    
+    for (NSUInteger end=length; end>0; ) {
+        NSUInteger n = MIN(end, ((index + end - 1) & 63) + 1);
+        uint64_t word = BABitsLoad(bytes, index + end - n, n);
+        if(!set)
+            word = ~word & BABitsHighMask(n);
+        if(word)
+            return end - n + 63 - __builtin_ctzll(word);
+        end -= n;
+    }
+    
+    return NSNotFound;
+}
+
+// Runs of set bits among the <length> bits starting at <index>, as offsets from <index>;
+// finds where each run starts and ends with a leading zero count, rather than testing every bit
+NS_INLINE void BABitsEnumerateRuns(const unsigned char *bytes, NSUInteger index, NSUInteger length, BABitArrayRunEnumerator block) {
+    
+    NSUInteger start = 0;
+    BOOL inRun = NO;
+    
+    for (NSUInteger x=0; x<length; x+=64) {
+        
+        NSUInteger n = MIN(64, length - x);
+        uint64_t word = BABitsLoad(bytes, index + x, n);
+        NSUInteger bit = 0;
+        
+        // look for the next bit which differs from the current state
+        while(bit < n) {
+            uint64_t changes = ((inRun ? ~word : word) << bit) & BABitsHighMask(n - bit);
+            if(!changes)
+                break;
+            bit += __builtin_clzll(changes);
+            if(inRun)
+                block(NSMakeRange(start, x + bit - start));
+            else
+                start = x + bit;
+            inRun = !inRun;
+        }
+    }
+    
+    if(inRun)
+        block(NSMakeRange(start, length - start));
+}
+
+// Count the set bits in a range of a buffer (BABitArray.m)
+extern NSUInteger hammingWeight(unsigned char *bytes, NSRange range);
+
+@interface BABitArray (BABitArrayPrivate)
+- (unsigned char *)buffer; // may change when a shared buffer is first written; do not keep
+- (BABitArray *)takeChangedRows; // for the rectangle index; nil if there is none
+@end
+
+// Runs of set bits in a row of the given width; a word at a time where the array supports it
+NS_INLINE void BABitArrayEnumerateRowRuns(id<BABitArray2D> bitArray, NSUInteger y, NSUInteger width, BABitArrayRunEnumerator block) {
+    
+    if([bitArray respondsToSelector:@selector(enumerateRunsInRow:block:)]) {
+        [bitArray enumerateRunsInRow:y block:block];
+        return;
+    }
+    
+    BOOL *bits = malloc(width * sizeof(BOOL));
+    NSUInteger start = NSNotFound;
+    
+    [bitArray readBits:bits range:NSMakeRange(y * width, width)];
+    
+    for (NSUInteger x=0; x<width; ++x) {
+        if(bits[x] && start == NSNotFound)
+            start = x;
+        else if(!bits[x] && start != NSNotFound) {
+            block(NSMakeRange(start, x - start));
+            start = NSNotFound;
+        }
+    }
+    if(start != NSNotFound)
+        block(NSMakeRange(start, width - start));
+    
+    free(bits);
+}
@@ -0,0 +1,59 @@
+//
+//  BABitArrayView.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-11.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BABitArray.h>
+
+
+/**
+ * A view of a range or 2-dimensional region of a bit array, which reads the array's buffer in place.
+ *
+ * Bit indexes are relative to the view: a region view of width w maps bit i to (i % w, i / w) in the
+ * region. Rows which do not start on a byte boundary are shifted a word at a time as they are read;
+ * nothing is copied up front, so a view is cheap to make and always shows the current bits.
+ *
+ * A view retains its bit array, but not the array's buffer; it reads whatever buffer the array has, so
+ * it is not a snapshot. Views of views are flattened into views of the underlying array.
+ *
+ * BABitArrayView is read-only: its mutators raise an exception. BAMutableBitArrayView writes through
+ * to the bit array, with the array's own methods, so its count, copies and change tracking stay correct.
+ */
+
+@interface BABitArrayView : NSObject<BABitArray2D> {
+    BABitArray *_bitArray;
+    BASampleArray *_size;
+    NSUInteger _offset; // index of the first bit in the bit array
+    NSUInteger _width;
+    NSUInteger _height;
+    NSUInteger _stride; // bits between rows in the bit array
+}
+
+@property (readonly) BABitArray *bitArray;
+@property (readonly) BASampleArray *size;
+
+- (id)initWithBitArray:(BABitArray *)bitArray range:(NSRange)bitRange;
+// otherArray must be a BABitArray with a 2-dimensional size, or another view
+- (id)initWithBitArray:(id<BABitArray>)otherArray region:(BARegion2)region;
+
+- (BOOL)isEqualToBitArray:(id<BABitArray>)other;
+
+// A new bit array with a copy of the bits
+- (BABitArray *)bitArrayCopy;
+
+@end
+
+
+@interface BAMutableBitArrayView : BABitArrayView
+@end
+
+
+@interface BABitArray (Views)
+- (BABitArrayView *)viewWithRange:(NSRange)bitRange;
+- (BABitArrayView *)viewWithRegion2:(BARegion2)region;
+- (BAMutableBitArrayView *)mutableViewWithRange:(NSRange)bitRange;
+- (BAMutableBitArrayView *)mutableViewWithRegion2:(BARegion2)region;
+@end
@@ -0,0 +1,484 @@
+//
+//  BABitArrayView.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-11.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BABitArrayView.h>
+
+#import "BABitArrayPrivate.h"
+
+
+// A view range is visited as segments, one per row it touches; <index> is the position of the segment
+// in the view, <source> its position in the bit array. Return NO to stop.
+typedef BOOL (^BABitArrayViewSegment)(NSUInteger index, NSUInteger source, NSUInteger length);
+
+
+@implementation BABitArrayView
+
+@synthesize bitArray=_bitArray, size=_size;
+
+#pragma mark - Private
+
+- (void)checkRange:(NSRange)range {
+    if(NSMaxRange(range) > _width * _height)
+        [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)NSMaxRange(range) - 1];
+}
+
+- (NSUInteger)sourceIndex:(NSUInteger)index {
+    if(index >= _width * _height)
+        [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
+    return _offset + (index / _width) * _stride + index % _width;
+}
+
+- (void)enumerateSegmentsInRange:(NSRange)range reverse:(BOOL)reverse block:(BABitArrayViewSegment)block {
+
+    [self checkRange:range];
+
+    if(reverse) {
+        for (NSUInteger end=NSMaxRange(range); end>range.location; ) {
+            NSUInteger x = (end - 1) % _width;
+            NSUInteger n = MIN(x + 1, end - range.location);
+            NSUInteger index = end - n;
+            if(!block(index, _offset + (index / _width) * _stride + index % _width, n))
+                return;
+            end = index;
+        }
+    }
+    else {
+        for (NSUInteger index=range.location; index<NSMaxRange(range); ) {
+            NSUInteger x = index % _width;
+            NSUInteger n = MIN(_width - x, NSMaxRange(range) - index);
+            if(!block(index, _offset + (index / _width) * _stride + x, n))
+                return;
+            index += n;
+        }
+    }
+}
+
+- (NSUInteger)find:(BOOL)set reverse:(BOOL)reverse {
+
+    __block NSUInteger result = NSNotFound;
+
+    [self enumerateSegmentsInRange:NSMakeRange(0, _width * _height) reverse:reverse block:^BOOL(NSUInteger index, NSUInteger source, NSUInteger length) {
+        unsigned char *buffer = [_bitArray buffer];
+        NSUInteger offset = reverse ? BABitsFindLast(buffer, source, length, set) : BABitsFindFirst(buffer, source, length, set);
+        if(offset != NSNotFound)
+            result = index + offset;
+        return offset == NSNotFound;
+    }];
+
+    return result;
+}
+
+- (void)readOnly {
+    [NSException raise:NSInternalInconsistencyException format:@"%@ is read-only", [self class]];
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_bitArray release], _bitArray = nil;
+    [_size release], _size = nil;
+    [super dealloc];
+}
+
+- (id)init {
+    return [self initWithBitArray:nil range:NSMakeRange(0, 0)];
+}
+
+- (NSUInteger)hash {
+    return [self length] ^ [self count];
+}
+
+- (BOOL)isEqual:(id)object {
+    return [object conformsToProtocol:@protocol(BABitArray)] && [self isEqualToBitArray:object];
+}
+
+- (NSString *)description {
+    if(_size)
+        return [NSString stringWithFormat:@"%@ %lu x %lu at %lu:\n%@", [super description], (unsigned long)_width, (unsigned long)_height, (unsigned long)_offset, [self stringForRegion2]];
+    return [NSString stringWithFormat:@"%@ at %lu: %@", [super description], (unsigned long)_offset, [self stringForRange:NSMakeRange(0, _width)]];
+}
+
+#pragma mark - BABitArrayView
+
+- (id)initWithBitArray:(BABitArray *)bitArray range:(NSRange)bitRange {
+    self = [super init];
+    if(self) {
+        NSAssert(NSMaxRange(bitRange) <= bitArray.length, @"range beyond bounds of bit array");
+        _bitArray = [bitArray retain];
+        _offset = bitRange.location;
+        _width = bitRange.length;
+        _height = 1;
+        _stride = bitRange.length;
+    }
+    return self;
+}
+
+- (BOOL)isEqualToBitArray:(id<BABitArray>)other {
+
+    NSUInteger length = [self length];
+
+    if(length != [other length] || [self count] != [other count])
+        return NO;
+
+    BOOL *bits = malloc(_width * sizeof(BOOL));
+    BOOL *otherBits = malloc(_width * sizeof(BOOL));
+    BOOL equal = YES;
+
+    for (NSUInteger i=0; i<length && equal; i+=_width) {
+        NSRange range = NSMakeRange(i, _width);
+        [self readBits:bits range:range];
+        [other readBits:otherBits range:range];
+        equal = 0 == memcmp(bits, otherBits, _width * sizeof(BOOL));
+    }
+
+    free(bits);
+    free(otherBits);
+
+    return equal;
+}
+
+- (BABitArray *)bitArrayCopy {
+
+    BABitArray *copy = _size ? [BABitArray bitArrayWithSize2:_size.size2] : [BABitArray bitArrayWithLength:_width];
+    NSUInteger byteLength = (_width * _height + 7) / 8;
+
+    if(!byteLength)
+        return copy;
+
+    // whole words, so the last store cannot run past the end
+    unsigned char *bytes = calloc((byteLength + sizeof(uint64_t) - 1) / sizeof(uint64_t), sizeof(uint64_t));
+    unsigned char *buffer = [_bitArray buffer];
+
+    for (NSUInteger y=0; y<_height; ++y) {
+        NSUInteger source = _offset + y * _stride;
+        for (NSUInteger x=0; x<_width; x+=64) {
+            NSUInteger n = MIN(64, _width - x);
+            BABitsStore(bytes, y * _width + x, n, BABitsLoad(buffer, source + x, n));
+        }
+    }
+
+    [copy writeBytes:bytes range:NSMakeRange(0, byteLength)];
+    free(bytes);
+
+    return copy;
+}
+
+#pragma mark - BABitArray
+
+- (NSUInteger)length {
+    return _width * _height;
+}
+
+- (NSUInteger)count {
+
+    unsigned char *buffer = [_bitArray buffer];
+    NSUInteger count = 0;
+
+    for (NSUInteger y=0; y<_height; ++y)
+        count += hammingWeight(buffer, NSMakeRange(_offset + y * _stride, _width));
+
+    return count;
+}
+
+- (BOOL)bit:(NSUInteger)index {
+    return [_bitArray bit:[self sourceIndex:index]];
+}
+
+- (void)setBit:(NSUInteger)index {
+    [self readOnly];
+}
+
+- (void)setRange:(NSRange)bitRange {
+    [self readOnly];
+}
+
+- (void)setAll {
+    [self setRange:NSMakeRange(0, [self length])];
+}
+
+- (void)clearBit:(NSUInteger)index {
+    [self readOnly];
+}
+
+- (void)clearRange:(NSRange)bitRange {
+    [self readOnly];
+}
+
+- (void)clearAll {
+    [self clearRange:NSMakeRange(0, [self length])];
+}
+
+- (NSUInteger)firstSetBit {
+    return [self find:YES reverse:NO];
+}
+
+- (NSUInteger)lastSetBit {
+    return [self find:YES reverse:YES];
+}
+
+- (NSUInteger)readBits:(BOOL *)bits range:(NSRange)bitRange {
+
+    __block NSUInteger count = 0;
+
+    [self enumerateSegmentsInRange:bitRange reverse:NO block:^BOOL(NSUInteger index, NSUInteger source, NSUInteger length) {
+        count += [_bitArray readBits:bits + (index - bitRange.location) range:NSMakeRange(source, length)];
+        return YES;
+    }];
+
+    return count;
+}
+
+- (NSUInteger)writeBits:(BOOL * const)bits range:(NSRange)bitRange {
+    [self readOnly];
+    return 0;
+}
+
+- (NSUInteger)firstClearBit {
+    return [self find:NO reverse:NO];
+}
+
+- (NSUInteger)lastClearBit {
+    return [self find:NO reverse:YES];
+}
+
+- (NSString *)stringForRange:(NSRange)range {
+
+    BOOL *bits = malloc(range.length * sizeof(BOOL));
+    char *chars = calloc(sizeof(char), range.length + 1);
+
+    [self readBits:bits range:range];
+    for (NSUInteger i=0; i<range.length; ++i)
+        chars[i] = bits[i] ? 'S' : '_';
+
+    NSString *result = [NSString stringWithCString:chars encoding:NSASCIIStringEncoding];
+
+    free(bits);
+    free(chars);
+
+    return result;
+}
+
+#pragma mark - BABitArray2D
+
+#define SIZE_ASSERT() NSAssert(_size != nil, @"Cannot perform spatial calculations without size")
+
+- (id)initWithBitArray:(id<BABitArray>)otherArray region:(BARegion2)region {
+
+    BABitArray *bitArray;
+    NSUInteger offset, stride;
+
+    if([otherArray isKindOfClass:[BABitArrayView class]]) {
+        BABitArrayView *view = (BABitArrayView *)otherArray;
+        NSAssert(view->_size != nil, @"Cannot make a region view without size");
+        NSAssert(region.origin.x + region.size.width <= view->_width && region.origin.y + region.size.height <= view->_height, @"region beyond bounds of view");
+        bitArray = view->_bitArray;
+        offset = view->_offset + region.origin.y * view->_stride + region.origin.x;
+        stride = view->_stride;
+    }
+    else {
+        NSAssert([otherArray isKindOfClass:[BABitArray class]], @"Views are only supported on BABitArray");
+        bitArray = (BABitArray *)otherArray;
+        BASize2 size2 = [bitArray size].size2;
+        NSAssert([bitArray size] != nil, @"Cannot make a region view without size");
+        NSAssert(region.origin.x + region.size.width <= size2.width && region.origin.y + region.size.height <= size2.height, @"region beyond bounds of bit array");
+        offset = region.origin.y * size2.width + region.origin.x;
+        stride = size2.width;
+    }
+
+    self = [self initWithBitArray:bitArray range:NSMakeRange(0, 0)];
+    if(self) {
+        _offset = offset;
+        _width = region.size.width;
+        _height = region.size.height;
+        _stride = stride;
+        _size = [[BASampleArray sampleArrayForSize2:region.size] retain];
+    }
+    return self;
+}
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    return [self bit:x + y * _width];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    [self setBit:x + y * _width];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    [self clearBit:x + y * _width];
+}
+
+- (BOOL)bitAtPoint2:(BAPoint2)point {
+    return [self bitAtX:point.x y:point.y];
+}
+
+- (void)setPoint2:(BAPoint2)point {
+    [self setBitAtX:point.x y:point.y];
+}
+
+- (void)clearPoint2:(BAPoint2)point {
+    [self clearBitAtX:point.x y:point.y];
+}
+
+// a region view is flat; its rows may be read as the layers of a volume
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    return [self bit:x + y * _width + z * _width * _height];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self setBit:x + y * _width + z * _width * _height];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self clearBit:x + y * _width + z * _width * _height];
+}
+
+- (void)updateRegion2:(BARegion2)region set:(BOOL)set {
+
+    SIZE_ASSERT();
+
+    NSRange range = NSMakeRange(region.origin.x + region.origin.y * _width, region.size.width);
+
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        if(set)
+            [self setRange:range];
+        else
+            [self clearRange:range];
+        range.location += _width;
+    }
+}
+
+- (void)setRegion2:(BARegion2)region {
+    [self updateRegion2:region set:YES];
+}
+
+- (void)clearRegion2:(BARegion2)region {
+    [self updateRegion2:region set:NO];
+}
+
+- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin {
+
+    SIZE_ASSERT();
+
+    BASize2 sourceSize = [bitArray size].size2;
+    NSRange sourceRange = NSMakeRange(origin.x + sourceSize.width * origin.y, region.size.width);
+    NSRange destRange = NSMakeRange(region.origin.x + _width * region.origin.y, region.size.width);
+    BOOL *bits = malloc(region.size.width * sizeof(BOOL));
+
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        [bitArray readBits:bits range:sourceRange];
+        [self writeBits:bits range:destRange];
+        sourceRange.location += sourceSize.width;
+        destRange.location += _width;
+    }
+
+    free(bits);
+}
+
+// Another view; nothing is copied
+- (id<BABitArray2D>)subArrayWithRegion:(BARegion2)region {
+    return [[[[self class] alloc] initWithBitArray:self region:region] autorelease];
+}
+
+- (void)enumerateRunsInRow:(NSUInteger)y block:(BABitArrayRunEnumerator)block {
+    NSAssert(y < _height, @"row beyond bounds of view");
+    BABitsEnumerateRuns([_bitArray buffer], _offset + y * _stride, _width, block);
+}
+
+- (NSArray *)rowStringsForRegion2:(BARegion2)region {
+
+    SIZE_ASSERT();
+
+    NSMutableArray *rows = [NSMutableArray array];
+
+    if (BARegion2EqualToRegion2(region, BARegion2Zero())) {
+        region.size = _size.size2;
+    }
+
+    NSRange range = NSMakeRange(region.origin.x + _width * region.origin.y, region.size.width);
+
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        [rows insertObject:[self stringForRange:range] atIndex:0];
+        range.location += _width;
+    }
+
+    return [[rows copy] autorelease];
+}
+
+- (NSString *)stringForRegion2:(BARegion2)region {
+    return [[self rowStringsForRegion2:region] componentsJoinedByString:@"\n"];
+}
+
+- (NSString *)stringForRegion2 {
+    return [[self rowStringsForRegion2:BARegion2Zero()] componentsJoinedByString:@"\n"];
+}
+
+@end
+
+
+@implementation BAMutableBitArrayView
+
+- (void)setBit:(NSUInteger)index {
+    [_bitArray setBit:[self sourceIndex:index]];
+}
+
+- (void)setRange:(NSRange)bitRange {
+    [self enumerateSegmentsInRange:bitRange reverse:NO block:^BOOL(NSUInteger index, NSUInteger source, NSUInteger length) {
+        [_bitArray setRange:NSMakeRange(source, length)];
+        return YES;
+    }];
+}
+
+- (void)clearBit:(NSUInteger)index {
+    [_bitArray clearBit:[self sourceIndex:index]];
+}
+
+- (void)clearRange:(NSRange)bitRange {
+    [self enumerateSegmentsInRange:bitRange reverse:NO block:^BOOL(NSUInteger index, NSUInteger source, NSUInteger length) {
+        [_bitArray clearRange:NSMakeRange(source, length)];
+        return YES;
+    }];
+}
+
+- (NSUInteger)writeBits:(BOOL * const)bits range:(NSRange)bitRange {
+
+    __block NSUInteger result = 0;
+
+    [self enumerateSegmentsInRange:bitRange reverse:NO block:^BOOL(NSUInteger index, NSUInteger source, NSUInteger length) {
+        result += [_bitArray writeBits:bits + (index - bitRange.location) range:NSMakeRange(source, length)];
+        return YES;
+    }];
+
+    return result;
+}
+
+@end
+
+
+@implementation BABitArray (Views)
+
+- (BABitArrayView *)viewWithRange:(NSRange)bitRange {
+    return [[[BABitArrayView alloc] initWithBitArray:self range:bitRange] autorelease];
+}
+
+- (BABitArrayView *)viewWithRegion2:(BARegion2)region {
+    return [[[BABitArrayView alloc] initWithBitArray:self region:region] autorelease];
+}
+
+- (BAMutableBitArrayView *)mutableViewWithRange:(NSRange)bitRange {
+    return [[[BAMutableBitArrayView alloc] initWithBitArray:self range:bitRange] autorelease];
+}
+
+- (BAMutableBitArrayView *)mutableViewWithRegion2:(BARegion2)region {
+    return [[[BAMutableBitArrayView alloc] initWithBitArray:self region:region] autorelease];
+}
+
+@end
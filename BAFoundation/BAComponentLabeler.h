@@ -0,0 +1,55 @@
+//
+//  BAComponentLabeler.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-09.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BABitArray.h>
+
+
+typedef NS_ENUM(NSUInteger, BAConnectivity) {
+    BAConnectivity4 = 4, // neighbours share an edge
+    BAConnectivity8 = 8, // neighbours share an edge or a corner
+};
+
+typedef struct {
+    NSUInteger identifier; // starting at 1, in the order components are reported
+    NSUInteger size;       // number of set bits
+    BARegion2 bounds;
+} BAComponent;
+
+// return NO to stop labeling
+typedef BOOL (^BAComponentHandler)(BAComponent component);
+
+
+/**
+ * Finds the connected components of set bits in a 2-dimensional bit array, such as the caves and
+ * rooms of a map.
+ *
+ * Each row is read as runs of set bits (a word at a time, for bit arrays which support
+ * -enumerateRunsInRow:block:) and runs which touch runs in the previous row are merged with
+ * union-find. A component is complete, and reported, as soon as a row adds nothing to it, so
+ * labeling can stop early without reading the rest of the array.
+ */
+
+@interface BAComponentLabeler : NSObject {
+    id<BABitArray2D> _bitArray;
+    BASize2 _size;
+    BAConnectivity _connectivity;
+}
+
+@property (nonatomic, readonly) id<BABitArray2D> bitArray;
+@property (nonatomic) BAConnectivity connectivity; // default is BAConnectivity4
+
+- (id)initWithBitArray:(id<BABitArray2D>)bitArray;
+
+// Components are reported in order of their last row; returns the number of components reported
+- (NSUInteger)labelComponents:(BAComponentHandler)block;
+
+// Also writes the identifier of each reported component into its bits' samples, and zero elsewhere.
+// <labels> must have 4-byte samples, at least one per bit, in row order (e.g. a vector of width*height)
+- (NSUInteger)labelComponents:(BAComponentHandler)block labels:(BASampleArray *)labels;
+
+@end
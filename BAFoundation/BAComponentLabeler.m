@@ -0,0 +1,185 @@
+//
+//  BAComponentLabeler.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-09.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BAComponentLabeler.h>
+
+#import "BABitArrayPrivate.h"
+#import <BAFoundation/BAFunctions.h>
+
+
+// Every run is a node in the union-find forest; the statistics are only kept up to date in roots
+typedef struct {
+    NSUInteger start;
+    NSUInteger end;    // exclusive
+    NSUInteger y;
+    NSUInteger parent;
+
+    NSUInteger size;
+    NSUInteger minX, maxX, minY, maxY;
+    NSUInteger identifier; // 0 until reported
+} BARun;
+
+typedef struct {
+    BARun *runs;
+    NSUInteger count;
+    NSUInteger capacity;
+} BARunTable;
+
+static void AppendRun(BARunTable *table, NSRange range, NSUInteger y) {
+
+    if(table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 1024;
+        table->runs = realloc(table->runs, table->capacity * sizeof(BARun));
+    }
+
+    NSUInteger index = table->count++;
+
+    table->runs[index] = (BARun) {
+        .start = range.location, .end = NSMaxRange(range), .y = y, .parent = index,
+        .size = range.length, .minX = range.location, .maxX = NSMaxRange(range) - 1, .minY = y, .maxY = y,
+    };
+}
+
+// With path halving
+static NSUInteger FindRoot(BARun *runs, NSUInteger index) {
+    while(runs[index].parent != index) {
+        runs[index].parent = runs[runs[index].parent].parent;
+        index = runs[index].parent;
+    }
+    return index;
+}
+
+// The larger component absorbs the smaller
+static void JoinRuns(BARun *runs, NSUInteger a, NSUInteger b) {
+
+    a = FindRoot(runs, a);
+    b = FindRoot(runs, b);
+
+    if(a == b)
+        return;
+
+    if(runs[a].size < runs[b].size) {
+        NSUInteger t = a;
+        a = b;
+        b = t;
+    }
+
+    runs[b].parent = a;
+    runs[a].size += runs[b].size;
+    runs[a].minX = MIN(runs[a].minX, runs[b].minX);
+    runs[a].maxX = MAX(runs[a].maxX, runs[b].maxX);
+    runs[a].minY = MIN(runs[a].minY, runs[b].minY);
+    runs[a].maxY = MAX(runs[a].maxY, runs[b].maxY);
+}
+
+
+@implementation BAComponentLabeler
+
+@synthesize bitArray=_bitArray, connectivity=_connectivity;
+
+- (id)initWithBitArray:(id<BABitArray2D>)bitArray {
+    self = [super init];
+    if(self) {
+        _bitArray = [bitArray retain];
+        _size = [bitArray size].size2;
+        _connectivity = BAConnectivity4;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_bitArray release], _bitArray = nil;
+    [super dealloc];
+}
+
+- (NSUInteger)labelComponents:(BAComponentHandler)block {
+    return [self labelComponents:block labels:nil];
+}
+
+- (NSUInteger)labelComponents:(BAComponentHandler)block labels:(BASampleArray *)labels {
+
+    NSUInteger width = _size.width;
+    NSUInteger height = _size.height;
+
+    NSAssert(!labels || (labels.size == sizeof(UInt32) && labels.count >= width * height), @"label array is too small");
+
+    // With 8-connectivity, runs which touch diagonally are joined as well
+    NSUInteger reach = _connectivity == BAConnectivity8 ? 1 : 0;
+
+    BARunTable table = { NULL, 0, 0 };
+    BARunTable *pTable = &table;
+    NSUInteger previousStart = 0, previousEnd = 0;
+    NSUInteger reported = 0;
+    BOOL stop = NO;
+
+    for (NSUInteger y=0; y<=height && !stop; ++y) {
+
+        NSUInteger rowStart = table.count;
+
+        if(y < height) {
+            BABitArrayEnumerateRowRuns(_bitArray, y, width, ^(NSRange run) {
+                AppendRun(pTable, run, y);
+            });
+        }
+
+        NSUInteger rowEnd = table.count;
+        BARun *runs = table.runs;
+        NSUInteger p = previousStart;
+
+        // Both rows are in order, so each only has to be scanned once
+        for (NSUInteger c=rowStart; c<rowEnd; ++c) {
+            while(p < previousEnd && runs[p].end + reach <= runs[c].start)
+                ++p;
+            for (NSUInteger q=p; q<previousEnd && runs[q].start < runs[c].end + reach; ++q)
+                JoinRuns(runs, q, c);
+        }
+
+        // Components which this row did not extend are complete
+        for (NSUInteger q=previousStart; q<previousEnd && !stop; ++q) {
+
+            NSUInteger root = FindRoot(runs, q);
+            BARun *r = runs + root;
+
+            if(r->maxY == y || r->identifier)
+                continue;
+
+            r->identifier = ++reported;
+
+            if(block) {
+                BAComponent component = { r->identifier, r->size, BARegion2Make(r->minX, r->minY, r->maxX - r->minX + 1, r->maxY - r->minY + 1) };
+                stop = !block(component);
+            }
+        }
+
+        previousStart = rowStart;
+        previousEnd = rowEnd;
+    }
+
+    if(labels) {
+
+        UInt32 *samples = (UInt32 *)labels.samples;
+
+        memset(samples, 0, width * height * sizeof(UInt32));
+
+        for (NSUInteger i=0; i<table.count; ++i) {
+
+            BARun *run = table.runs + i;
+            UInt32 identifier = (UInt32)table.runs[FindRoot(table.runs, i)].identifier;
+
+            if(identifier)
+                for (NSUInteger x=run->start; x<run->end; ++x)
+                    samples[run->y * width + x] = identifier;
+        }
+    }
+
+    free(table.runs);
+
+    return reported;
+}
+
+@end
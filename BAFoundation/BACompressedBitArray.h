@@ -0,0 +1,65 @@
+//
+//  BACompressedBitArray.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-06.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BABitArray.h>
+
+
+/**
+ * A compressed bit array for skewed data: mostly empty, with dense clusters.
+ *
+ * The bits are divided into chunks of 2^16. Each chunk which has any set bits keeps them in a
+ * container: a sorted array of positions, a bitmap, or a list of runs. Containers switch between
+ * array and bitmap as bits are set and cleared; range operations and -optimize also consider runs
+ * and pick whichever is smallest.
+ *
+ * Single bit access costs a binary search at worst. The class can be used as the leaf storage of a
+ * sparse bit array (see BASparseBitArray.bitArrayClass).
+ */
+
+@interface BACompressedBitArray : NSObject<NSCopying, NSCoding, BABitArray2D> {
+
+    BASampleArray *_size;
+    BASize2 _size2;
+
+    NSUInteger _length;
+    NSUInteger _count;
+
+    NSUInteger _chunkCount;
+    void *_containers;
+
+    BOOL _enableArchiveCompression;
+}
+
+@property (nonatomic) BOOL enableArchiveCompression;
+
+@property (readonly) BASampleArray *size;
+
+// bytes used by containers and the container table
+@property (readonly) NSUInteger storageSize;
+
+- (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector;
+- (id)initWithLength:(NSUInteger)bits;
+- (id)initWithSize2:(BASize2)size2;
+- (id)initWithBitArray:(id<BABitArray>)otherArray;
+
+- (BOOL)isEqualToBitArray:(id<BABitArray>)other;
+
+- (NSUInteger)nextAfter:(NSUInteger)prev;
+- (void)enumerate:(BABitArrayEnumerator)block;
+
+- (BOOL)checkCount;
+- (void)refreshCount;
+
+// convert containers to runs where that is smaller
+- (void)optimize;
+
++ (instancetype)bitArrayWithLength:(NSUInteger)bits size:(BASampleArray *)vector;
++ (instancetype)bitArrayWithLength:(NSUInteger)bits;
++ (instancetype)bitArrayWithSize2:(BASize2)size2;
+
+@end
@@ -0,0 +1,1252 @@
+//
+//  BACompressedBitArray.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-06.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BACompressedBitArray.h>
+
+#import <BAFoundation/BAFunctions.h>
+#import <BAFoundation/NSData+GZip.h>
+
+
+#pragma mark - Containers
+
+/* Each chunk of 2^16 bits is held in one container, which stores the low 16 bits of its set positions:
+ *
+ *  - array:  sorted positions; used up to 4096 set bits (8KB, the size of a bitmap)
+ *  - bitmap: 1024 words, one bit per position
+ *  - run:    sorted (start, length-1) pairs, for clustered bits
+ *
+ * Single bit updates move between array and bitmap as the cardinality crosses 4096. Range updates,
+ * and -optimize, choose whichever of the three is smallest.
+ */
+
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+#define ARRAY_MAX 4096
+#define BITMAP_WORDS (CHUNK_SIZE / 64)
+#define BITMAP_SLOTS (BITMAP_WORDS * 4) // in uint16_t
+
+typedef NS_ENUM(uint8_t, BAContainerType) {
+    BAContainerTypeArray,
+    BAContainerTypeBitmap,
+    BAContainerTypeRun,
+};
+
+typedef struct {
+    union {
+        uint16_t *values;   // array positions, or run (start, length-1) pairs
+        uint64_t *words;    // bitmap
+    };
+    uint32_t cardinality;   // number of set bits
+    uint32_t used;          // number of positions (array) or runs (run)
+    uint32_t capacity;      // allocated uint16_t slots
+    BAContainerType type;
+} BAContainer;
+
+static void ContainerFree(BAContainer *c) {
+    free(c->values);
+    memset(c, 0, sizeof(BAContainer));
+}
+
+static void ContainerReserve(BAContainer *c, uint32_t slots) {
+    if(slots <= c->capacity)
+        return;
+    uint32_t capacity = MAX(slots, MIN(c->capacity + c->capacity / 2, BITMAP_SLOTS));
+    capacity = MAX(capacity, 4);
+    c->values = realloc(c->values, capacity * sizeof(uint16_t));
+    c->capacity = capacity;
+}
+
+static void ContainerCopy(BAContainer *dest, const BAContainer *source) {
+    *dest = *source;
+    dest->values = NULL;
+    dest->capacity = 0;
+    if(source->cardinality) {
+        uint32_t slots = source->type == BAContainerTypeBitmap ? BITMAP_SLOTS : source->type == BAContainerTypeRun ? 2 * source->used : source->used;
+        ContainerReserve(dest, slots);
+        memcpy(dest->values, source->values, slots * sizeof(uint16_t));
+    }
+}
+
+static size_t ContainerBytes(const BAContainer *c) {
+    return c->capacity * sizeof(uint16_t);
+}
+
+// Index of the first array position >= value
+static uint32_t ArrayLowerBound(const uint16_t *values, uint32_t used, uint32_t value) {
+    uint32_t low = 0, high = used;
+    while(low < high) {
+        uint32_t mid = (low + high) / 2;
+        if(values[mid] < value)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Index of the last run starting at or before value, or -1
+static int32_t RunFind(const uint16_t *runs, uint32_t used, uint32_t value) {
+    int32_t low = 0, high = (int32_t)used - 1, result = -1;
+    while(low <= high) {
+        int32_t mid = (low + high) / 2;
+        if(runs[2*mid] <= value) {
+            result = mid;
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return result;
+}
+
+#define RUN_START(runs, i) ((uint32_t)(runs)[2*(i)])
+#define RUN_END(runs, i) ((uint32_t)(runs)[2*(i)] + (runs)[2*(i)+1]) // inclusive
+
+static void ContainerToBitmap(const BAContainer *c, uint64_t *words) {
+    memset(words, 0, BITMAP_WORDS * sizeof(uint64_t));
+    if(!c->cardinality)
+        return;
+    switch (c->type) {
+        case BAContainerTypeArray:
+            for (uint32_t i=0; i<c->used; ++i)
+                words[c->values[i] >> 6] |= 1ULL << (c->values[i] & 63);
+            break;
+        case BAContainerTypeBitmap:
+            memcpy(words, c->words, BITMAP_WORDS * sizeof(uint64_t));
+            break;
+        case BAContainerTypeRun:
+            for (uint32_t i=0; i<c->used; ++i) {
+                uint32_t start = RUN_START(c->values, i);
+                uint32_t end = RUN_END(c->values, i) + 1;
+                while(start < end) {
+                    uint32_t n = MIN(end - start, 64 - (start & 63));
+                    words[start >> 6] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (start & 63);
+                    start += n;
+                }
+            }
+            break;
+    }
+}
+
+static void WordsSetRange(uint64_t *words, uint32_t start, uint32_t end, BOOL set) {
+    while(start < end) {
+        uint32_t n = MIN(end - start, 64 - (start & 63));
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (start & 63);
+        if(set)
+            words[start >> 6] |= mask;
+        else
+            words[start >> 6] &= ~mask;
+        start += n;
+    }
+}
+
+// Replace the contents of the container with the bitmap, using the smallest representation
+static void ContainerFromBitmap(BAContainer *c, const uint64_t *words, BOOL allowRuns) {
+
+    uint32_t cardinality = 0, runs = 0;
+    uint64_t carry = 0;
+
+    for (NSUInteger i=0; i<BITMAP_WORDS; ++i) {
+        uint64_t w = words[i];
+        cardinality += __builtin_popcountll(w);
+        runs += __builtin_popcountll(w & ~((w << 1) | carry));
+        carry = w >> 63;
+    }
+
+    if(!cardinality) {
+        ContainerFree(c);
+        return;
+    }
+
+    uint32_t arraySlots = cardinality <= ARRAY_MAX ? cardinality : UINT32_MAX;
+    uint32_t runSlots = allowRuns ? 2 * runs : UINT32_MAX;
+    BAContainerType type = BAContainerTypeBitmap;
+
+    if(runSlots < MIN(arraySlots, BITMAP_SLOTS))
+        type = BAContainerTypeRun;
+    else if(arraySlots <= BITMAP_SLOTS)
+        type = BAContainerTypeArray;
+
+    uint32_t slots = type == BAContainerTypeBitmap ? BITMAP_SLOTS : type == BAContainerTypeRun ? runSlots : arraySlots;
+
+    // Shrink allocations which have become much larger than needed
+    if(c->capacity > 2 * slots && c->capacity > 16) {
+        free(c->values);
+        c->values = NULL;
+        c->capacity = 0;
+    }
+    ContainerReserve(c, slots);
+    c->type = type;
+    c->cardinality = cardinality;
+
+    if(type == BAContainerTypeBitmap) {
+        c->used = 0;
+        if(c->words != words)
+            memcpy(c->words, words, BITMAP_WORDS * sizeof(uint64_t));
+        return;
+    }
+
+    uint32_t n = 0;
+
+    if(type == BAContainerTypeArray) {
+        for (NSUInteger i=0; i<BITMAP_WORDS; ++i) {
+            uint64_t w = words[i];
+            while(w) {
+                c->values[n++] = (uint16_t)(i * 64 + __builtin_ctzll(w));
+                w &= w - 1;
+            }
+        }
+    }
+    else {
+        uint32_t position = 0;
+        while(position < CHUNK_SIZE) {
+            // find the next set bit, then the next clear bit after it
+            uint32_t i = position >> 6;
+            uint64_t w = words[i] & (~0ULL << (position & 63));
+            while(!w && ++i < BITMAP_WORDS)
+                w = words[i];
+            if(i >= BITMAP_WORDS)
+                break;
+            uint32_t start = i * 64 + __builtin_ctzll(w);
+            w = ~words[i] & (~0ULL << (start & 63));
+            while(!w && ++i < BITMAP_WORDS)
+                w = ~words[i];
+            uint32_t end = i >= BITMAP_WORDS ? (uint32_t)CHUNK_SIZE : i * 64 + __builtin_ctzll(w);
+            c->values[2*n] = (uint16_t)start;
+            c->values[2*n+1] = (uint16_t)(end - start - 1);
+            ++n;
+            position = end;
+        }
+    }
+
+    c->used = n;
+}
+
+static void ContainerConvertToBitmap(BAContainer *c) {
+    uint64_t *words = malloc(BITMAP_WORDS * sizeof(uint64_t));
+    ContainerToBitmap(c, words);
+    uint32_t cardinality = c->cardinality;
+    free(c->values);
+    c->words = words;
+    c->capacity = BITMAP_SLOTS;
+    c->type = BAContainerTypeBitmap;
+    c->cardinality = cardinality;
+    c->used = 0;
+}
+
+static void ContainerConvertBitmapToArray(BAContainer *c) {
+    uint64_t words[BITMAP_WORDS];
+    memcpy(words, c->words, sizeof(words));
+    ContainerFromBitmap(c, words, NO);
+}
+
+static void ContainerRebuild(BAContainer *c, BOOL allowRuns) {
+    uint64_t words[BITMAP_WORDS];
+    ContainerToBitmap(c, words);
+    ContainerFromBitmap(c, words, allowRuns);
+}
+
+static BOOL ContainerContains(const BAContainer *c, uint32_t value) {
+    if(!c->cardinality)
+        return NO;
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value);
+            return i < c->used && c->values[i] == value;
+        }
+        case BAContainerTypeBitmap:
+            return (c->words[value >> 6] >> (value & 63)) & 1;
+        case BAContainerTypeRun: {
+            int32_t i = RunFind(c->values, c->used, value);
+            return i >= 0 && value <= RUN_END(c->values, i);
+        }
+    }
+    return NO;
+}
+
+static BOOL RunAdd(BAContainer *c, uint32_t value) {
+
+    uint16_t *runs = c->values;
+    int32_t i = RunFind(runs, c->used, value);
+
+    if(i >= 0 && value <= RUN_END(runs, i))
+        return NO;
+
+    BOOL joinsPrevious = i >= 0 && RUN_END(runs, i) + 1 == value;
+    BOOL joinsNext = (uint32_t)(i + 1) < c->used && RUN_START(runs, i + 1) == value + 1;
+
+    if(joinsPrevious && joinsNext) {
+        runs[2*i+1] = (uint16_t)(RUN_END(runs, i + 1) - RUN_START(runs, i));
+        memmove(runs + 2*(i+1), runs + 2*(i+2), (c->used - i - 2) * 2 * sizeof(uint16_t));
+        c->used--;
+    }
+    else if(joinsPrevious) {
+        runs[2*i+1]++;
+    }
+    else if(joinsNext) {
+        runs[2*(i+1)]--;
+        runs[2*(i+1)+1]++;
+    }
+    else {
+        ContainerReserve(c, 2 * (c->used + 1));
+        runs = c->values;
+        memmove(runs + 2*(i+2), runs + 2*(i+1), (c->used - i - 1) * 2 * sizeof(uint16_t));
+        runs[2*(i+1)] = (uint16_t)value;
+        runs[2*(i+1)+1] = 0;
+        c->used++;
+    }
+
+    return YES;
+}
+
+static BOOL RunRemove(BAContainer *c, uint32_t value) {
+
+    uint16_t *runs = c->values;
+    int32_t i = RunFind(runs, c->used, value);
+
+    if(i < 0 || value > RUN_END(runs, i))
+        return NO;
+
+    uint32_t start = RUN_START(runs, i);
+    uint32_t end = RUN_END(runs, i);
+
+    if(start == end) {
+        memmove(runs + 2*i, runs + 2*(i+1), (c->used - i - 1) * 2 * sizeof(uint16_t));
+        c->used--;
+    }
+    else if(value == start) {
+        runs[2*i]++;
+        runs[2*i+1]--;
+    }
+    else if(value == end) {
+        runs[2*i+1]--;
+    }
+    else {
+        ContainerReserve(c, 2 * (c->used + 1));
+        runs = c->values;
+        memmove(runs + 2*(i+2), runs + 2*(i+1), (c->used - i - 1) * 2 * sizeof(uint16_t));
+        runs[2*i+1] = (uint16_t)(value - start - 1);
+        runs[2*(i+1)] = (uint16_t)(value + 1);
+        runs[2*(i+1)+1] = (uint16_t)(end - value - 1);
+        c->used++;
+    }
+
+    return YES;
+}
+
+static BOOL ContainerAdd(BAContainer *c, uint32_t value) {
+
+    if(!c->cardinality) {
+        ContainerFree(c);
+        c->type = BAContainerTypeArray;
+    }
+
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value);
+            if(i < c->used && c->values[i] == value)
+                return NO;
+            if(c->used == ARRAY_MAX) {
+                ContainerConvertToBitmap(c);
+                return ContainerAdd(c, value);
+            }
+            ContainerReserve(c, c->used + 1);
+            memmove(c->values + i + 1, c->values + i, (c->used - i) * sizeof(uint16_t));
+            c->values[i] = (uint16_t)value;
+            c->used++;
+            break;
+        }
+        case BAContainerTypeBitmap: {
+            uint64_t mask = 1ULL << (value & 63);
+            if(c->words[value >> 6] & mask)
+                return NO;
+            c->words[value >> 6] |= mask;
+            break;
+        }
+        case BAContainerTypeRun:
+            if(!RunAdd(c, value))
+                return NO;
+            c->cardinality++;
+            // a run container which has fragmented is rebuilt as whichever is smaller
+            if(2 * c->used > MIN(c->cardinality, BITMAP_SLOTS))
+                ContainerRebuild(c, NO);
+            return YES;
+    }
+
+    c->cardinality++;
+
+    return YES;
+}
+
+static BOOL ContainerRemove(BAContainer *c, uint32_t value) {
+
+    if(!c->cardinality)
+        return NO;
+
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value);
+            if(i >= c->used || c->values[i] != value)
+                return NO;
+            memmove(c->values + i, c->values + i + 1, (c->used - i - 1) * sizeof(uint16_t));
+            c->used--;
+            break;
+        }
+        case BAContainerTypeBitmap: {
+            uint64_t mask = 1ULL << (value & 63);
+            if(!(c->words[value >> 6] & mask))
+                return NO;
+            c->words[value >> 6] &= ~mask;
+            if(--c->cardinality <= ARRAY_MAX)
+                ContainerConvertBitmapToArray(c);
+            return YES;
+        }
+        case BAContainerTypeRun:
+            if(!RunRemove(c, value))
+                return NO;
+            if(--c->cardinality == 0)
+                ContainerFree(c);
+            else if(2 * c->used > MIN(c->cardinality, BITMAP_SLOTS))
+                ContainerRebuild(c, NO);
+            return YES;
+    }
+
+    if(--c->cardinality == 0)
+        ContainerFree(c);
+
+    return YES;
+}
+
+// Set or clear [start, end), where limit is the number of positions the chunk holds
+static void ContainerUpdateRange(BAContainer *c, uint32_t start, uint32_t end, uint32_t limit, BOOL set) {
+
+    if(start >= end)
+        return;
+
+    if(start == 0 && end == limit) {
+        ContainerFree(c);
+        if(set) {
+            ContainerReserve(c, 2);
+            c->type = BAContainerTypeRun;
+            c->values[0] = 0;
+            c->values[1] = (uint16_t)(limit - 1);
+            c->used = 1;
+            c->cardinality = limit;
+        }
+        return;
+    }
+
+    if(!c->cardinality) {
+        if(!set)
+            return;
+        ContainerReserve(c, 2);
+        c->type = BAContainerTypeRun;
+        c->values[0] = (uint16_t)start;
+        c->values[1] = (uint16_t)(end - start - 1);
+        c->used = 1;
+        c->cardinality = end - start;
+        return;
+    }
+
+    uint64_t words[BITMAP_WORDS];
+    ContainerToBitmap(c, words);
+    WordsSetRange(words, start, end, set);
+    ContainerFromBitmap(c, words, YES);
+}
+
+// First set position >= value, or -1
+static int32_t ContainerNextSet(const BAContainer *c, uint32_t value) {
+    if(!c->cardinality)
+        return -1;
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value);
+            return i < c->used ? c->values[i] : -1;
+        }
+        case BAContainerTypeBitmap: {
+            uint32_t i = value >> 6;
+            if(i >= BITMAP_WORDS)
+                return -1;
+            uint64_t w = c->words[i] & (~0ULL << (value & 63));
+            while(!w && ++i < BITMAP_WORDS)
+                w = c->words[i];
+            return w ? (int32_t)(i * 64 + __builtin_ctzll(w)) : -1;
+        }
+        case BAContainerTypeRun: {
+            int32_t i = RunFind(c->values, c->used, value);
+            if(i >= 0 && value <= RUN_END(c->values, i))
+                return value;
+            return (uint32_t)(i + 1) < c->used ? (int32_t)RUN_START(c->values, i + 1) : -1;
+        }
+    }
+    return -1;
+}
+
+// Last set position <= value, or -1
+static int32_t ContainerPreviousSet(const BAContainer *c, uint32_t value) {
+    if(!c->cardinality)
+        return -1;
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value + 1);
+            return i > 0 ? c->values[i - 1] : -1;
+        }
+        case BAContainerTypeBitmap: {
+            int32_t i = value >> 6;
+            uint64_t w = c->words[i] & (~0ULL >> (63 - (value & 63)));
+            while(!w && --i >= 0)
+                w = c->words[i];
+            return w ? (int32_t)(i * 64 + 63 - __builtin_clzll(w)) : -1;
+        }
+        case BAContainerTypeRun: {
+            int32_t i = RunFind(c->values, c->used, value);
+            if(i < 0)
+                return -1;
+            return (int32_t)MIN(value, RUN_END(c->values, i));
+        }
+    }
+    return -1;
+}
+
+// First clear position >= value and < limit, or -1
+static int32_t ContainerNextClear(const BAContainer *c, uint32_t value, uint32_t limit) {
+
+    if(value >= limit)
+        return -1;
+    if(!c->cardinality)
+        return value;
+
+    int32_t result = -1;
+
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            uint32_t i = ArrayLowerBound(c->values, c->used, value);
+            while(i < c->used && c->values[i] == value) {
+                ++i;
+                ++value;
+            }
+            result = value;
+            break;
+        }
+        case BAContainerTypeBitmap: {
+            uint32_t i = value >> 6;
+            uint64_t w = ~c->words[i] & (~0ULL << (value & 63));
+            while(!w && ++i < BITMAP_WORDS)
+                w = ~c->words[i];
+            result = w ? (int32_t)(i * 64 + __builtin_ctzll(w)) : -1;
+            break;
+        }
+        case BAContainerTypeRun: {
+            // runs are never adjacent, so the position after a run is clear
+            int32_t i = RunFind(c->values, c->used, value);
+            result = i >= 0 && value <= RUN_END(c->values, i) ? (int32_t)RUN_END(c->values, i) + 1 : (int32_t)value;
+            break;
+        }
+    }
+
+    return result >= 0 && (uint32_t)result < limit ? result : -1;
+}
+
+// Last clear position <= value, or -1
+static int32_t ContainerPreviousClear(const BAContainer *c, uint32_t value) {
+
+    if(!c->cardinality)
+        return value;
+
+    switch (c->type) {
+        case BAContainerTypeArray: {
+            int32_t i = (int32_t)ArrayLowerBound(c->values, c->used, value + 1) - 1;
+            int32_t v = value;
+            while(i >= 0 && v >= 0 && c->values[i] == v) {
+                --i;
+                --v;
+            }
+            return v;
+        }
+        case BAContainerTypeBitmap: {
+            int32_t i = value >> 6;
+            uint64_t w = ~c->words[i] & (~0ULL >> (63 - (value & 63)));
+            while(!w && --i >= 0)
+                w = ~c->words[i];
+            return w ? (int32_t)(i * 64 + 63 - __builtin_clzll(w)) : -1;
+        }
+        case BAContainerTypeRun: {
+            int32_t i = RunFind(c->values, c->used, value);
+            return i >= 0 && value <= RUN_END(c->values, i) ? (int32_t)RUN_START(c->values, i) - 1 : (int32_t)value;
+        }
+    }
+
+    return -1;
+}
+
+// Read [start, start+length) into bits, which must be cleared; returns the number of set bits
+static uint32_t ContainerReadBits(const BAContainer *c, BOOL *bits, uint32_t start, uint32_t length) {
+
+    uint32_t end = start + length;
+    uint32_t total = 0;
+
+    if(!c->cardinality)
+        return 0;
+
+    switch (c->type) {
+        case BAContainerTypeArray:
+            for (uint32_t i=ArrayLowerBound(c->values, c->used, start); i<c->used && c->values[i] < end; ++i, ++total)
+                bits[c->values[i] - start] = YES;
+            break;
+        case BAContainerTypeBitmap:
+            for (uint32_t i=start; i<end; ++i) {
+                BOOL bit = (c->words[i >> 6] >> (i & 63)) & 1;
+                bits[i - start] = bit;
+                total += bit;
+            }
+            break;
+        case BAContainerTypeRun: {
+            int32_t first = RunFind(c->values, c->used, start);
+            for (uint32_t i=MAX(first, 0); i<c->used && RUN_START(c->values, i) < end; ++i) {
+                uint32_t runStart = MAX(RUN_START(c->values, i), start);
+                uint32_t runEnd = MIN(RUN_END(c->values, i) + 1, end);
+                if(runStart < runEnd) {
+                    memset(bits + runStart - start, YES, runEnd - runStart);
+                    total += runEnd - runStart;
+                }
+            }
+            break;
+        }
+    }
+
+    return total;
+}
+
+// Write [start, start+length) from bits; returns the change in cardinality
+static int32_t ContainerWriteBits(BAContainer *c, const BOOL *bits, uint32_t start, uint32_t length) {
+
+    int32_t before = c->cardinality;
+    uint64_t words[BITMAP_WORDS];
+
+    ContainerToBitmap(c, words);
+    for (uint32_t i=0; i<length; ++i) {
+        uint32_t p = start + i;
+        if(bits[i])
+            words[p >> 6] |= 1ULL << (p & 63);
+        else
+            words[p >> 6] &= ~(1ULL << (p & 63));
+    }
+    ContainerFromBitmap(c, words, c->type == BAContainerTypeRun);
+
+    return (int32_t)c->cardinality - before;
+}
+
+
+#pragma mark -
+
+#define CONTAINERS ((BAContainer *)_containers)
+
+@implementation BACompressedBitArray
+
+@synthesize enableArchiveCompression=_enableArchiveCompression;
+@synthesize size=_size;
+@synthesize length=_length, count=_count;
+
+#pragma mark - Private
+
+- (NSUInteger)limitForChunk:(NSUInteger)chunk {
+    return MIN(CHUNK_SIZE, _length - (chunk << CHUNK_SHIFT));
+}
+
+- (void)checkRange:(NSRange)range {
+    if(NSMaxRange(range) > _length)
+        [NSException raise:NSInvalidArgumentException format:@"range beyond bounds: %@", NSStringFromRange(range)];
+}
+
+- (void)updateRange:(NSRange)range set:(BOOL)set {
+    
+    [self checkRange:range];
+    
+    NSUInteger index = range.location;
+    NSUInteger end = NSMaxRange(range);
+    
+    while(index < end) {
+        
+        NSUInteger chunk = index >> CHUNK_SHIFT;
+        NSUInteger chunkEnd = MIN(end, (chunk + 1) << CHUNK_SHIFT);
+        BAContainer *c = &CONTAINERS[chunk];
+        NSInteger before = c->cardinality;
+        
+        ContainerUpdateRange(c, (uint32_t)(index & CHUNK_MASK), (uint32_t)(chunkEnd - (chunk << CHUNK_SHIFT)), (uint32_t)[self limitForChunk:chunk], set);
+        _count += (NSInteger)c->cardinality - before;
+        index = chunkEnd;
+    }
+}
+
+- (NSUInteger)updateBits:(BOOL *)bits range:(NSRange)range write:(BOOL)write {
+    
+    [self checkRange:range];
+    
+    NSUInteger index = range.location;
+    NSUInteger end = NSMaxRange(range);
+    NSInteger result = 0;
+    
+    if(!write)
+        memset(bits, 0, range.length * sizeof(BOOL));
+    
+    while(index < end) {
+        
+        NSUInteger chunk = index >> CHUNK_SHIFT;
+        NSUInteger chunkEnd = MIN(end, (chunk + 1) << CHUNK_SHIFT);
+        BAContainer *c = &CONTAINERS[chunk];
+        uint32_t start = (uint32_t)(index & CHUNK_MASK);
+        uint32_t length = (uint32_t)(chunkEnd - index);
+        
+        if(write) {
+            int32_t delta = ContainerWriteBits(c, bits, start, length);
+            _count += delta;
+            result += delta;
+        }
+        else {
+            result += ContainerReadBits(c, bits, start, length);
+        }
+        
+        bits += length;
+        index = chunkEnd;
+    }
+    
+    return (NSUInteger)result;
+}
+
+
+#pragma mark - Accessors
+
+- (NSUInteger)storageSize {
+    
+    NSUInteger total = _chunkCount * sizeof(BAContainer);
+    
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        total += ContainerBytes(&CONTAINERS[i]);
+    
+    return total;
+}
+
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        ContainerFree(&CONTAINERS[i]);
+    free(_containers);
+    [_size release];
+    [super dealloc];
+}
+
+- (id)init {
+    return [self initWithLength:0 size:nil];
+}
+
+- (NSUInteger)hash {
+    return _length ^ (_count << 16);
+}
+
+- (BOOL)isEqual:(id)object {
+    return [object isKindOfClass:[self class]] && [self isEqualToBitArray:object];
+}
+
+- (NSString *)description {
+    NSUInteger containers[3] = { 0, 0, 0 };
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        if(CONTAINERS[i].cardinality)
+            containers[CONTAINERS[i].type]++;
+    return [NSString stringWithFormat:@"%@ length:%lu count:%lu; containers: %lu array, %lu bitmap, %lu run; %lu bytes",
+            [super description], (unsigned long)_length, (unsigned long)_count,
+            (unsigned long)containers[BAContainerTypeArray], (unsigned long)containers[BAContainerTypeBitmap],
+            (unsigned long)containers[BAContainerTypeRun], (unsigned long)self.storageSize];
+}
+
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+    
+    BACompressedBitArray *copy = [[[self class] alloc] initWithLength:_length size:_size];
+    
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        ContainerCopy(&((BAContainer *)copy->_containers)[i], &CONTAINERS[i]);
+    copy->_count = _count;
+    copy->_enableArchiveCompression = _enableArchiveCompression;
+    
+    return copy;
+}
+
+
+#pragma mark - NSCoding
+
+/* Archived containers are a sequence of records, one per non-empty chunk: four little-endian 32-bit
+ * values (chunk, type, used, cardinality) followed by the container contents, little-endian.
+ */
+
+- (NSData *)containerData {
+    
+    NSMutableData *data = [NSMutableData data];
+    
+    for (NSUInteger i=0; i<_chunkCount; ++i) {
+        
+        BAContainer *c = &CONTAINERS[i];
+        
+        if(!c->cardinality)
+            continue;
+        
+        uint32_t header[4] = {
+            CFSwapInt32HostToLittle((uint32_t)i),
+            CFSwapInt32HostToLittle(c->type),
+            CFSwapInt32HostToLittle(c->used),
+            CFSwapInt32HostToLittle(c->cardinality)
+        };
+        [data appendBytes:header length:sizeof(header)];
+        
+        if(c->type == BAContainerTypeBitmap) {
+            for (NSUInteger w=0; w<BITMAP_WORDS; ++w) {
+                uint64_t word = CFSwapInt64HostToLittle(c->words[w]);
+                [data appendBytes:&word length:sizeof(word)];
+            }
+        }
+        else {
+            uint32_t slots = c->type == BAContainerTypeRun ? 2 * c->used : c->used;
+            for (NSUInteger s=0; s<slots; ++s) {
+                uint16_t value = CFSwapInt16HostToLittle(c->values[s]);
+                [data appendBytes:&value length:sizeof(value)];
+            }
+        }
+    }
+    
+    return data;
+}
+
+- (void)loadContainerData:(NSData *)data {
+    
+    const unsigned char *bytes = [data bytes];
+    const unsigned char *end = bytes + [data length];
+    
+    _count = 0;
+    
+    while(bytes + 4 * sizeof(uint32_t) <= end) {
+        
+        uint32_t header[4];
+        
+        memcpy(header, bytes, sizeof(header));
+        bytes += sizeof(header);
+        
+        uint32_t chunk = CFSwapInt32LittleToHost(header[0]);
+        BAContainerType type = (BAContainerType)CFSwapInt32LittleToHost(header[1]);
+        uint32_t used = CFSwapInt32LittleToHost(header[2]);
+        uint32_t slots = type == BAContainerTypeBitmap ? BITMAP_SLOTS : type == BAContainerTypeRun ? 2 * used : used;
+        
+        if(chunk >= _chunkCount || type > BAContainerTypeRun || slots > BITMAP_SLOTS || bytes + slots * sizeof(uint16_t) > end)
+            [NSException raise:NSInternalInconsistencyException format:@"Corrupt compressed bit array archive"];
+        
+        BAContainer *c = &CONTAINERS[chunk];
+        
+        ContainerFree(c);
+        ContainerReserve(c, slots);
+        c->type = type;
+        c->used = type == BAContainerTypeBitmap ? 0 : used;
+        c->cardinality = CFSwapInt32LittleToHost(header[3]);
+        
+        if(type == BAContainerTypeBitmap) {
+            memcpy(c->words, bytes, BITMAP_WORDS * sizeof(uint64_t));
+            for (NSUInteger w=0; w<BITMAP_WORDS; ++w)
+                c->words[w] = CFSwapInt64LittleToHost(c->words[w]);
+        }
+        else {
+            memcpy(c->values, bytes, slots * sizeof(uint16_t));
+            for (NSUInteger s=0; s<slots; ++s)
+                c->values[s] = CFSwapInt16LittleToHost(c->values[s]);
+        }
+        
+        bytes += slots * sizeof(uint16_t);
+        _count += c->cardinality;
+    }
+}
+
+- (void)encodeWithCoder:(NSCoder *)aCoder {
+    
+    NSData *data = [self containerData];
+    NSString *key = @"containers";
+    if(_enableArchiveCompression) {
+        data = [data gzipDeflate];
+        key = @"gzippedContainers";
+    }
+    
+    [aCoder encodeObject:data forKey:key];
+    [aCoder encodeInteger:(NSInteger)_length forKey:@"length"];
+    [aCoder encodeBool:_enableArchiveCompression forKey:@"compressed"];
+    [aCoder encodeInteger:_count forKey:@"count"];
+    [aCoder encodeObject:_size forKey:@"size"];
+}
+
+- (id)initWithCoder:(NSCoder *)aDecoder {
+    self = [self initWithLength:[aDecoder decodeIntegerForKey:@"length"] size:[aDecoder decodeObjectForKey:@"size"]];
+    if(self) {
+        _enableArchiveCompression = [aDecoder decodeBoolForKey:@"compressed"];
+        [self loadContainerData:[aDecoder decodeObjectForKey:@"containers"] ?: [[aDecoder decodeObjectForKey:@"gzippedContainers"] gzipInflate]];
+        
+        NSUInteger storedCount = [aDecoder decodeIntegerForKey:@"count"];
+        
+        if(storedCount != _count)
+            NSLog(@"Count is wrong for compressed bit array. Expected: %d; actual: %d", (int)storedCount, (int)_count);
+    }
+    return self;
+}
+
+
+#pragma mark - BACompressedBitArray
+
+- (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector {
+    self = [super init];
+    if(self) {
+        _length = bits;
+        _size = [vector copy];
+        _size2 = _size ? _size.size2 : BASize2Make(0, 0);
+        _chunkCount = (bits + CHUNK_MASK) >> CHUNK_SHIFT;
+        _containers = calloc(MAX(_chunkCount, 1), sizeof(BAContainer));
+    }
+    return self;
+}
+
+- (id)initWithLength:(NSUInteger)bits {
+    return [self initWithLength:bits size:nil];
+}
+
+- (id)initWithSize2:(BASize2)size2 {
+    return [self initWithLength:size2.width * size2.height size:[BASampleArray sampleArrayForSize2:size2]];
+}
+
+- (id)initWithBitArray:(id<BABitArray>)otherArray {
+    
+    BASampleArray *size = [otherArray respondsToSelector:@selector(size)] ? [(id<BABitArray2D>)otherArray size] : nil;
+    
+    self = [self initWithLength:otherArray.length size:size];
+    if(self) {
+        for (NSUInteger i=0; i<_chunkCount; ++i) {
+            NSRange range = NSMakeRange(i << CHUNK_SHIFT, [self limitForChunk:i]);
+            BOOL *bits = malloc(range.length * sizeof(BOOL));
+            if([otherArray readBits:bits range:range])
+                [self writeBits:bits range:range];
+            free(bits);
+        }
+        [self optimize];
+    }
+    return self;
+}
+
+- (BOOL)isEqualToBitArray:(id<BABitArray>)other {
+    
+    if(other.length != _length || other.count != _count)
+        return NO;
+    
+    // with equal counts, the arrays are equal if every bit set here is also set in other
+    for (NSUInteger index = [self firstSetBit]; index != NSNotFound; index = [self nextAfter:index])
+        if(![other bit:index])
+            return NO;
+    
+    return YES;
+}
+
+- (NSUInteger)nextAfter:(NSUInteger)prev {
+    
+    NSUInteger index = prev + 1;
+    
+    for (NSUInteger chunk = index >> CHUNK_SHIFT; chunk < _chunkCount; ++chunk) {
+        uint32_t start = chunk == (index >> CHUNK_SHIFT) ? (uint32_t)(index & CHUNK_MASK) : 0;
+        int32_t next = ContainerNextSet(&CONTAINERS[chunk], start);
+        if(next >= 0)
+            return (chunk << CHUNK_SHIFT) + next;
+    }
+    
+    return NSNotFound;
+}
+
+- (void)enumerate:(BABitArrayEnumerator)block {
+    for (NSUInteger index = [self firstSetBit]; index != NSNotFound; index = [self nextAfter:index])
+        block(index);
+}
+
+- (BOOL)checkCount {
+    
+    NSUInteger total = 0;
+    
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        total += CONTAINERS[i].cardinality;
+    
+    return total == _count;
+}
+
+- (void)refreshCount {
+    
+    _count = 0;
+    
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        _count += CONTAINERS[i].cardinality;
+}
+
+- (void)optimize {
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        if(CONTAINERS[i].cardinality)
+            ContainerRebuild(&CONTAINERS[i], YES);
+}
+
++ (instancetype)bitArrayWithLength:(NSUInteger)bits size:(BASampleArray *)vector {
+    return [[[self alloc] initWithLength:bits size:vector] autorelease];
+}
+
++ (instancetype)bitArrayWithLength:(NSUInteger)bits {
+    return [[[self alloc] initWithLength:bits] autorelease];
+}
+
++ (instancetype)bitArrayWithSize2:(BASize2)size2 {
+    return [[[self alloc] initWithSize2:size2] autorelease];
+}
+
+
+#pragma mark - BABitArray
+
+- (BOOL)bit:(NSUInteger)index {
+    if(index >= _length)
+        [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
+    return ContainerContains(&CONTAINERS[index >> CHUNK_SHIFT], (uint32_t)(index & CHUNK_MASK));
+}
+
+- (void)setBit:(NSUInteger)index {
+    if(index >= _length)
+        [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
+    if(ContainerAdd(&CONTAINERS[index >> CHUNK_SHIFT], (uint32_t)(index & CHUNK_MASK)))
+        ++_count;
+}
+
+- (void)setRange:(NSRange)bitRange {
+    [self updateRange:bitRange set:YES];
+}
+
+- (void)setAll {
+    [self updateRange:NSMakeRange(0, _length) set:YES];
+}
+
+- (void)clearBit:(NSUInteger)index {
+    if(index >= _length)
+        [NSException raise:NSInvalidArgumentException format:@"index beyond bounds: %lu", (unsigned long)index];
+    if(ContainerRemove(&CONTAINERS[index >> CHUNK_SHIFT], (uint32_t)(index & CHUNK_MASK)))
+        --_count;
+}
+
+- (void)clearRange:(NSRange)bitRange {
+    [self updateRange:bitRange set:NO];
+}
+
+- (void)clearAll {
+    for (NSUInteger i=0; i<_chunkCount; ++i)
+        ContainerFree(&CONTAINERS[i]);
+    _count = 0;
+}
+
+- (NSUInteger)firstSetBit {
+    return _count ? [self nextAfter:-1] : NSNotFound;
+}
+
+- (NSUInteger)lastSetBit {
+    
+    for (NSUInteger chunk = _chunkCount; _count && chunk-- > 0;) {
+        int32_t last = ContainerPreviousSet(&CONTAINERS[chunk], (uint32_t)[self limitForChunk:chunk] - 1);
+        if(last >= 0)
+            return (chunk << CHUNK_SHIFT) + last;
+    }
+    
+    return NSNotFound;
+}
+
+- (NSUInteger)readBits:(BOOL *)bits range:(NSRange)bitRange {
+    return [self updateBits:bits range:bitRange write:NO];
+}
+
+- (NSUInteger)writeBits:(BOOL * const)bits range:(NSRange)bitRange {
+    return [self updateBits:bits range:bitRange write:YES];
+}
+
+- (NSUInteger)firstClearBit {
+    
+    for (NSUInteger chunk = 0; _count < _length && chunk < _chunkCount; ++chunk) {
+        int32_t first = ContainerNextClear(&CONTAINERS[chunk], 0, (uint32_t)[self limitForChunk:chunk]);
+        if(first >= 0)
+            return (chunk << CHUNK_SHIFT) + first;
+    }
+    
+    return NSNotFound;
+}
+
+- (NSUInteger)lastClearBit {
+    
+    for (NSUInteger chunk = _chunkCount; _count < _length && chunk-- > 0;) {
+        int32_t last = ContainerPreviousClear(&CONTAINERS[chunk], (uint32_t)[self limitForChunk:chunk] - 1);
+        if(last >= 0)
+            return (chunk << CHUNK_SHIFT) + last;
+    }
+    
+    return NSNotFound;
+}
+
+- (NSString *)stringForRange:(NSRange)range {
+    
+    char *bytes = calloc(sizeof(char), range.length+1);
+    
+    [self readBits:(BOOL *)bytes range:range];
+    
+    for (NSUInteger i=0; i<range.length; ++i)
+        bytes[i] = bytes[i] ? 'S' : '_';
+    
+    NSString *result = [NSString stringWithCString:bytes encoding:NSASCIIStringEncoding];
+    
+    free(bytes);
+    
+    return result;
+}
+
+
+#pragma mark - BABitArray2D
+
+#define SIZE_ASSERT() NSAssert(_size != nil, @"Cannot perform spatial calculations without size")
+
+- (id)initWithBitArray:(id<BABitArray2D>)otherArray region:(BARegion2)region {
+    self = [self initWithSize2:region.size];
+    if(self) {
+        BAPoint2 origin = region.origin;
+        region.origin = BAPoint2Zero();
+        [self writeRegion2:region fromArray:otherArray offset:origin];
+    }
+    return self;
+}
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    return [self bit:x + y * _size2.width];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    [self setBit:x + y * _size2.width];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    SIZE_ASSERT();
+    [self clearBit:x + y * _size2.width];
+}
+
+- (BOOL)bitAtPoint2:(BAPoint2)point {
+    return [self bitAtX:point.x y:point.y];
+}
+
+- (void)setPoint2:(BAPoint2)point {
+    [self setBitAtX:point.x y:point.y];
+}
+
+- (void)clearPoint2:(BAPoint2)point {
+    [self clearBitAtX:point.x y:point.y];
+}
+
+- (NSUInteger)indexForX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    SIZE_ASSERT();
+    BASize3 size3 = _size.size3;
+    return x + (y + z * size3.height) * size3.width;
+}
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    return [self bit:[self indexForX:x y:y z:z]];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self setBit:[self indexForX:x y:y z:z]];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self clearBit:[self indexForX:x y:y z:z]];
+}
+
+- (void)updateRegion2:(BARegion2)region set:(BOOL)set {
+    
+    SIZE_ASSERT();
+    
+    NSRange range = NSMakeRange(region.origin.x + region.origin.y * _size2.width, region.size.width);
+    
+    // rows which span the whole width are contiguous
+    if(region.size.width == _size2.width) {
+        range.length *= region.size.height;
+        [self updateRange:range set:set];
+        return;
+    }
+    
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        [self updateRange:range set:set];
+        range.location += _size2.width;
+    }
+}
+
+- (void)setRegion2:(BARegion2)region {
+    [self updateRegion2:region set:YES];
+}
+
+- (void)clearRegion2:(BARegion2)region {
+    [self updateRegion2:region set:NO];
+}
+
+- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin {
+    
+    SIZE_ASSERT();
+    
+    BASize2 sourceSize = [bitArray size].size2;
+    NSRange sourceRange = NSMakeRange(origin.x + sourceSize.width * origin.y, region.size.width);
+    NSRange destRange = NSMakeRange(region.origin.x + _size2.width * region.origin.y, region.size.width);
+    BOOL *bits = malloc(region.size.width * sizeof(BOOL));
+    
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        [bitArray readBits:bits range:sourceRange];
+        [self writeBits:bits range:destRange];
+        sourceRange.location += sourceSize.width;
+        destRange.location += _size2.width;
+    }
+    
+    free(bits);
+}
+
+- (id<BABitArray2D>)subArrayWithRegion:(BARegion2)region {
+    return [[[[self class] alloc] initWithBitArray:self region:region] autorelease];
+}
+
+- (NSArray *)rowStringsForRegion2:(BARegion2)region {
+    
+    NSMutableArray *rows = [NSMutableArray array];
+    
+    if (BARegion2EqualToRegion2(region, BARegion2Zero())) {
+        region.size = _size2;
+    }
+    
+    NSRange range = NSMakeRange(region.origin.x + _size2.width * region.origin.y, region.size.width);
+    
+    for (NSInteger i=0; i<region.size.height; ++i) {
+        [rows insertObject:[self stringForRange:range] atIndex:0];
+        range.location += _size2.width;
+    }
+    
+    return [[rows copy] autorelease];
+}
+
+- (NSString *)stringForRegion2:(BARegion2)region {
+    return [[self rowStringsForRegion2:region] componentsJoinedByString:@"\n"];
+}
+
+- (NSString *)stringForRegion2 {
+    return [[self rowStringsForRegion2:BARegion2Zero()] componentsJoinedByString:@"\n"];
+}
+
+@end
@@ -12,10 +12,19 @@
 
 #import <BAFoundation/BABitArray.h>
 #import <BAFoundation/BABitArray+Rectangles.h>
+#import <BAFoundation/BABitArrayView.h>
+#import <BAFoundation/BACompressedBitArray.h>
+#import <BAFoundation/BAComponentLabeler.h>
 #import <BAFoundation/BASampleArray.h>
+#import <BAFoundation/BASlabAllocator.h>
 #import <BAFoundation/BASparseArray.h>
 #import <BAFoundation/BASparseBitArray.h>
 #import <BAFoundation/BASparseSampleArray.h>
+#import <BAFoundation/BASparseArrayCursor.h>
+#import <BAFoundation/BASignedSparseArray.h>
+#import <BAFoundation/BASparseArrayFile.h>
+#import <BAFoundation/BASparseArrayPager.h>
+#import <BAFoundation/BASparseArrayStencil.h>
 
 #import <BAFoundation/BACoreDataManager.h>
 #import <BAFoundation/BARelationshipProxy.h>
@@ -41,5 +50,6 @@
 #import <BAFoundation/NSArray+BAFExtensions.h>
 #import <BAFoundation/NSDictionary+BAFExtensions.h>
 #import <BAFoundation/NSData+GZip.h>
+#import <BAFoundation/NSData+WAH.h>
 #import <BAFoundation/NSObject+PlistTransforming.h>
 
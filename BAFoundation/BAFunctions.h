@@ -190,6 +190,48 @@ NS_INLINE BARegion2 BARegion2FromCGRect(CGRect rect) {
     return BARegion2Make(CGRectGetMinX(rect), CGRectGetMinY(rect), CGRectGetWidth(rect), CGRectGetHeight(rect));
 }
 
+#pragma mark - Integer Boxes
+
+NS_INLINE BAPoint3 BAPoint3Make( NSInteger x, NSInteger y, NSInteger z ) {
+    return (BAPoint3) { x, y, z };
+}
+
+NS_INLINE BAPoint3 BAPoint3Zero( void ) {
+    return (BAPoint3) { 0, 0, 0 };
+}
+
+NS_INLINE BASize3 BASize3Make( NSInteger w, NSInteger h, NSInteger d ) {
+    return (BASize3) { w, h, d };
+}
+
+NS_INLINE BARegion3 BARegion3Make(NSInteger x, NSInteger y, NSInteger z, NSInteger width, NSInteger height, NSInteger depth) {
+    return (BARegion3) { { x, y, z }, { width, height, depth } };
+}
+
+NS_INLINE NSInteger BARegion3Volume(BARegion3 region) {
+    return region.size.width * region.size.height * region.size.depth;
+}
+
+NS_INLINE BOOL BARegion3IsEmpty(BARegion3 region) {
+    return region.size.width <= 0 || region.size.height <= 0 || region.size.depth <= 0;
+}
+
+NS_INLINE BOOL BARegion3ContainsRegion3(BARegion3 outer, BARegion3 inner) {
+    return (outer.origin.x <= inner.origin.x && outer.origin.x + outer.size.width  >= inner.origin.x + inner.size.width &&
+            outer.origin.y <= inner.origin.y && outer.origin.y + outer.size.height >= inner.origin.y + inner.size.height &&
+            outer.origin.z <= inner.origin.z && outer.origin.z + outer.size.depth  >= inner.origin.z + inner.size.depth);
+}
+
+NS_INLINE BARegion3 BARegion3Intersection(BARegion3 first, BARegion3 second) {
+    NSInteger x = MAX(first.origin.x, second.origin.x);
+    NSInteger y = MAX(first.origin.y, second.origin.y);
+    NSInteger z = MAX(first.origin.z, second.origin.z);
+    NSInteger maxX = MIN(first.origin.x + first.size.width, second.origin.x + second.size.width);
+    NSInteger maxY = MIN(first.origin.y + first.size.height, second.origin.y + second.size.height);
+    NSInteger maxZ = MIN(first.origin.z + first.size.depth, second.origin.z + second.size.depth);
+    return BARegion3Make(x, y, z, maxX - x, maxY - y, maxZ - z);
+}
+
 #pragma mark - Equality
 
 NS_INLINE BOOL BANEQ(double a, double b) {
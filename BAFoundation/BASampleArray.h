@@ -8,7 +8,7 @@
 
 #import <Foundation/Foundation.h>
 
-@class BANumber;
+@class BANumber, BASlabAllocator;
 
 /**
  * A Sample Array encapsulates an indexed block of memory. The length of the array and the size (in bytes) of
@@ -80,6 +80,7 @@
 @interface BASampleArray : NSObject<NSCoding, NSCopying, BASampleArray> {
     
     UInt8 *_samples;
+    BASlabAllocator *_slab; // where _samples came from, or nil if it was malloc'd
     
     NSUInteger _power; // the number of dimensions
     NSUInteger _order; // samples per dimension - the same in all dimensions
@@ -95,7 +96,9 @@
 @property (nonatomic, readonly) NSData *data;
 
 // if (order^power)*size > NSIntegerMax, throws an internal inconsistency exception
-- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size NS_DESIGNATED_INITIALIZER;
+- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size;
+// The samples are a zero-filled block from <slab>, if they fit in one; copies are always malloc'd
+- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size slab:(BASlabAllocator *)slab NS_DESIGNATED_INITIALIZER;
 
 - (void)iterate:(void(^)(BANumber *, NSUInteger, UInt8 *))block;
 
@@ -9,6 +9,7 @@
 #import <BAFoundation/BASampleArray.h>
 
 #import <BAFoundation/BAFunctions.h>
+#import <BAFoundation/BASlabAllocator.h>
 #import "BANumber.h"
 
 
@@ -37,7 +38,9 @@
 
 #pragma mark - NSObject
 - (void)dealloc {
-    if(_samples) free(_samples);
+    if(_slab) [_slab freeBlock:_samples];
+    else if(_samples) free(_samples);
+    [_slab release], _slab = nil;
     [super dealloc];
 }
 
@@ -74,6 +77,10 @@
 
 #pragma mark - BASampleArray
 - (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size {
+    return [self initWithPower:power order:order size:size slab:nil];
+}
+
+- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size slab:(BASlabAllocator *)slab {
     
     const NSUInteger maxOrder = [[self class] maxOrderForPower:power size:size];
     if (order > maxOrder) {
@@ -88,7 +95,12 @@
         _order = order;
         _size  =  size;
         _count = powi(_order, _power);
-        _samples = malloc(_size*_count);
+        if(slab && _size*_count <= slab.blockSize) {
+            _samples = [slab allocateBlock];
+            _slab = _samples ? [slab retain] : nil;
+        }
+        if(!_samples)
+            _samples = malloc(_size*_count);
 
         NSAssert(_samples, @"Failed to allocate memory for BASampleArray");
     }
@@ -0,0 +1,89 @@
+//
+//  BASignedSparseArray.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-14.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+
+/**
+ * An aggregate of sparse arrays which accepts signed co-ordinates, as described in BASparseArray.h.
+ *
+ * There is one sparse array, or partition, for each combination of signs: bit i of the partition index is
+ * set when co-ordinate i is negative. Negative co-ordinates are mirrored into their partition, so that
+ * -1 maps to 0, -2 to 1, and so on. Each partition is made on the first write to it, and grows on its
+ * own, so the depth of each tree follows how far from the origin it has been written, in its direction.
+ *
+ * Reads outside the written extent return clear bits or zeroed samples, without growing anything.
+ */
+
+@interface BASignedSparseArray : NSObject {
+    BASparseArray **_partitions; // 2^power entries, NULL until written
+    NSUInteger _base;
+    NSUInteger _power;
+}
+
+@property (nonatomic, readonly) NSUInteger base;
+@property (nonatomic, readonly) NSUInteger power;
+@property (nonatomic, readonly) NSUInteger partitionCount; // 2^power
+
+- (id)initWithBase:(NSUInteger)base power:(NSUInteger)power;
+
+- (BASparseArray *)partitionAtIndex:(NSUInteger)index;
+
+// Returns the partition which holds the co-ordinates, and the storage index within it; nil if the
+// partition has not been made and create is NO. Does not grow the partition.
+- (BASparseArray *)partitionForCoordinates:(const NSInteger *)coordinates index:(NSUInteger *)pIndex create:(BOOL)create;
+
+// Subclasses return a new, retained, sparse array for a partition
+- (BASparseArray *)newPartition;
+
+@end
+
+
+@interface BASignedSparseBitArray : BASignedSparseArray
+
+- (NSUInteger)count;
+
+- (BOOL)bitAtCoordinates:(const NSInteger *)coordinates;
+- (void)setBitAtCoordinates:(const NSInteger *)coordinates;
+- (void)clearBitAtCoordinates:(const NSInteger *)coordinates;
+
+// for arrays of power 2 and 3, respectively
+- (BOOL)bitAtX:(NSInteger)x y:(NSInteger)y;
+- (void)setBitAtX:(NSInteger)x y:(NSInteger)y;
+- (void)clearBitAtX:(NSInteger)x y:(NSInteger)y;
+
+- (BOOL)bitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+- (void)setBitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+- (void)clearBitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+
+@end
+
+
+@interface BASignedSparseSampleArray : BASignedSparseArray {
+    NSUInteger _size;
+}
+
+@property (nonatomic, readonly) NSUInteger size; // bytes per sample
+
+- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size;
+
+- (void)sample:(UInt8 *)sample atCoordinates:(const NSInteger *)coordinates;
+- (void)setSample:(UInt8 *)sample atCoordinates:(const NSInteger *)coordinates;
+
+// for arrays of power 2 and 3, respectively
+- (BAPageSample)pageSampleAtX:(NSInteger)x y:(NSInteger)y;
+- (void)setPageSample:(BAPageSample)sample atX:(NSInteger)x y:(NSInteger)y;
+
+- (BABlockSample)blockSampleAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+- (void)setBlockSample:(BABlockSample)sample atX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+
+- (float)blockFloatAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+- (void)setBlockFloat:(float)sample atX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z;
+
+@end
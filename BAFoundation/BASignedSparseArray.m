@@ -0,0 +1,246 @@
+//
+//  BASignedSparseArray.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-14.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASignedSparseArray.h>
+
+#import "BASparseArrayPrivate.h"
+
+
+@implementation BASignedSparseArray
+
+@synthesize base=_base, power=_power;
+
+#pragma mark - Accessors
+
+- (NSUInteger)partitionCount {
+    return (NSUInteger)1 << _power;
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    if(_partitions) {
+        for (NSUInteger i=0; i<self.partitionCount; ++i)
+            [_partitions[i] release];
+        free(_partitions), _partitions = NULL;
+    }
+    [super dealloc];
+}
+
+#pragma mark - BASignedSparseArray
+
+- (id)initWithBase:(NSUInteger)base power:(NSUInteger)power {
+    self = [super init];
+    if(self) {
+        _base = base;
+        _power = power;
+        _partitions = calloc(self.partitionCount, sizeof(BASparseArray *));
+    }
+    return self;
+}
+
+- (BASparseArray *)partitionAtIndex:(NSUInteger)index {
+    NSAssert(index < self.partitionCount, @"no partition with index %tu", index);
+    return __atomic_load_n(_partitions + index, __ATOMIC_ACQUIRE);
+}
+
+- (BASparseArray *)partitionForCoordinates:(const NSInteger *)coordinates index:(NSUInteger *)pIndex create:(BOOL)create {
+
+    NSUInteger relative[_power];
+    NSUInteger partitionIndex = 0;
+
+    // mirror negative co-ordinates: -1 -> 0, -2 -> 1, etc.
+    for (NSUInteger i=0; i<_power; ++i) {
+        if(coordinates[i] < 0) {
+            partitionIndex |= (NSUInteger)1 << i;
+            relative[i] = (NSUInteger)~coordinates[i];
+        }
+        else {
+            relative[i] = (NSUInteger)coordinates[i];
+        }
+    }
+
+    BASparseArray *partition = __atomic_load_n(_partitions + partitionIndex, __ATOMIC_ACQUIRE);
+
+    // published like sparse array children; a thread which loses the race releases its partition
+    if(!partition && create) {
+        BASparseArray *newPartition = [self newPartition];
+        if(__atomic_compare_exchange_n(_partitions + partitionIndex, &partition, newPartition, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            partition = newPartition;
+        else
+            [newPartition release];
+    }
+
+    if(pIndex)
+        *pIndex = StorageIndexForCoordinates(relative, _base, _power);
+
+    return partition;
+}
+
+- (BASparseArray *)newPartition {
+    return [[BASparseArray alloc] initWithBase:_base power:_power];
+}
+
+@end
+
+
+@implementation BASignedSparseBitArray
+
+#pragma mark - Private
+
+- (void)updateBitAtCoordinates:(const NSInteger *)coordinates set:(BOOL)set {
+
+    NSUInteger index;
+    BASparseBitArray *partition = (BASparseBitArray *)[self partitionForCoordinates:coordinates index:&index create:set];
+
+    if(set)
+        [partition setBit:index];
+    else if(index < partition.treeSize)
+        [partition clearBit:index];
+}
+
+#pragma mark - BASignedSparseArray
+
+- (BASparseArray *)newPartition {
+    return [[BASparseBitArray alloc] initWithBase:_base power:_power];
+}
+
+#pragma mark - BASignedSparseBitArray
+
+- (NSUInteger)count {
+    NSUInteger count = 0;
+    for (NSUInteger i=0; i<self.partitionCount; ++i)
+        count += [(BASparseBitArray *)[self partitionAtIndex:i] count];
+    return count;
+}
+
+- (BOOL)bitAtCoordinates:(const NSInteger *)coordinates {
+    NSUInteger index;
+    BASparseBitArray *partition = (BASparseBitArray *)[self partitionForCoordinates:coordinates index:&index create:NO];
+    return index < partition.treeSize && [partition bit:index];
+}
+
+- (void)setBitAtCoordinates:(const NSInteger *)coordinates {
+    [self updateBitAtCoordinates:coordinates set:YES];
+}
+
+- (void)clearBitAtCoordinates:(const NSInteger *)coordinates {
+    [self updateBitAtCoordinates:coordinates set:NO];
+}
+
+- (BOOL)bitAtX:(NSInteger)x y:(NSInteger)y {
+    NSInteger coordinates[2] = { x, y };
+    return [self bitAtCoordinates:coordinates];
+}
+
+- (void)setBitAtX:(NSInteger)x y:(NSInteger)y {
+    NSInteger coordinates[2] = { x, y };
+    [self updateBitAtCoordinates:coordinates set:YES];
+}
+
+- (void)clearBitAtX:(NSInteger)x y:(NSInteger)y {
+    NSInteger coordinates[2] = { x, y };
+    [self updateBitAtCoordinates:coordinates set:NO];
+}
+
+- (BOOL)bitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    return [self bitAtCoordinates:coordinates];
+}
+
+- (void)setBitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    [self updateBitAtCoordinates:coordinates set:YES];
+}
+
+- (void)clearBitAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    [self updateBitAtCoordinates:coordinates set:NO];
+}
+
+@end
+
+
+@implementation BASignedSparseSampleArray
+
+@synthesize size=_size;
+
+#pragma mark - BASignedSparseArray
+
+- (BASparseArray *)newPartition {
+    return [[BASparseSampleArray alloc] initWithPower:_power order:_base size:_size];
+}
+
+#pragma mark - BASignedSparseSampleArray
+
+- (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size {
+    self = [super initWithBase:order power:power];
+    if(self) {
+        _size = size;
+    }
+    return self;
+}
+
+- (void)sample:(UInt8 *)sample atCoordinates:(const NSInteger *)coordinates {
+
+    NSUInteger index;
+    BASparseSampleArray *partition = (BASparseSampleArray *)[self partitionForCoordinates:coordinates index:&index create:NO];
+
+    if(index < partition.treeSize)
+        [partition sample:sample atIndex:index];
+    else
+        memset(sample, 0, _size);
+}
+
+- (void)setSample:(UInt8 *)sample atCoordinates:(const NSInteger *)coordinates {
+
+    NSUInteger index;
+    BASparseSampleArray *partition = (BASparseSampleArray *)[self partitionForCoordinates:coordinates index:&index create:YES];
+
+    if(index >= partition.treeSize)
+        [partition expandToFitSize:index+1];
+    [partition setSample:sample atIndex:index];
+}
+
+- (BAPageSample)pageSampleAtX:(NSInteger)x y:(NSInteger)y {
+    NSInteger coordinates[2] = { x, y };
+    BAPageSample sample = 0;
+    [self sample:(UInt8 *)&sample atCoordinates:coordinates];
+    return sample;
+}
+
+- (void)setPageSample:(BAPageSample)sample atX:(NSInteger)x y:(NSInteger)y {
+    NSInteger coordinates[2] = { x, y };
+    [self setSample:(UInt8 *)&sample atCoordinates:coordinates];
+}
+
+- (BABlockSample)blockSampleAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    BABlockSample sample = 0;
+    [self sample:(UInt8 *)&sample atCoordinates:coordinates];
+    return sample;
+}
+
+- (void)setBlockSample:(BABlockSample)sample atX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    [self setSample:(UInt8 *)&sample atCoordinates:coordinates];
+}
+
+- (float)blockFloatAtX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    float sample = 0;
+    [self sample:(UInt8 *)&sample atCoordinates:coordinates];
+    return sample;
+}
+
+- (void)setBlockFloat:(float)sample atX:(NSInteger)x y:(NSInteger)y z:(NSInteger)z {
+    NSInteger coordinates[3] = { x, y, z };
+    [self setSample:(UInt8 *)&sample atCoordinates:coordinates];
+}
+
+@end
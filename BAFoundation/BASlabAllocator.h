@@ -0,0 +1,50 @@
+//
+//  BASlabAllocator.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-16.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/**
+ * Hands out blocks of a single size, carved from slabs of many blocks each.
+ *
+ * Blocks are zero-filled, and start on a 64 byte (cache line) boundary; the block size is rounded up to match.
+ * A freed block goes on a free list, and is the next one handed out. Slabs are only given back to the system
+ * when the allocator is deallocated, so its footprint is the most blocks it ever had out at once.
+ *
+ * Sparse arrays keep the storage of all of their leaves in one allocator, so that a tree of many small leaves
+ * is a few large allocations rather than many small ones, and leaves made together sit together in memory.
+ * Anything which holds a block should retain the allocator.
+ *
+ * Blocks may be allocated and freed from any thread.
+ */
+
+@interface BASlabAllocator : NSObject {
+    void **_slabs;
+    NSUInteger _slabCount;
+    NSUInteger _slabCapacity;   // entries in _slabs
+    NSUInteger _blockSize;
+    NSUInteger _blocksPerSlab;
+    NSUInteger _unusedBlocks;   // never handed out, at the end of the newest slab
+    void *_freeBlocks;          // each one holds the address of the next
+    NSUInteger _allocatedBlocks;
+}
+
+@property (readonly) NSUInteger blockSize;
+@property (readonly) NSUInteger blocksPerSlab;
+@property (readonly) NSUInteger allocatedBlocks; // handed out and not yet freed
+@property (readonly) NSUInteger reservedBytes;   // all of the slabs
+
+// Slabs are 64KB, or one block when blocks are bigger than that
+- (id)initWithBlockSize:(NSUInteger)blockSize;
+- (id)initWithBlockSize:(NSUInteger)blockSize blocksPerSlab:(NSUInteger)blocksPerSlab;
+
+// NULL if memory could not be allocated
+- (void *)allocateBlock;
+- (void)freeBlock:(void *)block;
+
+@end
@@ -0,0 +1,116 @@
+//
+//  BASlabAllocator.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-16.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASlabAllocator.h>
+
+
+static const NSUInteger BASlabAlignment = 64;
+static const NSUInteger BASlabDefaultSize = 1 << 16;
+
+
+@implementation BASlabAllocator
+
+@synthesize blockSize=_blockSize, blocksPerSlab=_blocksPerSlab;
+
+#pragma mark - Accessors
+
+- (NSUInteger)allocatedBlocks {
+    @synchronized(self) {
+        return _allocatedBlocks;
+    }
+}
+
+- (NSUInteger)reservedBytes {
+    @synchronized(self) {
+        return _slabCount * _blocksPerSlab * _blockSize;
+    }
+}
+
+#pragma mark - NSObject
+
+- (id)init {
+    return [self initWithBlockSize:BASlabAlignment];
+}
+
+- (void)dealloc {
+    NSAssert(0 == _allocatedBlocks, @"slab allocator released with %tu blocks still in use", _allocatedBlocks);
+    for (NSUInteger i=0; i<_slabCount; ++i)
+        free(_slabs[i]);
+    free(_slabs), _slabs = NULL;
+    [super dealloc];
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ block size: %tu. blocks: %tu in use, %tu reserved", NSStringFromClass([self class]),
+            _blockSize, self.allocatedBlocks, _slabCount * _blocksPerSlab];
+}
+
+#pragma mark - BASlabAllocator
+
+- (id)initWithBlockSize:(NSUInteger)blockSize {
+    NSUInteger alignedSize = (MAX(blockSize, 1) + BASlabAlignment - 1) & ~(BASlabAlignment - 1);
+    return [self initWithBlockSize:blockSize blocksPerSlab:MAX(BASlabDefaultSize / alignedSize, 1)];
+}
+
+- (id)initWithBlockSize:(NSUInteger)blockSize blocksPerSlab:(NSUInteger)blocksPerSlab {
+    NSParameterAssert(blocksPerSlab > 0);
+    self = [super init];
+    if(self) {
+        // room for the free list link, and every block on a cache line boundary
+        _blockSize = (MAX(blockSize, sizeof(void *)) + BASlabAlignment - 1) & ~(BASlabAlignment - 1);
+        _blocksPerSlab = blocksPerSlab;
+    }
+    return self;
+}
+
+- (void *)allocateBlock {
+
+    void *block = NULL;
+
+    @synchronized(self) {
+        if(_freeBlocks) {
+            block = _freeBlocks;
+            _freeBlocks = *(void **)block;
+        }
+        else {
+            if(0 == _unusedBlocks) {
+                void *slab = NULL;
+                if(_slabCount == _slabCapacity) {
+                    NSUInteger capacity = MAX(_slabCapacity * 2, 8);
+                    void **slabs = realloc(_slabs, capacity * sizeof(void *));
+                    if(!slabs)
+                        return NULL;
+                    _slabs = slabs;
+                    _slabCapacity = capacity;
+                }
+                if(posix_memalign(&slab, BASlabAlignment, _blocksPerSlab * _blockSize))
+                    return NULL;
+                _slabs[_slabCount++] = slab;
+                _unusedBlocks = _blocksPerSlab;
+            }
+            block = (char *)_slabs[_slabCount - 1] + (_blocksPerSlab - _unusedBlocks--) * _blockSize;
+        }
+        ++_allocatedBlocks;
+    }
+
+    // outside the lock; nobody else can see the block yet
+    return memset(block, 0, _blockSize);
+}
+
+- (void)freeBlock:(void *)block {
+    if(!block)
+        return;
+    @synchronized(self) {
+        NSAssert(_allocatedBlocks > 0, @"freeing a block which was not allocated");
+        *(void **)block = _freeBlocks;
+        _freeBlocks = block;
+        --_allocatedBlocks;
+    }
+}
+
+@end
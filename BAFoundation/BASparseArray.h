@@ -18,7 +18,7 @@ extern NSUInteger powersOf4[TABLE_SIZE];
 extern NSUInteger powersOf8[TABLE_SIZE];
 
 
-@class BASparseArray;
+@class BASparseArray, BASparseArrayFile, BASparseArrayPager, BASlabAllocator;
 
 
 typedef void  (^SparseArrayUpdate)(BASparseArray *sparseArray, NSUInteger index, void *newValue);
@@ -30,6 +30,18 @@ typedef void (^SparseArrayRefresh)(BASparseArray *sparseArray);
 // return YES to prune the given tree
 typedef BOOL (^SparseArrayWalk)(BASparseArray *sparseArray, NSIndexPath *indexPath, NSUInteger *offset);
 
+typedef NS_OPTIONS(NSUInteger, BASparseArrayVisitOrder) {
+    BASparseArrayVisitPreOrder  = 1 << 0, // a node before its children
+    BASparseArrayVisitPostOrder = 1 << 1, // a node after its children
+};
+
+/* <origin> is the co-ordinate of the first datum under <node>, one element per dimension, and is only
+ * valid during the call. <post> is YES for the post-order call. Return YES from the pre-order call
+ * to skip the node's children; the node still gets its post-order call. The result of the post-order
+ * call is ignored.
+ */
+typedef BOOL (^SparseArrayVisit)(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post);
+
 
 /* Leaf indexes for multi-dimensional arrays are numbered consistently following a recursive pattern.
  * Each leaf index is determined by its search order in the tree. As the tree grows, new leaves
@@ -98,21 +110,93 @@ typedef BOOL (^SparseArrayWalk)(BASparseArray *sparseArray, NSIndexPath *indexPa
  * where a partition is a combination of signed directions, one per axis. A 1-d aggregate array would need 2 sparse
  * arrays; a 2-d aggregate would need 4, etc.
  *
- * The aggregate representation is responsible for transforming the absolute coordinate space into a relative
- * coordinate space of positive values using mirroring and translation by 1 (-1 -> 0, -2 -> 1, -3 -> 2, etc).
+ * The aggregate representation (see BASignedSparseArray) is responsible for transforming the absolute coordinate
+ * space into a relative coordinate space of positive values using mirroring and translation by 1 (-1 -> 0, -2 -> 1,
+ * -3 -> 2, etc).
  * If transforming from a floating point co-ordinate space to an integer space, more care is needed.
  */
 
 
-extern NSUInteger LeafIndexFor2DCoordinates(NSUInteger x, NSUInteger y, NSUInteger base);
-extern void LeafCoordinatesForIndex2D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py);
+/* The leaf index is the Morton (Z-order) code of the leaf co-ordinates: bit b of co-ordinate i is bit
+ * (b * power + i) of the index. These spread the bits of a co-ordinate apart, and gather them back, in a
+ * fixed number of steps, with pdep/pext where BMI2 is available, or shifts and masks. A 64-bit index
+ * holds 32 bits of each 2D co-ordinate, and 21 bits of each 3D co-ordinate; higher bits are ignored.
+ */
 
-extern NSUInteger LeafIndexFor3DCoordinates(NSUInteger x, NSUInteger y, NSUInteger z, NSUInteger base);
-extern void LeafCoordinatesForIndex3D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py, NSUInteger *pz);
+#if defined(__BMI2__)
+#import <immintrin.h>
+#endif
 
+NS_INLINE uint64_t BAMortonSpread2(uint64_t x) {
+#if defined(__BMI2__)
+    return _pdep_u64(x, 0x5555555555555555ULL);
+#else
+    x &= 0x00000000FFFFFFFFULL;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2))  & 0x3333333333333333ULL;
+    x = (x | (x << 1))  & 0x5555555555555555ULL;
+    return x;
+#endif
+}
+
+NS_INLINE uint64_t BAMortonCompact2(uint64_t x) {
+#if defined(__BMI2__)
+    return _pext_u64(x, 0x5555555555555555ULL);
+#else
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1))  & 0x3333333333333333ULL;
+    x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4))  & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8))  & 0x0000FFFF0000FFFFULL;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+    return x;
+#endif
+}
+
+NS_INLINE uint64_t BAMortonSpread3(uint64_t x) {
+#if defined(__BMI2__)
+    return _pdep_u64(x, 0x1249249249249249ULL);
+#else
+    x &= 0x00000000001FFFFFULL;
+    x = (x | (x << 32)) & 0x001F00000000FFFFULL;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFULL;
+    x = (x | (x << 8))  & 0x100F00F00F00F00FULL;
+    x = (x | (x << 4))  & 0x10C30C30C30C30C3ULL;
+    x = (x | (x << 2))  & 0x1249249249249249ULL;
+    return x;
+#endif
+}
+
+NS_INLINE uint64_t BAMortonCompact3(uint64_t x) {
+#if defined(__BMI2__)
+    return _pext_u64(x, 0x1249249249249249ULL);
+#else
+    x &= 0x1249249249249249ULL;
+    x = (x | (x >> 2))  & 0x10C30C30C30C30C3ULL;
+    x = (x | (x >> 4))  & 0x100F00F00F00F00FULL;
+    x = (x | (x >> 8))  & 0x001F0000FF0000FFULL;
+    x = (x | (x >> 16)) & 0x001F00000000FFFFULL;
+    x = (x | (x >> 32)) & 0x00000000001FFFFFULL;
+    return x;
+#endif
+}
+
+// These take sample co-ordinates, and return the index of the leaf which contains them
+extern NSUInteger LeafIndexFor2DCoordinates(NSUInteger x, NSUInteger y, NSUInteger base);
+extern NSUInteger LeafIndexFor3DCoordinates(NSUInteger x, NSUInteger y, NSUInteger z, NSUInteger base);
 extern NSUInteger LeafIndexForCoordinates(NSUInteger *coords, NSUInteger base, NSUInteger power);
+
+// These return leaf co-ordinates (sample co-ordinates divided by base)
+extern void LeafCoordinatesForIndex2D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py);
+extern void LeafCoordinatesForIndex3D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py, NSUInteger *pz);
 extern void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUInteger power);
 
+// Batch versions; <coords> holds <count> points of <power> co-ordinates each, one point after another
+extern void LeafIndexesForCoordinates(const NSUInteger *coords, NSUInteger *indexes, NSUInteger count, NSUInteger base, NSUInteger power);
+extern void LeafCoordinatesForIndexes(const NSUInteger *indexes, NSUInteger *coords, NSUInteger count, NSUInteger power);
+
 inline NSUInteger LeafCoordinatesFromAbsolute3D(NSUInteger base, NSUInteger *x, NSUInteger *y, NSUInteger *z) {
     NSUInteger index = LeafIndexFor3DCoordinates(*x, *y, *z, base);
     *x = *x%base;
@@ -128,7 +212,7 @@ inline NSUInteger LeafCoordinatesFromAbsolute3D(NSUInteger base, NSUInteger *x,
     SparseArrayUpdate _updateBlock;
     SparseArrayRefresh _refreshBlock;
     
-    NSMutableArray *_children; // interior nodes
+    BASparseArray **_children; // interior nodes: <_scale> entries, NULL where no child has been made yet
     
     id _userObject;
     
@@ -141,6 +225,20 @@ inline NSUInteger LeafCoordinatesFromAbsolute3D(NSUInteger base, NSUInteger *x,
     NSUInteger _treeBase; // size of each dimension of the whole sub-tree: base * 2^level
     
     BOOL _enableArchiveCompression;
+    
+    BASlabAllocator *_slab; // where the leaves of the whole tree get their storage, or nil
+    
+    // leaves of an array which is saved in a file; see BASparseArrayFile.h
+    BASparseArrayFile *_file; // where the leaf was last saved, if anywhere
+    NSRange _payload;          // the leaf's storage in _file
+    BOOL _dirty;               // written since it was last saved
+    
+    // leaves of an array with a memory budget; see BASparseArrayPager.h
+    BASparseArrayPager *_pager; // shared by the whole tree, or nil
+    NSUInteger _lastUse;        // the pager's epoch when the leaf's storage was last asked for
+    NSUInteger _accesses;       // requests for the leaf's storage
+    NSUInteger _pins;           // callers using the leaf's storage, which is not evicted while there are any
+    BOOL _evicting;             // the pager is taking the leaf's storage away
 }
 
 @property (nonatomic, assign) BASparseArray *parent;
@@ -150,7 +248,7 @@ inline NSUInteger LeafCoordinatesFromAbsolute3D(NSUInteger base, NSUInteger *x,
 @property (nonatomic, copy) SparseArrayUpdate updateBlock;
 @property (nonatomic, copy) SparseArrayRefresh refreshBlock;
 
-@property (nonatomic, readonly) NSArray *children;
+@property (nonatomic, readonly) NSArray *children; // a new array, with NSNull for missing children
 
 @property (nonatomic, retain) id userObject; // If object adopts NSCoding, will be serialized
 
@@ -173,7 +271,20 @@ inline NSUInteger LeafCoordinatesFromAbsolute3D(NSUInteger base, NSUInteger *x,
 
 @property (nonatomic) BOOL enableArchiveCompression;
 
-- (void)walkChildren:(SparseArrayWalk)walkBlock;
+- (void)walkChildren:(SparseArrayWalk)walkBlock DEPRECATED_MSG_ATTRIBUTE("use -visitNodesWithOrder:block:");
+
+/* Visits the receiver and every node under it which has been made, depth first, in child index order.
+ * Origins are relative to the receiver, so they are absolute when it is the root. Nothing is allocated
+ * per node. Do not expand the tree during a visit.
+ */
+- (void)visitNodesWithOrder:(BASparseArrayVisitOrder)order block:(SparseArrayVisit)block;
+
+/* As above, but subtrees are visited on many threads at once, so the block must be thread-safe.
+ * The nodes near the top are visited on the calling thread: their pre-order calls come before, and
+ * their post-order calls after, those of the subtrees under them. Pruning one of them skips all of
+ * its subtrees. Returns when every node has been visited.
+ */
+- (void)visitNodesConcurrentlyWithOrder:(BASparseArrayVisitOrder)order block:(SparseArrayVisit)block;
 
 // The initial tree always has two levels (0 and 1)
 // The root, at level 1, has <scale> children, all leaves, each with <leafSize> storage
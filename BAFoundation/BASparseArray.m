@@ -17,211 +17,105 @@ NSUInteger powersOf4[TABLE_SIZE];
 NSUInteger powersOf8[TABLE_SIZE];
 
 
-#pragma mark - Private Functions
-
-/* The leaf index calculations first determine the maximum size of the hypercube containing the desired coordinates.
- * Then they divide that space into 2^power partitions, and determine in which of those partitions the point lies.
- *
- * Find the offset of the next child partition: the index of the child, from 0 to 2^power-1, multiplied by l^power,
- * the size of each child partition. Offset the coordinates to be relative to the child partition's first element,
- * then recursive call using the new coordinates and child size (half that of the parent).
- *
- * The index is a recursive sum which terminates when we cannot divide the children any more.
- */
+#pragma mark - Functions
 
-// Don't call recursive functions directly from class code
-static NSUInteger LeafIndex2DRecursive(NSUInteger x, NSUInteger y, NSUInteger l) {
-    
-    l /= 2;
-    
-    NSUInteger result = 0;
-    NSUInteger childIndex = 0;
-    
-    if(x >= l) {
-        x -= l; // or x%=l
-        ++childIndex;
-    }
-    if(y >= l) {
-        y -= l; // or y%=l
-        childIndex+=2;
-    }
-    
-    if(l > 1)
-        result = l*l*childIndex + LeafIndex2DRecursive(x, y, l);
-    else
-        result = childIndex;
-    
-    return result;
+// Each co-ordinate is divided by <base>, then bit b of co-ordinate i becomes bit (b * power + i)
+NSUInteger LeafIndexFor2DCoordinates(NSUInteger x, NSUInteger y, NSUInteger base) {
+    return (NSUInteger)(BAMortonSpread2(x / base) | (BAMortonSpread2(y / base) << 1));
 }
 
-static NSUInteger LeafIndex3DRecursive(NSUInteger x, NSUInteger y, NSUInteger z, NSUInteger l) {
-    
-    l /= 2;
-    
-    NSUInteger result = 0;
-    NSUInteger childIndex = 0;
-    
-    if(x >= l) {
-        x -= l; // or x%=l
-        ++childIndex;
-    }
-    if(y >= l) {
-        y -= l; // or y%=l
-        childIndex+=2;
-    }
-    if(z >= l) {
-        z -= l; // or z%=l
-        childIndex+=4;
-    }
-    
-    if(l > 1)
-        result = l*l*l*childIndex + LeafIndex3DRecursive(x, y, z, l);
-    else
-        result = childIndex;
-    
-    return result;
+void LeafCoordinatesForIndex2D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py) {
+    *px = (NSUInteger)BAMortonCompact2(leafIndex);
+    *py = (NSUInteger)BAMortonCompact2(leafIndex >> 1);
 }
 
-static NSUInteger LeafIndexRecursive(NSUInteger *coords, NSUInteger count, NSUInteger l) {
-    
-    l /= 2;
-    
-    NSUInteger result = 0;
-    NSUInteger childIndex = 0;
-    NSUInteger offset = 1;
-
-    for (NSUInteger i=0; i<count; ++i) {
-        if(coords[i] >= l) {
-            coords[i] -= l;
-            childIndex += offset;
-        }
-        offset += 2;
-    }
-    
-    if(l > 1)
-        result = (NSUInteger)powi(l, count)*childIndex + LeafIndexRecursive(coords, count, l);
-    else
-        result = childIndex;
-    
-    return result;
+NSUInteger LeafIndexFor3DCoordinates(NSUInteger x, NSUInteger y, NSUInteger z, NSUInteger base) {
+    return (NSUInteger)(BAMortonSpread3(x / base) | (BAMortonSpread3(y / base) << 1) | (BAMortonSpread3(z / base) << 2));
 }
 
-
-#pragma mark - Functions
-// This expects sample coordinates for x,y
-NSUInteger LeafIndexFor2DCoordinates(NSUInteger x, NSUInteger y, NSUInteger base) {
-    
-    // convert sample coordinates to leaf coordinates
-    x /= base;
-    y /= base;
-    
-    NSUInteger max = MAX(x,y);
-    
-    // provide a power of 2 that will fit the current value, so increment max so 1->2, 2->4, 4->8, etc
-    return (max == 0) ? 0 : LeafIndex2DRecursive(x, y, NextPowerOf2((uint32_t)max+1));
+void LeafCoordinatesForIndex3D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py, NSUInteger *pz) {
+    *px = (NSUInteger)BAMortonCompact3(leafIndex);
+    *py = (NSUInteger)BAMortonCompact3(leafIndex >> 1);
+    *pz = (NSUInteger)BAMortonCompact3(leafIndex >> 2);
 }
 
-// This is the reverse operation of LeafIndexFor2DCoordinates();
-// it's not used, so it's mostly to confirm I understand what's going on - at least theoretically
-void LeafCoordinatesForIndex2D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py) {
+// Other powers move one bit at a time
+NSUInteger LeafIndexForCoordinates(NSUInteger *coords, NSUInteger base, NSUInteger power) {
     
-	if(leafIndex == 0) {
-		*px = 0;
-		*py = 0;
-		return;
-	}
+    if(power == 1)
+        return coords[0] / base;
     
-    NSUInteger x = 0;
-    NSUInteger y = 0;
-    NSUInteger i = 1;
+    if(power == 2)
+        return LeafIndexFor2DCoordinates(coords[0], coords[1], base);
     
-    while (powersOf4[i] <= leafIndex && i < TABLE_SIZE) ++i;
+    if(power == 3)
+        return LeafIndexFor3DCoordinates(coords[0], coords[1], coords[2], base);
     
-    assert(powersOf4[i] > leafIndex);
+    NSUInteger index = 0;
     
-    while (i-- > 0) {
-        
-        NSUInteger c = powersOf4[i];
-        NSUInteger offset = leafIndex / c;
-        
-        if(offset & 0x02)
-            y += powersOf2[i];
-        if(offset & 0x01)
-            x += powersOf2[i];
-        
-        leafIndex %= c;
+    for(NSUInteger i=0; i<power && i<64; ++i) {
+        NSUInteger coord = coords[i] / base;
+        for (NSUInteger bit=i; bit<64 && coord; bit+=power, coord>>=1)
+            index |= (NSUInteger)(coord & 1) << bit;
     }
     
-    *px = x;
-    *py = y;
-}
-
-NSUInteger LeafIndexFor3DCoordinates(NSUInteger x, NSUInteger y, NSUInteger z, NSUInteger base) {
-    
-    // convert sample coordinates to leaf coordinates
-    x /= base;
-    y /= base;
-    z /= base;
-    
-    NSUInteger max = MAX(MAX(x,y), z);
-    
-    // provide a power of 2 that will fit the current value, so increment max so 1->2, 2->4, 4->8, etc
-    return (max == 0) ? 0 : LeafIndex3DRecursive(x, y, z, NextPowerOf2((uint32_t)max+1));
+    return index;
 }
 
-// As with the 2D equivalent, this is not used, just important to understand
-void LeafCoordinatesForIndex3D(NSUInteger leafIndex, NSUInteger *px, NSUInteger *py, NSUInteger *pz) {
-    
-    if(leafIndex < 1) return;
+void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUInteger power) {
     
-    NSUInteger x = 0, y = 0, z = 0;
-    NSUInteger i = 1;
+    if(power == 1) {
+        coords[0] = leafIndex;
+        return;
+    }
     
-    while (powersOf4[i] <= leafIndex) ++i;
+    if(power == 2) {
+        LeafCoordinatesForIndex2D(leafIndex, coords, coords + 1);
+        return;
+    }
     
-    while (i-- > 0) {
-        
-        NSUInteger c = powersOf8[i];
-        NSUInteger offset = leafIndex / c;
-        
-        if(offset & 0x04)
-            z += powersOf2[i];
-        if(offset & 0x02)
-            y += powersOf2[i];
-        if(offset & 0x01)
-            x += powersOf2[i];
-        
-        leafIndex %= c;
+    if(power == 3) {
+        LeafCoordinatesForIndex3D(leafIndex, coords, coords + 1, coords + 2);
+        return;
     }
     
-    *px = x;
-    *py = y;
-    *pz = z;
+    for(NSUInteger i=0; i<power; ++i) {
+        NSUInteger coord = 0;
+        for (NSUInteger bit=i, shift=0; bit<64; bit+=power, ++shift)
+            coord |= ((leafIndex >> bit) & 1) << shift;
+        coords[i] = coord;
+    }
 }
 
-NSUInteger LeafIndexForCoordinates(NSUInteger *coords, NSUInteger base, NSUInteger power) {
-    
-    if(power == 2)
-        return LeafIndexFor2DCoordinates(coords[0], coords[1], base);
+void LeafIndexesForCoordinates(const NSUInteger *coords, NSUInteger *indexes, NSUInteger count, NSUInteger base, NSUInteger power) {
     
-    if(power == 3)
-        return LeafIndexFor3DCoordinates(coords[0], coords[1], coords[2], base);
-    
-    NSUInteger max = 0;
-    
-    for(NSUInteger i=0; i<power; ++i) {
-        max = MAX(max, coords[i]);
-        coords[i]/=base;
+    if(power == 2) {
+        for (NSUInteger i=0; i<count; ++i, coords+=2)
+            indexes[i] = LeafIndexFor2DCoordinates(coords[0], coords[1], base);
+    }
+    else if(power == 3) {
+        for (NSUInteger i=0; i<count; ++i, coords+=3)
+            indexes[i] = LeafIndexFor3DCoordinates(coords[0], coords[1], coords[2], base);
+    }
+    else {
+        for (NSUInteger i=0; i<count; ++i, coords+=power)
+            indexes[i] = LeafIndexForCoordinates((NSUInteger *)coords, base, power);
     }
-    
-    return max == 0 ? 0 : LeafIndexRecursive(coords, power, NextPowerOf2((uint32_t)max+1));
 }
 
-void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUInteger power) {
-    // TODO:
+void LeafCoordinatesForIndexes(const NSUInteger *indexes, NSUInteger *coords, NSUInteger count, NSUInteger power) {
+    for (NSUInteger i=0; i<count; ++i, coords+=power)
+        LeafCoordinatesForIndex(indexes[i], coords, power);
 }
 
 
+// A node on the stack of a visit
+typedef struct {
+    BASparseArray *node;
+    NSUInteger next; // the next child to look at; <scale> when there are none left
+} BAVisitFrame;
+
+
 @implementation BASparseArray
 
 #pragma mark - Properties
@@ -231,8 +125,6 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
 @synthesize updateBlock=_updateBlock;
 @synthesize refreshBlock=_refreshBlock;
 
-@synthesize children=_children;
-
 @synthesize userObject=_userObject;
 
 @synthesize base=_base;
@@ -264,11 +156,8 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
         _treeBase = _base * powi(2, _level);
         _treeSize = _leafSize << (_level * _power);
         
-        if(_level > 0) {
-            _children = [[NSMutableArray alloc] init];
-            for (NSUInteger i=0; i<_scale; ++i)
-                [_children addObject:[NSNull null]];
-        }
+        if(_level > 0)
+            _children = calloc(_scale, sizeof(BASparseArray *));
     }
     
     return self;
@@ -281,7 +170,7 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     if(self) {
 		_index = index;
 		child.parent = self;
-        [_children replaceObjectAtIndex:index withObject:child];
+        _children[index] = [child retain];
     }
     return self;
 }
@@ -291,6 +180,8 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
 	if (self) {
 		_index = index;
 		_parent = parent;
+		_slab = [parent->_slab retain];
+		_pager = [parent->_pager retain];
 	}
 	return self;
 }
@@ -325,26 +216,22 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     NSAssert(index < _scale, @"child index calculation error; no child with index %u", (unsigned)index);
     NSAssert(_children, @"No children!");
     
-	BASparseArray *child;
-	BOOL enlarged = NO;
+    // Children are never removed, so a child once published can be read without locking
+	BASparseArray *child = __atomic_load_n(_children + index, __ATOMIC_ACQUIRE);
+	
+	if(child || !create)
+		return child;
 	
-	@synchronized(_children) {
-		child = [_children objectAtIndex:index];
+	// Racing creators each make a child; the first to swap it in wins, and the others use the winner
+	BASparseArray *winner = nil;
 	
-		if((id)child == [NSNull null]) {
-			if(create) {
-				child = [[[self class] alloc] initWithParent:self index:self.offset + index];
-				[_children replaceObjectAtIndex:index withObject:child];
-				[child release];
-				enlarged = YES;
-			}
-			else {
-				child = nil;
-			}
-		}
+	child = [[[self class] alloc] initWithParent:self index:self.offset + index];
+	if(!__atomic_compare_exchange_n(_children + index, &winner, child, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		[child release];
+		return winner;
 	}
 	
-	if(enlarged && _enlargeBlock) {
+	if(_enlargeBlock) {
 		_enlargeBlock(self, index);
 	}
 	
@@ -363,7 +250,7 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     
     NSUInteger size = _treeSize >> _power;
     NSUInteger childIndex = storageIndex / size;
-    BASparseArray *child = [self childAtIndex:childIndex create:YES];
+    BASparseArray *child = __atomic_load_n(_children + childIndex, __ATOMIC_ACQUIRE) ?: [self childAtIndex:childIndex create:YES];
     
     if(pOffset)
         *pOffset = size*childIndex;
@@ -371,26 +258,101 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     return child;
 }
 
+// dispatch_apply runs some of the children on the calling thread, and returns when they are all done
 - (void)initializeChildren:(void (^)(BASparseArray *child))initializeBlock {
     
-    dispatch_group_t group = dispatch_group_create();
-    NSUInteger count = [_children count];
+    if(!initializeBlock)
+        return;
     
-    for(NSUInteger i=0; i<count; ++i) {
-        
-        BASparseArray *child = [self childAtIndex:i];
-        
-        dispatch_group_enter(group);
-        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-//            if(setBits) [child setAll]; else [child clearAll];
-            if(initializeBlock)
-                initializeBlock(child);
-            dispatch_group_leave(group);
-        });
+    dispatch_apply(_scale, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        initializeBlock([self childAtIndex:i]);
+    });
+}
+
+// One frame and one origin per level; the stack is never deeper than the receiver is high
+- (void)visitNodesFromOrigin:(const NSUInteger *)rootOrigin order:(BASparseArrayVisitOrder)order block:(SparseArrayVisit)block {
+
+    BAVisitFrame stack[_level + 1];
+    NSUInteger origins[(_level + 1) * _power];
+    NSUInteger count = 0;
+    NSUInteger childIndex = 0;
+    BASparseArray *next = self;
+
+    for (;;) {
+
+        if(next) {
+
+            NSUInteger *origin = origins + count * _power;
+
+            if(count) {
+                // bit j of the child index is the half it occupies along axis j
+                NSUInteger *parentOrigin = origin - _power;
+                NSUInteger childBase = stack[count - 1].node->_treeBase >> 1;
+                for (NSUInteger j=0; j<_power; ++j)
+                    origin[j] = parentOrigin[j] + ((childIndex >> j) & 1) * childBase;
+            }
+            else {
+                memcpy(origin, rootOrigin, _power * sizeof(NSUInteger));
+            }
+
+            BOOL prune = (order & BASparseArrayVisitPreOrder) && block(next, origin, next->_level, NO);
+
+            stack[count].node = next;
+            stack[count].next = prune || 0 == next->_level ? _scale : 0;
+            ++count;
+            next = nil;
+        }
+
+        if(0 == count)
+            break;
+
+        BAVisitFrame *frame = stack + count - 1;
+
+        while(!next && frame->next < _scale) {
+            childIndex = frame->next++;
+            next = __atomic_load_n(frame->node->_children + childIndex, __ATOMIC_ACQUIRE);
+        }
+
+        if(next)
+            continue;
+
+        if(order & BASparseArrayVisitPostOrder)
+            block(frame->node, origins + (count - 1) * _power, frame->node->_level, YES);
+        --count;
     }
-    
-    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
-    dispatch_release(group);
+}
+
+- (void)setFile:(BASparseArrayFile *)file payload:(NSRange)payload {
+    if(file != _file) {
+        [_file release];
+        _file = [file retain];
+    }
+    _payload = payload;
+    _dirty = NO;
+}
+
+- (void)loadFromFile:(BASparseArrayFile *)file payload:(NSRange)payload population:(NSUInteger)population {
+    [self setFile:file payload:payload];
+}
+
+- (NSData *)leafPayload {
+    return nil;
+}
+
+- (NSData *)payloadForStorage:(id)storage {
+    return nil;
+}
+
+- (id)residentStorage {
+    return nil;
+}
+
+- (id)takeResidentStorage {
+    return nil;
+}
+
+- (NSUInteger)storageBytes {
+    return 0;
 }
 
 #pragma mark - Derived Accessors
@@ -399,6 +361,19 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
 	return _scale * _index;
 }
 
+- (NSArray *)children {
+    
+    if(!_children)
+        return nil;
+    
+    NSMutableArray *children = [NSMutableArray arrayWithCapacity:_scale];
+    
+    for (NSUInteger i=0; i<_scale; ++i)
+        [children addObject:_children[i] ?: (id)[NSNull null]];
+    
+    return children;
+}
+
 #pragma mark - NSObject
 
 - (void)dealloc {
@@ -408,7 +383,15 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     self.updateBlock = nil;
     self.refreshBlock = nil;
     self.userObject = nil;
-    [_children release], _children = nil;
+    [_file release], _file = nil;
+    [_slab release], _slab = nil;
+    [_pager nodeWillDeallocate:self];
+    [_pager release], _pager = nil;
+    if(_children) {
+        for (NSUInteger i=0; i<_scale; ++i)
+            [_children[i] release];
+        free(_children), _children = NULL;
+    }
     [super dealloc];
 }
 
@@ -446,7 +429,19 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
         _leafSize = [aDecoder decodeIntegerForKey:@"leafSize"];
         _treeSize = [aDecoder decodeIntegerForKey:@"treeSize"];
         _treeBase = [aDecoder decodeIntegerForKey:@"treeBase"];
-        _children = [[aDecoder decodeObjectForKey:@"children"] retain];
+        
+        // archived as an array, with NSNull for missing children
+        NSArray *children = [aDecoder decodeObjectForKey:@"children"];
+        if(_level > 0) {
+            _children = calloc(_scale, sizeof(BASparseArray *));
+            for (NSUInteger i=0; i<_scale && i<[children count]; ++i) {
+                BASparseArray *child = [children objectAtIndex:i];
+                if((id)child != [NSNull null]) {
+                    _children[i] = [child retain];
+                    child.parent = self;
+                }
+            }
+        }
         _userObject = [[aDecoder decodeObjectForKey:@"userObject"] retain];
     }
     return self;
@@ -461,7 +456,7 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     [aCoder encodeInteger:_leafSize forKey:@"leafSize"];
     [aCoder encodeInteger:_treeSize forKey:@"treeSize"];
     [aCoder encodeInteger:_treeBase forKey:@"treeBase"];
-	[aCoder encodeObject:_children forKey:@"children"];
+	[aCoder encodeObject:[self children] forKey:@"children"];
     if ([_userObject conformsToProtocol:@protocol(NSCoding)]) {
         [aCoder encodeObject:_userObject forKey:@"userObject"];
     }
@@ -475,24 +470,89 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     if(walkBlock(self, indexPath, offset) || 0 == _level)
         return;
 
-    NSUInteger *childOffset = calloc(sizeof(NSUInteger), _power);
-    NSUInteger i=0;
+    NSUInteger childOffset[_power];
+    NSUInteger childBase = _treeBase >> 1;
     
-    for (id child in self.children) {
-        if(child != [NSNull null]) {
-            for (NSUInteger j=0; i<_power; ++i)
-                childOffset[j] = offset[j] + _treeBase*(i&(1<<j));
-            [child recursiveWalkChildren:walkBlock indexPath:[indexPath indexPathByAddingIndex:i] offset:childOffset];
-        }
-        ++i;
+    for (NSUInteger i=0; i<_scale; ++i) {
+        if(!_children[i])
+            continue;
+        // bit j of the child index is the half it occupies along axis j
+        for (NSUInteger j=0; j<_power; ++j)
+            childOffset[j] = offset[j] + ((i >> j) & 1) * childBase;
+        [_children[i] recursiveWalkChildren:walkBlock indexPath:[indexPath indexPathByAddingIndex:i] offset:childOffset];
     }
-    
-    free(childOffset);
 }
 
 - (void)walkChildren:(SparseArrayWalk)walkBlock {
-    NSUInteger *offset = calloc(sizeof(NSUInteger), _power);
-    [self recursiveWalkChildren:walkBlock indexPath:[[NSIndexPath alloc] init] offset:offset];
+    NSUInteger offset[_power];
+    memset(offset, 0, sizeof(offset));
+    [self recursiveWalkChildren:walkBlock indexPath:[[[NSIndexPath alloc] init] autorelease] offset:offset];
+}
+
+- (void)visitNodesWithOrder:(BASparseArrayVisitOrder)order block:(SparseArrayVisit)block {
+    NSUInteger origin[_power];
+    memset(origin, 0, sizeof(origin));
+    [self visitNodesFromOrigin:origin order:order block:block];
+}
+
+// The top <depth> levels are visited here, and the subtrees under them, several per thread, by dispatch_apply
+- (void)visitNodesConcurrentlyWithOrder:(BASparseArrayVisitOrder)order block:(SparseArrayVisit)block {
+
+    NSUInteger subtreeCount = 1;
+    NSUInteger depth = 0;
+    NSUInteger wanted = [[NSProcessInfo processInfo] activeProcessorCount] * 4;
+
+    while(subtreeCount < wanted && depth < _level) {
+        subtreeCount *= _scale;
+        ++depth;
+    }
+
+    if(0 == depth) {
+        [self visitNodesWithOrder:order block:block];
+        return;
+    }
+
+    // each entry is a node followed by its origin
+    NSUInteger frontier = _level - depth;
+    NSUInteger power = _power;
+    NSUInteger entrySize = sizeof(BASparseArray *) + power * sizeof(NSUInteger);
+    NSMutableData *subtrees = [NSMutableData data];
+    NSMutableData *posts = [NSMutableData data];
+    NSUInteger origin[_power];
+
+    memset(origin, 0, sizeof(origin));
+    [self visitNodesFromOrigin:origin order:BASparseArrayVisitPreOrder|BASparseArrayVisitPostOrder block:^BOOL(BASparseArray *node, const NSUInteger *nodeOrigin, NSUInteger level, BOOL post) {
+        if(level == frontier) {
+            if(!post) {
+                [subtrees appendBytes:&node length:sizeof(BASparseArray *)];
+                [subtrees appendBytes:nodeOrigin length:power * sizeof(NSUInteger)];
+            }
+            return YES;
+        }
+        if(post) {
+            if(order & BASparseArrayVisitPostOrder) {
+                [posts appendBytes:&node length:sizeof(BASparseArray *)];
+                [posts appendBytes:nodeOrigin length:power * sizeof(NSUInteger)];
+            }
+            return NO;
+        }
+        return (order & BASparseArrayVisitPreOrder) && block(node, nodeOrigin, level, NO);
+    }];
+
+    const char *entries = [subtrees bytes];
+
+    dispatch_apply([subtrees length] / entrySize, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        const char *entry = entries + i * entrySize;
+        BASparseArray *node = *(BASparseArray * const *)entry;
+        [node visitNodesFromOrigin:(const NSUInteger *)(entry + sizeof(BASparseArray *)) order:order block:block];
+    });
+
+    // already in post order
+    entries = [posts bytes];
+    for (NSUInteger i=0, count=[posts length] / entrySize; i<count; ++i, entries+=entrySize) {
+        BASparseArray *node = *(BASparseArray * const *)entries;
+        block(node, (const NSUInteger *)(entries + sizeof(BASparseArray *)), node->_level, YES);
+    }
 }
 
 - (id)initWithBase:(NSUInteger)base power:(NSUInteger)power {
@@ -503,18 +563,15 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
 	
 	BASparseArray *newChild = [[[[self class] alloc] initWithParent:self index:self.offset] autorelease];
 	
-	// Change our now grandchildren's parent to be our new child
-	for (BASparseArray *child in _children) {
-		if ((id)child != [NSNull null]) {
-			child.parent = newChild;
-		}
-	}
+	// Change our now grandchildren's parent to be our new child; a root which was a leaf has none
+	for (NSUInteger i=0; _children && i<_scale; ++i)
+		_children[i].parent = newChild;
+	free(newChild->_children);
 	newChild->_children = _children;
 	
 	// Create new children with new child at index 0
-	_children = [[NSMutableArray alloc] initWithObjects:newChild, nil];
-	for (NSUInteger i=1; i<_scale; ++i)
-		[_children addObject:[NSNull null]];
+	_children = calloc(_scale, sizeof(BASparseArray *));
+	_children[0] = [newChild retain];
 }
 
 - (void)expandToFitSize:(NSUInteger)newTreeSize {
@@ -551,24 +608,33 @@ void LeafCoordinatesForIndex(NSUInteger leafIndex, NSUInteger *coords, NSUIntege
     return [child leafForIndex:index%childLeafCount];
 }
 
+// A loop rather than recursion; each level is a pointer load unless the child has to be made
 - (BASparseArray *)leafForStorageIndex:(NSUInteger)index offset:(NSUInteger *)pOffset {
     
+    BASparseArray *node = self;
     NSUInteger offset = 0;
-    BASparseArray *child = [self childForStorageIndex:index offset:&offset];
     
-    NSAssert(index >= offset, @"offset calculation error.");
+    while(node->_level) {
+        
+        NSUInteger size = node->_treeSize >> node->_power;
+        NSUInteger childIndex = (index - offset) / size;
+        BASparseArray *child = __atomic_load_n(node->_children + childIndex, __ATOMIC_ACQUIRE);
+        
+        NSAssert(childIndex < node->_scale, @"child index calculation error; no child with index %u", (unsigned)childIndex);
+        
+        if(!child)
+            child = [node childAtIndex:childIndex create:YES];
+        
+        offset += size * childIndex;
+        node = child;
+    }
     
-//    if(child->_level == 0)
-//        return child;
-    if(child == self)
-        return self;
+    NSAssert(index - offset < _leafSize, @"node traversal error; locating child for bit %tu", index);
     
     if(pOffset)
         *pOffset += offset;
-    else
-        pOffset = &offset;
     
-    return [child leafForStorageIndex:index-offset offset:pOffset];
+    return node;
 }
 
 @end
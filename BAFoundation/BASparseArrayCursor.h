@@ -0,0 +1,98 @@
+//
+//  BASparseArrayCursor.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-13.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+
+/**
+ * A cursor remembers the last leaf it visited in a sparse array, and the path from the root down to it.
+ *
+ * An access which falls in the same leaf as the one before it goes straight to the leaf's storage. Any
+ * other access climbs the cached path only as far as the lowest node which contains the new index, and
+ * walks down from there, so scanlines and neighbourhoods touch the tree about once per leaf.
+ *
+ * Leaves are never removed and their storage indexes do not change when the tree grows, so a cursor stays
+ * valid for the life of its array. A cursor is not thread-safe; make one for each thread.
+ *
+ * Reads through a cursor do not create leaves. A missing leaf reads as clear bits or zeroed samples.
+ *
+ * The leaf a cursor is on is pinned (see BASparseArrayPager.h), so its storage stays in memory until the
+ * cursor moves on or is released.
+ */
+
+@interface BASparseArrayCursor : NSObject {
+    BASparseArray *_array;
+    BASparseArray *_leaf;
+    NSUInteger _base;
+    NSUInteger _power;
+    NSUInteger _leafOffset;
+    NSUInteger _leafSize;  // zero until a leaf is found
+    NSUInteger _depth;     // number of nodes in the path; the root is first
+    BASparseArray *_path[sizeof(NSUInteger) * 8 + 1];
+    NSUInteger _offsets[sizeof(NSUInteger) * 8 + 1];
+}
+
+@property (nonatomic, readonly) BASparseArray *array;
+@property (nonatomic, readonly) BASparseArray *leaf;
+@property (nonatomic, readonly) NSRange leafRange; // storage indexes of the current leaf
+
+- (id)initWithSparseArray:(BASparseArray *)array;
+
+// Same as -[BASparseArray leafForStorageIndex:offset:], but starts from the last leaf visited; when
+// create is NO, returns nil if there is no leaf at that index yet
+- (BASparseArray *)leafForStorageIndex:(NSUInteger)index offset:(NSUInteger *)pOffset create:(BOOL)create;
+
+// Called when the cursor moves to another leaf; subclasses cache the leaf's storage here
+- (void)didMoveToLeaf:(BASparseArray *)leaf;
+
+@end
+
+
+@interface BASparseBitArrayCursor : BASparseArrayCursor {
+    id<BABitArray2D> _bits;
+}
+
+- (BOOL)bit:(NSUInteger)index;
+- (void)setBit:(NSUInteger)index;
+- (void)clearBit:(NSUInteger)index;
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y;
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y;
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y;
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z;
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z;
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z;
+
+@end
+
+
+@interface BASparseSampleArrayCursor : BASparseArrayCursor {
+    BASampleArray *_samples;
+    UInt8 *_buffer;
+    NSUInteger _sampleSize;
+}
+
+- (void)sample:(UInt8 *)sample atIndex:(NSUInteger)index;
+- (void)setSample:(UInt8 *)sample atIndex:(NSUInteger)index;
+
+- (void)sample:(UInt8 *)sample atCoordinates:(NSUInteger *)coordinates;
+- (void)setSample:(UInt8 *)sample atCoordinates:(NSUInteger *)coordinates;
+
+@end
+
+
+@interface BASparseBitArray (Cursors)
+- (BASparseBitArrayCursor *)cursor;
+@end
+
+
+@interface BASparseSampleArray (Cursors)
+- (BASparseSampleArrayCursor *)cursor;
+@end
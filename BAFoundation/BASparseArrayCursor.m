@@ -0,0 +1,273 @@
+//
+//  BASparseArrayCursor.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-13.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArrayCursor.h>
+
+#import "BASparseArrayPrivate.h"
+
+
+@implementation BASparseArrayCursor
+
+@synthesize array=_array, leaf=_leaf;
+
+#pragma mark - Accessors
+
+- (NSRange)leafRange {
+    return NSMakeRange(_leafOffset, _leafSize);
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_leaf unpinStorage], _leaf = nil;
+    [_array release], _array = nil;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayCursor
+
+- (id)initWithSparseArray:(BASparseArray *)array {
+    self = [super init];
+    if(self) {
+        _array = [array retain];
+        _base = array.base;
+        _power = array.power;
+        _path[0] = array;
+        _depth = 1;
+    }
+    return self;
+}
+
+- (BASparseArray *)leafForStorageIndex:(NSUInteger)index offset:(NSUInteger *)pOffset create:(BOOL)create {
+
+    if(index - _leafOffset < _leafSize) {
+        if(pOffset)
+            *pOffset = _leafOffset;
+        return _leaf;
+    }
+
+    if(index >= _array.treeSize) {
+        if(!create)
+            return nil;
+        [_array expandToFitSize:index+1];
+    }
+
+    // Climb to the lowest node on the path which holds the index. If the tree has grown since the path
+    // was cached, the nodes below the root are no longer its direct descendants, but they still hold
+    // the same storage indexes, which is all that matters here.
+    NSUInteger depth = _depth;
+
+    while(depth > 1 && index - _offsets[depth-1] >= _path[depth-1].treeSize)
+        --depth;
+
+    BASparseArray *node = _path[depth-1];
+    NSUInteger offset = _offsets[depth-1];
+
+    while(node.level) {
+
+        NSUInteger size = node.treeSize >> _power;
+        NSUInteger childIndex = (index - offset) / size;
+        BASparseArray *child = [node childAtIndex:childIndex create:create];
+
+        if(!child)
+            break;
+
+        offset += size * childIndex;
+        node = child;
+
+        _path[depth] = node;
+        _offsets[depth] = offset;
+        ++depth;
+    }
+
+    _depth = depth;
+
+    // the cached leaf, if any, is still good
+    if(node.level)
+        return nil;
+
+    // the leaf's storage is cached by subclasses, so the leaf stays pinned while the cursor is on it
+    if(node != _leaf) {
+        [node pinStorage];
+        [_leaf unpinStorage];
+    }
+
+    _leaf = node;
+    _leafOffset = offset;
+    _leafSize = node.leafSize;
+    [self didMoveToLeaf:node];
+
+    if(pOffset)
+        *pOffset = offset;
+
+    return node;
+}
+
+- (void)didMoveToLeaf:(BASparseArray *)leaf {
+}
+
+@end
+
+
+@implementation BASparseBitArrayCursor
+
+#pragma mark - Private
+
+- (void)updateBit:(NSUInteger)index set:(BOOL)setBit {
+
+    if(index - _leafOffset >= _leafSize)
+        [self leafForStorageIndex:index offset:NULL create:YES];
+
+    SparseArrayUpdate updateBlock = _leaf.updateBlock;
+    NSUInteger count = [_bits count];
+
+    index -= _leafOffset;
+    if(setBit)
+        [_bits setBit:index];
+    else
+        [_bits clearBit:index];
+    [(BASparseBitArray *)_leaf didWriteBits:(NSInteger)([_bits count] - count)];
+    if(updateBlock)
+        updateBlock(_leaf, index, (void *)&setBit);
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_bits release], _bits = nil;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayCursor
+
+- (void)didMoveToLeaf:(BASparseArray *)leaf {
+    [_bits release];
+    _bits = [[(BASparseBitArray *)leaf bits] retain];
+}
+
+#pragma mark - BASparseBitArrayCursor
+
+- (BOOL)bit:(NSUInteger)index {
+    if(index - _leafOffset >= _leafSize && ![self leafForStorageIndex:index offset:NULL create:NO])
+        return NO;
+    return [_bits bit:index - _leafOffset];
+}
+
+- (void)setBit:(NSUInteger)index {
+    [self updateBit:index set:YES];
+}
+
+- (void)clearBit:(NSUInteger)index {
+    [self updateBit:index set:NO];
+}
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y {
+    return [self bit:StorageIndexFor2DCoordinates(x, y, _base)];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    [self updateBit:StorageIndexFor2DCoordinates(x, y, _base) set:YES];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y {
+    [self updateBit:StorageIndexFor2DCoordinates(x, y, _base) set:NO];
+}
+
+- (BOOL)bitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    return [self bit:StorageIndexFor3DCoordinates(x, y, z, _base)];
+}
+
+- (void)setBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self updateBit:StorageIndexFor3DCoordinates(x, y, z, _base) set:YES];
+}
+
+- (void)clearBitAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
+    [self updateBit:StorageIndexFor3DCoordinates(x, y, z, _base) set:NO];
+}
+
+@end
+
+
+@implementation BASparseSampleArrayCursor
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_samples release], _samples = nil;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayCursor
+
+- (id)initWithSparseArray:(BASparseArray *)array {
+    self = [super initWithSparseArray:array];
+    if(self) {
+        _sampleSize = [(BASparseSampleArray *)array size];
+    }
+    return self;
+}
+
+// Sample arrays never reallocate, so the leaf's buffer can be used directly
+- (void)didMoveToLeaf:(BASparseArray *)leaf {
+    [_samples release];
+    _samples = [[(BASparseSampleArray *)leaf samples] retain];
+    _buffer = _samples.samples;
+}
+
+#pragma mark - BASparseSampleArrayCursor
+
+- (void)sample:(UInt8 *)sample atIndex:(NSUInteger)index {
+    if(index - _leafOffset >= _leafSize && ![self leafForStorageIndex:index offset:NULL create:NO]) {
+        memset(sample, 0, _sampleSize);
+        return;
+    }
+    memcpy(sample, _buffer + (index - _leafOffset) * _sampleSize, _sampleSize);
+}
+
+- (void)setSample:(UInt8 *)sample atIndex:(NSUInteger)index {
+
+    if(index - _leafOffset >= _leafSize)
+        [self leafForStorageIndex:index offset:NULL create:YES];
+
+    SparseArrayUpdate updateBlock = _array.updateBlock;
+
+    index -= _leafOffset;
+    memcpy(_buffer + index * _sampleSize, sample, _sampleSize);
+    [(BASparseSampleArray *)_leaf didWriteSamples];
+
+    if(updateBlock)
+        updateBlock(_array, index, sample);
+}
+
+- (void)sample:(UInt8 *)sample atCoordinates:(NSUInteger *)coordinates {
+    [self sample:sample atIndex:StorageIndexForCoordinates(coordinates, _base, _power)];
+}
+
+- (void)setSample:(UInt8 *)sample atCoordinates:(NSUInteger *)coordinates {
+    [self setSample:sample atIndex:StorageIndexForCoordinates(coordinates, _base, _power)];
+}
+
+@end
+
+
+@implementation BASparseBitArray (Cursors)
+
+- (BASparseBitArrayCursor *)cursor {
+    return [[[BASparseBitArrayCursor alloc] initWithSparseArray:self] autorelease];
+}
+
+@end
+
+
+@implementation BASparseSampleArray (Cursors)
+
+- (BASparseSampleArrayCursor *)cursor {
+    return [[[BASparseSampleArrayCursor alloc] initWithSparseArray:self] autorelease];
+}
+
+@end
@@ -0,0 +1,60 @@
+//
+//  BASparseArrayFile.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-15.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArray.h>
+
+
+/**
+ * A file which holds a sparse bit or sample array, read through a memory map.
+ *
+ * The file has a header, the leaf payloads, and a leaf index, in native byte order:
+ *
+ *   header   what kind of array it is, its base, power and depth, and where the index is
+ *   payloads the storage of each leaf, compressed on its own, each starting on a 64 byte boundary
+ *   index    the storage offset, population and payload location of each leaf, in storage order
+ *
+ * Interior nodes are not saved; opening a file makes them from the storage offsets in the index. Leaves
+ * which were never written are not saved either. A leaf loads its payload the first time its storage
+ * is needed, so opening a file costs about the same as reading its index, however big the array is.
+ *
+ * Saving changes appends the payloads of the leaves written since the last save, and a new index, then
+ * points the header at it. The space held by the old payloads is only reclaimed by writing the array to
+ * a new file; writing to the file the array was read from fails. Saving and writing must not overlap any
+ * other use of the array.
+ */
+
+@interface BASparseArrayFile : NSObject {
+    NSURL *_url;
+    int _descriptor;
+    void *_map;
+    NSUInteger _mapLength;
+    NSUInteger _length; // where the next payload goes
+}
+
+@property (nonatomic, readonly) NSURL *url;
+
+- (id)initWithURL:(NSURL *)url create:(BOOL)create error:(NSError **)error;
+
+@end
+
+
+@interface BASparseArray (FileStorage)
+
+// The file which the array was read from or last written to
+@property (nonatomic, readonly) BASparseArrayFile *file;
+
+// A BASparseBitArray or BASparseSampleArray, depending on what the file holds; no leaves are loaded
++ (id)sparseArrayWithContentsOfURL:(NSURL *)url error:(NSError **)error;
+
+// Writes every leaf to a new file, which the array then saves its changes to
+- (BOOL)writeToURL:(NSURL *)url error:(NSError **)error;
+
+// Writes the leaves which changed since the last save to the array's file
+- (BOOL)saveChanges:(NSError **)error;
+
+@end
@@ -0,0 +1,472 @@
+//
+//  BASparseArrayFile.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-15.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArrayFile.h>
+
+#import "BASparseArrayPrivate.h"
+#import <BAFoundation/NSData+GZip.h>
+
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+
+static const char BASparseFileMagic[4] = { 'B', 'A', 'S', 'A' };
+static const uint32_t BASparseFileVersion = 1;
+
+// Payloads and the index start on this boundary
+static const NSUInteger BASparseFileAlignment = 64;
+
+enum {
+    BASparseFileBits = 0,
+    BASparseFileSamples = 1,
+};
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t sampleSize;    // bytes per sample, for sample arrays
+    uint64_t base;
+    uint64_t power;
+    uint64_t level;         // of the root
+    uint64_t leafCount;
+    uint64_t indexLocation; // from the start of the file
+} BASparseFileHeader;
+
+typedef struct {
+    uint64_t offset;     // storage index of the leaf's first bit or sample
+    uint64_t population; // set bits, for bit arrays
+    uint64_t location;   // of the compressed payload, from the start of the file
+    uint64_t length;
+} BASparseFileLeaf;
+
+
+static NSError *POSIXError(NSURL *url) {
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSURLErrorKey : url }];
+}
+
+static NSError *CorruptFileError(NSURL *url) {
+    return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{ NSURLErrorKey : url }];
+}
+
+// The tree size for a header, or zero if it would not fit in an NSUInteger
+static NSUInteger TreeSizeForHeader(const BASparseFileHeader *header) {
+
+    NSUInteger size = 1;
+
+    for (NSUInteger i=0; i<header->power; ++i) {
+        if(size > NSUIntegerMax / header->base)
+            return 0;
+        size *= header->base;
+    }
+    for (NSUInteger i=0; i<header->level; ++i) {
+        if(size > NSUIntegerMax >> header->power)
+            return 0;
+        size <<= header->power;
+    }
+
+    return size;
+}
+
+// Leaves in storage order, with the storage index of the first datum of each
+static void GatherLeaves(BASparseArray *node, NSUInteger offset, NSMutableArray *leaves, NSMutableData *offsets) {
+
+    if(0 == node.level) {
+        [leaves addObject:node];
+        [offsets appendBytes:&offset length:sizeof(offset)];
+        return;
+    }
+
+    NSUInteger childSize = node.treeSize >> node.power;
+
+    for (NSUInteger i=0; i<node.scale; ++i) {
+        BASparseArray *child = [node childAtIndex:i];
+        if(child)
+            GatherLeaves(child, offset + i * childSize, leaves, offsets);
+    }
+}
+
+
+@interface BASparseArrayFile ()
+- (const BASparseFileHeader *)header;
+- (const BASparseFileLeaf *)leaves;
+- (NSData *)compressedPayloadWithRange:(NSRange)range;
+- (BOOL)finishWithHeader:(BASparseFileHeader *)header index:(NSData *)index error:(NSError **)error;
+- (BOOL)isFileAtURL:(NSURL *)url;
+@end
+
+
+@implementation BASparseArrayFile
+
+@synthesize url=_url;
+
+#pragma mark - Private
+
+- (BOOL)map:(NSError **)error {
+
+    struct stat info;
+
+    if(fstat(_descriptor, &info)) {
+        if(error)
+            *error = POSIXError(_url);
+        return NO;
+    }
+
+    if(_map)
+        munmap(_map, _mapLength), _map = NULL;
+
+    _length = _mapLength = (NSUInteger)info.st_size;
+    if(0 == _mapLength)
+        return YES;
+
+    _map = mmap(NULL, _mapLength, PROT_READ, MAP_SHARED, _descriptor, 0);
+    if(MAP_FAILED == _map) {
+        _map = NULL;
+        _mapLength = 0;
+        if(error)
+            *error = POSIXError(_url);
+        return NO;
+    }
+
+    return YES;
+}
+
+- (BOOL)isValid {
+
+    const BASparseFileHeader *header = _map;
+
+    if(_mapLength < sizeof(BASparseFileHeader) || memcmp(header->magic, BASparseFileMagic, sizeof(BASparseFileMagic)))
+        return NO;
+    if(header->version != BASparseFileVersion || header->kind > BASparseFileSamples)
+        return NO;
+    if(0 == header->base || 0 == header->power || (header->kind == BASparseFileSamples && 0 == header->sampleSize))
+        return NO;
+    if(0 == TreeSizeForHeader(header))
+        return NO;
+    if(header->indexLocation > _mapLength || header->leafCount > (_mapLength - header->indexLocation) / sizeof(BASparseFileLeaf))
+        return NO;
+
+    const BASparseFileLeaf *leaf = [self leaves];
+
+    for (NSUInteger i=0; i<header->leafCount; ++i, ++leaf)
+        if(leaf->location > _mapLength || leaf->length > _mapLength - leaf->location)
+            return NO;
+
+    return YES;
+}
+
+- (const BASparseFileHeader *)header {
+    return _map;
+}
+
+// Links and other paths to the same file count too
+- (BOOL)isFileAtURL:(NSURL *)url {
+
+    struct stat mine, theirs;
+
+    if(0 == fstat(_descriptor, &mine) && 0 == stat([[url path] fileSystemRepresentation], &theirs))
+        return mine.st_dev == theirs.st_dev && mine.st_ino == theirs.st_ino;
+
+    return [[[url URLByStandardizingPath] path] isEqualToString:[[_url URLByStandardizingPath] path]];
+}
+
+- (const BASparseFileLeaf *)leaves {
+    return (const BASparseFileLeaf *)((const UInt8 *)_map + [self header]->indexLocation);
+}
+
+// A copy, which stays good when the file is mapped again; payloads appended since the file was last
+// mapped are read instead
+- (NSData *)compressedPayloadWithRange:(NSRange)range {
+
+    if(NSMaxRange(range) <= _mapLength)
+        return [NSData dataWithBytes:(const UInt8 *)_map + range.location length:range.length];
+
+    NSMutableData *data = [NSMutableData dataWithLength:range.length];
+
+    if(pread(_descriptor, [data mutableBytes], range.length, (off_t)range.location) != (ssize_t)range.length)
+        [NSException raise:NSInternalInconsistencyException format:@"could not read sparse array payload: %s", strerror(errno)];
+
+    return data;
+}
+
+// The header is written only once everything it points to is on disk
+- (BOOL)finishWithHeader:(BASparseFileHeader *)header index:(NSData *)index error:(NSError **)error {
+
+    NSRange range;
+
+    if(![self appendData:index range:&range error:error])
+        return NO;
+
+    header->indexLocation = range.location;
+
+    if(fsync(_descriptor) || pwrite(_descriptor, header, sizeof(BASparseFileHeader), 0) != sizeof(BASparseFileHeader) || fsync(_descriptor)) {
+        if(error)
+            *error = POSIXError(_url);
+        return NO;
+    }
+
+    return [self map:error];
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    if(_map)
+        munmap(_map, _mapLength), _map = NULL;
+    if(_descriptor >= 0)
+        close(_descriptor), _descriptor = -1;
+    [_url release], _url = nil;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayFile
+
+- (id)initWithURL:(NSURL *)url create:(BOOL)create error:(NSError **)error {
+
+    self = [super init];
+
+    if(self) {
+
+        const char *path = [[url path] fileSystemRepresentation];
+
+        _url = [url copy];
+        _descriptor = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+
+        // a file which cannot be written can still be read
+        if(_descriptor < 0 && !create)
+            _descriptor = open(path, O_RDONLY);
+
+        if(_descriptor < 0) {
+            if(error)
+                *error = POSIXError(url);
+            [self release];
+            return nil;
+        }
+
+        if(create) {
+            BASparseFileHeader header = { { 0 } };
+            if(pwrite(_descriptor, &header, sizeof(header), 0) != sizeof(header)) {
+                if(error)
+                    *error = POSIXError(url);
+                [self release];
+                return nil;
+            }
+        }
+
+        if(![self map:error]) {
+            [self release];
+            return nil;
+        }
+
+        if(!create && ![self isValid]) {
+            if(error)
+                *error = CorruptFileError(url);
+            [self release];
+            return nil;
+        }
+    }
+
+    return self;
+}
+
+@end
+
+
+@implementation BASparseArrayFile (SparseArrayPrivate)
+
+- (NSData *)payloadWithRange:(NSRange)range {
+    if(NSMaxRange(range) > _mapLength)
+        return [[self compressedPayloadWithRange:range] gzipInflate];
+    return [[NSData dataWithBytesNoCopy:(UInt8 *)_map + range.location length:range.length freeWhenDone:NO] gzipInflate];
+}
+
+- (BOOL)appendData:(NSData *)data range:(NSRange *)pRange error:(NSError **)error {
+
+    NSUInteger location = (_length + BASparseFileAlignment - 1) & ~(BASparseFileAlignment - 1);
+
+    if(pwrite(_descriptor, [data bytes], [data length], (off_t)location) != (ssize_t)[data length]) {
+        if(error)
+            *error = POSIXError(_url);
+        return NO;
+    }
+
+    _length = location + [data length];
+    *pRange = NSMakeRange(location, [data length]);
+
+    return YES;
+}
+
+@end
+
+
+@implementation BASparseArray (FileStorage)
+
+#pragma mark - Private
+
+// With <all>, every leaf with storage is saved; otherwise only leaves written since the last save are
+// added to the file, and the others keep the payloads they already have in it
+- (BOOL)writeLeavesToFile:(BASparseArrayFile *)file all:(BOOL)all error:(NSError **)error {
+
+    NSMutableArray *leaves = [NSMutableArray array];
+    NSMutableData *offsets = [NSMutableData data];
+
+    GatherLeaves(self, 0, leaves, offsets);
+
+    NSUInteger count = [leaves count];
+    const NSUInteger *offset = [offsets bytes];
+    NSRange *payloads = calloc(count, sizeof(NSRange));
+    NSMutableData *index = [NSMutableData data];
+    BOOL isSampleArray = [self isKindOfClass:[BASparseSampleArray class]];
+
+    for (NSUInteger i=0; i<count; ++i) {
+
+        BASparseArray *leaf = [leaves objectAtIndex:i];
+        NSData *compressed = nil;
+
+        if(leaf->_dirty || (all && !leaf->_file)) {
+            [leaf pinStorage];
+            compressed = [[leaf leafPayload] gzipDeflate];
+            [leaf unpinStorage];
+        }
+        else if(leaf->_file && leaf->_file != file)
+            compressed = [leaf->_file compressedPayloadWithRange:leaf->_payload];
+        else if(leaf->_file)
+            payloads[i] = leaf->_payload;
+
+        if(compressed && ![file appendData:compressed range:payloads + i error:error]) {
+            free(payloads);
+            return NO;
+        }
+        if(!payloads[i].length)
+            continue;
+
+        BASparseFileLeaf record = {
+            offset[i],
+            isSampleArray ? 0 : [(BASparseBitArray *)leaf count],
+            payloads[i].location,
+            payloads[i].length
+        };
+        [index appendBytes:&record length:sizeof(record)];
+    }
+
+    BASparseFileHeader header = { { 0 } };
+
+    memcpy(header.magic, BASparseFileMagic, sizeof(BASparseFileMagic));
+    header.version = BASparseFileVersion;
+    header.kind = isSampleArray ? BASparseFileSamples : BASparseFileBits;
+    header.sampleSize = isSampleArray ? (uint32_t)[(BASparseSampleArray *)self size] : 0;
+    header.base = _base;
+    header.power = _power;
+    header.level = _level;
+    header.leafCount = [index length] / sizeof(BASparseFileLeaf);
+
+    if(![file finishWithHeader:&header index:index error:error]) {
+        free(payloads);
+        return NO;
+    }
+
+    if(_level)
+        [self setFile:file payload:NSMakeRange(0, 0)];
+    for (NSUInteger i=0; i<count; ++i)
+        if(payloads[i].length)
+            [[leaves objectAtIndex:i] setFile:file payload:payloads[i]];
+
+    free(payloads);
+
+    return YES;
+}
+
+// An eviction pass also moves leaves between files, so the two never overlap
+- (BOOL)saveLeavesToFile:(BASparseArrayFile *)file all:(BOOL)all error:(NSError **)error {
+
+    if(!_pager)
+        return [self writeLeavesToFile:file all:all error:error];
+
+    __block BOOL saved = NO;
+    __block NSError *saveError = nil;
+
+    [_pager performWithoutEviction:^{
+        saved = [self writeLeavesToFile:file all:all error:&saveError];
+        [saveError retain];
+    }];
+
+    if(error && saveError)
+        *error = saveError;
+    [saveError autorelease];
+
+    return saved;
+}
+
+#pragma mark - FileStorage
+
+- (BASparseArrayFile *)file {
+    return _file;
+}
+
++ (id)sparseArrayWithContentsOfURL:(NSURL *)url error:(NSError **)error {
+
+    BASparseArrayFile *file = [[[BASparseArrayFile alloc] initWithURL:url create:NO error:error] autorelease];
+
+    if(!file)
+        return nil;
+
+    const BASparseFileHeader *header = [file header];
+    BASparseArray *array = nil;
+
+    if(header->kind == BASparseFileSamples)
+        array = [[BASparseSampleArray alloc] initWithPower:header->power order:header->base size:header->sampleSize];
+    else
+        array = [[BASparseBitArray alloc] initWithBase:header->base power:header->power];
+    [array autorelease];
+
+    NSUInteger treeSize = TreeSizeForHeader(header);
+
+    if(treeSize > array.treeSize)
+        [array expandToFitSize:treeSize];
+    [array setFile:file payload:NSMakeRange(0, 0)];
+
+    const BASparseFileLeaf *record = [file leaves];
+
+    for (NSUInteger i=0; i<header->leafCount; ++i, ++record) {
+
+        if(record->offset >= array.treeSize || record->offset % array.leafSize || record->population > array.leafSize) {
+            if(error)
+                *error = CorruptFileError(url);
+            return nil;
+        }
+
+        BASparseArray *leaf = [array leafForStorageIndex:record->offset offset:NULL];
+
+        [leaf loadFromFile:file payload:NSMakeRange(record->location, record->length) population:record->population];
+    }
+
+    return array;
+}
+
+- (BOOL)writeToURL:(NSURL *)url error:(NSError **)error {
+
+    // making the new file empties it, which would pull it out from under our map
+    if([_file isFileAtURL:url]) {
+        if(error)
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteInvalidFileNameError userInfo:@{ NSURLErrorKey : url }];
+        return NO;
+    }
+
+    BASparseArrayFile *file = [[[BASparseArrayFile alloc] initWithURL:url create:YES error:error] autorelease];
+
+    return file && [self saveLeavesToFile:file all:YES error:error];
+}
+
+- (BOOL)saveChanges:(NSError **)error {
+    NSAssert(_file, @"sparse array has no file; use -writeToURL:error: first");
+    return [self saveLeavesToFile:_file all:NO error:error];
+}
+
+@end
@@ -0,0 +1,87 @@
+//
+//  BASparseArrayPager.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-17.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArray.h>
+
+
+typedef struct {
+    NSUInteger accesses;      // requests for the storage of a leaf
+    NSUInteger misses;        // those which had to load it from a file
+    NSUInteger residentBytes; // leaf storage in memory
+    NSUInteger bytesPagedIn;  // compressed payloads read back
+    NSUInteger bytesPagedOut; // compressed payloads written to the backing file
+    NSUInteger evictions;     // leaves whose storage was dropped
+} BASparseArrayPagingStats;
+
+NS_INLINE double BASparseArrayPagingHitRate(BASparseArrayPagingStats stats) {
+    return stats.accesses ? 1.0 - (double)stats.misses / (double)stats.accesses : 1.0;
+}
+
+
+/**
+ * Keeps the leaf storage of a sparse bit or sample array within a memory budget.
+ *
+ * Leaves note when their storage was last asked for. When making or reloading the storage of a leaf takes
+ * the tree over its budget, an eviction pass is started on a background queue. The pass drops the storage
+ * of the least recently used leaves until the tree is back under seven eighths of its budget. Leaves which
+ * were written since they were last saved are first appended to a backing file, which is unlinked as soon
+ * as it is made and goes away with the tree. Leaves which were not are just dropped, as their storage is
+ * still in the backing file, or in the file the array was read from (see BASparseArrayFile.h), or was never
+ * written. A leaf whose storage has been dropped loads it again the next time it is needed.
+ *
+ * The storage of a pinned leaf is never dropped. The array pins a leaf for as long as it uses the leaf's
+ * storage, and a cursor pins the leaf it is on. Code which uses the bits or samples of a leaf directly
+ * must pin the leaf before asking for them, and unpin it when done.
+ *
+ * Time is counted in passes, and the least recently used leaves go first. The storage of a leaf which was
+ * asked for during the current or last pass is not dropped, and dropped storage is only released by the
+ * pass after that, but neither makes it safe to use storage without a pin.
+ * Leaf storage which comes from the tree's slab (see BASlabAllocator.h) is reused by the tree rather than
+ * given back to the system.
+ */
+
+@interface BASparseArrayPager : NSObject {
+    BASparseArray *_root;            // not retained; the root owns the pager
+    BASparseArrayFile *_backingFile; // made by the first pass which needs it
+    dispatch_queue_t _queue;         // passes, one at a time
+    NSMutableArray *_retired;        // storage dropped by the last pass
+    NSUInteger _budget;
+    NSUInteger _epoch;               // passes started
+    NSUInteger _residentBytes;
+    NSUInteger _misses;
+    NSUInteger _bytesPagedIn;
+    NSUInteger _bytesPagedOut;
+    NSUInteger _evictions;
+    BOOL _scheduled;                 // a pass is waiting to run
+}
+
+@property (nonatomic) NSUInteger budget; // in bytes of leaf storage
+
+- (id)initWithRoot:(BASparseArray *)root budget:(NSUInteger)budget;
+
+// Starts a pass, if none is waiting already, and calls <completion>, if any, on a global queue after it
+- (void)scheduleEvictionWithCompletion:(dispatch_block_t)completion;
+
+@end
+
+
+@interface BASparseArray (MemoryBudget)
+
+// Bytes of leaf storage the tree keeps in memory; 0, the default, for no limit. Set on the root, before
+// the array is shared between threads. Setting 0 stops evictions, but does not reload anything.
+@property (nonatomic) NSUInteger memoryBudget;
+
+@property (nonatomic, readonly) BASparseArrayPager *pager;
+@property (nonatomic, readonly) BASparseArrayPagingStats pagingStats; // all zeroes without a budget
+
+// Keeps the storage of a leaf from being evicted until it is unpinned as many times as it was pinned.
+// Cheap enough to call for every access; calling it on a node which is not a leaf does nothing useful.
+- (void)pinStorage;
+- (void)unpinStorage;
+
+@end
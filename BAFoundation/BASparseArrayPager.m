@@ -0,0 +1,359 @@
+//
+//  BASparseArrayPager.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-17.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArrayPager.h>
+
+#import "BASparseArrayPrivate.h"
+#import <BAFoundation/NSData+GZip.h>
+
+#import <sched.h>
+#import <unistd.h>
+
+
+// A leaf with storage, and when it was last used, as of the start of a pass
+typedef struct {
+    BASparseArray *leaf;
+    NSUInteger lastUse;
+} BAPagerCandidate;
+
+static int CompareCandidates(const void *a, const void *b) {
+    NSUInteger lastA = ((const BAPagerCandidate *)a)->lastUse, lastB = ((const BAPagerCandidate *)b)->lastUse;
+    return lastA < lastB ? -1 : lastA > lastB;
+}
+
+
+@interface BASparseArrayPager ()
+- (BASparseArrayFile *)backingFile:(NSError **)error;
+- (void)didLoadBytes:(NSUInteger)bytes pagedIn:(NSUInteger)pagedIn;
+- (void)didPageOutBytes:(NSUInteger)bytes;
+- (void)retireStorage:(id)storage bytes:(NSUInteger)bytes;
+- (NSUInteger)residentBytes;
+- (BASparseArrayPagingStats)stats;
+@end
+
+
+@interface BASparseArray (MemoryBudgetPrivate)
+- (void)attachPager:(BASparseArrayPager *)pager;
+- (void)evictLeavesBefore:(NSUInteger)epoch downTo:(NSUInteger)target pager:(BASparseArrayPager *)pager;
+- (NSUInteger)storageAccesses;
+@end
+
+
+@implementation BASparseArrayPager
+
+@synthesize budget=_budget;
+
+#pragma mark - Private
+
+- (BASparseArrayFile *)backingFile:(NSError **)error {
+    if(!_backingFile) {
+        NSString *name = [NSString stringWithFormat:@"BASparseArray-%@.pages", [[NSProcessInfo processInfo] globallyUniqueString]];
+        NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:name]];
+        _backingFile = [[BASparseArrayFile alloc] initWithURL:url create:YES error:error];
+        // the open descriptor keeps the file until the pager is gone, and nothing is left behind after a crash
+        if(_backingFile)
+            unlink([[url path] fileSystemRepresentation]);
+    }
+    return _backingFile;
+}
+
+- (void)didLoadBytes:(NSUInteger)bytes pagedIn:(NSUInteger)pagedIn {
+
+    NSUInteger resident = __atomic_add_fetch(&_residentBytes, bytes, __ATOMIC_RELAXED);
+
+    if(pagedIn) {
+        __atomic_add_fetch(&_misses, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_bytesPagedIn, pagedIn, __ATOMIC_RELAXED);
+    }
+
+    NSUInteger budget = _budget;
+
+    if(budget && resident > budget)
+        [self scheduleEvictionWithCompletion:nil];
+}
+
+- (void)didPageOutBytes:(NSUInteger)bytes {
+    __atomic_add_fetch(&_bytesPagedOut, bytes, __ATOMIC_RELAXED);
+}
+
+// Released by the next pass; see the header
+- (void)retireStorage:(id)storage bytes:(NSUInteger)bytes {
+    [_retired addObject:storage];
+    [storage release];
+    __atomic_sub_fetch(&_residentBytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_evictions, 1, __ATOMIC_RELAXED);
+}
+
+- (NSUInteger)residentBytes {
+    return __atomic_load_n(&_residentBytes, __ATOMIC_RELAXED);
+}
+
+- (BASparseArrayPagingStats)stats {
+    BASparseArrayPagingStats stats = {
+        0,
+        __atomic_load_n(&_misses, __ATOMIC_RELAXED),
+        __atomic_load_n(&_residentBytes, __ATOMIC_RELAXED),
+        __atomic_load_n(&_bytesPagedIn, __ATOMIC_RELAXED),
+        __atomic_load_n(&_bytesPagedOut, __ATOMIC_RELAXED),
+        __atomic_load_n(&_evictions, __ATOMIC_RELAXED),
+    };
+    return stats;
+}
+
+// Runs on the queue
+- (void)evict {
+
+    __atomic_store_n(&_scheduled, NO, __ATOMIC_RELEASE);
+
+    NSUInteger epoch = __atomic_add_fetch(&_epoch, 1, __ATOMIC_SEQ_CST);
+    NSUInteger budget = _budget;
+
+    [_retired removeAllObjects];
+
+    if(_root && budget && self.residentBytes > budget - budget / 8)
+        [_root evictLeavesBefore:epoch - 1 downTo:budget - budget / 8 pager:self];
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_retired release], _retired = nil;
+    [_backingFile release], _backingFile = nil;
+    if(_queue)
+        dispatch_release(_queue), _queue = NULL;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayPager
+
+- (id)initWithRoot:(BASparseArray *)root budget:(NSUInteger)budget {
+    self = [super init];
+    if(self) {
+        _root = root;
+        _budget = budget;
+        _queue = dispatch_queue_create("com.lichenlabs.BAFoundation.BASparseArrayPager", DISPATCH_QUEUE_SERIAL);
+        _retired = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)setBudget:(NSUInteger)budget {
+    _budget = budget;
+    if(budget && self.residentBytes > budget)
+        [self scheduleEvictionWithCompletion:nil];
+}
+
+- (void)scheduleEvictionWithCompletion:(dispatch_block_t)completion {
+
+    if(!completion && __atomic_exchange_n(&_scheduled, YES, __ATOMIC_ACQ_REL))
+        return;
+
+    dispatch_async(_queue, ^{
+        [self evict];
+        if(completion)
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), completion);
+    });
+}
+
+@end
+
+
+@implementation BASparseArrayPager (SparseArrayPrivate)
+
+- (NSUInteger)epoch {
+    return __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+}
+
+- (void)nodeWillDeallocate:(BASparseArray *)node {
+    if(node == _root)
+        dispatch_sync(_queue, ^{
+            _root = nil;
+        });
+}
+
+- (void)performWithoutEviction:(dispatch_block_t)block {
+    dispatch_sync(_queue, block);
+}
+
+@end
+
+
+@implementation BASparseArray (MemoryBudgetPrivate)
+
+- (void)attachPager:(BASparseArrayPager *)pager {
+
+    if(_pager != pager) {
+        [_pager release];
+        _pager = [pager retain];
+    }
+
+    if(0 == _level && [self residentStorage])
+        [pager didLoadBytes:[self storageBytes] pagedIn:0];
+
+    for (NSUInteger i=0; _children && i<_scale; ++i)
+        [[self childAtIndex:i] attachPager:pager];
+}
+
+- (void)gatherCandidates:(NSMutableData *)candidates {
+
+    if(0 == _level) {
+        if([self residentStorage]) {
+            BAPagerCandidate candidate = { self, __atomic_load_n(&_lastUse, __ATOMIC_RELAXED) };
+            [candidates appendBytes:&candidate length:sizeof(candidate)];
+        }
+        return;
+    }
+
+    for (NSUInteger i=0; i<_scale; ++i)
+        [[self childAtIndex:i] gatherCandidates:candidates];
+}
+
+// Returns NO only if the leaf had changes which could not be saved
+- (BOOL)evictStorageBefore:(NSUInteger)epoch pager:(BASparseArrayPager *)pager error:(NSError **)error {
+
+    id storage = [self residentStorage];
+
+    if(!storage)
+        return YES;
+
+    // pins and getters note the use and then check the flag, so either they wait, or we see the use
+    __atomic_store_n(&_evicting, YES, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&_pins, __ATOMIC_SEQ_CST) || __atomic_load_n(&_lastUse, __ATOMIC_SEQ_CST) >= epoch) {
+        __atomic_store_n(&_evicting, NO, __ATOMIC_RELEASE);
+        return YES;
+    }
+
+    if(__atomic_exchange_n(&_dirty, NO, __ATOMIC_ACQ_REL)) {
+
+        BASparseArrayFile *file = [pager backingFile:error];
+        NSData *compressed = [[self payloadForStorage:storage] gzipDeflate];
+        NSRange payload;
+
+        if(!file || ![file appendData:compressed range:&payload error:error]) {
+            __atomic_store_n(&_dirty, YES, __ATOMIC_RELEASE);
+            __atomic_store_n(&_evicting, NO, __ATOMIC_RELEASE);
+            return NO;
+        }
+        [self setFile:file payload:payload];
+        [pager didPageOutBytes:payload.length];
+    }
+
+    [pager retireStorage:[self takeResidentStorage] bytes:[self storageBytes]];
+    __atomic_store_n(&_evicting, NO, __ATOMIC_RELEASE);
+
+    return YES;
+}
+
+// Least recently used first; storage which is pinned, or was used since <epoch> began, is kept
+- (void)evictLeavesBefore:(NSUInteger)epoch downTo:(NSUInteger)target pager:(BASparseArrayPager *)pager {
+
+    NSMutableData *candidates = [NSMutableData data];
+
+    [self gatherCandidates:candidates];
+
+    NSUInteger count = [candidates length] / sizeof(BAPagerCandidate);
+    BAPagerCandidate *candidate = [candidates mutableBytes];
+
+    qsort(candidate, count, sizeof(BAPagerCandidate), CompareCandidates);
+
+    for (NSUInteger i=0; i<count && [pager residentBytes] > target; ++i, ++candidate) {
+
+        NSError *error = nil;
+
+        if(candidate->lastUse >= epoch)
+            break;
+        if(![candidate->leaf evictStorageBefore:epoch pager:pager error:&error]) {
+            NSLog(@"Could not page out sparse array leaf %@: %@", candidate->leaf, error);
+            break;
+        }
+    }
+}
+
+@end
+
+
+@implementation BASparseArray (SparseArrayPaging)
+
+- (void)willUseStorage {
+    __atomic_store_n(&_lastUse, [_pager epoch], __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&_accesses, 1, __ATOMIC_RELAXED);
+    while(__atomic_load_n(&_evicting, __ATOMIC_SEQ_CST))
+        sched_yield();
+}
+
+- (void)didLoadStorage {
+    [_pager didLoadBytes:[self storageBytes] pagedIn:_file ? _payload.length : 0];
+}
+
+- (NSUInteger)storageAccesses {
+
+    if(0 == _level)
+        return __atomic_load_n(&_accesses, __ATOMIC_RELAXED);
+
+    NSUInteger accesses = 0;
+
+    for (NSUInteger i=0; i<_scale; ++i)
+        accesses += [[self childAtIndex:i] storageAccesses];
+
+    return accesses;
+}
+
+@end
+
+
+@implementation BASparseArray (MemoryBudget)
+
+- (NSUInteger)memoryBudget {
+    return _pager.budget;
+}
+
+- (void)setMemoryBudget:(NSUInteger)budget {
+
+    NSAssert(!self.parent, @"the memory budget is set on the root of a tree");
+
+    if(_pager) {
+        _pager.budget = budget;
+        return;
+    }
+
+    BASparseArrayPager *pager = [[BASparseArrayPager alloc] initWithRoot:self budget:budget];
+
+    [self attachPager:pager];
+    [pager release];
+}
+
+- (BASparseArrayPager *)pager {
+    return _pager;
+}
+
+- (BASparseArrayPagingStats)pagingStats {
+
+    BASparseArrayPagingStats stats = { 0 };
+
+    if(_pager) {
+        stats = [_pager stats];
+        stats.accesses = [self storageAccesses];
+    }
+
+    return stats;
+}
+
+// Pins are counted with or without a pager, so a budget can be set while a cursor is out
+- (void)pinStorage {
+    __atomic_add_fetch(&_pins, 1, __ATOMIC_SEQ_CST);
+    while(_pager && __atomic_load_n(&_evicting, __ATOMIC_SEQ_CST))
+        sched_yield();
+}
+
+- (void)unpinStorage {
+    NSAssert(__atomic_load_n(&_pins, __ATOMIC_RELAXED), @"unbalanced unpin of %@", self);
+    __atomic_sub_fetch(&_pins, 1, __ATOMIC_RELEASE);
+}
+
+@end
@@ -8,6 +8,11 @@
 
 
 #import <BAFoundation/BASparseArray.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+#import <BAFoundation/BASparseArrayFile.h>
+#import <BAFoundation/BASparseArrayPager.h>
+#import <BAFoundation/BAFunctions.h>
 
 
 static inline NSUInteger StorageIndexFor2DCoordinates( NSUInteger x, NSUInteger y, NSUInteger base ) {
@@ -20,11 +25,20 @@ static inline NSUInteger StorageIndexFor3DCoordinates( NSUInteger x, NSUInteger
     return leafIndex * base*base*base + (z%base)*base*base + (y%base)*base + x%base;
 }
 
+// Within a leaf, the first co-ordinate varies fastest
+static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteger base, NSUInteger power) {
+    NSUInteger leafIndex = LeafIndexForCoordinates(coords, base, power);
+    NSUInteger result = 0;
+    for(NSUInteger i=power; i-->0; )
+        result = result * base + coords[i] % base;
+    return leafIndex * powi(base, power) + result;
+}
+
 @interface BASparseArray (SparseArrayPrivate)
 
 - (id)initWithBase:(NSUInteger)base power:(NSUInteger)power level:(NSUInteger)level;
-- (id)initWithChild:(BASparseArray *)child position:(NSUInteger)position;
-- (id)initWithParent:(BASparseArray *)parent;
+- (id)initWithChild:(BASparseArray *)child index:(NSUInteger)index;
+- (id)initWithParent:(BASparseArray *)parent index:(NSUInteger)index;
 
 - (NSUInteger)treeSizeForStorageIndex:(NSUInteger)index depth:(NSUInteger *)pDepth;
 - (NSUInteger)treeSizeForStorageIndex:(NSUInteger)index;
@@ -35,4 +49,50 @@ static inline NSUInteger StorageIndexFor3DCoordinates( NSUInteger x, NSUInteger
 
 - (void)initializeChildren:(void (^)(BASparseArray *child))initializeBlock;
 
+- (void)insertGeneration;
+
+// Where a leaf's storage was saved; the leaf is clean until it is written again
+- (void)setFile:(BASparseArrayFile *)file payload:(NSRange)payload;
+
+// For leaves read from a file, which load their storage from it when it is first needed; subclasses
+// restore their summaries here
+- (void)loadFromFile:(BASparseArrayFile *)file payload:(NSRange)payload population:(NSUInteger)population;
+
+// The storage of a leaf, uncompressed, as it is saved in a file; nil if it has none. The payload may
+// share the storage, so the caller keeps the leaf pinned while it uses it.
+- (NSData *)leafPayload;
+- (NSData *)payloadForStorage:(id)storage;
+
+// For the pager: the storage of a leaf, without loading or making it, or noting the use; the size it
+// has, or would have; and the storage, removed from the leaf and owned by the caller
+- (id)residentStorage;
+- (NSUInteger)storageBytes;
+- (id)takeResidentStorage;
+
+// Leaves of a tree with a pager call these from their storage getters
+- (void)willUseStorage; // waits if the storage is being evicted
+- (void)didLoadStorage; // made or reloaded, and published
+
+@end
+
+@interface BASparseArrayFile (SparseArrayPrivate)
+- (NSData *)payloadWithRange:(NSRange)range; // uncompressed
+- (BOOL)appendData:(NSData *)data range:(NSRange *)pRange error:(NSError **)error;
+@end
+
+@interface BASparseArrayPager (SparseArrayPrivate)
+- (NSUInteger)epoch;
+- (void)nodeWillDeallocate:(BASparseArray *)node;
+// Saving runs in here, so that it never overlaps an eviction pass
+- (void)performWithoutEviction:(dispatch_block_t)block;
+@end
+
+// For writes which go straight to the storage of a leaf: these mark the leaf dirty and update the
+// summaries of the leaf and all of its ancestors
+@interface BASparseBitArray (SparseBitArrayPrivate)
+- (void)didWriteBits:(NSInteger)delta; // the change in the number of set bits
+@end
+
+@interface BASparseSampleArray (SparseSampleArrayPrivate)
+- (void)didWriteSamples;
 @end
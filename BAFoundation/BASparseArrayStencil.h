@@ -0,0 +1,98 @@
+//
+//  BASparseArrayStencil.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-18.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+@class BASparseArrayCursor;
+
+
+typedef NS_ENUM(NSUInteger, BAStencilNeighbourhood) {
+    BAStencilFaceNeighbours, // leaves which share a face with the centre: 4 in 2D, 6 in 3D
+    BAStencilAllNeighbours,  // and those which share an edge or a corner: 8 in 2D, 26 in 3D
+};
+
+/* <centre> is one datum of the apron. The datum one step along axis i is at centre + strides[i], and one
+ * step back at centre - strides[i]; strides are in bytes. <coordinates> are the absolute co-ordinates of
+ * the centre. Neither is valid after the call.
+ */
+typedef void (^BAStencilKernel)(const UInt8 *centre, const NSInteger *strides, const NSUInteger *coordinates);
+
+
+/**
+ * A stencil runs a kernel over every datum of a leaf of a sparse bit or sample array, with the data
+ * around it close at hand, so that a pass over a tree never looks anything up per datum.
+ *
+ * For each leaf, the stencil fills an apron: a copy of the leaf with a border one datum wide, taken from
+ * the neighbouring leaves, so the apron is (base + 2) data along each axis. Samples are copied as they
+ * are; bits become bytes of 0 or 1. Where there is no neighbouring leaf, or the border falls outside the
+ * tree, the apron is zero. With BAStencilFaceNeighbours, the edges and corners of the apron are always
+ * zero, which is enough for the 4 or 6 neighbours of every datum.
+ *
+ * Neighbouring leaves are found with a cursor, and remembered. When the stencil moves to a leaf next to
+ * the last one, as it mostly does when going through leaves in index order, the neighbours they share are
+ * not looked up again. Leaves made after the stencil looked for them are found the next time it looks.
+ *
+ * The stencil retains its array, but not the storage of any leaf, so it can be used with a tree which
+ * has a memory budget (see BASparseArrayPager.h). A stencil is not thread-safe; make one for each thread.
+ */
+
+@interface BASparseArrayStencil : NSObject {
+    BASparseArray *_array;
+    BASparseArrayCursor *_cursor;
+    BASparseArray **_neighbours;  // 3^power, or nil where not found yet; offsets o from the centre are at sum((o[i] + 1) * 3^i)
+    NSUInteger *_leafOrigin;      // of the leaf in the middle of _neighbours
+    UInt8 *_apron;
+    NSInteger *_strides;
+    NSUInteger _base;
+    NSUInteger _power;
+    NSUInteger _apronBase;        // base + 2
+    NSUInteger _apronLength;      // in bytes
+    NSUInteger _sampleSize;       // 1 for bits
+    NSUInteger _neighbourCount;   // 3^power, including the centre
+    BAStencilNeighbourhood _neighbourhood;
+    BOOL _isBitArray;
+    BOOL _hasOrigin;
+}
+
+@property (nonatomic, readonly) BASparseArray *array;
+@property (nonatomic, readonly) BAStencilNeighbourhood neighbourhood;
+@property (nonatomic, readonly) BASparseArray *leaf; // the centre, or nil
+@property (nonatomic, readonly) const NSUInteger *leafOrigin; // power elements; NULL until a leaf is loaded
+
+@property (nonatomic, readonly) const UInt8 *apron; // the first datum is the corner before the leaf's origin
+@property (nonatomic, readonly) const NSInteger *strides;
+@property (nonatomic, readonly) NSUInteger apronBase;
+@property (nonatomic, readonly) NSUInteger sampleSize;
+
+// <array> must be a BASparseBitArray or a BASparseSampleArray
+- (id)initWithSparseArray:(BASparseArray *)array neighbourhood:(BAStencilNeighbourhood)neighbourhood;
+
+// The leaf at <offsets> (each -1, 0 or 1) leaves from the centre, or nil if there is none
+- (BASparseArray *)neighbourAtOffsets:(const NSInteger *)offsets;
+
+// Moves to the leaf which holds <coordinates>, and fills the apron; returns NO if there is no leaf there
+- (BOOL)loadLeafAtCoordinates:(const NSUInteger *)coordinates;
+
+// Runs <kernel> for every datum of the loaded leaf
+- (void)applyKernel:(BAStencilKernel)kernel;
+
+// Loads every leaf in the tree in index order, and runs <kernel> for every datum of each
+- (void)applyKernelToLeaves:(BAStencilKernel)kernel;
+
+@end
+
+
+@interface BASparseBitArray (Stencils)
+- (BASparseArrayStencil *)stencilWithNeighbourhood:(BAStencilNeighbourhood)neighbourhood;
+@end
+
+
+@interface BASparseSampleArray (Stencils)
+- (BASparseArrayStencil *)stencilWithNeighbourhood:(BAStencilNeighbourhood)neighbourhood;
+@end
@@ -0,0 +1,305 @@
+//
+//  BASparseArrayStencil.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-18.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/BASparseArrayStencil.h>
+
+#import "BASparseArrayPrivate.h"
+#import <BAFoundation/BASparseArrayCursor.h>
+
+
+@implementation BASparseArrayStencil
+
+@synthesize array=_array, neighbourhood=_neighbourhood;
+@synthesize apron=_apron, strides=_strides, apronBase=_apronBase, sampleSize=_sampleSize;
+
+#pragma mark - Accessors
+
+- (BASparseArray *)leaf {
+    return _hasOrigin ? _neighbours[_neighbourCount / 2] : nil;
+}
+
+- (const NSUInteger *)leafOrigin {
+    return _hasOrigin ? _leafOrigin : NULL;
+}
+
+#pragma mark - Private
+
+// Neighbours which the old and new centres share keep their places relative to the new centre
+- (void)moveToLeafOrigin:(const NSUInteger *)origin {
+
+    NSInteger shift[_power];
+    BOOL near = _hasOrigin;
+    BOOL moved = !_hasOrigin;
+
+    for (NSUInteger i=0; i<_power; ++i) {
+        shift[i] = (NSInteger)(origin[i] - _leafOrigin[i]) / (NSInteger)_base;
+        near = near && shift[i] >= -1 && shift[i] <= 1;
+        moved = moved || shift[i] != 0;
+    }
+
+    if(!moved)
+        return;
+
+    BASparseArray *old[_neighbourCount];
+
+    memcpy(old, _neighbours, sizeof(old));
+
+    for (NSUInteger k=0; k<_neighbourCount; ++k) {
+
+        NSUInteger rest = k;
+        NSUInteger from = 0;
+        NSUInteger factor = 1;
+        BOOL shared = near;
+
+        for (NSUInteger i=0; i<_power && shared; ++i, rest /= 3, factor *= 3) {
+            NSInteger offset = (NSInteger)(rest % 3) - 1 + shift[i];
+            shared = offset >= -1 && offset <= 1;
+            from += (NSUInteger)(offset + 1) * factor;
+        }
+
+        _neighbours[k] = shared ? old[from] : nil;
+    }
+
+    memcpy(_leafOrigin, origin, _power * sizeof(NSUInteger));
+    _hasOrigin = YES;
+}
+
+// Missing leaves are looked for again every time, in case they have been made since
+- (BASparseArray *)neighbourAtIndex:(NSUInteger)k offsets:(const NSInteger *)offsets {
+
+    BASparseArray *leaf = _neighbours[k];
+
+    if(leaf)
+        return leaf;
+
+    NSUInteger coordinates[_power];
+    NSUInteger treeBase = _array.treeBase;
+
+    for (NSUInteger i=0; i<_power; ++i) {
+        if(offsets[i] < 0 && _leafOrigin[i] < _base)
+            return nil;
+        coordinates[i] = _leafOrigin[i] + offsets[i] * (NSInteger)_base;
+        if(coordinates[i] >= treeBase)
+            return nil;
+    }
+
+    NSUInteger index = LeafIndexForCoordinates(coordinates, _base, _power) * _array.leafSize;
+
+    leaf = [_cursor leafForStorageIndex:index offset:NULL create:NO];
+    _neighbours[k] = leaf;
+
+    return leaf;
+}
+
+// Copies the part of <leaf> which falls in the apron, one row (along the first axis) at a time
+- (void)copyLeaf:(BASparseArray *)leaf offsets:(const NSInteger *)offsets {
+
+    NSUInteger source[_power];
+    NSUInteger dest[_power];
+    NSUInteger extent[_power];
+    NSUInteger rows = 1;
+
+    for (NSUInteger i=0; i<_power; ++i) {
+        source[i] = offsets[i] < 0 ? _base - 1 : 0;
+        dest[i] = offsets[i] < 0 ? 0 : offsets[i] > 0 ? _base + 1 : 1;
+        extent[i] = offsets[i] ? 1 : _base;
+        if(i > 0)
+            rows *= extent[i];
+    }
+
+    id<BABitArray2D> bits = nil;
+    const UInt8 *samples = NULL;
+
+    if(_isBitArray && [(BASparseBitArray *)leaf isEmpty])
+        return;
+
+    [leaf pinStorage];
+
+    if(_isBitArray)
+        bits = [(BASparseBitArray *)leaf bits];
+    else
+        samples = [[(BASparseSampleArray *)leaf samples] samples];
+
+    for (NSUInteger r=0; r<rows; ++r) {
+
+        NSUInteger rest = r;
+        NSUInteger from = source[0];
+        NSUInteger to = dest[0];
+        NSUInteger leafStride = _base;
+        NSUInteger apronStride = _apronBase;
+
+        for (NSUInteger i=1; i<_power; ++i) {
+            NSUInteger c = rest % extent[i];
+            rest /= extent[i];
+            from += (source[i] + c) * leafStride;
+            to += (dest[i] + c) * apronStride;
+            leafStride *= _base;
+            apronStride *= _apronBase;
+        }
+
+        if(bits)
+            [bits readBits:(BOOL *)(_apron + to) range:NSMakeRange(from, extent[0])];
+        else
+            memcpy(_apron + to * _sampleSize, samples + from * _sampleSize, extent[0] * _sampleSize);
+    }
+
+    [leaf unpinStorage];
+}
+
+#pragma mark - NSObject
+
+- (void)dealloc {
+    [_array release], _array = nil;
+    [_cursor release], _cursor = nil;
+    free(_neighbours), _neighbours = NULL;
+    free(_leafOrigin), _leafOrigin = NULL;
+    free(_strides), _strides = NULL;
+    free(_apron), _apron = NULL;
+    [super dealloc];
+}
+
+#pragma mark - BASparseArrayStencil
+
+- (id)initWithSparseArray:(BASparseArray *)array neighbourhood:(BAStencilNeighbourhood)neighbourhood {
+
+    NSAssert([array isKindOfClass:[BASparseBitArray class]] || [array isKindOfClass:[BASparseSampleArray class]],
+             @"stencils need a sparse bit or sample array, not %@", array);
+
+    self = [super init];
+    if(self) {
+        _array = [array retain];
+        _cursor = [[BASparseArrayCursor alloc] initWithSparseArray:array];
+        _neighbourhood = neighbourhood;
+        _base = array.base;
+        _power = array.power;
+        _apronBase = _base + 2;
+        _isBitArray = [array isKindOfClass:[BASparseBitArray class]];
+        _sampleSize = _isBitArray ? 1 : [(BASparseSampleArray *)array size];
+        _neighbourCount = (NSUInteger)powi(3, _power);
+        _neighbours = calloc(_neighbourCount, sizeof(BASparseArray *));
+        _leafOrigin = calloc(_power, sizeof(NSUInteger));
+        _strides = malloc(_power * sizeof(NSInteger));
+
+        NSUInteger stride = _sampleSize;
+
+        for (NSUInteger i=0; i<_power; ++i, stride *= _apronBase)
+            _strides[i] = (NSInteger)stride;
+        _apronLength = stride;
+        _apron = malloc(_apronLength);
+    }
+    return self;
+}
+
+- (BASparseArray *)neighbourAtOffsets:(const NSInteger *)offsets {
+
+    if(!_hasOrigin)
+        return nil;
+
+    NSUInteger k = 0;
+
+    for (NSUInteger i=_power; i-->0; )
+        k = k * 3 + (NSUInteger)(offsets[i] + 1);
+
+    return [self neighbourAtIndex:k offsets:offsets];
+}
+
+- (BOOL)loadLeafAtCoordinates:(const NSUInteger *)coordinates {
+
+    NSUInteger origin[_power];
+
+    for (NSUInteger i=0; i<_power; ++i)
+        origin[i] = coordinates[i] - coordinates[i] % _base;
+    [self moveToLeafOrigin:origin];
+
+    NSInteger offsets[_power];
+
+    for (NSUInteger i=0; i<_power; ++i)
+        offsets[i] = 0;
+    if(![self neighbourAtIndex:_neighbourCount / 2 offsets:offsets])
+        return NO;
+
+    memset(_apron, 0, _apronLength);
+
+    for (NSUInteger k=0; k<_neighbourCount; ++k) {
+
+        NSUInteger rest = k;
+        NSUInteger distance = 0; // the number of axes along which the neighbour is offset
+
+        for (NSUInteger i=0; i<_power; ++i, rest /= 3) {
+            offsets[i] = (NSInteger)(rest % 3) - 1;
+            distance += offsets[i] != 0;
+        }
+
+        if(BAStencilFaceNeighbours == _neighbourhood && distance > 1)
+            continue;
+
+        BASparseArray *leaf = [self neighbourAtIndex:k offsets:offsets];
+
+        if(leaf)
+            [self copyLeaf:leaf offsets:offsets];
+    }
+
+    return YES;
+}
+
+- (void)applyKernel:(BAStencilKernel)kernel {
+
+    if(!self.leaf)
+        return;
+
+    NSUInteger coordinates[_power];
+    NSUInteger leafSize = _array.leafSize;
+    const UInt8 *centre = _apron;
+
+    for (NSUInteger i=0; i<_power; ++i) {
+        coordinates[i] = _leafOrigin[i];
+        centre += _strides[i];
+    }
+
+    for (NSUInteger n=0; n<leafSize; ++n) {
+
+        kernel(centre, _strides, coordinates);
+
+        // the first co-ordinate varies fastest, as in the leaf
+        for (NSUInteger i=0; i<_power; ++i) {
+            centre += _strides[i];
+            if(++coordinates[i] - _leafOrigin[i] < _base)
+                break;
+            coordinates[i] = _leafOrigin[i];
+            centre -= _strides[i] * (NSInteger)_base;
+        }
+    }
+}
+
+- (void)applyKernelToLeaves:(BAStencilKernel)kernel {
+    [_array visitNodesWithOrder:BASparseArrayVisitPreOrder block:^BOOL(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post) {
+        if(0 == level && [self loadLeafAtCoordinates:origin])
+            [self applyKernel:kernel];
+        return NO;
+    }];
+}
+
+@end
+
+
+@implementation BASparseBitArray (Stencils)
+
+- (BASparseArrayStencil *)stencilWithNeighbourhood:(BAStencilNeighbourhood)neighbourhood {
+    return [[[BASparseArrayStencil alloc] initWithSparseArray:self neighbourhood:neighbourhood] autorelease];
+}
+
+@end
+
+
+@implementation BASparseSampleArray (Stencils)
+
+- (BASparseArrayStencil *)stencilWithNeighbourhood:(BAStencilNeighbourhood)neighbourhood {
+    return [[[BASparseArrayStencil alloc] initWithSparseArray:self neighbourhood:neighbourhood] autorelease];
+}
+
+@end
@@ -15,17 +15,58 @@
 
 typedef void(^SparseRangeUpdate)(BASparseBitArray *bitArray, NSRange range, BOOL set);
 
+// <count> points of <power> co-ordinates each, one point after another; return YES to stop
+typedef BOOL (^SparseBitsHandler)(const NSUInteger *coordinates, NSUInteger count);
+
 
 @interface BASparseBitArray : BASparseArray<BABitArray> {
     SparseRangeUpdate _rangeUpdateBlock;
+    NSUInteger _population; // set bits in this sub-tree
+    BASampleArray *_leafDimensions; // the size of every leaf's bits, shared by the whole tree
 }
 
+// Leaf storage class: BABitArray (the default), BACompressedBitArray, or another BABitArray2D class
+// which also implements -initWithLength:size:, -checkCount and -setEnableArchiveCompression:
 @property (nonatomic) Class bitArrayClass;
-@property (nonatomic, strong) BABitArray *bits;
+@property (nonatomic, strong) id<BABitArray2D> bits;
+// Leaves of BABitArray, or a subclass, keep their buffers in blocks from one slab (see BASlabAllocator.h)
+// per tree, unless a leaf's buffer is big enough to be mapped
+
+/* Every node keeps the number of set bits below it. Writes made through the array, or a cursor, update the
+ * nodes on the path from the leaf to the root, so -count is a single read, and searches and box queries skip
+ * sub-trees which are empty or, when looking for clear bits, full. Writes made directly to the bits of a leaf
+ * are not counted.
+ */
+@property (nonatomic, readonly, getter=isEmpty) BOOL empty; // no bits set
+@property (nonatomic, readonly, getter=isFull) BOOL full;   // every bit in the tree set
 
 // Add new category to BAScene and move there
 //- (void)setRegion:(BARegioni)region;
 
+/* Range, region and whole-array updates are done leaf by leaf. The methods of BABitArray return when every
+ * leaf has been updated. An update which touches fewer than 64K bits, rounded to whole leaves, is done on
+ * the calling thread; a larger one is split into grains of that size, which run in parallel.
+ *
+ * These versions grow the tree and make any missing leaves before they return, then update the leaves in
+ * the background, and call <completion> on a global queue when they are done. With a nil completion they
+ * are the same as the synchronous methods.
+ */
+- (void)setRange:(NSRange)range completion:(dispatch_block_t)completion;
+- (void)clearRange:(NSRange)range completion:(dispatch_block_t)completion;
+- (void)setRegion2:(BARegion2)region completion:(dispatch_block_t)completion;
+- (void)clearRegion2:(BARegion2)region completion:(dispatch_block_t)completion;
+- (void)setAllWithCompletion:(dispatch_block_t)completion;
+- (void)clearAllWithCompletion:(dispatch_block_t)completion;
+- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin completion:(dispatch_block_t)completion;
+
+/* The co-ordinates of the set bits inside a box, delivered in batches. Only children which hold set bits
+ * and overlap the box are visited, and leaves are scanned a word at a time, so the cost follows the number
+ * of occupied leaves in the box, not its volume. Points come leaf by leaf. Returns the number of points delivered.
+ */
+- (NSUInteger)enumerateSetBitsInBox:(const NSUInteger *)origin size:(const NSUInteger *)size block:(SparseBitsHandler)block;
+- (NSUInteger)enumerateSetBitsInRegion2:(BARegion2)region block:(SparseBitsHandler)block;
+- (NSUInteger)enumerateSetBitsInRegion3:(BARegion3)region block:(SparseBitsHandler)block;
+
 @end
 
 
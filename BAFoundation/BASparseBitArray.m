@@ -9,8 +9,10 @@
 #import <BAFoundation/BASparseBitArray.h>
 
 #import "BASparseArrayPrivate.h"
+#import "BABitArrayPrivate.h"
 
 #import <BAFoundation/NSData+GZip.h>
+#import <BAFoundation/BASlabAllocator.h>
 #import <BAFoundation/BAFunctions.h>
 
 
@@ -20,6 +22,116 @@
 + (BASampleArray *)sampleArrayForBase:(NSUInteger)base power:(NSUInteger)power;
 @end
 
+// What the leaf storage class must provide beyond BABitArray2D
+@protocol BASparseBitArrayLeaf <BABitArray2D>
+- (id)initWithLength:(NSUInteger)bits size:(BASampleArray *)vector;
+- (BOOL)checkCount;
+- (void)setEnableArchiveCompression:(BOOL)enableArchiveCompression;
+@end
+
+// A piece of a bulk update which touches a single leaf; co-ordinates are relative to the leaf
+typedef struct {
+    BASparseBitArray *leaf;
+    NSRange range;
+    BARegion2 region;
+    BAPoint2 origin; // for writes, the co-ordinates in the source array of the region's origin
+} BASparseBulkItem;
+
+typedef void (^BASparseBulkItemBlock)(const BASparseBulkItem *item);
+
+// Bulk updates smaller than this are not worth handing to another thread
+static const NSUInteger BASparseBulkGrainBits = 1 << 16;
+
+// Points found by a box query, waiting to be handed to the caller
+typedef struct {
+    SparseBitsHandler block;
+    NSUInteger *coordinates;
+    NSUInteger count;
+    NSUInteger capacity; // in points
+    NSUInteger total;
+    BOOL stop;
+} BASparseBitsBatch;
+
+static void FlushBatch(BASparseBitsBatch *batch) {
+    if(batch->count && !batch->stop) {
+        batch->stop = batch->block(batch->coordinates, batch->count);
+        batch->total += batch->count;
+    }
+    batch->count = 0;
+}
+
+// Runs of set bits among <length> bits of a leaf, starting at <index>
+static void LeafEnumerateRuns(id<BABitArray2D> bits, NSUInteger index, NSUInteger length, BABitArrayRunEnumerator block) {
+    
+    if([bits isKindOfClass:[BABitArray class]]) {
+        BABitsEnumerateRuns([(BABitArray *)bits buffer], index, length, block);
+        return;
+    }
+    
+    BOOL *values = malloc(length * sizeof(BOOL));
+    NSUInteger start = NSNotFound;
+    
+    [bits readBits:values range:NSMakeRange(index, length)];
+    for (NSUInteger i=0; i<=length; ++i) {
+        if(i < length && values[i]) {
+            if(start == NSNotFound)
+                start = i;
+        }
+        else if(start != NSNotFound) {
+            block(NSMakeRange(start, i - start));
+            start = NSNotFound;
+        }
+    }
+    
+    free(values);
+}
+
+// Leaf payloads are the bits packed as BABitArray keeps them, first bit in the high bit of the first byte
+static void LoadBits(id<BABitArray2D> bits, NSData *payload) {
+    
+    NSUInteger length = [bits length];
+    
+    if([payload length] < (length + 7) / 8)
+        [NSException raise:NSInternalInconsistencyException format:@"sparse array file payload is too short"];
+    
+    if([bits isKindOfClass:[BABitArray class]]) {
+        [(BABitArray *)bits writeBytes:(unsigned char *)[payload bytes] range:NSMakeRange(0, (length + 7) / 8)];
+        return;
+    }
+    
+    BABitArray *packed = [[BABitArray alloc] initWithData:payload length:length];
+    BOOL *values = malloc(length * sizeof(BOOL));
+    
+    [packed readBits:values range:NSMakeRange(0, length)];
+    [bits writeBits:values range:NSMakeRange(0, length)];
+    
+    free(values);
+    [packed release];
+}
+
+static NSData *PayloadForBits(id<BABitArray2D> bits) {
+    
+    NSUInteger length = [bits length];
+    NSMutableData *payload = [NSMutableData dataWithLength:(length + 7) / 8];
+    
+    if([bits isKindOfClass:[BABitArray class]]) {
+        [(BABitArray *)bits readBytes:[payload mutableBytes] range:NSMakeRange(0, [payload length])];
+        return payload;
+    }
+    
+    BABitArray *packed = [[BABitArray alloc] initWithLength:length];
+    BOOL *values = malloc(length * sizeof(BOOL));
+    
+    [bits readBits:values range:NSMakeRange(0, length)];
+    [packed writeBits:values range:NSMakeRange(0, length)];
+    [packed readBytes:[payload mutableBytes] range:NSMakeRange(0, [payload length])];
+    
+    free(values);
+    [packed release];
+    
+    return payload;
+}
+
 #pragma mark -
 
 @implementation BASparseBitArray
@@ -34,102 +146,482 @@
 
     NSUInteger offset = 0;
     BASparseBitArray *leaf = (BASparseBitArray *)[self leafForStorageIndex:index offset:&offset];
-    BABitArray *bits = leaf.bits;
+    [leaf pinStorage];
+    id<BABitArray2D> bits = leaf.bits;
     SparseArrayUpdate updateBlock = leaf.updateBlock;
+    NSUInteger count = [bits count];
     
     index -= offset;
     if(setBit)
         [bits setBit:index];
     else
         [bits clearBit:index];
+    [leaf didWriteBits:(NSInteger)([bits count] - count)];
+    [leaf unpinStorage];
     if(updateBlock)
         updateBlock(leaf, index, (void *)&setBit);
 }
 
-- (void)recursiveUpdateRange:(NSRange)range set:(BOOL)setBits {
-    
-    NSUInteger maxIndex = range.location + range.length;
+- (void)addPopulation:(NSInteger)delta {
+    if(!delta)
+        return;
+    for (BASparseBitArray *node = self; node; node = (BASparseBitArray *)node.parent)
+        __atomic_add_fetch(&node->_population, (NSUInteger)delta, __ATOMIC_RELAXED);
+}
 
-    if(!_level) {
-        NSAssert(maxIndex < _leafSize, @"node traversal error; updating range %@", NSStringFromRange(range));
-        if(setBits)
-            [self.bits setRange:range];
+- (void)didWriteBits:(NSInteger)delta {
+    __atomic_store_n(&_dirty, YES, __ATOMIC_RELEASE);
+    [self addPopulation:delta];
+}
+
+// The bits of a leaf which has any, loading them from its file if need be; never makes new ones. The
+// caller pins the leaf first.
+- (id<BABitArray2D>)storedBits {
+    return _bits || _file ? self.bits : nil;
+}
+
+// Sub-trees which cannot hold the bit are skipped without being visited: empty ones when looking for a
+// set bit, and full ones when looking for a clear bit. Missing children and leaf storage are all clear.
+- (NSUInteger)findBit:(BOOL)set last:(BOOL)last {
+    
+    if(set ? self.isEmpty : self.isFull)
+        return NSNotFound;
+    
+    if(0 == _level) {
+        NSUInteger found;
+        [self pinStorage];
+        id<BABitArray2D> bits = [self storedBits];
+        if(!bits)
+            found = last ? _leafSize - 1 : 0;
+        else if(set)
+            found = last ? [bits lastSetBit] : [bits firstSetBit];
+        else
+            found = last ? [bits lastClearBit] : [bits firstClearBit];
+        [self unpinStorage];
+        return found;
+    }
+    
+    NSUInteger childSize = _treeSize >> _power;
+    
+    for (NSUInteger n=0; n<_scale; ++n) {
+        
+        NSUInteger i = last ? _scale - 1 - n : n;
+        BASparseBitArray *child = (BASparseBitArray *)[self childAtIndex:i];
+        NSUInteger found;
+        
+        if(child)
+            found = [child findBit:set last:last];
         else
-            [self.bits clearRange:range];
-        if(_rangeUpdateBlock)
-            _rangeUpdateBlock(self, range, setBits);
+            found = set ? NSNotFound : (last ? childSize - 1 : 0);
+        
+        if(NSNotFound != found)
+            return i * childSize + found;
+    }
+    
+    return NSNotFound;
+}
+
+// Bulk updates are split into items of at most one leaf each. Items are applied on the calling thread
+// if they fit in one grain, otherwise a grain at a time with dispatch_apply, which waits for them all.
+- (void)applyBulkItems:(NSData *)items block:(BASparseBulkItemBlock)block {
+    
+    const BASparseBulkItem *item = [items bytes];
+    NSUInteger count = [items length] / sizeof(BASparseBulkItem);
+    NSUInteger grain = MAX(1, BASparseBulkGrainBits / _leafSize);
+    
+    if(count <= grain) {
+        for (NSUInteger i=0; i<count; ++i)
+            block(item + i);
         return;
     }
     
+    dispatch_apply((count + grain - 1) / grain, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+        NSUInteger end = MIN(count, (chunk + 1) * grain);
+        for (NSUInteger i=chunk * grain; i<end; ++i)
+            block(item + i);
+    });
+}
+
+// Callers grow the tree and make the leaves on the calling thread; only the leaf updates are deferred
+- (void)applyBulkItems:(NSData *)items block:(BASparseBulkItemBlock)block completion:(dispatch_block_t)completion {
+    if(!completion) {
+        [self applyBulkItems:items block:block];
+        return;
+    }
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [self applyBulkItems:items block:block];
+        completion();
+    });
+}
+
+- (NSData *)bulkItemsForRange:(NSRange)range {
     
-    NSUInteger treeSize = [self treeSizeForStorageIndex:range.location + range.length];
-    NSUInteger childSize = treeSize >> _power;
-    dispatch_group_t group = dispatch_group_create();
+    NSMutableData *items = [NSMutableData data];
     
     while (range.length) {
         
+        BASparseBulkItem item = { nil };
         NSUInteger offset = 0;
-        BASparseBitArray *child = (BASparseBitArray *)[self childForStorageIndex:range.location offset:&offset];
-        NSUInteger length = MIN(range.length, childSize - range.location);
         
-        dispatch_group_enter(group);
-        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-            [child updateRange:NSMakeRange(range.location-offset, length) set:setBits];
-            dispatch_group_leave(group);
-        });
-        range.location += length;
-        range.length -= length;
+        item.leaf = (BASparseBitArray *)[self leafForStorageIndex:range.location offset:&offset];
+        item.range.location = range.location - offset;
+        item.range.length = MIN(range.length, _leafSize - item.range.location);
+        [items appendBytes:&item length:sizeof(item)];
+        
+        range.location += item.range.length;
+        range.length -= item.range.length;
+    }
+    
+    return items;
+}
+
+- (NSData *)bulkItemsForRegion:(BARegion2)region origin:(BAPoint2)origin {
+    
+    NSMutableData *items = [NSMutableData data];
+    NSInteger base = (NSInteger)_base;
+    
+    if(BARegion2IsEmpty(region))
+        return items;
+    
+    for (NSInteger y=region.origin.y - region.origin.y % base; y<BARegion2GetMaxY(region); y+=base) {
+        for (NSInteger x=region.origin.x - region.origin.x % base; x<BARegion2GetMaxX(region); x+=base) {
+            
+            BARegion2 tile = BARegion2Intersection(region, BARegion2Make(x, y, base, base));
+            BASparseBulkItem item = { nil };
+            
+            item.leaf = (BASparseBitArray *)[self leafForStorageIndex:StorageIndexFor2DCoordinates(x, y, _base) offset:NULL];
+            item.origin = BAPoint2Make(origin.x + tile.origin.x - region.origin.x, origin.y + tile.origin.y - region.origin.y);
+            item.region = BARegion2Make(tile.origin.x - x, tile.origin.y - y, tile.size.width, tile.size.height);
+            [items appendBytes:&item length:sizeof(item)];
+        }
     }
     
-    dispatch_release(group);
+    return items;
 }
 
-- (void)updateRange:(NSRange)range set:(BOOL)setBits {
+// Existing leaves only; if <storage> is NO, leaves which have not made their bits are skipped. Sub-trees
+// which are already full, when setting, or empty, when clearing, are skipped too.
+- (void)collectLeaves:(NSMutableData *)items withStorage:(BOOL)storage {
+    
+    if(self.count == (storage ? _treeSize : 0))
+        return;
+    
+    if(0 == _level) {
+        if(storage || _bits || _file) {
+            BASparseBulkItem item = { self, NSMakeRange(0, _leafSize) };
+            [items appendBytes:&item length:sizeof(item)];
+        }
+        return;
+    }
+    
+    for (NSUInteger i=0; i<_scale; ++i)
+        [(BASparseBitArray *)[self childAtIndex:i] collectLeaves:items withStorage:storage];
+}
+
+- (void)updateRange:(NSRange)range set:(BOOL)setBits completion:(dispatch_block_t)completion {
     
     NSUInteger maxIndex = range.location + range.length;
     
     if(maxIndex >= _treeSize)
         [self expandToFitSize:maxIndex];
     
-    [self recursiveUpdateRange:range set:setBits];    
+    [self applyBulkItems:[self bulkItemsForRange:range] block:^(const BASparseBulkItem *item) {
+        BASparseBitArray *leaf = item->leaf;
+        [leaf pinStorage];
+        id<BABitArray2D> bits = leaf.bits;
+        NSUInteger count = [bits count];
+        if(setBits)
+            [bits setRange:item->range];
+        else
+            [bits clearRange:item->range];
+        [leaf didWriteBits:(NSInteger)([bits count] - count)];
+        [leaf unpinStorage];
+        if(leaf->_rangeUpdateBlock)
+            leaf->_rangeUpdateBlock(leaf, item->range, setBits);
+    } completion:completion];
+}
+
+- (void)updateRegion2:(BARegion2)region set:(BOOL)set completion:(dispatch_block_t)completion {
+    
+    [self expandToFitRegion2:region];
+    [self applyBulkItems:[self bulkItemsForRegion:region origin:BAPoint2Zero()] block:^(const BASparseBulkItem *item) {
+        BASparseBitArray *leaf = item->leaf;
+        [leaf pinStorage];
+        id<BABitArray2D> bits = leaf.bits;
+        NSUInteger count = [bits count];
+        if(set)
+            [bits setRegion2:item->region];
+        else
+            [bits clearRegion2:item->region];
+        [leaf didWriteBits:(NSInteger)([bits count] - count)];
+        [leaf unpinStorage];
+        if(leaf->_refreshBlock)
+            leaf->_refreshBlock(leaf);
+    } completion:completion];
+}
+
+- (void)expandToFitRegion2:(BARegion2)region {
+    if(BARegion2IsEmpty(region))
+        return;
+    NSUInteger maxIndex = StorageIndexFor2DCoordinates(BARegion2GetMaxX(region) - 1, BARegion2GetMaxY(region) - 1, _base);
+    if(maxIndex >= _treeSize)
+        [self expandToFitSize:maxIndex+1];
+}
+
+
+#pragma mark - Bulk Updates
+
+- (void)setRange:(NSRange)range completion:(dispatch_block_t)completion {
+    [self updateRange:range set:YES completion:completion];
+}
+
+- (void)clearRange:(NSRange)range completion:(dispatch_block_t)completion {
+    [self updateRange:range set:NO completion:completion];
+}
+
+- (void)setRegion2:(BARegion2)region completion:(dispatch_block_t)completion {
+    [self updateRegion2:region set:YES completion:completion];
+}
+
+- (void)clearRegion2:(BARegion2)region completion:(dispatch_block_t)completion {
+    [self updateRegion2:region set:NO completion:completion];
+}
+
+- (void)setAllWithCompletion:(dispatch_block_t)completion {
+    
+    NSMutableData *items = [NSMutableData data];
+    
+    [self collectLeaves:items withStorage:YES];
+    [self applyBulkItems:items block:^(const BASparseBulkItem *item) {
+        [item->leaf pinStorage];
+        id<BABitArray2D> bits = item->leaf.bits;
+        NSUInteger count = [bits count];
+        [bits setAll];
+        [item->leaf didWriteBits:(NSInteger)([bits count] - count)];
+        [item->leaf unpinStorage];
+    } completion:completion];
+}
+
+- (void)clearAllWithCompletion:(dispatch_block_t)completion {
+    
+    NSMutableData *items = [NSMutableData data];
+    
+    [self collectLeaves:items withStorage:NO];
+    [self applyBulkItems:items block:^(const BASparseBulkItem *item) {
+        [item->leaf pinStorage];
+        id<BABitArray2D> bits = item->leaf.bits;
+        NSUInteger count = [bits count];
+        [bits clearAll];
+        [item->leaf didWriteBits:(NSInteger)([bits count] - count)];
+        [item->leaf unpinStorage];
+    } completion:completion];
+}
+
+- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin completion:(dispatch_block_t)completion {
+    
+    [self expandToFitRegion2:region];
+    [self applyBulkItems:[self bulkItemsForRegion:region origin:origin] block:^(const BASparseBulkItem *item) {
+        BASparseBitArray *leaf = item->leaf;
+        [leaf pinStorage];
+        id<BABitArray2D> bits = leaf.bits;
+        NSUInteger count = [bits count];
+        [bits writeRegion2:item->region fromArray:bitArray offset:item->origin];
+        [leaf didWriteBits:(NSInteger)([bits count] - count)];
+        [leaf unpinStorage];
+        if(leaf->_refreshBlock)
+            leaf->_refreshBlock(leaf);
+    } completion:completion];
+}
+
+
+#pragma mark - Box Queries
+
+// <min> and <max> bound the box, <offset> is where this node starts; all are absolute co-ordinates
+- (void)enumerateSetBitsFrom:(const NSUInteger *)min to:(const NSUInteger *)max offset:(const NSUInteger *)offset batch:(BASparseBitsBatch *)batch {
+    
+    if(self.isEmpty)
+        return;
+    
+    if(_level) {
+        
+        NSUInteger childBase = _treeBase >> 1;
+        NSUInteger childOffset[_power];
+        
+        // bit j of the child index is the half it occupies along axis j
+        for (NSUInteger i=0; i<_scale && !batch->stop; ++i) {
+            
+            BASparseBitArray *child = (BASparseBitArray *)[self childAtIndex:i];
+            BOOL overlaps = child != nil;
+            
+            for (NSUInteger j=0; j<_power && overlaps; ++j) {
+                childOffset[j] = offset[j] + ((i >> j) & 1) * childBase;
+                overlaps = childOffset[j] < max[j] && childOffset[j] + childBase > min[j];
+            }
+            if(overlaps)
+                [child enumerateSetBitsFrom:min to:max offset:childOffset batch:batch];
+        }
+        return;
+    }
+    
+    // the part of the box in this leaf, relative to the leaf
+    NSUInteger lo[_power], hi[_power], row[_power];
+    
+    for (NSUInteger j=0; j<_power; ++j) {
+        lo[j] = MAX(min[j], offset[j]) - offset[j];
+        hi[j] = MIN(max[j], offset[j] + _base) - offset[j];
+        row[j] = lo[j];
+    }
+    
+    // visit each row of the box along the first axis; the other axes count like an odometer
+    NSUInteger power = _power, *pRow = row, x0 = offset[0] + lo[0];
+    [self pinStorage];
+    id<BABitArray2D> bits = [self storedBits];
+    
+    while(!batch->stop) {
+        
+        NSUInteger index = 0;
+        
+        for (NSUInteger j=_power; j-->1; )
+            index = (index + row[j]) * _base;
+        
+        LeafEnumerateRuns(bits, index + lo[0], hi[0] - lo[0], ^(NSRange run) {
+            for (NSUInteger x=run.location; x<NSMaxRange(run) && !batch->stop; ++x) {
+                if(batch->count == batch->capacity)
+                    FlushBatch(batch);
+                NSUInteger *point = batch->coordinates + batch->count * power;
+                point[0] = x0 + x;
+                for (NSUInteger j=1; j<power; ++j)
+                    point[j] = offset[j] + pRow[j];
+                ++batch->count;
+            }
+        });
+        
+        NSUInteger j = 1;
+        
+        while(j < _power && ++row[j] == hi[j]) {
+            row[j] = lo[j];
+            ++j;
+        }
+        if(j >= _power)
+            break;
+    }
+    
+    [self unpinStorage];
+}
+
+- (NSUInteger)enumerateSetBitsInBox:(const NSUInteger *)origin size:(const NSUInteger *)size block:(SparseBitsHandler)block {
+    
+    NSUInteger min[_power], max[_power], offset[_power];
+    BASparseBitsBatch batch = { block };
+    
+    for (NSUInteger j=0; j<_power; ++j) {
+        if(!size[j])
+            return 0;
+        min[j] = origin[j];
+        max[j] = origin[j] + size[j];
+        offset[j] = 0;
+    }
+    
+    batch.capacity = 1024;
+    batch.coordinates = malloc(batch.capacity * _power * sizeof(NSUInteger));
+    
+    [self enumerateSetBitsFrom:min to:max offset:offset batch:&batch];
+    FlushBatch(&batch);
+    free(batch.coordinates);
+    
+    return batch.total;
+}
+
+- (NSUInteger)enumerateSetBitsInRegion2:(BARegion2)region block:(SparseBitsHandler)block {
+    
+    NSAssert(_power == 2, @"2D query of a %tu-dimensional array", _power);
+    
+    region = BARegion2Intersection(region, BARegion2Make(0, 0, _treeBase, _treeBase));
+    if(BARegion2IsEmpty(region))
+        return 0;
+    
+    NSUInteger origin[2] = { region.origin.x, region.origin.y };
+    NSUInteger size[2] = { region.size.width, region.size.height };
+    
+    return [self enumerateSetBitsInBox:origin size:size block:block];
+}
+
+- (NSUInteger)enumerateSetBitsInRegion3:(BARegion3)region block:(SparseBitsHandler)block {
+    
+    NSAssert(_power == 3, @"3D query of a %tu-dimensional array", _power);
+    
+    region = BARegion3Intersection(region, BARegion3Make(0, 0, 0, _treeBase, _treeBase, _treeBase));
+    if(BARegion3IsEmpty(region))
+        return 0;
+    
+    NSUInteger origin[3] = { region.origin.x, region.origin.y, region.origin.z };
+    NSUInteger size[3] = { region.size.width, region.size.height, region.size.depth };
+    
+    return [self enumerateSetBitsInBox:origin size:size block:block];
 }
 
 
 #pragma mark - Accessors
 
 - (void)setBitArrayClass:(Class)bitArrayClass {
-	NSAssert([bitArrayClass isSubclassOfClass:[BABitArray class]], @"bitArrayClass %@ does not inherit from BABitArray", bitArrayClass);
+	NSAssert([bitArrayClass conformsToProtocol:@protocol(BABitArray2D)] &&
+             [bitArrayClass instancesRespondToSelector:@selector(initWithLength:size:)] &&
+             [bitArrayClass instancesRespondToSelector:@selector(checkCount)] &&
+             [bitArrayClass instancesRespondToSelector:@selector(setEnableArchiveCompression:)],
+             @"bitArrayClass %@ cannot be used for leaf storage", bitArrayClass);
 	_bitArrayClass = bitArrayClass;
 }
 
-- (BABitArray *)bits {
-    if(!_bits && _level == 0) {
-        @synchronized(self) {
-            if(!_bits) {
-                _bits = [[_bitArrayClass alloc] initWithLength:_leafSize size:[BASampleArray sampleArrayForBase:_base power:_power]];
-                _bits.enableArchiveCompression = self.enableArchiveCompression;
-            }
+// Published with compare-and-swap, like children; a thread which loses the race releases its bits
+- (id<BABitArray2D>)bits {
+    if(_pager && _level == 0)
+        [self willUseStorage];
+    id<BABitArray2D> bits = __atomic_load_n(&_bits, __ATOMIC_ACQUIRE);
+    if(!bits && _level == 0) {
+        BASampleArray *size = _leafDimensions ?: [BASampleArray sampleArrayForBase:_base power:_power];
+        id<BASparseBitArrayLeaf> newBits;
+        if(_slab && [_bitArrayClass isSubclassOfClass:[BABitArray class]])
+            newBits = [(BABitArray *)[_bitArrayClass alloc] initWithLength:_leafSize size:size slab:_slab];
+        else
+            newBits = [[_bitArrayClass alloc] initWithLength:_leafSize size:size];
+        [newBits setEnableArchiveCompression:self.enableArchiveCompression];
+        if(_file)
+            LoadBits(newBits, [_file payloadWithRange:_payload]);
+        if(__atomic_compare_exchange_n(&_bits, &bits, (id<BABitArray2D>)newBits, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            bits = newBits;
+            if(_pager)
+                [self didLoadStorage];
+        }
+        else {
+            [newBits release];
         }
     }
-    return _bits;
+    return bits;
+}
+
+// Leaves swap in their bits with the count they already have
+- (void)setBits:(id<BABitArray2D>)bits {
+    if(bits == _bits)
+        return;
+    NSInteger delta = (NSInteger)([bits count] - [_bits count]);
+    [_bits release];
+    _bits = [bits retain];
+    [self didWriteBits:delta];
 }
 
 - (NSUInteger)length { return _treeSize; }
 
 - (NSUInteger)count {
+    NSAssert(_level || !_bits || [(id<BASparseBitArrayLeaf>)_bits checkCount], @"count check failed");
+    return __atomic_load_n(&_population, __ATOMIC_RELAXED);
+}
 
-    if(_level == 0) {
-        NSAssert([_bits checkCount], @"count check failed");
-        return [_bits count];
-    }
-    
-    NSUInteger count = 0;
-    
-    for (id child in _children)
-        if(child != [NSNull null])
-            count += [child count];
-    
-    return count;
+- (BOOL)isEmpty {
+    return 0 == self.count;
+}
+
+- (BOOL)isFull {
+    return _treeSize == self.count;
 }
 
 
@@ -143,20 +635,73 @@
 	return self;
 }
 - (void)dealloc {
-    self.bits = nil;
+    [_bits release], _bits = nil;
+    [_leafDimensions release], _leafDimensions = nil;
     [super dealloc];
 }
 
 #pragma mark - BASparseArray
 
-- (id)initWithParent:(BASparseArray *)parent {
-	self = [super initWithParent:parent];
+- (id)initWithParent:(BASparseArray *)parent index:(NSUInteger)index {
+	self = [super initWithParent:parent index:index];
 	if (self) {
 		_bitArrayClass = [(BASparseBitArray *)parent bitArrayClass];
+		_leafDimensions = [((BASparseBitArray *)parent)->_leafDimensions retain];
 	}
 	return self;
 }
 
+// Only the root makes the storage shared by the tree; buffers big enough to be mapped are left alone
+- (id)initWithBase:(NSUInteger)base power:(NSUInteger)power {
+	self = [super initWithBase:base power:power];
+	if (self) {
+		NSUInteger leafBytes = (_leafSize + 7) / 8;
+		_leafDimensions = [[BASampleArray sampleArrayForBase:base power:power] retain];
+		if(leafBytes < [BABitArray mappedStorageThreshold])
+			_slab = [[BASlabAllocator alloc] initWithBlockSize:leafBytes];
+	}
+	return self;
+}
+
+// The new child takes over all of the set bits, including those of a root which was a leaf
+- (void)insertGeneration {
+    
+    [super insertGeneration];
+    
+    BASparseBitArray *child = (BASparseBitArray *)_children[0];
+    
+    child->_population = _population;
+    if(0 == child->_level) {
+        child->_bits = _bits;
+        _bits = nil;
+    }
+}
+
+- (void)loadFromFile:(BASparseArrayFile *)file payload:(NSRange)payload population:(NSUInteger)population {
+    [super loadFromFile:file payload:payload population:population];
+    [self addPopulation:(NSInteger)population];
+}
+
+- (NSData *)leafPayload {
+    return [self payloadForStorage:[self storedBits]];
+}
+
+- (NSData *)payloadForStorage:(id)storage {
+    return storage ? PayloadForBits(storage) : nil;
+}
+
+- (id)residentStorage {
+    return __atomic_load_n(&_bits, __ATOMIC_ACQUIRE);
+}
+
+- (id)takeResidentStorage {
+    return __atomic_exchange_n(&_bits, nil, __ATOMIC_ACQ_REL);
+}
+
+- (NSUInteger)storageBytes {
+    return (_leafSize + 7) / 8;
+}
+
 
 #pragma mark - NSCoding
 - (id)initWithCoder:(NSCoder *)aDecoder {
@@ -164,14 +709,25 @@
     if(self) {
         _bits = [[aDecoder decodeObjectForKey:@"bits"] retain];
 		_bitArrayClass = NSClassFromString([aDecoder decodeObjectForKey:@"bitArrayClass"]);
+        
+        // populations are not archived; children are decoded first
+        if(0 == _level) {
+            _population = [_bits count];
+        }
+        else {
+            for (NSUInteger i=0; i<_scale; ++i)
+                _population += [(BASparseBitArray *)_children[i] count];
+        }
     }
     return self;
 }
 
 - (void)encodeWithCoder:(NSCoder *)aCoder {
     [super encodeWithCoder:aCoder];
-	if(_bits) {
-        [aCoder encodeObject:_bits forKey:@"bits"];
+	if(_bits || _file) {
+        [self pinStorage];
+        [aCoder encodeObject:self.bits forKey:@"bits"];
+        [self unpinStorage];
 	}
 	if (_bitArrayClass) {
 		[aCoder encodeObject:NSStringFromClass(_bitArrayClass) forKey:@"bitArrayClass"];
@@ -184,7 +740,10 @@
 - (BOOL)bit:(NSUInteger)index {
     NSUInteger offset = 0;
     BASparseBitArray *leaf = (BASparseBitArray *)[self leafForStorageIndex:index offset:&offset];
-    return [leaf.bits bit:index-offset];
+    [leaf pinStorage];
+    BOOL bit = [leaf.bits bit:index-offset];
+    [leaf unpinStorage];
+    return bit;
 }
 
 - (void)setBit:(NSUInteger)index {
@@ -196,125 +755,35 @@
 }
 
 - (void)setRange:(NSRange)range {
-    [self updateRange:range set:YES];
+    [self updateRange:range set:YES completion:nil];
 }
 
 - (void)clearRange:(NSRange)range {
-    [self updateRange:range set:NO];
+    [self updateRange:range set:NO completion:nil];
 }
 
 - (void)setAll {
-    if(0 == _level)
-        // AVOID creating if not created
-        [_bits setAll];
-    else {
-        for (id child in self.children) {
-            if(child != [NSNull null])
-                [child setAll];
-        }
-    }
+    [self setAllWithCompletion:nil];
 }
 
 - (void)clearAll {
-    if(!_level)
-        // AVOID creating if not created
-        [_bits clearAll];
-    else {
-        for (id child in self.children) {
-            if(child != [NSNull null])
-                [child clearAll];
-        }
-    }
+    [self clearAllWithCompletion:nil];
 }
 
 - (NSUInteger)firstSetBit {
-    
-    if(0 == _level)
-        return _bits ? [_bits firstSetBit] : NSNotFound;
-    
-    NSUInteger firstSetBit = NSNotFound;
-
-    for (id child in self.children) {
-        if(child == [NSNull null])
-            continue;
-        firstSetBit = [child firstSetBit];
-        if(NSNotFound != firstSetBit)
-            break;
-    }
-    
-    return firstSetBit;
+    return [self findBit:YES last:NO];
 }
 
 - (NSUInteger)lastSetBit {
-    
-    if(0 == _level)
-        return _bits ? [_bits lastSetBit] : NSNotFound;
-    
-    NSUInteger lastSetBit = NSNotFound;
-    
-    for (id child in [self.children reverseObjectEnumerator]) {
-        if(child == [NSNull null])
-            continue;
-        lastSetBit = [child firstSetBit];
-        if(NSNotFound != lastSetBit)
-            break;
-    }
-    
-    return lastSetBit;
+    return [self findBit:YES last:YES];
 }
 
 - (NSUInteger)firstClearBit {
-    
-    if(0 == _level)
-        return [_bits lastClearBit];
-    
-    NSUInteger firstClearBit = NSNotFound;
-
-    for (id child in self.children) {
-        if(child == [NSNull null])
-            continue;
-        firstClearBit = [child firstClearBit];
-        if(NSNotFound != firstClearBit)
-            break;
-    }
-    
-    return firstClearBit;
+    return [self findBit:NO last:NO];
 }
 
-- (NSUInteger)lastClearBit { return NSNotFound; }
-
-- (NSUInteger)recursiveUpdateBits:(BOOL *)bits write:(BOOL)write range:(NSRange)bitRange {
-
-    NSUInteger first = bitRange.location%_treeBase;
-    NSUInteger last = first + bitRange.length;
-    
-    NSAssert(last <= _treeBase, @"Range exceeds bounds");
-    
-    if(0 == _level) {
-        if(write)
-            return [self.bits readBits:bits range:bitRange];
-        else
-            return [self.bits writeBits:bits range:bitRange];
-    }
-    else {
-        
-        NSUInteger treeSize = [self treeSizeForStorageIndex:bitRange.location + bitRange.length];
-        NSUInteger childSize = treeSize >> _power;
-        NSUInteger result = 0;
-        
-        while (bitRange.length) {
-            
-            NSUInteger offset = 0;
-            BASparseBitArray *child = (BASparseBitArray *)[self childForStorageIndex:bitRange.location offset:&offset];
-            NSUInteger length = MIN(bitRange.length, childSize - bitRange.location);
-            
-            result += [child recursiveUpdateBits:bits+offset write:write range:NSMakeRange(bitRange.location-offset, length)];
-            bitRange.location += length;
-            bitRange.length -= length;
-        }
-        
-        return result;
-    }
+- (NSUInteger)lastClearBit {
+    return [self findBit:NO last:YES];
 }
 
 - (NSUInteger)updateBits:(BOOL *)bits write:(BOOL)write range:(NSRange)bitRange {
@@ -324,7 +793,30 @@
     if(maxIndex >= _treeSize)
         [self expandToFitSize:maxIndex];
 
-    return [self recursiveUpdateBits:bits write:write range:bitRange];
+    NSData *items = [self bulkItemsForRange:bitRange];
+    const BASparseBulkItem *item = [items bytes];
+    NSUInteger itemCount = [items length] / sizeof(BASparseBulkItem);
+    NSUInteger result = 0;
+    
+    for (NSUInteger i=0; i<itemCount; ++i, ++item) {
+        
+        [item->leaf pinStorage];
+        
+        id<BABitArray2D> leafBits = item->leaf.bits;
+        
+        if(write) {
+            NSUInteger count = [leafBits count];
+            result += [leafBits writeBits:bits range:item->range];
+            [item->leaf didWriteBits:(NSInteger)([leafBits count] - count)];
+        }
+        else {
+            result += [leafBits readBits:bits range:item->range];
+        }
+        [item->leaf unpinStorage];
+        bits += item->range.length;
+    }
+    
+    return result;
 }
 
 - (NSUInteger)readBits:(BOOL *)bits range:(NSRange)bitRange {
@@ -361,12 +853,6 @@
 @end
 
 
-@interface BABitArray (ExposedPrivates)
-- (void)updateRegion2:(BARegion2)region set:(BOOL)set;
-
-@end
-
-
 @implementation BASparseBitArray (SpatialStorage)
 
 - (BASampleArray *)size {
@@ -421,90 +907,12 @@
     [self updateBitAtX:x y:y z:z set:NO];
 }
 
-- (void)recursiveUpdateRegion2:(BARegion2)region set:(BOOL)set {
-    
-    if(0 == _level) {
-        [self.bits updateRegion2:region set:set];
-        if(_refreshBlock)
-            _refreshBlock(self);
-    }
-    else {
-        // partition the rectangle between the children, offset, recurse
-        NSUInteger childBase = _treeBase/2;
-        
-        for (NSUInteger i=0; i<4; ++i) {
-            
-            BARegion2 subRegion = BARegion2Intersection(region, BARegion2Make(i&1 ? childBase : 0, i&2 ? childBase : 0, childBase, childBase));
-            if (BARegion2IsEmpty(subRegion)) {
-                continue;
-            }
-            
-            if(i&1)
-                subRegion.origin.x -= childBase;
-            if(i&2)
-                subRegion.origin.y -= childBase;
-            
-            [(BASparseBitArray *)[self childAtIndex:i create:YES] recursiveUpdateRegion2:subRegion set:set];
-        }
-    }
-}
-
-- (void)updateRegion2:(BARegion2)region set:(BOOL)set {
-    
-    NSUInteger maxIndex = StorageIndexFor2DCoordinates(BARegion2GetMaxX(region), BARegion2GetMaxY(region), _treeBase);
-    if(maxIndex >= _treeSize)
-        [self expandToFitSize:maxIndex+1];
-    [self recursiveUpdateRegion2:region set:set];
-}
-
 - (void)setRegion2:(BARegion2)region {
-    [self updateRegion2:region set:YES];
+    [self updateRegion2:region set:YES completion:nil];
 }
 
 - (void)clearRegion2:(BARegion2)region {
-    [self updateRegion2:region set:NO];
-}
-
-- (void)recursiveWriteRegion:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin dispatchGroup:(dispatch_group_t)group {
-    
-    if(0 == _level) {
-        [self.bits writeRegion2:region fromArray:bitArray offset:origin];
-        if(_refreshBlock)
-            _refreshBlock(self);
-    }
-    else {
-		
-        NSUInteger childBase = _treeBase/2;
-        
-        for (NSUInteger i=0; i<4; ++i) {
-			
-			BASparseBitArray *child = (BASparseBitArray *)[self childAtIndex:i create:YES];
-            
-			dispatch_group_enter(group);
-            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-                
-                BARegion2 subRect = BARegion2Intersection(region, BARegion2Make(i&1 ? childBase : 0, i&2 ? childBase : 0, childBase, childBase));
-                BAPoint2 offset = origin;
-                
-                if(!BARegion2IsEmpty(subRect)) {
-                    
-                    if(i&1) {
-                        subRect.origin.x -= childBase;
-                        if(region.origin.x < childBase)
-                            offset.x += (childBase - region.origin.x);
-                    }
-                    if(i&2) {
-                        subRect.origin.y -= childBase;
-                        if(region.origin.y < childBase)
-                            offset.y += (childBase - region.origin.y);
-                    }
-                    
-                    [child recursiveWriteRegion:subRect fromArray:bitArray offset:offset dispatchGroup:group];
-                }
-                dispatch_group_leave(group);
-            });
-        }
-    }
+    [self updateRegion2:region set:NO completion:nil];
 }
 
 - (NSUInteger)readBits:(BOOL *)bits fromX:(NSUInteger)x y:(NSUInteger)y length:(NSUInteger)length {
@@ -530,8 +938,11 @@
         
         if(leafIndex < leafCount)
             leaf = (BASparseBitArray *)[self leafForIndex:leafIndex];
-        if(leaf)
+        if(leaf) {
+            [leaf pinStorage];
             subCount = [leaf.bits readBits:subBits range:bitsRange];
+            [leaf unpinStorage];
+        }
         else
             memset(subBits, 0, ll);
 
@@ -549,19 +960,45 @@
     return count;
 }
 
-- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin {
-
-    NSUInteger maxIndex = StorageIndexFor2DCoordinates(BARegion2GetMaxX(region), BARegion2GetMaxY(region), _treeBase);
+// Leaves which were never written are skipped; runs which cross from one leaf to the next are joined
+- (void)enumerateRunsInRow:(NSUInteger)y block:(BABitArrayRunEnumerator)block {
     
-    if(maxIndex >= _treeSize)
-        [self expandToFitSize:maxIndex+1];
-	
-	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-		dispatch_group_t group = dispatch_group_create();
-        [self recursiveWriteRegion:region fromArray:bitArray offset:origin dispatchGroup:group];
-		dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
-		dispatch_release(group);
-	});
+    NSUInteger leafCount = powi(_scale, _level);
+    __block NSRange pending = NSMakeRange(NSNotFound, 0);
+    
+    for (NSUInteger x=0; x<_treeBase; x+=_base) {
+        
+        NSUInteger leafIndex = LeafIndexFor2DCoordinates(x, y, _base);
+        BASparseBitArray *leaf = nil;
+        
+        if(0 == _level)
+            leaf = self;
+        else if(leafIndex < leafCount)
+            leaf = (BASparseBitArray *)[self leafForIndex:leafIndex];
+        if(!leaf)
+            continue;
+        
+        [leaf pinStorage];
+        BABitArrayEnumerateRowRuns(leaf.bits, y%_base, _base, ^(NSRange run) {
+            run.location += x;
+            if(pending.location != NSNotFound && NSMaxRange(pending) == run.location) {
+                pending.length += run.length;
+            }
+            else {
+                if(pending.location != NSNotFound)
+                    block(pending);
+                pending = run;
+            }
+        });
+        [leaf unpinStorage];
+    }
+    
+    if(pending.location != NSNotFound)
+        block(pending);
+}
+
+- (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray offset:(BAPoint2)origin {
+    [self writeRegion2:region fromArray:bitArray offset:origin completion:nil];
 }
 
 - (void)writeRegion2:(BARegion2)region fromArray:(id<BABitArray2D>)bitArray {
@@ -640,10 +1077,12 @@ static NSArray *BlanksForRegion(BARegion2 region) {
         return nil;
     
     if(0 == _level) {
-        if(_bits)
-            return [_bits rowStringsForRegion2:region];
-        else
+        if(!_bits && !_file)
             return BlanksForRegion(region);
+        [self pinStorage];
+        NSArray *strings = [self.bits rowStringsForRegion2:region];
+        [self unpinStorage];
+        return strings;
     }
     
     
@@ -665,9 +1104,9 @@ static NSArray *BlanksForRegion(BARegion2 region) {
         if(i&2)
             subRegion.origin.y -= childBase;
         
-        id child = [_children objectAtIndex:i];
+        BASparseBitArray *child = (BASparseBitArray *)_children[i];
 
-        childStrings[i] = child == [NSNull null] ? BlanksForRegion(subRegion) : [child rowStringsForRegion2:subRegion];
+        childStrings[i] = child ? [child rowStringsForRegion2:subRegion] : BlanksForRegion(subRegion);
     }
     
     NSMutableArray *rowStrings = [NSMutableArray array];
@@ -17,15 +17,28 @@ typedef NSUInteger BABlockSample;
 
 @interface BASparseSampleArray : BASparseArray<BASampleArray> {
     BASampleArray *_samples;
+    NSUInteger _minimum; // summary of this sub-tree, good while _summaryValid is set
+    NSUInteger _maximum;
+    BOOL _summaryValid;
 }
 
-@property (nonatomic, strong, readonly) BASampleArray *samples;
+@property (nonatomic, strong, readonly) BASampleArray *samples; // from one slab per tree; see BASlabAllocator.h
+
+/* The smallest and largest samples in the whole tree. Samples are compared as unsigned integers, using the
+ * first word of samples larger than that, and parts of the tree which were never written count as zero.
+ *
+ * Every node keeps the summary of its sub-tree. A write marks the nodes above it out of date, and the next
+ * request brings up to date only those nodes, so repeated requests, and requests after a few writes, are cheap.
+ */
+@property (nonatomic, readonly) NSUInteger minimumSample;
+@property (nonatomic, readonly) NSUInteger maximumSample;
 
 - (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size NS_DESIGNATED_INITIALIZER;
 
 // deprecated; use -initWithPower:order:size
 - (id)initWithBase:(NSUInteger)base power:(NSUInteger)power sampleSize:(NSUInteger)size;
 
+// Writes beyond the tree grow it, as for sparse bit arrays; reads beyond it are zero
 - (BAPageSample)pageSampleAtX:(NSUInteger)x y:(NSUInteger)y;
 - (void)setPageSample:(BAPageSample)sample atX:(NSUInteger)x y:(NSUInteger)y;
 
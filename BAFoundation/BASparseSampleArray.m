@@ -10,41 +10,114 @@
 
 #import "BASparseArrayPrivate.h"
 #import <BAFoundation/BASampleArray.h>
+#import <BAFoundation/BASlabAllocator.h>
 #import <BAFoundation/BAFunctions.h>
 
 
-static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteger base, NSUInteger power) {
-    NSUInteger leafIndex = LeafIndexForCoordinates(coords, base, power);
-    NSUInteger result = leafIndex * powi(base, power);
-    for(NSUInteger i=0; i<power; ++i)
-        result += powi(base, power-1-i) + coords[i];
-    return power;
-}
-
-
 @implementation BASparseSampleArray
 
 @synthesize order=_order;
 @synthesize size=_size;
 
+#pragma mark - Private
+
+// A node which is out of date has ancestors which are out of date, so the walk stops at the first one
+- (void)invalidateSummary {
+    for (BASparseSampleArray *node = self; node; node = (BASparseSampleArray *)node.parent)
+        if(!__atomic_exchange_n(&node->_summaryValid, NO, __ATOMIC_ACQ_REL))
+            break;
+}
+
+- (void)didWriteSamples {
+    __atomic_store_n(&_dirty, YES, __ATOMIC_RELEASE);
+    [self invalidateSummary];
+}
+
+// The samples of a leaf which has any, loading them from its file if need be; never makes new ones. The
+// caller pins the leaf first.
+- (BASampleArray *)storedSamples {
+    return __atomic_load_n(&_samples, __ATOMIC_ACQUIRE) || _file ? self.samples : nil;
+}
+
+// Brings this sub-tree up to date; only the nodes written since the last summary are visited
+- (void)summarize {
+    
+    if(__atomic_load_n(&_summaryValid, __ATOMIC_ACQUIRE))
+        return;
+    
+    // set first, so that a write made while summarizing marks the node out of date again
+    __atomic_store_n(&_summaryValid, YES, __ATOMIC_RELEASE);
+    
+    NSUInteger minimum = NSUIntegerMax, maximum = 0;
+    
+    if(0 == _level) {
+        
+        [self pinStorage];
+        
+        BASampleArray *samples = [self storedSamples];
+        const UInt8 *buffer = samples.samples;
+        NSUInteger width = MIN(_size, sizeof(NSUInteger));
+        
+        if(!samples)
+            minimum = 0;
+        for (NSUInteger i=0; samples && i<_leafSize; ++i, buffer+=_size) {
+            NSUInteger sample = 0;
+            memcpy(&sample, buffer, width);
+            minimum = MIN(minimum, sample);
+            maximum = MAX(maximum, sample);
+        }
+        
+        [self unpinStorage];
+    }
+    else {
+        for (NSUInteger i=0; i<_scale; ++i) {
+            BASparseSampleArray *child = (BASparseSampleArray *)[self childAtIndex:i];
+            if(!child) {
+                minimum = 0;
+                continue;
+            }
+            [child summarize];
+            minimum = MIN(minimum, child->_minimum);
+            maximum = MAX(maximum, child->_maximum);
+        }
+    }
+    
+    _minimum = minimum;
+    _maximum = maximum;
+}
+
 #pragma mark - Accessors
 
 - (BASampleArray *)samples {
-    if(!_samples && _level == 0) {
-        @synchronized(self) {
-            if(!_samples) {
-                // self.base is the same thing as BASampleArray.order (Need to change the name on the latter)
-                _samples = [BASampleArray sampleArrayWithPower:self.power order:self.base size:_size];
-            }
+    if(_pager && _level == 0)
+        [self willUseStorage];
+    BASampleArray *samples = __atomic_load_n(&_samples, __ATOMIC_ACQUIRE);
+    if(!samples && _level == 0) {
+        // self.base is the same thing as BASampleArray.order (Need to change the name on the latter)
+        BASampleArray *newSamples = [[BASampleArray alloc] initWithPower:self.power order:self.base size:_size slab:_slab];
+        if(_file) {
+            NSData *payload = [_file payloadWithRange:_payload];
+            if([payload length] < newSamples.length)
+                [NSException raise:NSInternalInconsistencyException format:@"sparse array file payload is too short"];
+            memcpy(newSamples.samples, [payload bytes], newSamples.length);
+        }
+        if(__atomic_compare_exchange_n(&_samples, &samples, newSamples, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            samples = newSamples;
+            if(_pager)
+                [self didLoadStorage];
+        }
+        else {
+            [newSamples release];
         }
     }
-    return _samples;
+    return samples;
 }
 
 
 #pragma mark - NSObject
 
 - (void)dealloc {
+    [_samples release], _samples = nil;
     self.updateBlock = nil;
     [super dealloc];
 }
@@ -52,28 +125,92 @@ static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteg
 
 #pragma mark - BASparseArray
 
+// New nodes hold nothing but zeroes, which is what their parent already assumed
+- (id)initWithBase:(NSUInteger)base power:(NSUInteger)power level:(NSUInteger)level {
+    self = [super initWithBase:base power:power level:level];
+    if(self) {
+        _summaryValid = YES;
+    }
+    return self;
+}
+
+- (id)initWithParent:(BASparseArray *)parent index:(NSUInteger)index {
+    self = [super initWithParent:parent index:index];
+    if(self) {
+        _size = [(BASparseSampleArray *)parent size];
+    }
+    return self;
+}
+
 - (id)initWithBase:(NSUInteger)base power:(NSUInteger)power {
     return [self initWithPower:power order:base size:1];
 }
 
+// The new child takes over the summary; the space added beside it reads as zeroes
+- (void)insertGeneration {
+    
+    [super insertGeneration];
+    
+    BASparseSampleArray *child = (BASparseSampleArray *)_children[0];
+    
+    child->_minimum = _minimum;
+    child->_maximum = _maximum;
+    child->_summaryValid = _summaryValid;
+    _minimum = 0;
+}
+
+- (void)loadFromFile:(BASparseArrayFile *)file payload:(NSRange)payload population:(NSUInteger)population {
+    [super loadFromFile:file payload:payload population:population];
+    [self invalidateSummary];
+}
+
+- (NSData *)leafPayload {
+    return [self payloadForStorage:[self storedSamples]];
+}
+
+- (NSData *)payloadForStorage:(id)storage {
+    return [(BASampleArray *)storage data];
+}
+
+- (id)residentStorage {
+    return __atomic_load_n(&_samples, __ATOMIC_ACQUIRE);
+}
+
+- (id)takeResidentStorage {
+    return __atomic_exchange_n(&_samples, nil, __ATOMIC_ACQ_REL);
+}
+
+- (NSUInteger)storageBytes {
+    return _leafSize * _size;
+}
+
 
 #pragma mark - BASampleArray
 
+// Only the root makes the storage shared by the tree
 - (id)initWithPower:(NSUInteger)power order:(NSUInteger)order size:(NSUInteger)size {
     self = [super initWithBase:order power:power];
     if(self) {
         _size = size;
+        _slab = [[BASlabAllocator alloc] initWithBlockSize:_leafSize * _size];
     }
     return self;
 }
 
+// Beyond the tree, samples read as zero
 - (void)sample:(UInt8 *)sample atIndex:(NSUInteger)index {
 
+    if(index >= _treeSize) {
+        memset(sample, 0, _size);
+        return;
+    }
+
     NSUInteger offset = 0;
     BASparseSampleArray *leaf = (BASparseSampleArray *)[self leafForStorageIndex:index offset:&offset];
-    BASampleArray *samples = leaf->_samples;
     
-    [samples sample:sample atIndex:index - offset];
+    [leaf pinStorage];
+    [leaf.samples sample:sample atIndex:index - offset];
+    [leaf unpinStorage];
 }
 
 - (void)sample:(UInt8 *)sample atCoordinates:(NSUInteger *)coordinates {
@@ -82,13 +219,18 @@ static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteg
 
 - (void)setSample:(UInt8 *)sample atIndex:(NSUInteger)index {
     
+    if(index >= _treeSize)
+        [self expandToFitSize:index+1];
+    
     NSUInteger offset = 0;
     BASparseSampleArray *leaf = (BASparseSampleArray *)[self leafForStorageIndex:index offset:&offset];
-    BASampleArray *samples = leaf->_samples;
     
     index -= offset;
     
-    [samples setSample:sample atIndex:index];
+    [leaf pinStorage];
+    [leaf.samples setSample:sample atIndex:index];
+    [leaf didWriteSamples];
+    [leaf unpinStorage];
     
     if(_updateBlock)
         _updateBlock(self, index, sample);
@@ -98,28 +240,29 @@ static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteg
     [self setSample:sample atIndex:StorageIndexForCoordinates(coordinates, _base, _power)];
 }
 
+// Samples may be smaller than the result; the rest of it is zero
 - (BAPageSample)pageSampleAtX:(NSUInteger)x y:(NSUInteger)y {
-    BAPageSample sample;
+    BAPageSample sample = 0;
     [self sample:(UInt8 *)&sample atIndex:StorageIndexFor2DCoordinates(x, y, _base)];
     return sample;
 }
 
 - (void)setPageSample:(BAPageSample)sample atX:(NSUInteger)x y:(NSUInteger)y {
-    [self setSample:(UInt8 *)sample atIndex:StorageIndexFor2DCoordinates(x, y, _base)];
+    [self setSample:(UInt8 *)&sample atIndex:StorageIndexFor2DCoordinates(x, y, _base)];
 }
 
 - (BABlockSample)blockSampleAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
-    BABlockSample sample;
+    BABlockSample sample = 0;
     [self sample:(UInt8 *)&sample atIndex:StorageIndexFor3DCoordinates(x, y, z, _base)];
     return sample;
 }
 
 - (void)setBlockSample:(BABlockSample)sample atX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
-    [self setSample:(UInt8 *)sample atIndex:StorageIndexFor3DCoordinates(x, y, z, _base)];
+    [self setSample:(UInt8 *)&sample atIndex:StorageIndexFor3DCoordinates(x, y, z, _base)];
 }
 
 - (float)blockFloatAtX:(NSUInteger)x y:(NSUInteger)y z:(NSUInteger)z {
-    float sample;
+    float sample = 0;
     [self sample:(UInt8 *)&sample atIndex:StorageIndexFor3DCoordinates(x, y, z, _base)];
     return sample;
 }
@@ -135,4 +278,14 @@ static inline NSUInteger StorageIndexForCoordinates(NSUInteger *coords, NSUInteg
     return [self initWithPower:power order:base size:size];
 }
 
+- (NSUInteger)minimumSample {
+    [self summarize];
+    return _minimum;
+}
+
+- (NSUInteger)maximumSample {
+    [self summarize];
+    return _maximum;
+}
+
 @end
@@ -23,6 +23,23 @@ typedef struct {
     BASize2 size;
 } BARegion2;
 
+typedef struct {
+    NSInteger x;
+    NSInteger y;
+    NSInteger z;
+} BAPoint3;
+
+typedef struct {
+    NSInteger width;
+    NSInteger height;
+    NSInteger depth;
+} BASize3;
+
+typedef struct {
+    BAPoint3 origin;
+    BASize3 size;
+} BARegion3;
+
 typedef NS_ENUM(NSUInteger, BAQuadrant) {
     BAQuadrant00 = 0x01, // +X, +Y
     BAQuadrant01 = 0x02, // -X, +Y
@@ -0,0 +1,27 @@
+//
+//  NSData+WAH.h
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-08.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Word-aligned hybrid run-length encoding, for bit buffers which are mostly runs of clear or set bits.
+ *
+ * The data is read as 64-bit words. Runs of all-clear or all-set words are replaced by a marker
+ * word, which also carries the count of mixed (literal) words which follow it verbatim. A word which
+ * differs from the run in a single bit is folded into the marker. Decoding is memset and memcpy.
+ */
+
+@interface NSData (WAH)
+
+- (NSData *)wahEncode;
+
+// length is the length of the original data; returns nil if the data is not a valid encoding of that length
+- (NSData *)wahDecodeWithLength:(NSUInteger)length;
+- (BOOL)wahDecodeIntoBytes:(void *)bytes length:(NSUInteger)length;
+
+@end
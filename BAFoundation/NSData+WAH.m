@@ -0,0 +1,189 @@
+//
+//  NSData+WAH.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-08.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <BAFoundation/NSData+WAH.h>
+
+
+/* Marker word, stored little-endian:
+ *
+ *  bit  63     fill value of the run
+ *  bits 57-62  position of the flipped bit in the odd word
+ *  bit  56     an odd word follows the run
+ *  bits 28-55  run length in words
+ *  bits 0-27   number of literal words which follow the marker
+ *
+ * Literal words are copied from the buffer unchanged; the last one is zero-padded if the data
+ * length is not a multiple of eight bytes.
+ */
+
+#define MARKER_FILL_BIT (1ULL << 63)
+#define MARKER_ODD_SHIFT 57
+#define MARKER_ODD_BIT (1ULL << 56)
+#define MARKER_RUN_SHIFT 28
+#define MARKER_MAX_RUN 0xFFFFFFFULL
+#define MARKER_MAX_LITERALS 0xFFFFFFFULL
+
+// 0 for a word of clear bits, 1 for a word of set bits, -1 for a mixed (literal) word
+static inline int WordFill(const unsigned char *bytes, size_t word, size_t length) {
+
+    uint64_t w = 0;
+    size_t offset = word * sizeof(uint64_t);
+
+    if(offset + sizeof(uint64_t) <= length) {
+        memcpy(&w, bytes + offset, sizeof(uint64_t));
+    }
+    else {
+        // a partial last word is a fill of either kind if its bytes are
+        unsigned char first = bytes[offset];
+        if(first != 0x00 && first != 0xFF)
+            return -1;
+        for (size_t i=offset+1; i<length; ++i)
+            if(bytes[i] != first)
+                return -1;
+        return first ? 1 : 0;
+    }
+
+    if(w == 0)
+        return 0;
+    if(w == ~0ULL)
+        return 1;
+    return -1;
+}
+
+static size_t WAHEncode(const unsigned char *bytes, size_t length, unsigned char *output) {
+
+    size_t words = (length + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    size_t word = 0;
+    size_t outLength = 0;
+
+    while(word < words) {
+
+        uint64_t run = 0;
+        uint64_t literals = 0;
+        int fill = WordFill(bytes, word, length);
+        int fillBit = fill > 0;
+
+        if(fill >= 0) {
+            while(word < words && run < MARKER_MAX_RUN && WordFill(bytes, word, length) == fill) {
+                ++run;
+                ++word;
+            }
+        }
+
+        // a full word after the fill which differs from it in one bit is folded into the marker
+        uint64_t odd = 0;
+
+        if(word < words && (word + 1) * sizeof(uint64_t) <= length) {
+            uint64_t w;
+            memcpy(&w, bytes + word * sizeof(uint64_t), sizeof(w));
+            w = CFSwapInt64LittleToHost(w) ^ (fillBit ? ~0ULL : 0);
+            if(w && !(w & (w - 1))) {
+                odd = MARKER_ODD_BIT | ((uint64_t)__builtin_ctzll(w) << MARKER_ODD_SHIFT);
+                ++word;
+            }
+        }
+
+        size_t literalStart = word;
+
+        while(!odd && word < words && literals < MARKER_MAX_LITERALS && WordFill(bytes, word, length) < 0) {
+            ++literals;
+            ++word;
+        }
+
+        uint64_t marker = CFSwapInt64HostToLittle((fillBit ? MARKER_FILL_BIT : 0) | odd | (run << MARKER_RUN_SHIFT) | literals);
+        memcpy(output + outLength, &marker, sizeof(marker));
+        outLength += sizeof(marker);
+
+        // literal words are stored as they are in the buffer; the last may be partial
+        size_t literalBytes = MIN((size_t)literals * sizeof(uint64_t), length - literalStart * sizeof(uint64_t));
+        memcpy(output + outLength, bytes + literalStart * sizeof(uint64_t), literalBytes);
+        outLength += literals * sizeof(uint64_t);
+        if(literalBytes < literals * sizeof(uint64_t))
+            memset(output + outLength - (literals * sizeof(uint64_t) - literalBytes), 0, literals * sizeof(uint64_t) - literalBytes);
+    }
+
+    return outLength;
+}
+
+// Worst case: one marker per literal word, plus the last marker
+static size_t WAHMaxEncodedLength(size_t length) {
+    size_t words = (length + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    return (words + 1) * sizeof(uint64_t) + (words / MARKER_MAX_LITERALS + 1) * sizeof(uint64_t);
+}
+
+static BOOL WAHDecode(const unsigned char *input, size_t inputLength, unsigned char *bytes, size_t length) {
+
+    const unsigned char *end = input + inputLength;
+    size_t offset = 0;
+
+    if(inputLength % sizeof(uint64_t))
+        return NO;
+
+    while(input < end) {
+
+        uint64_t marker;
+
+        memcpy(&marker, input, sizeof(marker));
+        marker = CFSwapInt64LittleToHost(marker);
+        input += sizeof(marker);
+
+        size_t runBytes = (size_t)((marker >> MARKER_RUN_SHIFT) & MARKER_MAX_RUN) * sizeof(uint64_t);
+        size_t literalBytes = (size_t)(marker & MARKER_MAX_LITERALS) * sizeof(uint64_t);
+
+        if(runBytes > length - offset + sizeof(uint64_t) - 1 || literalBytes > (size_t)(end - input))
+            return NO;
+
+        size_t n = MIN(runBytes, length - offset);
+        memset(bytes + offset, (marker & MARKER_FILL_BIT) ? 0xFF : 0x00, n);
+        offset += n;
+
+        if(marker & MARKER_ODD_BIT) {
+            uint64_t word = (marker & MARKER_FILL_BIT) ? ~0ULL : 0;
+            word = CFSwapInt64HostToLittle(word ^ (1ULL << ((marker >> MARKER_ODD_SHIFT) & 63)));
+            if(length - offset < sizeof(word))
+                return NO;
+            memcpy(bytes + offset, &word, sizeof(word));
+            offset += sizeof(word);
+        }
+
+        n = MIN(literalBytes, length - offset);
+        if(literalBytes > n + sizeof(uint64_t) - 1)
+            return NO;
+        memcpy(bytes + offset, input, n);
+        offset += n;
+        input += literalBytes;
+    }
+
+    return offset == length;
+}
+
+
+@implementation NSData (WAH)
+
+- (NSData *)wahEncode {
+    
+    NSUInteger length = [self length];
+    NSMutableData *encoded = [NSMutableData dataWithLength:WAHMaxEncodedLength(length)];
+    
+    [encoded setLength:WAHEncode([self bytes], length, [encoded mutableBytes])];
+    
+    return encoded;
+}
+
+- (NSData *)wahDecodeWithLength:(NSUInteger)length {
+    
+    NSMutableData *decoded = [NSMutableData dataWithLength:length];
+    
+    return [self wahDecodeIntoBytes:[decoded mutableBytes] length:length] ? decoded : nil;
+}
+
+- (BOOL)wahDecodeIntoBytes:(void *)bytes length:(NSUInteger)length {
+    return WAHDecode([self bytes], [self length], bytes, length);
+}
+
+@end
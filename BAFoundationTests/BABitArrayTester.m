@@ -9,9 +9,13 @@
 #import "BABitArrayTester.h"
 
 #import <BAFoundation/BABitArray.h>
+#import <BAFoundation/BABitArray+Rectangles.h>
 #import <BAFoundation/BAFunctions.h>
+#import <BAFoundation/NSData+GZip.h>
+#import <BAFoundation/NSData+WAH.h>
 
 @interface BABitArray (Testing)
++ (instancetype)testBitArrayWithSize2:(BASize2)size2;
 + (instancetype)testBitArray8by8;
 + (instancetype)testBitArray128by128;
 + (instancetype)testBitArray256by256;
@@ -188,6 +192,230 @@
     XCTAssertTrue([ba1 isEqualToBitArray:ba2], @"BABitArray encode-decode equality test failed");
 }
 
+- (void)test12EncodeDecodeCompressed {
+    
+    BABitArray *ba1 = [BABitArray testBitArray256by256];
+    
+    [ba1 setRegion2:BARegion2Make(10, 20, 100, 50)];
+    [ba1 setBitAtX:200 y:3];
+    [ba1 setBitAtX:7 y:250];
+    [ba1 setBitAtX:255 y:255];
+    ba1.enableArchiveCompression = YES;
+    
+    NSData *data = [NSKeyedArchiver archivedDataWithRootObject:ba1];
+    BABitArray *ba2 = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    
+    XCTAssertTrue([ba1 isEqualToBitArray:ba2], @"BABitArray run-length encode-decode equality test failed");
+    XCTAssertLessThan([data length], [[ba1 bufferData] length], @"BABitArray run-length encoding did not compress");
+    
+    // archives from before run-length encoding was introduced
+    NSMutableData *legacyData = [NSMutableData data];
+    NSKeyedArchiver *archiver = [[[NSKeyedArchiver alloc] initForWritingWithMutableData:legacyData] autorelease];
+    
+    [archiver encodeObject:[[ba1 bufferData] gzipDeflate] forKey:@"gzippedData"];
+    [archiver encodeInteger:(NSInteger)[ba1 length] forKey:@"length"];
+    [archiver encodeBool:YES forKey:@"compressed"];
+    [archiver encodeInteger:(NSInteger)[ba1 count] forKey:@"count"];
+    [archiver encodeObject:[ba1 size] forKey:@"size"];
+    [archiver finishEncoding];
+    
+    NSKeyedUnarchiver *unarchiver = [[[NSKeyedUnarchiver alloc] initForReadingWithData:legacyData] autorelease];
+    BABitArray *ba3 = [[[BABitArray alloc] initWithCoder:unarchiver] autorelease];
+    
+    XCTAssertTrue([ba1 isEqualToBitArray:ba3], @"BABitArray legacy gzip decode equality test failed");
+    
+    NSData *encoded = [[ba1 bufferData] wahEncode];
+    XCTAssertEqualObjects([encoded wahDecodeWithLength:[[ba1 bufferData] length]], [ba1 bufferData], @"run-length round trip failed");
+    XCTAssertNil([encoded wahDecodeWithLength:[[ba1 bufferData] length] - 8], @"run-length decode accepted the wrong length");
+}
+
+- (void)test13LargeMapped {
+    
+    NSUInteger length = (NSUInteger)1 << 32;
+    BABitArray *ba = [BABitArray bitArrayWithLength:length];
+    
+    XCTAssertEqual([ba storage], BABitArrayStorageMapped, @"large bit array should be mapped");
+    
+    [ba setBit:3];
+    [ba setBit:length - 1];
+    [ba setRange:NSMakeRange(((NSUInteger)1 << 31) - 10, 100)];
+    
+    XCTAssertEqual([ba count], (NSUInteger)102, @"large bit array count is wrong");
+    XCTAssertTrue([ba bit:length - 1], @"large bit array lost last bit");
+    XCTAssertEqual([ba lastSetBit], length - 1, @"large bit array last set bit is wrong");
+    XCTAssertEqual([ba nextAfter:3], ((NSUInteger)1 << 31) - 10, @"large bit array next bit is wrong");
+    
+    [ba clearAll];
+    
+    XCTAssertFalse([ba bit:length - 1], @"large bit array clear failed");
+    XCTAssertEqual([ba firstSetBit], (NSUInteger)NSNotFound, @"large bit array clear failed");
+    
+    XCTAssertEqual([[BABitArray bitArray4096] storage], BABitArrayStorageHeap, @"small bit array should use the heap");
+}
+
+- (void)test14CopyOnWrite {
+    
+    BABitArray *ba1 = [BABitArray testBitArray256by256];
+    
+    [ba1 setRegion2:BARegion2Make(10, 10, 20, 20)];
+    
+    BABitArray *ba2 = [[ba1 copy] autorelease];
+    NSUInteger bytes = [[ba1 bufferData] length];
+    
+    XCTAssertEqual([ba1 sharedBytes], bytes, @"copy should share the buffer");
+    XCTAssertEqual([ba2 privateBytes], (NSUInteger)0, @"copy should share the buffer");
+    
+    [ba2 setBitAtX:100 y:100];
+    
+    XCTAssertFalse([ba1 bitAtX:100 y:100], @"write to copy changed the original");
+    XCTAssertEqual([ba1 count], (NSUInteger)400, @"write to copy changed the original count");
+    XCTAssertEqual([ba2 count], (NSUInteger)401, @"write to copy failed");
+    XCTAssertEqual([ba1 privateBytes], bytes, @"original should own its buffer after the copy is written");
+    XCTAssertEqual([ba2 privateBytes], bytes, @"copy should own its buffer after it is written");
+    
+    NSData *snapshot = [ba1 bufferData];
+    [ba1 clearAll];
+    XCTAssertEqual([[[[BABitArray alloc] initWithData:snapshot length:[ba1 length]] autorelease] count], (NSUInteger)400, @"buffer data is not a snapshot");
+    
+    // mapped buffers are copied a page at a time by the system
+    BABitArray *ba3 = [BABitArray bitArrayWithLength:(NSUInteger)1 << 30];
+    
+    [ba3 setRange:NSMakeRange(0, 1 << 20)];
+    
+    BABitArray *ba4 = [[ba3 copy] autorelease];
+    
+    XCTAssertEqual([ba4 storage], BABitArrayStorageMapped, @"copy of mapped bit array should be mapped");
+    
+    [ba4 clearBit:5];
+    [ba3 setBit:((NSUInteger)1 << 30) - 1];
+    
+    XCTAssertTrue([ba3 bit:5], @"write to mapped copy changed the original");
+    XCTAssertFalse([ba4 bit:((NSUInteger)1 << 30) - 1], @"write to mapped original changed the copy");
+    XCTAssertEqual([ba4 count], (NSUInteger)(1 << 20) - 1, @"mapped copy count is wrong");
+}
+
+- (void)test15Concurrent {
+    
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(1000, 1000)];
+    const NSUInteger workers = 8;
+    
+    ba.concurrent = YES;
+    XCTAssertTrue(ba.isConcurrent, @"concurrent mode not enabled");
+    
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    
+    // workers interleave bits, so they all write to the same words; overlapping ranges and regions
+    // are only cleared together, or set together, so the result does not depend on the order
+    dispatch_apply(workers, queue, ^(size_t worker) {
+        for (NSUInteger i=worker; i<[ba length]; i+=workers)
+            [ba setBit:i];
+        for (NSUInteger i=worker; i<[ba length]; i+=workers*2)
+            [ba clearBit:i];
+    });
+    dispatch_apply(workers, queue, ^(size_t worker) {
+        [ba clearRegion2:BARegion2Make(worker * 100, 0, 50, 1000)];
+    });
+    dispatch_apply(workers, queue, ^(size_t worker) {
+        [ba setRange:NSMakeRange(500000 + worker * 1000, 1500)];
+    });
+    
+    BABitArray *expected = [BABitArray bitArrayWithSize2:BASize2Make(1000, 1000)];
+    
+    for (NSUInteger i=0; i<[expected length]; ++i)
+        if((i % (workers*2)) >= workers)
+            [expected setBit:i];
+    for (NSUInteger worker=0; worker<workers; ++worker)
+        [expected clearRegion2:BARegion2Make(worker * 100, 0, 50, 1000)];
+    [expected setRange:NSMakeRange(500000, workers * 1000 + 500)];
+    
+    XCTAssertTrue([ba checkCount], @"concurrent count is wrong");
+    XCTAssertEqual([ba count], [expected count], @"concurrent count is wrong");
+    XCTAssertEqualObjects(ba, expected, @"concurrent updates were lost");
+    
+    ba.concurrent = NO;
+    XCTAssertTrue([ba checkCount], @"count is wrong after leaving concurrent mode");
+}
+
+- (void)test16ChangeTracking {
+    
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(100, 100)];
+    
+    [ba setBitAtX:99 y:99];
+    XCTAssertNil([ba takeDirtyTiles], @"tracking should be off by default");
+    
+    [ba setTrackingTileSize:16];
+    
+    [ba setBitAtX:99 y:99];
+    XCTAssertEqual([[ba takeDirtyTiles] count], (NSUInteger)0, @"unchanged bit marked dirty");
+    
+    [ba setBitAtX:5 y:5];
+    [ba setRegion2:BARegion2Make(20, 40, 30, 10)];
+    [ba clearBitAtX:99 y:99];
+    
+    BABitArray *tiles = [ba takeDirtyTiles];
+    
+    XCTAssertEqual(tiles.size.size2.width, (NSInteger)7, @"wrong tile grid");
+    XCTAssertEqual([tiles count], (NSUInteger)(1 + 3 * 2 + 1), @"wrong dirty tiles");
+    XCTAssertTrue([tiles bitAtX:0 y:0], @"set bit not marked");
+    XCTAssertTrue([tiles bitAtX:3 y:3], @"region not marked");
+    XCTAssertTrue([tiles bitAtX:6 y:6], @"cleared bit not marked");
+    XCTAssertEqual([[ba takeDirtyTiles] count], (NSUInteger)0, @"taking tiles did not reset them");
+    
+    __block NSUInteger regionCount = 0;
+    __block BARegion2 lastRegion;
+    
+    [ba setRegion2:BARegion2Make(0, 64, 40, 36)];
+    [ba takeDirtyRegions2:^(BARegion2 region) {
+        ++regionCount;
+        lastRegion = region;
+    }];
+    XCTAssertEqual(regionCount, (NSUInteger)1, @"dirty tiles were not merged");
+    XCTAssertTrue(BARegion2EqualToRegion2(lastRegion, BARegion2Make(0, 64, 48, 36)), @"wrong dirty region");
+    
+    // a range across rows marks the whole rows it touches
+    [ba setRange:NSMakeRange(150, 200)];
+    XCTAssertEqual([[ba takeDirtyTiles] count], (NSUInteger)7, @"range not marked");
+    
+    [ba setRegion3:BARegion3Make(90, 0, 0, 10, 10, 1)];
+    XCTAssertTrue([[ba takeDirtyTiles] bitAtX:5 y:0], @"box not marked");
+}
+
+- (void)test17RectangleIndex {
+    
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(100, 60)];
+    
+    XCTAssertTrue(CGRectEqualToRect([ba largestEmptyRect], CGRectMake(0, 0, 100, 60)), @"empty array");
+    
+    [ba setRegion2:BARegion2Make(50, 0, 1, 60)];
+    XCTAssertTrue(CGRectEqualToRect([ba largestEmptyRect], CGRectMake(0, 0, 50, 60)), @"wrong largest rect");
+    XCTAssertTrue(CGRectEqualToRect([ba largestEmptySquare], CGRectMake(0, 0, 50, 50)), @"wrong largest square");
+    
+    // only rows touched since the last query are recomputed
+    [ba setRegion2:BARegion2Make(0, 30, 50, 1)];
+    XCTAssertTrue(CGRectEqualToRect([ba largestEmptyRect], CGRectMake(51, 0, 49, 60)), @"index not updated");
+    XCTAssertTrue(CGRectEqualToRect([ba firstEmptyRectWithSize:CGSizeMake(20, 20)], CGRectMake(0, 0, 20, 20)), @"wrong first rect");
+    
+    [ba setBitAtX:5 y:5];
+    XCTAssertTrue(CGRectEqualToRect([ba firstEmptyRectWithSize:CGSizeMake(20, 20)], CGRectMake(6, 0, 20, 20)), @"set bit not seen");
+    XCTAssertTrue(CGRectIsNull([ba firstEmptyRectWithSize:CGSizeMake(60, 60)]), @"rect too large should not fit");
+    
+    [ba clearRegion2:BARegion2Make(50, 0, 1, 60)];
+    XCTAssertTrue(CGRectEqualToRect([ba largestEmptyRect], CGRectMake(50, 0, 50, 60)), @"cleared bits not seen");
+    
+    srandom(100);
+    for (NSUInteger i=0; i<40; ++i) {
+        [ba setRegion2:BARegion2Make(random() % 90, random() % 50, random() % 10 + 1, random() % 10 + 1)];
+        [ba largestEmptyRect];
+    }
+    
+    CGRect rect = [ba largestEmptyRect];
+    CGRect square = [ba largestEmptySquare];
+    
+    [ba discardRectangleIndex];
+    XCTAssertTrue(CGRectEqualToRect(rect, [ba largestEmptyRect]), @"updated index differs from a new one");
+    XCTAssertTrue(CGRectEqualToRect(square, [ba largestEmptySquare]), @"updated index differs from a new one");
+}
+
 - (void)test20Enumeration {
     
     BABitArray *ba1 = [BABitArray bitArray64];
@@ -412,6 +640,144 @@
     XCTAssertTrue([a isEqualToBitArray:e], @"rotation by 90 degrees failed");
 }
 
+- (void)test45RotationNonSquare {
+    
+    BABitArray *ba1 = [BABitArray testBitArrayWithSize2:BASize2Make(100, 70)];
+    
+    [ba1 setRegion2:BARegion2Make(3, 5, 80, 10)];
+    [ba1 setRegion2:BARegion2Make(90, 0, 10, 70)];
+    [ba1 setBitAtX:67 y:69];
+    
+    BABitArray *a = [ba1 bitArrayByRotating:1];
+    
+    XCTAssertEqual(a.size.size2.width, (NSInteger)70, @"rotation did not swap width and height");
+    XCTAssertEqual(a.size.size2.height, (NSInteger)100, @"rotation did not swap width and height");
+    XCTAssertEqual([a count], [ba1 count], @"rotation changed count");
+    XCTAssertTrue([a checkCount], @"rotation count is wrong");
+    
+    for (NSInteger y=0; y<70; ++y) {
+        for (NSInteger x=0; x<100; ++x) {
+            if([ba1 bitAtX:x y:y] != [a bitAtX:69-y y:x]) {
+                XCTFail(@"rotation by 90 degrees failed at (%td, %td)", x, y);
+                return;
+            }
+        }
+    }
+    
+    XCTAssertTrue([[a bitArrayByRotating:3] isEqualToBitArray:ba1], @"rotation by 90 then 270 degrees failed");
+    XCTAssertTrue([[[a bitArrayByRotating:1] bitArrayByRotating:2] isEqualToBitArray:ba1], @"rotation by 90, 90 and 180 degrees failed");
+    XCTAssertTrue([[[ba1 bitArrayByFlippingRows] bitArrayByFlippingColumns] isEqualToBitArray:[ba1 bitArrayByRotating:2]], @"flipping rows and columns should match rotation by 180 degrees");
+}
+
+- (void)test50Region3 {
+    
+    BABitArray *ba1 = [BABitArray bitArrayWithSize3:BASize3Make(70, 20, 10)];
+    
+    [ba1 setRegion3:BARegion3Make(3, 2, 1, 66, 5, 4)];
+    XCTAssertEqual([ba1 count], (NSUInteger)(66*5*4), @"setRegion3: count is wrong");
+    XCTAssertTrue([ba1 checkCount], @"setRegion3: count is wrong");
+    XCTAssertTrue([ba1 bitAtX:68 y:6 z:4], @"setRegion3: failed");
+    XCTAssertFalse([ba1 bitAtX:69 y:6 z:4], @"setRegion3: set bit outside region");
+    XCTAssertFalse([ba1 bitAtX:3 y:2 z:5], @"setRegion3: set bit outside region");
+    
+    [ba1 clearRegion3:BARegion3Make(0, 0, 2, 70, 20, 2)];
+    XCTAssertEqual([ba1 count], (NSUInteger)(66*5*2), @"clearRegion3: count is wrong");
+    XCTAssertTrue([ba1 checkCount], @"clearRegion3: count is wrong");
+    
+    BABitArray *sub = [ba1 subArrayWithRegion3:BARegion3Make(2, 1, 0, 10, 10, 10)];
+    XCTAssertEqual([sub count], (NSUInteger)(9*5*2), @"subArrayWithRegion3: count is wrong");
+    XCTAssertTrue([sub checkCount], @"subArrayWithRegion3: count is wrong");
+    XCTAssertTrue([sub bitAtX:1 y:1 z:1], @"subArrayWithRegion3: failed");
+    XCTAssertFalse([sub bitAtX:0 y:1 z:1], @"subArrayWithRegion3: failed");
+}
+
+- (void)test51Morphology {
+    
+    BABitArray *ba1 = [BABitArray bitArray4096];
+    
+    [ba1 setBitAtX:8 y:8 z:8];
+    
+    BABitArray *dilated = [ba1 bitArrayByDilating];
+    XCTAssertEqual([dilated count], (NSUInteger)7, @"dilation count is wrong");
+    XCTAssertTrue([dilated checkCount], @"dilation count is wrong");
+    XCTAssertTrue([dilated bitAtX:7 y:8 z:8] && [dilated bitAtX:9 y:8 z:8], @"dilation along X failed");
+    XCTAssertTrue([dilated bitAtX:8 y:7 z:8] && [dilated bitAtX:8 y:9 z:8], @"dilation along Y failed");
+    XCTAssertTrue([dilated bitAtX:8 y:8 z:7] && [dilated bitAtX:8 y:8 z:9], @"dilation along Z failed");
+    
+    XCTAssertTrue([[dilated bitArrayByEroding] isEqualToBitArray:ba1], @"erosion did not undo dilation");
+    
+    [ba1 setAll];
+    BABitArray *eroded = [ba1 bitArrayByEroding];
+    XCTAssertEqual([eroded count], (NSUInteger)(14*14*14), @"erosion count is wrong");
+    XCTAssertFalse([eroded bitAtX:0 y:8 z:8], @"erosion at boundary failed");
+    XCTAssertTrue([eroded bitAtX:1 y:1 z:1], @"erosion failed");
+}
+
+#pragma mark - Benchmarks
+
+// An 8192x8192 map (8MB of bits) of a few solid regions and scattered points
++ (NSData *)sparseMapData {
+    
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(8192, 8192)];
+    
+    srandom(8088);
+    [ba setRegion2:BARegion2Make(100, 100, 2000, 1500)];
+    [ba setRegion2:BARegion2Make(5000, 6000, 640, 1800)];
+    for (NSUInteger i=0; i<20000; ++i)
+        [ba setBitAtX:random() % 8192 y:random() % 8192];
+    
+    return [ba bufferData];
+}
+
+- (void)testPerformanceWAHEncode {
+    NSData *data = [[self class] sparseMapData];
+    __block NSData *encoded = nil;
+    [self measureBlock:^{
+        [encoded release];
+        encoded = [[data wahEncode] retain];
+    }];
+    NSLog(@"WAH: %lu of %lu bytes", (unsigned long)[encoded length], (unsigned long)[data length]);
+    XCTAssertEqualObjects([encoded wahDecodeWithLength:[data length]], data);
+    [encoded release];
+}
+
+- (void)testPerformanceGZipEncode {
+    NSData *data = [[self class] sparseMapData];
+    __block NSData *encoded = nil;
+    [self measureBlock:^{
+        [encoded release];
+        encoded = [[data gzipDeflate] retain];
+    }];
+    NSLog(@"gzip: %lu of %lu bytes", (unsigned long)[encoded length], (unsigned long)[data length]);
+    XCTAssertEqualObjects([encoded gzipInflate], data);
+    [encoded release];
+}
+
+// Decodes the same map into a new bit array, as an archive of each kind would be read
+- (void)testPerformanceWAHDecode {
+    NSData *data = [[self class] sparseMapData];
+    NSData *encoded = [data wahEncode];
+    __block BABitArray *decoded = nil;
+    [self measureBlock:^{
+        [decoded release];
+        decoded = [[BABitArray alloc] initWithData:[encoded wahDecodeWithLength:[data length]] length:8192 * 8192];
+    }];
+    XCTAssertEqualObjects([decoded bufferData], data);
+    [decoded release];
+}
+
+- (void)testPerformanceGZipDecode {
+    NSData *data = [[self class] sparseMapData];
+    NSData *encoded = [data gzipDeflate];
+    __block BABitArray *decoded = nil;
+    [self measureBlock:^{
+        [decoded release];
+        decoded = [[BABitArray alloc] initWithData:[encoded gzipInflate] length:8192 * 8192];
+    }];
+    XCTAssertEqualObjects([decoded bufferData], data);
+    [decoded release];
+}
+
 @end
 
 
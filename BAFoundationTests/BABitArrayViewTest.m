@@ -0,0 +1,138 @@
+//
+//  BABitArrayViewTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-11.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BABitArrayView.h>
+#import <BAFoundation/BAFunctions.h>
+
+
+@interface BABitArrayViewTest : XCTestCase
+
+@end
+
+@implementation BABitArrayViewTest
+
+- (BABitArray *)randomBitArray {
+
+    BABitArray *bitArray = [BABitArray bitArrayWithSize2:BASize2Make(200, 100)];
+
+    srandom(200);
+    for (NSUInteger i=0; i<5000; ++i)
+        [bitArray setBit:random() % 20000];
+
+    return bitArray;
+}
+
+- (void)testRangeView {
+
+    BABitArray *bitArray = [self randomBitArray];
+    NSRange range = NSMakeRange(1003, 517);
+    BABitArrayView *view = [bitArray viewWithRange:range];
+    BABitArray *copy = [[BABitArray alloc] initWithBitArray:bitArray range:range];
+
+    XCTAssertEqual([view length], range.length);
+    XCTAssertEqual([view count], [copy count]);
+    XCTAssertEqual([view firstSetBit], [copy firstSetBit]);
+    XCTAssertEqual([view lastSetBit], [copy lastSetBit]);
+    XCTAssertEqual([view firstClearBit], [copy firstClearBit]);
+
+    NSUInteger lastClear = range.length - 1;
+    while([copy bit:lastClear])
+        --lastClear;
+    XCTAssertEqual([view lastClearBit], lastClear);
+
+    XCTAssertEqualObjects([view stringForRange:NSMakeRange(0, range.length)], [copy stringForRange:NSMakeRange(0, range.length)]);
+    XCTAssertTrue([view isEqualToBitArray:copy]);
+    XCTAssertEqualObjects([view bitArrayCopy], copy);
+
+    // not a snapshot
+    [bitArray clearRange:range];
+    XCTAssertEqual([view count], (NSUInteger)0);
+    XCTAssertEqual([view firstSetBit], (NSUInteger)NSNotFound);
+
+    XCTAssertThrows([view setBit:0]);
+}
+
+- (void)testRegionView {
+
+    BABitArray *bitArray = [self randomBitArray];
+    BARegion2 region = BARegion2Make(13, 7, 150, 61);
+    BABitArrayView *view = [bitArray viewWithRegion2:region];
+    BABitArray *copy = (BABitArray *)[bitArray subArrayWithRegion:region];
+
+    XCTAssertEqual([view count], [copy count]);
+    XCTAssertEqual([view firstSetBit], [copy firstSetBit]);
+    XCTAssertEqual([view lastSetBit], [copy lastSetBit]);
+    XCTAssertEqualObjects([view stringForRegion2], [copy stringForRegion2]);
+    XCTAssertEqualObjects([view bitArrayCopy], copy);
+
+    for (NSUInteger y=0; y<61; ++y) {
+        NSMutableArray *runs = [NSMutableArray array], *copyRuns = [NSMutableArray array];
+        [view enumerateRunsInRow:y block:^(NSRange run) { [runs addObject:[NSValue valueWithRange:run]]; }];
+        [copy enumerateRunsInRow:y block:^(NSRange run) { [copyRuns addObject:[NSValue valueWithRange:run]]; }];
+        XCTAssertEqualObjects(runs, copyRuns);
+    }
+
+    // views of views refer to the original array
+    BARegion2 inner = BARegion2Make(5, 9, 33, 20);
+    BABitArrayView *subview = (BABitArrayView *)[view subArrayWithRegion:inner];
+
+    XCTAssertEqual(subview.bitArray, bitArray);
+    XCTAssertEqualObjects([subview bitArrayCopy], [copy subArrayWithRegion:inner]);
+    XCTAssertEqual([subview bitAtX:0 y:0], [bitArray bitAtX:18 y:16]);
+}
+
+- (void)testMutableView {
+
+    BABitArray *bitArray = [BABitArray bitArrayWithSize2:BASize2Make(100, 50)];
+    BAMutableBitArrayView *view = [bitArray mutableViewWithRegion2:BARegion2Make(3, 5, 70, 20)];
+
+    [view setAll];
+    XCTAssertEqual([bitArray count], (NSUInteger)(70 * 20));
+    XCTAssertTrue([bitArray bitAtX:3 y:5]);
+    XCTAssertTrue([bitArray bitAtX:72 y:24]);
+    XCTAssertFalse([bitArray bitAtX:73 y:24]);
+
+    [view clearRegion2:BARegion2Make(10, 10, 10, 10)];
+    XCTAssertEqual([bitArray count], (NSUInteger)(70 * 20 - 100));
+    XCTAssertFalse([bitArray bitAtX:13 y:15]);
+
+    [view clearBitAtX:0 y:0];
+    XCTAssertFalse([bitArray bitAtX:3 y:5]);
+    XCTAssertEqual([view count], [bitArray count]);
+
+    // writes are not seen by copies of the array
+    BABitArray *copy = [bitArray copy];
+    [view clearAll];
+    XCTAssertEqual([bitArray count], (NSUInteger)0);
+    XCTAssertEqual([copy count], (NSUInteger)(70 * 20 - 101));
+}
+
+- (void)testByteRanges {
+
+    BABitArray *bitArray = [BABitArray bitArrayWithLength:256];
+    unsigned char bytes[4] = { 0xFF, 0x0F, 0xF0, 0x01 };
+    unsigned char readBack[4] = { 0 };
+
+    [bitArray writeBytes:bytes range:NSMakeRange(10, 4)];
+    XCTAssertEqual([bitArray firstSetBit], (NSUInteger)80);
+    XCTAssertEqual([bitArray count], (NSUInteger)17);
+
+    [bitArray readBytes:readBack range:NSMakeRange(10, 4)];
+    XCTAssertEqual(memcmp(bytes, readBack, 4), 0);
+
+    NSData *data = [bitArray dataForRange:NSMakeRange(84, 12)];
+    const unsigned char *shifted = [data bytes];
+
+    XCTAssertEqual([data length], (NSUInteger)2);
+    XCTAssertEqual(shifted[0], (unsigned char)0xF0);
+    XCTAssertEqual(shifted[1], (unsigned char)0xF0);
+}
+
+@end
@@ -0,0 +1,148 @@
+//
+//  BAComponentLabelerTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-09.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BAComponentLabeler.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASampleArray.h>
+#import <BAFoundation/BAFunctions.h>
+
+
+@interface BAComponentLabelerTest : XCTestCase
+
+@end
+
+@implementation BAComponentLabelerTest
+
+// Two rooms joined by a corridor, a U shape whose arms are only joined in its last rows,
+// and two cells which only touch at a corner
++ (void)fillMap:(id<BABitArray2D>)bitArray {
+    [bitArray setRegion2:BARegion2Make(2, 2, 10, 8)];
+    [bitArray setRegion2:BARegion2Make(12, 5, 20, 1)];
+    [bitArray setRegion2:BARegion2Make(32, 2, 70, 8)];
+
+    [bitArray setRegion2:BARegion2Make(10, 20, 3, 30)];
+    [bitArray setRegion2:BARegion2Make(30, 20, 3, 30)];
+    [bitArray setRegion2:BARegion2Make(10, 48, 23, 2)];
+
+    [bitArray setBitAtX:60 y:40];
+    [bitArray setBitAtX:61 y:41];
+}
+
+- (NSArray *)componentsOf:(id<BABitArray2D>)bitArray connectivity:(BAConnectivity)connectivity labels:(BASampleArray *)labels {
+
+    NSMutableArray *components = [NSMutableArray array];
+    BAComponentLabeler *labeler = [[[BAComponentLabeler alloc] initWithBitArray:bitArray] autorelease];
+
+    labeler.connectivity = connectivity;
+
+    NSUInteger count = [labeler labelComponents:^BOOL(BAComponent component) {
+        [components addObject:[NSValue valueWithBytes:&component objCType:@encode(BAComponent)]];
+        return YES;
+    } labels:labels];
+
+    XCTAssertEqual(count, components.count);
+
+    return components;
+}
+
+- (BAComponent)component:(NSValue *)value {
+    BAComponent component;
+    [value getValue:&component];
+    return component;
+}
+
+- (void)testComponents {
+
+    BABitArray *map = [BABitArray bitArrayWithSize2:BASize2Make(128, 64)];
+    BASampleArray *labels = [BASampleArray vectorWithOrder:128 * 64 size:sizeof(UInt32)];
+
+    [[self class] fillMap:map];
+
+    NSArray *components = [self componentsOf:map connectivity:BAConnectivity4 labels:labels];
+
+    XCTAssertEqual(components.count, (NSUInteger)4);
+
+    // reported in order of their last row
+    BAComponent rooms = [self component:components[0]];
+    XCTAssertEqual(rooms.identifier, (NSUInteger)1);
+    XCTAssertEqual(rooms.size, (NSUInteger)(80 + 20 + 560));
+    XCTAssertTrue(BARegion2EqualToRegion2(rooms.bounds, BARegion2Make(2, 2, 100, 8)));
+
+    BAComponent cell1 = [self component:components[1]];
+    BAComponent cell2 = [self component:components[2]];
+    XCTAssertEqual(cell1.size, (NSUInteger)1);
+    XCTAssertEqual(cell2.size, (NSUInteger)1);
+
+    BAComponent u = [self component:components[3]];
+    XCTAssertEqual(u.size, (NSUInteger)(90 + 90 + 46 - 12));
+    XCTAssertTrue(BARegion2EqualToRegion2(u.bounds, BARegion2Make(10, 20, 23, 30)));
+
+    UInt32 label;
+    NSUInteger x = 31, y = 49;
+    [labels sample:(UInt8 *)&label atIndex:x + y * 128];
+    XCTAssertEqual(label, (UInt32)u.identifier);
+    [labels sample:(UInt8 *)&label atIndex:20 + 5 * 128];
+    XCTAssertEqual(label, (UInt32)1);
+    [labels sample:(UInt8 *)&label atIndex:0];
+    XCTAssertEqual(label, (UInt32)0);
+
+    components = [self componentsOf:map connectivity:BAConnectivity8 labels:nil];
+    XCTAssertEqual(components.count, (NSUInteger)3);
+}
+
+- (void)testEarlyTermination {
+
+    BABitArray *map = [BABitArray bitArrayWithSize2:BASize2Make(128, 64)];
+    BAComponentLabeler *labeler = [[[BAComponentLabeler alloc] initWithBitArray:map] autorelease];
+    __block NSUInteger calls = 0;
+
+    [[self class] fillMap:map];
+
+    NSUInteger count = [labeler labelComponents:^BOOL(BAComponent component) {
+        ++calls;
+        return component.size < 100;
+    }];
+
+    XCTAssertEqual(count, (NSUInteger)1);
+    XCTAssertEqual(calls, (NSUInteger)1);
+}
+
+- (void)testSparseComponents {
+
+    BASparseBitArray *sparse = [[BASparseBitArray alloc] initWithBase:32 power:2];
+    BABitArray *flat = [BABitArray bitArrayWithSize2:BASize2Make(128, 128)];
+
+    [[self class] fillMap:sparse];
+    [[self class] fillMap:flat];
+
+    // the sparse array grows to 128 x 128 to hold the map
+    XCTAssertEqual([sparse size].size2.width, (NSInteger)128);
+    XCTAssertEqualObjects([self componentsOf:sparse connectivity:BAConnectivity4 labels:nil],
+                          [self componentsOf:flat connectivity:BAConnectivity4 labels:nil]);
+
+    [sparse release];
+}
+
+- (void)testPerformanceLabeling {
+
+    BABitArray *map = [BABitArray bitArrayWithSize2:BASize2Make(4096, 4096)];
+
+    srandom(4096);
+    for (NSUInteger i=0; i<4000; ++i)
+        [map setRegion2:BARegion2Make(random() % 4000, random() % 4000, random() % 96, random() % 96)];
+
+    BAComponentLabeler *labeler = [[[BAComponentLabeler alloc] initWithBitArray:map] autorelease];
+
+    [self measureBlock:^{
+        XCTAssertGreaterThan([labeler labelComponents:nil], 0UL);
+    }];
+}
+
+@end
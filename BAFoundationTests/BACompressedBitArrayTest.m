@@ -0,0 +1,236 @@
+//
+//  BACompressedBitArrayTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-06.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BACompressedBitArray.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BAFunctions.h>
+
+
+static const NSUInteger kOccupancySide = 1024;
+
+@interface BACompressedBitArrayTest : XCTestCase
+
+@end
+
+@implementation BACompressedBitArrayTest
+
+// Mostly empty, with a few dense clusters and some scattered bits
++ (void)fillOccupancy:(id<BABitArray2D>)bitArray {
+    srandom(8088);
+    [bitArray setRegion2:BARegion2Make(100, 100, 200, 150)];
+    [bitArray setRegion2:BARegion2Make(700, 600, 64, 300)];
+    for (NSUInteger i=0; i<2000; ++i)
+        [bitArray setBitAtX:random() % kOccupancySide y:random() % kOccupancySide];
+}
+
+- (void)testSingleBits {
+
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithLength:200000];
+
+    XCTAssertEqual([ba firstSetBit], (NSUInteger)NSNotFound);
+    XCTAssertEqual([ba firstClearBit], (NSUInteger)0);
+
+    [ba setBit:5];
+    [ba setBit:70000];
+    [ba setBit:199999];
+    [ba setBit:70000];
+
+    XCTAssertEqual([ba count], (NSUInteger)3);
+    XCTAssertTrue([ba bit:70000]);
+    XCTAssertFalse([ba bit:70001]);
+    XCTAssertEqual([ba firstSetBit], (NSUInteger)5);
+    XCTAssertEqual([ba nextAfter:5], (NSUInteger)70000);
+    XCTAssertEqual([ba lastSetBit], (NSUInteger)199999);
+    XCTAssertEqual([ba lastClearBit], (NSUInteger)199998);
+
+    [ba clearBit:70000];
+    XCTAssertEqual([ba count], (NSUInteger)2);
+    XCTAssertEqual([ba nextAfter:5], (NSUInteger)199999);
+}
+
+- (void)testContainerSwitching {
+
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithLength:1 << 16];
+    BABitArray *reference = [BABitArray bitArrayWithLength:1 << 16];
+
+    // every third bit: array, then bitmap past 4096
+    for (NSUInteger i=0; i<(1 << 16); i+=3) {
+        [ba setBit:i];
+        [reference setBit:i];
+    }
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    XCTAssertTrue([ba checkCount]);
+
+    NSUInteger bitmapSize = ba.storageSize;
+
+    // back under 4096: array
+    for (NSUInteger i=0; i<(1 << 16); i+=3) {
+        if(i % 6) {
+            [ba clearBit:i];
+            [reference clearBit:i];
+        }
+    }
+    [ba clearRange:NSMakeRange(0, 45000)];
+    [reference clearRange:NSMakeRange(0, 45000)];
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    XCTAssertLessThan(ba.storageSize, bitmapSize);
+
+    // a long range: run
+    [ba clearAll];
+    [reference clearAll];
+    [ba setRange:NSMakeRange(1000, 30000)];
+    [reference setRange:NSMakeRange(1000, 30000)];
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    XCTAssertLessThan(ba.storageSize, bitmapSize);
+    XCTAssertEqual([ba firstClearBit], [reference firstClearBit]);
+    XCTAssertEqual([ba lastClearBit], [reference lastClearBit]);
+
+    // splitting a run
+    [ba clearBit:2000];
+    [reference clearBit:2000];
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    XCTAssertEqual([ba nextAfter:1999], (NSUInteger)2001);
+}
+
+- (void)testReadWriteBits {
+
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithLength:150000];
+    BOOL bits[100];
+    BOOL read[100];
+
+    for (NSUInteger i=0; i<100; ++i)
+        bits[i] = i % 7 == 0 || (i > 40 && i < 60);
+
+    [ba writeBits:bits range:NSMakeRange(65500, 100)];
+
+    XCTAssertEqual([ba readBits:read range:NSMakeRange(65500, 100)], [ba count]);
+    XCTAssertEqual(memcmp(bits, read, sizeof(bits)), 0);
+    XCTAssertTrue([ba checkCount]);
+}
+
+- (void)testRegionsAndCoding {
+
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+    BABitArray *reference = [BABitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+
+    [[self class] fillOccupancy:ba];
+    [[self class] fillOccupancy:reference];
+    [ba clearRegion2:BARegion2Make(150, 120, 20, 20)];
+    [reference clearRegion2:BARegion2Make(150, 120, 20, 20)];
+
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    XCTAssertEqualObjects([ba stringForRegion2:BARegion2Make(140, 110, 40, 40)], [reference stringForRegion2:BARegion2Make(140, 110, 40, 40)]);
+
+    BARegion2 region = BARegion2Make(90, 90, 300, 300);
+    XCTAssertTrue([(BACompressedBitArray *)[ba subArrayWithRegion:region] isEqualToBitArray:(BABitArray *)[reference subArrayWithRegion:region]]);
+
+    [ba optimize];
+    XCTAssertTrue([ba isEqualToBitArray:reference]);
+    BACompressedBitArray *copy = [ba copy];
+    XCTAssertEqualObjects(copy, ba);
+    [copy release];
+
+    ba.enableArchiveCompression = YES;
+    BACompressedBitArray *decoded = [NSKeyedUnarchiver unarchiveObjectWithData:[NSKeyedArchiver archivedDataWithRootObject:ba]];
+    XCTAssertEqualObjects(decoded, ba);
+
+    BACompressedBitArray *converted = [[BACompressedBitArray alloc] initWithBitArray:reference];
+    XCTAssertEqualObjects(converted, ba);
+    [converted release];
+
+    NSLog(@"Occupancy map storage: %lu bytes compressed, %lu bytes flat", (unsigned long)ba.storageSize, (unsigned long)[reference bufferData].length);
+    XCTAssertLessThan(ba.storageSize, [reference bufferData].length);
+}
+
+- (void)testSparseLeafStorage {
+
+    BASparseBitArray *sparse = [[BASparseBitArray alloc] initWithBase:256 power:2];
+
+    sparse.bitArrayClass = [BACompressedBitArray class];
+    [sparse setRegion2:BARegion2Make(10, 10, 400, 20)];
+    [sparse setBitAtX:600 y:600];
+
+    // the root is not a leaf, and has no bits of its own
+    BASparseBitArray *leaf = (BASparseBitArray *)[sparse leafForIndex:0];
+
+    XCTAssertNil(sparse.bits);
+    XCTAssertNotNil(leaf);
+    XCTAssertTrue([leaf.bits isKindOfClass:[BACompressedBitArray class]], @"leaf bits are a %@", [leaf.bits class]);
+    XCTAssertEqual([sparse count], (NSUInteger)(400 * 20 + 1));
+    XCTAssertTrue([sparse bitAtX:409 y:29]);
+    XCTAssertFalse([sparse bitAtX:410 y:29]);
+    XCTAssertTrue([sparse bitAtX:600 y:600]);
+
+    [sparse release];
+}
+
+#pragma mark - Benchmarks
+
+- (void)testPerformanceFlatSetBits {
+    [self measureBlock:^{
+        BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+        [[self class] fillOccupancy:ba];
+    }];
+}
+
+- (void)testPerformanceCompressedSetBits {
+    [self measureBlock:^{
+        BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+        [[self class] fillOccupancy:ba];
+    }];
+}
+
+- (void)testPerformanceFlatEnumerate {
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+    [[self class] fillOccupancy:ba];
+    [self measureBlock:^{
+        __block NSUInteger total = 0;
+        for (NSUInteger i=0; i<10; ++i)
+            [ba enumerate:^(NSUInteger bit) { total += bit; }];
+        XCTAssertGreaterThan(total, 0UL);
+    }];
+}
+
+- (void)testPerformanceCompressedEnumerate {
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+    [[self class] fillOccupancy:ba];
+    [ba optimize];
+    [self measureBlock:^{
+        __block NSUInteger total = 0;
+        for (NSUInteger i=0; i<10; ++i)
+            [ba enumerate:^(NSUInteger bit) { total += bit; }];
+        XCTAssertGreaterThan(total, 0UL);
+    }];
+}
+
+- (void)testPerformanceFlatRandomAccess {
+    BABitArray *ba = [BABitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+    [[self class] fillOccupancy:ba];
+    [self measureBlock:^{
+        NSUInteger total = 0;
+        for (NSUInteger i=0; i<1000000; ++i)
+            total += [ba bit:(i * 7919) % (kOccupancySide * kOccupancySide)];
+        XCTAssertGreaterThan(total, 0UL);
+    }];
+}
+
+- (void)testPerformanceCompressedRandomAccess {
+    BACompressedBitArray *ba = [BACompressedBitArray bitArrayWithSize2:BASize2Make(kOccupancySide, kOccupancySide)];
+    [[self class] fillOccupancy:ba];
+    [ba optimize];
+    [self measureBlock:^{
+        NSUInteger total = 0;
+        for (NSUInteger i=0; i<1000000; ++i)
+            total += [ba bit:(i * 7919) % (kOccupancySide * kOccupancySide)];
+        XCTAssertGreaterThan(total, 0UL);
+    }];
+}
+
+@end
@@ -0,0 +1,133 @@
+//
+//  BARectanglesTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-12.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BABitArray+Rectangles.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BAFunctions.h>
+
+
+static const NSUInteger kMapSide = 1024;
+
+
+@interface BARectanglesTest : XCTestCase
+
+@end
+
+@implementation BARectanglesTest
+
+// Rooms, with noise around their edges
++ (BABitArray *)map {
+
+    BABitArray *map = [BABitArray bitArrayWithSize2:BASize2Make(kMapSide, kMapSide)];
+
+    srandom(1024);
+    for (NSUInteger i=0; i<600; ++i)
+        [map setRegion2:BARegion2Make(random() % (kMapSide - 64), random() % (kMapSide - 64), random() % 64 + 1, random() % 64 + 1)];
+    for (NSUInteger i=0; i<5000; ++i)
+        [map setBit:random() % (kMapSide * kMapSide)];
+
+    return map;
+}
+
+- (void)testCoverage {
+
+    BABitArray *map = [[self class] map];
+    BABitArray *painted = [BABitArray bitArrayWithSize2:BASize2Make(kMapSide, kMapSide)];
+    __block NSUInteger covered = 0;
+
+    NSUInteger count = [map enumerateSetRegions2:^BOOL(BARegion2 region) {
+        [painted setRegion2:region];
+        covered += region.size.width * region.size.height;
+        return NO;
+    }];
+
+    // no overlaps, and nothing else
+    XCTAssertEqual(covered, [map count]);
+    XCTAssertEqualObjects(painted, map);
+    XCTAssertLessThan(count * 10, [map count]);
+}
+
+- (void)testShapes {
+
+    BABitArray *map = [BABitArray bitArrayWithSize2:BASize2Make(100, 100)];
+    NSMutableArray *regions = [NSMutableArray array];
+
+    XCTAssertEqual([map enumerateSetRegions2:nil], (NSUInteger)0);
+
+    // an L: the full-width row is taken first
+    [map setRegion2:BARegion2Make(10, 10, 40, 5)];
+    [map setRegion2:BARegion2Make(10, 15, 5, 40)];
+
+    [map enumerateSetRegions2:^BOOL(BARegion2 region) {
+        [regions addObject:[NSValue valueWithBytes:&region objCType:@encode(BARegion2)]];
+        return NO;
+    }];
+
+    XCTAssertEqual(regions.count, (NSUInteger)2);
+    if(regions.count != 2)
+        return;
+
+    BARegion2 first, second;
+    [regions[0] getValue:&first];
+    [regions[1] getValue:&second];
+
+    XCTAssertTrue(BARegion2EqualToRegion2(first, BARegion2Make(10, 10, 40, 5)));
+    XCTAssertTrue(BARegion2EqualToRegion2(second, BARegion2Make(10, 15, 5, 40)));
+
+    __block NSUInteger calls = 0;
+    XCTAssertEqual([map enumerateSetRegions2:^BOOL(BARegion2 region) { return ++calls == 1; }], (NSUInteger)1);
+}
+
+- (void)testSparse {
+
+    BASparseBitArray *sparse = [[BASparseBitArray alloc] initWithBase:32 power:2];
+
+    [sparse setRegion2:BARegion2Make(20, 20, 30, 30)];
+
+    __block BARegion2 only;
+    NSUInteger count = BABitArrayEnumerateSetRegions2(sparse, ^BOOL(BARegion2 region) {
+        only = region;
+        return NO;
+    });
+
+    XCTAssertEqual(count, (NSUInteger)1);
+    XCTAssertTrue(BARegion2EqualToRegion2(only, BARegion2Make(20, 20, 30, 30)));
+
+    [sparse release];
+}
+
+#pragma mark - Benchmarks
+
+- (void)testPerformanceSetRegions {
+
+    BABitArray *map = [[self class] map];
+
+    [self measureBlock:^{
+        XCTAssertGreaterThan([map enumerateSetRegions2:^BOOL(BARegion2 region) { return NO; }], 0UL);
+    }];
+}
+
+// one region per set bit, for comparison
+- (void)testPerformancePerCell {
+
+    BABitArray *map = [[self class] map];
+
+    [self measureBlock:^{
+        __block NSUInteger count = 0;
+        BARegion2Handler handler = ^BOOL(BARegion2 region) { return NO; };
+        [map enumerate:^(NSUInteger bit) {
+            handler(BARegion2Make(bit % kMapSide, bit / kMapSide, 1, 1));
+            ++count;
+        }];
+        XCTAssertEqual(count, [map count]);
+    }];
+}
+
+@end
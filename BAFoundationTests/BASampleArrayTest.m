@@ -9,6 +9,8 @@
 #import <XCTest/XCTest.h>
 
 #import "BASampleArray.h"
+#import "BASparseSampleArray.h"
+#import "BASparseArrayCursor.h"
 
 @interface BASampleArray (ExposedPrivates)
 - (NSUInteger)indexForCoordinates:(NSUInteger *)coordinates;
@@ -148,4 +150,68 @@
     }
 }
 
+- (void)testSparseSummaries {
+    
+    BASparseSampleArray *sparse = [[BASparseSampleArray alloc] initWithPower:2 order:4 size:sizeof(UInt16)];
+    
+    XCTAssertEqual(sparse.minimumSample, (NSUInteger)0);
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)0);
+    
+    for (NSUInteger y=0; y<8; ++y)
+        for (NSUInteger x=0; x<8; ++x)
+            [sparse setPageSample:100 + y * 8 + x atX:x y:y];
+    
+    XCTAssertEqual(sparse.minimumSample, (NSUInteger)100);
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)163);
+    
+    // lowering the largest sample has to look again
+    [sparse setPageSample:1000 atX:5 y:5];
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)1000);
+    [sparse setPageSample:145 atX:5 y:5];
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)163);
+    XCTAssertEqual([sparse pageSampleAtX:5 y:5], (BAPageSample)145);
+    
+    // growing adds space which was never written
+    [sparse setPageSample:120 atX:20 y:3];
+    XCTAssertEqual(sparse.minimumSample, (NSUInteger)0);
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)163);
+    
+    [sparse release];
+}
+
+- (void)testSparseCursor {
+    
+    // leaves 16 wide; the tree is 32 wide to begin with
+    BASparseSampleArray *sparse = [[BASparseSampleArray alloc] initWithPower:2 order:16 size:sizeof(BAPageSample)];
+    BASparseSampleArrayCursor *cursor = [sparse cursor];
+    NSUInteger coordinates[2] = { 3, 5 };
+    BAPageSample sample = 7;
+    
+    // reads do not make leaves
+    [cursor sample:(UInt8 *)&sample atCoordinates:coordinates];
+    XCTAssertEqual(sample, (BAPageSample)0, @"missing leaf read as non-zero");
+    XCTAssertNil([cursor leaf], @"read made a leaf");
+    
+    // a row across the boundary between the first two leaves, and on into the next tree level
+    for (NSUInteger x=12; x<36; ++x) {
+        coordinates[0] = x;
+        sample = 1000 + x;
+        [cursor setSample:(UInt8 *)&sample atCoordinates:coordinates];
+    }
+    
+    XCTAssertEqual([sparse treeBase], (NSUInteger)64, @"tree did not grow");
+    
+    for (NSUInteger x=12; x<36; ++x) {
+        coordinates[0] = x;
+        [cursor sample:(UInt8 *)&sample atCoordinates:coordinates];
+        XCTAssertEqual(sample, (BAPageSample)(1000 + x), @"cursor read wrong at %zu", x);
+        XCTAssertEqual([sparse pageSampleAtX:x y:5], (BAPageSample)(1000 + x), @"cursor write lost at %zu", x);
+    }
+    
+    XCTAssertEqual([sparse pageSampleAtX:11 y:5], (BAPageSample)0, @"cursor wrote outside the row");
+    XCTAssertEqual(sparse.maximumSample, (NSUInteger)1035, @"cursor write not summarized");
+    
+    [sparse release];
+}
+
 @end
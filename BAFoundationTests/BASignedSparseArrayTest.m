@@ -0,0 +1,88 @@
+//
+//  BASignedSparseArrayTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-14.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BASignedSparseArray.h>
+
+
+@interface BASignedSparseArrayTest : XCTestCase
+
+@end
+
+@implementation BASignedSparseArrayTest
+
+- (void)testQuadrants {
+
+    BASignedSparseBitArray *array = [[BASignedSparseBitArray alloc] initWithBase:16 power:2];
+
+    [array setBitAtX:0 y:0];
+    [array setBitAtX:-1 y:0];
+    [array setBitAtX:0 y:-1];
+    [array setBitAtX:-1 y:-1];
+    [array setBitAtX:5 y:-30];
+
+    XCTAssertEqual([array count], (NSUInteger)5);
+    XCTAssertTrue([array bitAtX:-1 y:-1]);
+    XCTAssertTrue([array bitAtX:5 y:-30]);
+    XCTAssertFalse([array bitAtX:-5 y:30]);
+    XCTAssertFalse([array bitAtX:-1 y:1]);
+
+    // each partition holds the mirrored co-ordinates
+    BASparseBitArray *lowerRight = (BASparseBitArray *)[array partitionAtIndex:2];
+    XCTAssertTrue([lowerRight bitAtX:5 y:29]);
+    XCTAssertTrue([lowerRight bitAtX:0 y:0]);
+
+    [array clearBitAtX:-1 y:-1];
+    XCTAssertFalse([array bitAtX:-1 y:-1]);
+    XCTAssertEqual([array count], (NSUInteger)4);
+
+    // clearing does not grow partitions
+    [array clearBitAtX:-1000 y:-1000];
+    XCTAssertEqual([array partitionAtIndex:3].treeBase, (NSUInteger)32);
+
+    [array release];
+}
+
+- (void)testDepthFollowsExtent {
+
+    BASignedSparseBitArray *array = [[BASignedSparseBitArray alloc] initWithBase:16 power:2];
+
+    [array setBitAtX:-2000 y:3];
+    [array setBitAtX:10 y:10];
+
+    // only the partition which was written far from the origin grows deep
+    XCTAssertEqual([array partitionAtIndex:1].treeBase, (NSUInteger)2048);
+    XCTAssertEqual([array partitionAtIndex:0].treeBase, (NSUInteger)32);
+    XCTAssertNil([array partitionAtIndex:2]);
+
+    // clearing does not make partitions
+    [array clearBitAtX:-1000 y:-1000];
+    XCTAssertNil([array partitionAtIndex:3]);
+    XCTAssertFalse([array bitAtX:1999 y:3]);
+    XCTAssertTrue([array bitAtX:-2000 y:3]);
+
+    [array release];
+}
+
+- (void)testSamples {
+
+    BASignedSparseSampleArray *array = [[BASignedSparseSampleArray alloc] initWithPower:3 order:8 size:sizeof(float)];
+
+    [array setBlockFloat:1.5f atX:-3 y:4 z:-100];
+    [array setBlockFloat:2.5f atX:3 y:4 z:100];
+
+    XCTAssertEqual([array blockFloatAtX:-3 y:4 z:-100], 1.5f);
+    XCTAssertEqual([array blockFloatAtX:3 y:4 z:100], 2.5f);
+    XCTAssertEqual([array blockFloatAtX:3 y:4 z:-100], 0.0f);
+    XCTAssertEqual([array blockFloatAtX:-3 y:-4 z:-1000], 0.0f);
+
+    [array release];
+}
+
+@end
@@ -0,0 +1,189 @@
+//
+//  BASlabAllocatorTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-16.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BASlabAllocator.h>
+#import <BAFoundation/BASampleArray.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+#import <malloc/malloc.h>
+
+
+static const NSUInteger kBenchmarkLeaves = 4096;
+
+
+@interface BASparseArray (SlabTesting)
+- (BASlabAllocator *)leafSlab;
+@end
+
+@implementation BASparseArray (SlabTesting)
+- (BASlabAllocator *)leafSlab {
+    return _slab;
+}
+@end
+
+
+@interface BASlabAllocatorTest : XCTestCase
+
+@end
+
+@implementation BASlabAllocatorTest
+
+- (void)testBlocks {
+
+    BASlabAllocator *slab = [[BASlabAllocator alloc] initWithBlockSize:100 blocksPerSlab:4];
+
+    XCTAssertEqual(slab.blockSize, (NSUInteger)128);
+
+    unsigned char *blocks[5];
+    for (NSUInteger i=0; i<5; ++i) {
+        blocks[i] = [slab allocateBlock];
+        XCTAssertEqual((uintptr_t)blocks[i] % 64, (uintptr_t)0);
+        XCTAssertEqual(blocks[i][0], 0);
+        memset(blocks[i], 0xFF, slab.blockSize);
+    }
+    XCTAssertEqual(blocks[1] - blocks[0], (ptrdiff_t)128);
+    XCTAssertEqual(slab.allocatedBlocks, (NSUInteger)5);
+    XCTAssertEqual(slab.reservedBytes, (NSUInteger)(2 * 4 * 128));
+
+    // freed blocks are handed out again, cleared
+    [slab freeBlock:blocks[2]];
+    unsigned char *block = [slab allocateBlock];
+    XCTAssertEqual(block, blocks[2]);
+    XCTAssertEqual(block[0], 0);
+    XCTAssertEqual(block[127], 0);
+
+    for (NSUInteger i=0; i<5; ++i)
+        [slab freeBlock:blocks[i]];
+    XCTAssertEqual(slab.allocatedBlocks, (NSUInteger)0);
+
+    [slab release];
+}
+
+- (void)testSampleArray {
+
+    BASlabAllocator *slab = [[BASlabAllocator alloc] initWithBlockSize:8 * 8 * sizeof(UInt32)];
+    @autoreleasepool {
+        BASampleArray *samples = [[[BASampleArray alloc] initWithPower:2 order:8 size:sizeof(UInt32) slab:slab] autorelease];
+        UInt32 sample = 7;
+
+        XCTAssertEqual(slab.allocatedBlocks, (NSUInteger)1);
+        [samples setSample:(UInt8 *)&sample atIndex:63];
+        XCTAssertTrue([[[samples copy] autorelease] isEqualToSampleArray:samples]);
+
+        // too big for the slab
+        BASampleArray *big = [[[BASampleArray alloc] initWithPower:2 order:9 size:sizeof(UInt32) slab:slab] autorelease];
+        XCTAssertNotNil(big);
+        XCTAssertEqual(slab.allocatedBlocks, (NSUInteger)1);
+    }
+    XCTAssertEqual(slab.allocatedBlocks, (NSUInteger)0);
+
+    [slab release];
+}
+
+- (void)testSparseLeaves {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:16 power:2];
+
+    [array setBitAtX:3 y:4];
+    [array setBitAtX:40 y:100];
+
+    BASparseBitArray *leaf = (BASparseBitArray *)[array leafForStorageIndex:0 offset:NULL];
+    BABitArray *bits = (BABitArray *)leaf.bits;
+
+    XCTAssertEqual(bits.storage, BABitArrayStorageSlab);
+    XCTAssertTrue([bits bitAtX:3 y:4]);
+
+    // copies do not share the block
+    BABitArray *copy = [bits copy];
+    XCTAssertEqual(copy.storage, BABitArrayStorageHeap);
+    [array clearBitAtX:3 y:4];
+    XCTAssertTrue([copy bitAtX:3 y:4]);
+    XCTAssertFalse([bits bitAtX:3 y:4]);
+
+    XCTAssertTrue([array bitAtX:40 y:100]);
+    XCTAssertEqual([array count], (NSUInteger)1);
+
+    [copy release];
+    [array release];
+}
+
+#pragma mark - Benchmarks
+
+// Makes <kBenchmarkLeaves> leaf-sized sample arrays, writes each, then reads them all back
+- (void)measureLeavesWithSlab:(BOOL)useSlab {
+    [self measureBlock:^{
+        BASlabAllocator *slab = useSlab ? [[BASlabAllocator alloc] initWithBlockSize:16 * 16 * 16 * sizeof(float)] : nil;
+        NSMutableArray *leaves = [[NSMutableArray alloc] initWithCapacity:kBenchmarkLeaves];
+        float total = 0;
+        for (NSUInteger i=0; i<kBenchmarkLeaves; ++i) {
+            BASampleArray *leaf = [[BASampleArray alloc] initWithPower:3 order:16 size:sizeof(float) slab:slab];
+            float one = 1.0f;
+            [leaf setSample:(UInt8 *)&one atIndex:i % leaf.count];
+            [leaves addObject:leaf];
+            [leaf release];
+        }
+        for (BASampleArray *leaf in leaves) {
+            const float *samples = (const float *)leaf.samples;
+            for (NSUInteger j=0; j<leaf.count; ++j)
+                total += samples[j];
+        }
+        XCTAssertEqual(total, (float)kBenchmarkLeaves);
+        [leaves release];
+        [slab release];
+    }];
+}
+
+- (void)testPerformanceSlabLeaves {
+    [self measureLeavesWithSlab:YES];
+}
+
+- (void)testPerformanceHeapLeaves {
+    [self measureLeavesWithSlab:NO];
+}
+
+// Builds a tree of <kBenchmarkLeaves> leaves and visits every sample, then compares the slab's
+// footprint with what the same leaves would take from malloc
+- (void)testPerformanceSparseBuildAndWalk {
+
+    __block NSUInteger reserved = 0;
+    __block NSUInteger leafCount = 0;
+
+    [self measureBlock:^{
+        BASparseSampleArray *array = [[BASparseSampleArray alloc] initWithPower:3 order:16 size:sizeof(float)];
+        __block float total = 0;
+        for (NSUInteger i=0; i<kBenchmarkLeaves; ++i)
+            [array setBlockFloat:1.0f atX:(i % 16) * 16 y:((i / 16) % 16) * 16 z:(i / 256) * 16];
+        leafCount = 0;
+        [array visitNodesWithOrder:BASparseArrayVisitPreOrder block:^BOOL(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post) {
+            if(0 == level) {
+                BASampleArray *samples = [(BASparseSampleArray *)node samples];
+                const float *buffer = (const float *)samples.samples;
+                for (NSUInteger j=0; j<samples.count; ++j)
+                    total += buffer[j];
+                ++leafCount;
+            }
+            return NO;
+        }];
+        XCTAssertEqual(total, (float)kBenchmarkLeaves);
+        reserved = [array leafSlab].reservedBytes;
+        [array release];
+    }];
+
+    NSUInteger leafBytes = 16 * 16 * 16 * sizeof(float);
+    NSLog(@"%lu leaves: %lu bytes reserved by the slab, %lu bytes from malloc", (unsigned long)leafCount,
+          (unsigned long)reserved, (unsigned long)(leafCount * malloc_good_size(leafBytes)));
+
+    // 16KB leaves fill 64KB slabs exactly, so the slab reserves nothing beyond the leaves themselves
+    XCTAssertEqual(leafCount, kBenchmarkLeaves);
+    XCTAssertEqual(reserved, kBenchmarkLeaves * leafBytes);
+}
+
+@end
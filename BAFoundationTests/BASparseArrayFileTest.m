@@ -0,0 +1,126 @@
+//
+//  BASparseArrayFileTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-15.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BASparseArrayFile.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+
+@interface BASparseArrayFileTest : XCTestCase {
+    NSURL *_url;
+}
+
+@end
+
+@implementation BASparseArrayFileTest
+
+- (void)setUp {
+    [super setUp];
+    _url = [[NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]]] retain];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtURL:_url error:NULL];
+    [_url release], _url = nil;
+    [super tearDown];
+}
+
+- (unsigned long long)fileSize {
+    return [[[NSFileManager defaultManager] attributesOfItemAtPath:[_url path] error:NULL] fileSize];
+}
+
+- (void)testBits {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:16 power:2];
+    NSError *error = nil;
+
+    [array setRegion2:BARegion2Make(3, 5, 40, 20)];
+    [array setBitAtX:200 y:100];
+    XCTAssertTrue([array writeToURL:_url error:&error], @"%@", error);
+    XCTAssertEqualObjects([array.file url], _url);
+
+    BASparseBitArray *copy = [BASparseArray sparseArrayWithContentsOfURL:_url error:&error];
+
+    XCTAssertTrue([copy isKindOfClass:[BASparseBitArray class]], @"%@", error);
+    XCTAssertEqual([copy treeBase], [array treeBase]);
+    XCTAssertEqual([copy count], (NSUInteger)(40 * 20 + 1));
+    XCTAssertEqualObjects([copy stringForRegion2], [array stringForRegion2]);
+
+    // only the changed leaf and a new index are added
+    unsigned long long size = [self fileSize];
+
+    [copy clearBitAtX:200 y:100];
+    XCTAssertTrue([copy saveChanges:&error], @"%@", error);
+    XCTAssertLessThan([self fileSize] - size, size);
+
+    copy = [BASparseArray sparseArrayWithContentsOfURL:_url error:&error];
+    XCTAssertEqual([copy count], (NSUInteger)(40 * 20));
+    XCTAssertFalse([copy bitAtX:200 y:100]);
+    XCTAssertTrue([copy bitAtX:42 y:24]);
+    XCTAssertEqual([copy firstSetBit], [array firstSetBit]);
+
+    [array release];
+}
+
+- (void)testSamples {
+
+    BASparseSampleArray *array = [[BASparseSampleArray alloc] initWithPower:3 order:8 size:sizeof(float)];
+    NSError *error = nil;
+
+    [array setBlockFloat:1.5f atX:1 y:2 z:3];
+    [array setBlockFloat:-4.0f atX:30 y:20 z:10];
+    XCTAssertTrue([array writeToURL:_url error:&error], @"%@", error);
+
+    BASparseSampleArray *copy = [BASparseArray sparseArrayWithContentsOfURL:_url error:&error];
+
+    XCTAssertTrue([copy isKindOfClass:[BASparseSampleArray class]], @"%@", error);
+    XCTAssertEqual(copy.size, sizeof(float));
+    XCTAssertEqual([copy blockFloatAtX:1 y:2 z:3], 1.5f);
+    XCTAssertEqual([copy blockFloatAtX:30 y:20 z:10], -4.0f);
+    XCTAssertEqual([copy blockFloatAtX:9 y:20 z:10], 0.0f);
+
+    [array release];
+}
+
+- (void)testWriteOverOwnFile {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:16 power:2];
+    NSError *error = nil;
+
+    [array setBitAtX:200 y:100];
+    XCTAssertTrue([array writeToURL:_url error:&error], @"%@", error);
+
+    BASparseBitArray *copy = [BASparseArray sparseArrayWithContentsOfURL:_url error:&error];
+    NSURL *sameFile = [[_url URLByDeletingLastPathComponent] URLByAppendingPathComponent:[@"./" stringByAppendingString:[_url lastPathComponent]]];
+
+    // the file is left alone, and its leaves can still be loaded
+    unsigned long long size = [self fileSize];
+
+    error = nil;
+    XCTAssertFalse([copy writeToURL:sameFile error:&error]);
+    XCTAssertEqualObjects(error.domain, NSCocoaErrorDomain);
+    XCTAssertEqual(error.code, NSFileWriteInvalidFileNameError);
+    XCTAssertEqual([self fileSize], size);
+    XCTAssertTrue([copy bitAtX:200 y:100]);
+
+    [array release];
+}
+
+- (void)testCorruptFile {
+
+    NSError *error = nil;
+
+    [[@"not a sparse array" dataUsingEncoding:NSUTF8StringEncoding] writeToURL:_url atomically:NO];
+    XCTAssertNil([BASparseArray sparseArrayWithContentsOfURL:_url error:&error]);
+    XCTAssertEqualObjects(error.domain, NSCocoaErrorDomain);
+    XCTAssertEqual(error.code, NSFileReadCorruptFileError);
+}
+
+@end
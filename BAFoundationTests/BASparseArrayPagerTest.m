@@ -0,0 +1,175 @@
+//
+//  BASparseArrayPagerTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-17.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BASparseArrayPager.h>
+#import <BAFoundation/BASparseArrayCursor.h>
+#import <BAFoundation/BASparseArrayFile.h>
+#import <BAFoundation/BASparseBitArray.h>
+#import <BAFoundation/BASparseSampleArray.h>
+
+
+@interface BASparseArrayPagerTest : XCTestCase
+
+@end
+
+@implementation BASparseArrayPagerTest
+
+// Leaves used during the last pass are kept, so it takes two to evict anything just written
+- (void)evict:(BASparseArray *)array {
+    for (NSUInteger i=0; i<2; ++i) {
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [array.pager scheduleEvictionWithCompletion:^{
+            dispatch_semaphore_signal(done);
+        }];
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    }
+}
+
+- (void)testSamples {
+
+    BASparseSampleArray *array = [[BASparseSampleArray alloc] initWithPower:2 order:16 size:sizeof(UInt64)];
+    NSUInteger leafBytes = array.leafSize * sizeof(UInt64);
+
+    XCTAssertEqual(array.memoryBudget, (NSUInteger)0);
+    array.memoryBudget = 4 * leafBytes;
+    [array expandToFitSize:16 * array.leafSize];
+
+    for (UInt64 i=0; i<16; ++i) {
+        UInt64 sample = i + 1;
+        [array setSample:(UInt8 *)&sample atIndex:i * array.leafSize + 5];
+    }
+    [self evict:array];
+
+    BASparseArrayPagingStats stats = array.pagingStats;
+
+    XCTAssertLessThanOrEqual(stats.residentBytes, 4 * leafBytes);
+    XCTAssertGreaterThan(stats.evictions, (NSUInteger)0);
+    XCTAssertGreaterThan(stats.bytesPagedOut, (NSUInteger)0);
+    XCTAssertEqual(stats.misses, (NSUInteger)0);
+
+    for (UInt64 i=0; i<16; ++i) {
+        UInt64 sample = 0;
+        [array sample:(UInt8 *)&sample atIndex:i * array.leafSize + 5];
+        XCTAssertEqual(sample, i + 1);
+    }
+
+    stats = array.pagingStats;
+    XCTAssertGreaterThan(stats.misses, (NSUInteger)0);
+    XCTAssertGreaterThan(stats.bytesPagedIn, (NSUInteger)0);
+    XCTAssertLessThan(BASparseArrayPagingHitRate(stats), 1.0);
+    XCTAssertEqual(array.maximumSample, (NSUInteger)16);
+
+    [array release];
+}
+
+- (void)testBitsAndFiles {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:32 power:2];
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]]];
+    NSError *error = nil;
+
+    array.memoryBudget = 1;
+    [array setRegion2:BARegion2Make(10, 10, 200, 3)];
+    [self evict:array];
+
+    XCTAssertEqual(array.pagingStats.residentBytes, (NSUInteger)0);
+    XCTAssertEqual([array count], (NSUInteger)600);
+
+    // evicted leaves are copied out of the backing file
+    XCTAssertTrue([array writeToURL:url error:&error], @"%@", error);
+    array.memoryBudget = 0;
+    [array clearBitAtX:50 y:11];
+
+    BASparseBitArray *copy = [BASparseArray sparseArrayWithContentsOfURL:url error:&error];
+
+    XCTAssertEqual([copy count], (NSUInteger)600);
+    XCTAssertTrue([copy bitAtX:50 y:11]);
+    XCTAssertFalse([array bitAtX:50 y:11]);
+    XCTAssertTrue([array bitAtX:209 y:12]);
+
+    [[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+    [array release];
+}
+
+// The leaf under a cursor is pinned, so writes through the cursor are never made to storage the pager took
+- (void)testBitCursor {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:32 power:2];
+    BASparseBitArrayCursor *cursor = [[BASparseBitArrayCursor alloc] initWithSparseArray:array];
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]]];
+    NSError *error = nil;
+
+    array.memoryBudget = 1;
+    [cursor setBitAtX:3 y:3];
+    [array setBitAtX:40 y:3];
+    [self evict:array];
+
+    XCTAssertGreaterThan(array.pagingStats.evictions, (NSUInteger)0);
+    XCTAssertGreaterThan(array.pagingStats.residentBytes, (NSUInteger)0);
+
+    [cursor setBitAtX:4 y:3];
+    [cursor clearBitAtX:3 y:3];
+    [cursor setBitAtX:5 y:3];
+
+    XCTAssertEqual([array count], (NSUInteger)3);
+    XCTAssertTrue([cursor bitAtX:4 y:3]);
+    XCTAssertFalse([array bitAtX:3 y:3]);
+    XCTAssertTrue([array bitAtX:5 y:3]);
+    XCTAssertTrue([array bitAtX:40 y:3]);
+
+    // once the cursor moves on, its old leaf is paged out like any other, changes and all
+    [cursor setBitAtX:3 y:40];
+    [self evict:array];
+
+    XCTAssertTrue([array bitAtX:4 y:3]);
+    XCTAssertFalse([array bitAtX:3 y:3]);
+    XCTAssertTrue([array writeToURL:url error:&error], @"%@", error);
+
+    BASparseBitArray *copy = [BASparseArray sparseArrayWithContentsOfURL:url error:&error];
+
+    XCTAssertEqual([copy count], (NSUInteger)4);
+    XCTAssertTrue([copy bitAtX:5 y:3]);
+    XCTAssertTrue([copy bitAtX:3 y:40]);
+
+    [[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+    [cursor release];
+    [array release];
+}
+
+- (void)testSampleCursor {
+
+    BASparseSampleArray *array = [[BASparseSampleArray alloc] initWithPower:2 order:16 size:sizeof(UInt32)];
+    BASparseSampleArrayCursor *cursor = [[BASparseSampleArrayCursor alloc] initWithSparseArray:array];
+    UInt32 sample = 7;
+
+    array.memoryBudget = 1;
+    [array expandToFitSize:2 * array.leafSize];
+    [cursor setSample:(UInt8 *)&sample atIndex:5];
+    [array setSample:(UInt8 *)&sample atIndex:array.leafSize + 5];
+    [self evict:array];
+
+    sample = 9;
+    [cursor setSample:(UInt8 *)&sample atIndex:6];
+    [self evict:array];
+
+    sample = 0;
+    [array sample:(UInt8 *)&sample atIndex:6];
+    XCTAssertEqual(sample, (UInt32)9);
+    [array sample:(UInt8 *)&sample atIndex:5];
+    XCTAssertEqual(sample, (UInt32)7);
+    [array sample:(UInt8 *)&sample atIndex:array.leafSize + 5];
+    XCTAssertEqual(sample, (UInt32)7);
+    XCTAssertEqual(array.maximumSample, (NSUInteger)9);
+
+    [cursor release];
+    [array release];
+}
+
+@end
@@ -0,0 +1,96 @@
+//
+//  BASparseArrayStencilTest.m
+//  BAFoundation
+//
+//  Created by Brent Gulanowski on 2018-08-18.
+//  Copyright (c) 2018 Lichen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <BAFoundation/BASparseArrayStencil.h>
+
+
+@interface BASparseArrayStencilTest : XCTestCase
+
+@end
+
+@implementation BASparseArrayStencilTest
+
+// Each set bit adds its set neighbours, so every pair of neighbours is counted twice
+- (NSUInteger)neighbourPairsInArray:(BASparseBitArray *)array neighbourhood:(BAStencilNeighbourhood)neighbourhood {
+
+    __block NSUInteger count = 0;
+
+    [[array stencilWithNeighbourhood:neighbourhood] applyKernelToLeaves:^(const UInt8 *centre, const NSInteger *strides, const NSUInteger *coordinates) {
+        if(!*centre)
+            return;
+        for (NSInteger z=-1; z<=1; ++z)
+            for (NSInteger y=-1; y<=1; ++y)
+                for (NSInteger x=-1; x<=1; ++x)
+                    if(x || y || z)
+                        count += centre[x * strides[0] + y * strides[1] + z * strides[2]];
+    }];
+
+    return count / 2;
+}
+
+- (void)testBits {
+
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:8 power:3];
+
+    // a row across a leaf boundary, a diagonal across a corner, and one on its own
+    for (NSUInteger x=6; x<10; ++x)
+        [array setBitAtX:x y:3 z:3];
+    [array setBitAtX:7 y:7 z:7];
+    [array setBitAtX:8 y:8 z:8];
+    [array setBitAtX:0 y:0 z:0];
+
+    XCTAssertEqual([self neighbourPairsInArray:array neighbourhood:BAStencilFaceNeighbours], (NSUInteger)3);
+    XCTAssertEqual([self neighbourPairsInArray:array neighbourhood:BAStencilAllNeighbours], (NSUInteger)4);
+
+    [array release];
+}
+
+- (void)testSamples {
+
+    BASparseSampleArray *array = [[BASparseSampleArray alloc] initWithPower:3 order:8 size:sizeof(float)];
+    BASparseArrayStencil *stencil = [array stencilWithNeighbourhood:BAStencilFaceNeighbours];
+
+    [array setBlockFloat:1.5f atX:7 y:2 z:2];
+    [array setBlockFloat:2.5f atX:8 y:2 z:2];
+    [array setBlockFloat:4.0f atX:8 y:2 z:1];
+
+    NSUInteger coordinates[3] = { 8, 2, 2 };
+
+    XCTAssertTrue([stencil loadLeafAtCoordinates:coordinates]);
+    XCTAssertEqual(stencil.leafOrigin[0], (NSUInteger)8);
+    XCTAssertEqual(stencil.apronBase, (NSUInteger)10);
+
+    const NSInteger *strides = stencil.strides;
+    const UInt8 *centre = stencil.apron + 1 * strides[0] + 3 * strides[1] + 3 * strides[2];
+
+    XCTAssertEqual(*(const float *)centre, 2.5f);
+    XCTAssertEqual(*(const float *)(centre - strides[0]), 1.5f);
+    XCTAssertEqual(*(const float *)(centre - strides[2]), 4.0f);
+    XCTAssertEqual(*(const float *)(centre + strides[1]), 0.0f);
+
+    // moving back one leaf keeps the neighbours found so far
+    BASparseArray *leaf = stencil.leaf;
+    NSInteger offsets[3] = { 1, 0, 0 };
+
+    coordinates[0] = 0;
+    XCTAssertTrue([stencil loadLeafAtCoordinates:coordinates]);
+    XCTAssertEqual([stencil neighbourAtOffsets:offsets], leaf);
+    offsets[0] = -1;
+    XCTAssertNil([stencil neighbourAtOffsets:offsets]);
+
+    // nothing is made for a missing leaf
+    coordinates[1] = 40;
+    XCTAssertFalse([stencil loadLeafAtCoordinates:coordinates]);
+    XCTAssertNil(stencil.leaf);
+
+    [array release];
+}
+
+@end
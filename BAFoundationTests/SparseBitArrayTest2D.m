@@ -9,6 +9,7 @@
 #import "SparseBitArrayTest2D.h"
 
 #import "BASparseBitArray.h"
+#import "BASparseArrayCursor.h"
 #import "BAFunctions.h"
 
 
@@ -98,6 +99,9 @@
     __block NSUInteger nodeCount = 0;
     __block NSUInteger leafCount = 0;
     
+    // still covered while it is deprecated
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
     [_array walkChildren:^BOOL(BASparseArray *sparseArray, NSIndexPath *indexPath, NSUInteger *offset) {
 //        NSLog(@"%@ - {%d,%d}", indexPath, (int)*offset, (int)*(offset+1));
         ++nodeCount;
@@ -105,6 +109,7 @@
             ++leafCount;
         return NO;
     }];
+#pragma clang diagnostic pop
     
 //    NSLog(@"Count: %d nodes, %d leaves", (int)nodeCount, (int)leafCount);
     XCTAssertEqual(leafCount, e, @"Wrong leaf count. Expected: %zu. Actual: %zu", e, leafCount);
@@ -137,6 +142,229 @@
     XCTAssertEqualObjects(a, e, @"String creation failed.");
 }
 
+- (void)test07Archive {
+    
+    [_array setBitAtX:3 y:5];
+    [_array setBitAtX:L2_TREE_BASE-1 y:2];
+    
+    // missing children are still archived as NSNull
+    NSArray *children = [_array children];
+    
+    XCTAssertEqual([children count], SCALE, @"wrong child count");
+    XCTAssertTrue([children containsObject:[NSNull null]], @"all children were made");
+    
+    NSData *data = [NSKeyedArchiver archivedDataWithRootObject:_array];
+    BASparseBitArray *copy = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    
+    XCTAssertEqual([copy count], (NSUInteger)2, @"count failed after decoding");
+    XCTAssertTrue([copy bitAtX:L2_TREE_BASE-1 y:2], @"bit lost in decoding");
+    XCTAssertEqualObjects([copy stringForRegion2], [_array stringForRegion2], @"decoded array differs");
+}
+
+- (void)test08Cursor {
+    
+    BASparseBitArrayCursor *cursor = [_array cursor];
+    
+    // reads do not make leaves
+    XCTAssertFalse([cursor bitAtX:40 y:40], @"missing leaf read as set");
+    XCTAssertNil([cursor leaf], @"read made a leaf");
+    
+    for(NSUInteger y=0; y<L1_TREE_BASE; ++y)
+        for(NSUInteger x=y%3; x<L1_TREE_BASE; x+=3)
+            [cursor setBitAtX:x y:y];
+    
+    XCTAssertEqual([cursor leafRange].length, LEAF_SIZE, @"wrong leaf range");
+    
+    // writing beyond the tree grows it; the cursor keeps working across the expansion
+    [cursor setBitAtX:L2_TREE_BASE-1 y:L2_TREE_BASE-1];
+    XCTAssertEqual([_array treeBase], L2_TREE_BASE, @"tree did not grow");
+    
+    NSUInteger count = 0;
+    for(NSUInteger y=0; y<L2_TREE_BASE; ++y) {
+        for(NSUInteger x=0; x<L2_TREE_BASE; ++x) {
+            BOOL bit = [_array bitAtX:x y:y];
+            XCTAssertEqual([cursor bitAtX:x y:y], bit, @"cursor disagrees at (%zu,%zu)", x, y);
+            count += bit;
+        }
+    }
+    
+    XCTAssertEqual(count, [_array count], @"count failed");
+    
+    [cursor clearBitAtX:L2_TREE_BASE-1 y:L2_TREE_BASE-1];
+    XCTAssertFalse([_array bitAtX:L2_TREE_BASE-1 y:L2_TREE_BASE-1], @"clear failed");
+}
+
+- (void)test09ConcurrentCreation {
+    
+    __block NSUInteger builds = 0;
+    
+    _array.buildBlock = ^(BASparseArray *sparseArray, NSUInteger childIndex) {
+        __atomic_fetch_add(&builds, 1, __ATOMIC_RELAXED);
+    };
+    
+    // every thread races to make every leaf; reading a bit makes its leaf
+    dispatch_apply(16, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        for(NSUInteger y=0; y<L1_TREE_BASE; y+=BASE)
+            for(NSUInteger x=0; x<L1_TREE_BASE; x+=BASE)
+                [_array bitAtX:x + i y:y];
+    });
+    
+    XCTAssertEqual(builds, SCALE, @"build block should fire once per child");
+    XCTAssertFalse([[_array children] containsObject:[NSNull null]], @"a child was lost");
+}
+
+- (void)test10BulkUpdates {
+    
+    // small enough to run inline, but crossing leaves
+    [_array setRange:NSMakeRange(100, 500)];
+    XCTAssertEqual([_array count], (NSUInteger)500, @"range update incomplete");
+    XCTAssertFalse([_array bit:99], @"range update overran");
+    XCTAssertTrue([_array bit:599], @"range update incomplete");
+    XCTAssertFalse([_array bit:600], @"range update overran");
+    
+    [_array clearAll];
+    
+    // large enough to be split into grains
+    BARegion2 region = BARegion2Make(3, 5, 1000, 700);
+    [_array setRegion2:region];
+    XCTAssertEqual([_array count], (NSUInteger)(1000 * 700), @"region update incomplete");
+    XCTAssertEqual([_array treeBase], (NSUInteger)1024, @"tree grown too far");
+    
+    [_array clearAll];
+    XCTAssertEqual([_array count], (NSUInteger)0, @"clear incomplete");
+    
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    
+    [_array setRegion2:region completion:^{
+        dispatch_semaphore_signal(done);
+    }];
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    XCTAssertEqual([_array count], (NSUInteger)(1000 * 700), @"count wrong after completion");
+    
+    BASparseBitArray *copy = [[[BASparseBitArray alloc] initWithBase:BASE power:POWER] autorelease];
+    
+    [copy writeRegion2:BARegion2Make(0, 0, 200, 100) fromArray:_array offset:BAPoint2Make(3, 5)];
+    XCTAssertEqual([copy count], (NSUInteger)(200 * 100), @"write incomplete on return");
+    
+    dispatch_release(done);
+}
+
+- (void)test11BoxQuery {
+    
+    [_array setRegion2:BARegion2Make(10, 10, 20, 3)];
+    [_array setBitAtX:200 y:150];
+    [_array setBitAtX:5 y:5];
+    
+    __block NSUInteger sum = 0;
+    NSUInteger count = [_array enumerateSetBitsInRegion2:BARegion2Make(8, 8, 300, 300) block:^BOOL(const NSUInteger *coordinates, NSUInteger n) {
+        for(NSUInteger i=0; i<n; ++i)
+            sum += coordinates[2*i] + coordinates[2*i+1];
+        return NO;
+    }];
+    
+    XCTAssertEqual(count, (NSUInteger)61, @"wrong number of points");
+    XCTAssertEqual(sum, (NSUInteger)(3 * 390 + 20 * 33 + 350), @"wrong points");
+    
+    count = [_array enumerateSetBitsInRegion2:BARegion2Make(40, 0, 100, 100) block:^BOOL(const NSUInteger *coordinates, NSUInteger n) {
+        return NO;
+    }];
+    XCTAssertEqual(count, (NSUInteger)0, @"points outside the box");
+}
+
+- (void)test12Summaries {
+    
+    XCTAssertTrue([_array isEmpty], @"new array not empty");
+    XCTAssertEqual([_array firstSetBit], (NSUInteger)NSNotFound, @"set bit found in empty array");
+    XCTAssertEqual([_array firstClearBit], (NSUInteger)0, @"first clear bit wrong");
+    XCTAssertEqual([_array lastClearBit], L1_TREE_SIZE-1, @"last clear bit wrong");
+    
+    // in different leaves; results are indexes in the whole tree
+    [_array setBit:300];
+    [_array setBit:900];
+    XCTAssertEqual([_array count], (NSUInteger)2, @"count failed");
+    XCTAssertEqual([_array firstSetBit], (NSUInteger)300, @"first set bit wrong");
+    XCTAssertEqual([_array lastSetBit], (NSUInteger)900, @"last set bit wrong");
+    
+    [_array setRange:NSMakeRange(0, L1_TREE_SIZE)];
+    XCTAssertTrue([_array isFull], @"filled array not full");
+    XCTAssertEqual([_array firstClearBit], (NSUInteger)NSNotFound, @"clear bit found in full array");
+    
+    [_array clearBit:700];
+    XCTAssertEqual([_array count], L1_TREE_SIZE-1, @"count failed");
+    XCTAssertEqual([_array firstClearBit], (NSUInteger)700, @"first clear bit wrong");
+    XCTAssertEqual([_array lastClearBit], (NSUInteger)700, @"last clear bit wrong");
+    
+    // the old root's population moves down with its children
+    [_array setBit:L2_TREE_SIZE-1];
+    XCTAssertEqual([_array count], L1_TREE_SIZE, @"count lost in expansion");
+    XCTAssertEqual([(BASparseBitArray *)[_array childAtIndex:0] count], L1_TREE_SIZE-1, @"child count wrong");
+    XCTAssertEqual([_array lastSetBit], L2_TREE_SIZE-1, @"last set bit wrong");
+    XCTAssertEqual([_array lastClearBit], L2_TREE_SIZE-2, @"last clear bit wrong");
+    
+    // cursors and archives keep the populations
+    [[_array cursor] setBit:700];
+    XCTAssertEqual([_array count], L1_TREE_SIZE+1, @"cursor write not counted");
+    
+    BASparseBitArray *copy = [NSKeyedUnarchiver unarchiveObjectWithData:[NSKeyedArchiver archivedDataWithRootObject:_array]];
+    XCTAssertEqual([copy count], L1_TREE_SIZE+1, @"count failed after decoding");
+    
+    [_array clearAll];
+    XCTAssertTrue([_array isEmpty], @"cleared array not empty");
+}
+
+- (void)test13Visit {
+    
+    [_array setBitAtX:3 y:4];
+    [_array setBitAtX:200 y:150];
+    
+    BASparseArrayVisitOrder both = BASparseArrayVisitPreOrder|BASparseArrayVisitPostOrder;
+    NSUInteger rootLevel = _array.level;
+    __block NSUInteger nodeCount = 0;
+    __block NSUInteger leafSum = 0;
+    __block NSUInteger depth = 0;
+    __block BOOL levelsMatch = YES;
+    __block BASparseArray *last = nil;
+    
+    [_array visitNodesWithOrder:both block:^BOOL(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post) {
+        if(post) {
+            --depth;
+            last = node;
+            return NO;
+        }
+        levelsMatch = levelsMatch && level == node.level && level == rootLevel - depth;
+        ++depth;
+        ++nodeCount;
+        if(0 == level)
+            leafSum += origin[0] + origin[1];
+        return NO;
+    }];
+    
+    XCTAssertEqual(nodeCount, (NSUInteger)(1 + 2 * rootLevel), @"wrong node count");
+    XCTAssertEqual(leafSum, (NSUInteger)(192 + 144), @"wrong leaf origins");
+    XCTAssertTrue(levelsMatch, @"wrong levels");
+    XCTAssertEqual(last, (BASparseArray *)_array, @"root not last in post-order");
+    
+    // pruned nodes get their post-order call, but their children are skipped
+    __block NSUInteger postCount = 0;
+    [_array visitNodesWithOrder:both block:^BOOL(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post) {
+        if(post)
+            ++postCount;
+        return level == rootLevel - 1;
+    }];
+    XCTAssertEqual(postCount, (NSUInteger)3, @"pruning failed");
+    
+    __block NSUInteger concurrentCount = 0;
+    __block NSUInteger concurrentSum = 0;
+    [_array visitNodesConcurrentlyWithOrder:BASparseArrayVisitPreOrder block:^BOOL(BASparseArray *node, const NSUInteger *origin, NSUInteger level, BOOL post) {
+        __atomic_add_fetch(&concurrentCount, 1, __ATOMIC_RELAXED);
+        if(0 == level)
+            __atomic_add_fetch(&concurrentSum, origin[0] + origin[1], __ATOMIC_RELAXED);
+        return NO;
+    }];
+    XCTAssertEqual(concurrentCount, nodeCount, @"concurrent visit missed nodes");
+    XCTAssertEqual(concurrentSum, leafSum, @"concurrent visit origins wrong");
+}
+
 - (void)testWriteRect {
     
     BARegion2 setRegion = BARegion2Make(8, 8, 32, 32);
@@ -8,6 +8,46 @@
 
 #import "SparseBitArrayTest3D.h"
 
+#import "BASparseBitArray.h"
+#import "BAFunctions.h"
+
+
 @implementation SparseBitArrayTest3D
 
+- (void)testBoxQuery {
+    
+    BASparseBitArray *array = [[BASparseBitArray alloc] initWithBase:8 power:3];
+    
+    srandom(44);
+    for(NSUInteger i=0; i<2000; ++i)
+        [array setBitAtX:random() % 64 y:random() % 64 z:random() % 64];
+    
+    BARegion3 box = BARegion3Make(5, 10, 3, 40, 21, 50);
+    NSMutableSet *expected = [NSMutableSet set];
+    NSMutableSet *found = [NSMutableSet set];
+    
+    for(NSInteger z=box.origin.z; z<box.origin.z + box.size.depth; ++z)
+        for(NSInteger y=box.origin.y; y<box.origin.y + box.size.height; ++y)
+            for(NSInteger x=box.origin.x; x<box.origin.x + box.size.width; ++x)
+                if([array bitAtX:x y:y z:z])
+                    [expected addObject:[NSString stringWithFormat:@"%td,%td,%td", x, y, z]];
+    
+    NSUInteger count = [array enumerateSetBitsInRegion3:box block:^BOOL(const NSUInteger *coordinates, NSUInteger n) {
+        for(NSUInteger i=0; i<n; ++i, coordinates+=3)
+            [found addObject:[NSString stringWithFormat:@"%tu,%tu,%tu", coordinates[0], coordinates[1], coordinates[2]]];
+        return NO;
+    }];
+    
+    XCTAssertEqual(count, [expected count], @"wrong number of points");
+    XCTAssertEqualObjects(found, expected, @"wrong points");
+    
+    // stop early
+    count = [array enumerateSetBitsInRegion3:box block:^BOOL(const NSUInteger *coordinates, NSUInteger n) {
+        return YES;
+    }];
+    XCTAssertTrue(count > 0 && count <= [expected count], @"did not stop");
+    
+    [array release];
+}
+
 @end
@@ -84,6 +84,39 @@
     XCTAssertTrue(x == 21 && y == 7, @"Reverse coordinates failed; expected (8,10); actual: (%zu,%zu)", x, y);
 }
 
+- (void)testMortonRoundTrip {
+
+    NSUInteger x, y, z;
+
+    srandom(39);
+    for(NSUInteger i=0; i<1000; ++i) {
+        NSUInteger a = random() & 0xFFFFF, b = random() & 0xFFFFF, c = random() & 0xFFFFF;
+
+        LeafCoordinatesForIndex2D(LeafIndexFor2DCoordinates(a, b, 1), &x, &y);
+        XCTAssertTrue(x == a && y == b, @"2D round trip failed; expected (%zu,%zu); actual: (%zu,%zu)", a, b, x, y);
+
+        LeafCoordinatesForIndex3D(LeafIndexFor3DCoordinates(a, b, c, 1), &x, &y, &z);
+        XCTAssertTrue(x == a && y == b && z == c, @"3D round trip failed; expected (%zu,%zu,%zu); actual: (%zu,%zu,%zu)", a, b, c, x, y, z);
+    }
+
+    NSUInteger coords[4] = { 5, 9, 2, 14 }, result[4];
+    NSUInteger index = LeafIndexForCoordinates(coords, 1, 4);
+
+    XCTAssertEqual(coords[0], (NSUInteger)5, @"Leaf index must not modify coordinates");
+    XCTAssertEqual(index, (NSUInteger)0xA9C3, @"4D leaf index incorrect");
+    LeafCoordinatesForIndex(index, result, 4);
+    XCTAssertEqual(memcmp(coords, result, sizeof(coords)), 0, @"4D round trip failed");
+
+    NSUInteger pairs[8] = { 0, 3, 3, 0, 5, 7, 21, 7 }, indexes[4], expected[4] = { 10, 5, 59, 315 };
+
+    LeafIndexesForCoordinates(pairs, indexes, 4, 1, 2);
+    XCTAssertEqual(memcmp(indexes, expected, sizeof(indexes)), 0, @"Batch leaf indexes incorrect");
+
+    NSUInteger unpacked[8];
+    LeafCoordinatesForIndexes(indexes, unpacked, 4, 2);
+    XCTAssertEqual(memcmp(pairs, unpacked, sizeof(pairs)), 0, @"Batch leaf coordinates incorrect");
+}
+
 - (void)testSpeed01 {
     for(NSUInteger i=0; i<512; ++i)
         for(NSUInteger j=0; j<512; ++j)
@@ -123,6 +156,9 @@
     __block NSUInteger nodeCount = 0;
     __block NSUInteger leafCount = 0;
 
+    // still covered while it is deprecated
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
     [_array walkChildren:^BOOL(BASparseArray *sparseArray, NSIndexPath *indexPath, NSUInteger *offset) {
 //        NSLog(@"%@ - %d", indexPath, (int)&offset);
         ++nodeCount;
@@ -130,6 +166,7 @@
             ++leafCount;
         return NO;
     }];
+#pragma clang diagnostic pop
     
     NSLog(@"Count: %d nodes, %d leaves", (int)nodeCount, (int)leafCount);
     XCTAssertEqual(leafCount, e, @"Wrong leaf count. Expected: %zu. Actual: %zu", e, leafCount);